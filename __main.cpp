@@ -3,204 +3,765 @@
 #include <iostream>
 #include <iomanip>
 #include <cstring>
+#include <cstddef>
 #include <vector>
+#include <memory>
 #include <string_view>
 #include <string>
 #include <unordered_map>
+#include <map>
 #include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <future>
+#include <fstream>
+#include <sstream>
+#include <deque>
+#include <random>
 
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <sys/ptrace.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/personality.h>
 #include <sys/user.h>
+#include <sys/procfs.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/mman.h>
+#include <cpuid.h>
+#include <immintrin.h>
 
 #include <linenoise.h>
 
+#include <ELF/types.h>
+
 using namespace coretypes;
 
+// Every register the debugger knows about, in Reg enum order. This is the only place that has to change when adding a
+// register. Columns:
+//   GPR(enum, user_regs_struct field, DWARF number)
+//   EXT(enum, name, DWARF number, RegKind, index within the kind)
+// A DWARF number of -1 means the ABI doesn't assign one (or it is shared with a narrower register).
+#define DBG_REGISTERS(GPR, EXT) \
+    GPR(RAX,       rax,         0)            \
+    GPR(RBX,       rbx,         3)            \
+    GPR(RCX,       rcx,         2)            \
+    GPR(RDX,       rdx,         1)            \
+    GPR(RDI,       rdi,         5)            \
+    GPR(RSI,       rsi,         4)            \
+    GPR(RBP,       rbp,         6)            \
+    GPR(RSP,       rsp,         7)            \
+    GPR(R8,        r8,          8)            \
+    GPR(R9,        r9,          9)            \
+    GPR(R10,       r10,        10)            \
+    GPR(R11,       r11,        11)            \
+    GPR(R12,       r12,        12)            \
+    GPR(R13,       r13,        13)            \
+    GPR(R14,       r14,        14)            \
+    GPR(R15,       r15,        15)            \
+    GPR(RIP,       rip,        -1)            \
+    GPR(RFLAGS,    eflags,     49)            \
+    GPR(CS,        cs,         51)            \
+    GPR(ORIG_RAX,  orig_rax,   -1)            \
+    GPR(FS_BASE,   fs_base,    58)            \
+    GPR(GS_BASE,   gs_base,    59)            \
+    GPR(FS,        fs,         54)            \
+    GPR(GS,        gs,         55)            \
+    GPR(SS,        ss,         52)            \
+    GPR(DS,        ds,         53)            \
+    GPR(ES,        es,         50)            \
+    EXT(MXCSR,     mxcsr,      64, MXCSR,  0) \
+    EXT(XMM0,      xmm0,       17, XMM,    0) \
+    EXT(XMM1,      xmm1,       18, XMM,    1) \
+    EXT(XMM2,      xmm2,       19, XMM,    2) \
+    EXT(XMM3,      xmm3,       20, XMM,    3) \
+    EXT(XMM4,      xmm4,       21, XMM,    4) \
+    EXT(XMM5,      xmm5,       22, XMM,    5) \
+    EXT(XMM6,      xmm6,       23, XMM,    6) \
+    EXT(XMM7,      xmm7,       24, XMM,    7) \
+    EXT(XMM8,      xmm8,       25, XMM,    8) \
+    EXT(XMM9,      xmm9,       26, XMM,    9) \
+    EXT(XMM10,     xmm10,      27, XMM,   10) \
+    EXT(XMM11,     xmm11,      28, XMM,   11) \
+    EXT(XMM12,     xmm12,      29, XMM,   12) \
+    EXT(XMM13,     xmm13,      30, XMM,   13) \
+    EXT(XMM14,     xmm14,      31, XMM,   14) \
+    EXT(XMM15,     xmm15,      32, XMM,   15) \
+    EXT(XMM16,     xmm16,      67, XMM,   16) \
+    EXT(XMM17,     xmm17,      68, XMM,   17) \
+    EXT(XMM18,     xmm18,      69, XMM,   18) \
+    EXT(XMM19,     xmm19,      70, XMM,   19) \
+    EXT(XMM20,     xmm20,      71, XMM,   20) \
+    EXT(XMM21,     xmm21,      72, XMM,   21) \
+    EXT(XMM22,     xmm22,      73, XMM,   22) \
+    EXT(XMM23,     xmm23,      74, XMM,   23) \
+    EXT(XMM24,     xmm24,      75, XMM,   24) \
+    EXT(XMM25,     xmm25,      76, XMM,   25) \
+    EXT(XMM26,     xmm26,      77, XMM,   26) \
+    EXT(XMM27,     xmm27,      78, XMM,   27) \
+    EXT(XMM28,     xmm28,      79, XMM,   28) \
+    EXT(XMM29,     xmm29,      80, XMM,   29) \
+    EXT(XMM30,     xmm30,      81, XMM,   30) \
+    EXT(XMM31,     xmm31,      82, XMM,   31) \
+    EXT(YMM0,      ymm0,       -1, YMM,    0) \
+    EXT(YMM1,      ymm1,       -1, YMM,    1) \
+    EXT(YMM2,      ymm2,       -1, YMM,    2) \
+    EXT(YMM3,      ymm3,       -1, YMM,    3) \
+    EXT(YMM4,      ymm4,       -1, YMM,    4) \
+    EXT(YMM5,      ymm5,       -1, YMM,    5) \
+    EXT(YMM6,      ymm6,       -1, YMM,    6) \
+    EXT(YMM7,      ymm7,       -1, YMM,    7) \
+    EXT(YMM8,      ymm8,       -1, YMM,    8) \
+    EXT(YMM9,      ymm9,       -1, YMM,    9) \
+    EXT(YMM10,     ymm10,      -1, YMM,   10) \
+    EXT(YMM11,     ymm11,      -1, YMM,   11) \
+    EXT(YMM12,     ymm12,      -1, YMM,   12) \
+    EXT(YMM13,     ymm13,      -1, YMM,   13) \
+    EXT(YMM14,     ymm14,      -1, YMM,   14) \
+    EXT(YMM15,     ymm15,      -1, YMM,   15) \
+    EXT(YMM16,     ymm16,      -1, YMM,   16) \
+    EXT(YMM17,     ymm17,      -1, YMM,   17) \
+    EXT(YMM18,     ymm18,      -1, YMM,   18) \
+    EXT(YMM19,     ymm19,      -1, YMM,   19) \
+    EXT(YMM20,     ymm20,      -1, YMM,   20) \
+    EXT(YMM21,     ymm21,      -1, YMM,   21) \
+    EXT(YMM22,     ymm22,      -1, YMM,   22) \
+    EXT(YMM23,     ymm23,      -1, YMM,   23) \
+    EXT(YMM24,     ymm24,      -1, YMM,   24) \
+    EXT(YMM25,     ymm25,      -1, YMM,   25) \
+    EXT(YMM26,     ymm26,      -1, YMM,   26) \
+    EXT(YMM27,     ymm27,      -1, YMM,   27) \
+    EXT(YMM28,     ymm28,      -1, YMM,   28) \
+    EXT(YMM29,     ymm29,      -1, YMM,   29) \
+    EXT(YMM30,     ymm30,      -1, YMM,   30) \
+    EXT(YMM31,     ymm31,      -1, YMM,   31) \
+    EXT(ZMM0,      zmm0,       -1, ZMM,    0) \
+    EXT(ZMM1,      zmm1,       -1, ZMM,    1) \
+    EXT(ZMM2,      zmm2,       -1, ZMM,    2) \
+    EXT(ZMM3,      zmm3,       -1, ZMM,    3) \
+    EXT(ZMM4,      zmm4,       -1, ZMM,    4) \
+    EXT(ZMM5,      zmm5,       -1, ZMM,    5) \
+    EXT(ZMM6,      zmm6,       -1, ZMM,    6) \
+    EXT(ZMM7,      zmm7,       -1, ZMM,    7) \
+    EXT(ZMM8,      zmm8,       -1, ZMM,    8) \
+    EXT(ZMM9,      zmm9,       -1, ZMM,    9) \
+    EXT(ZMM10,     zmm10,      -1, ZMM,   10) \
+    EXT(ZMM11,     zmm11,      -1, ZMM,   11) \
+    EXT(ZMM12,     zmm12,      -1, ZMM,   12) \
+    EXT(ZMM13,     zmm13,      -1, ZMM,   13) \
+    EXT(ZMM14,     zmm14,      -1, ZMM,   14) \
+    EXT(ZMM15,     zmm15,      -1, ZMM,   15) \
+    EXT(ZMM16,     zmm16,      -1, ZMM,   16) \
+    EXT(ZMM17,     zmm17,      -1, ZMM,   17) \
+    EXT(ZMM18,     zmm18,      -1, ZMM,   18) \
+    EXT(ZMM19,     zmm19,      -1, ZMM,   19) \
+    EXT(ZMM20,     zmm20,      -1, ZMM,   20) \
+    EXT(ZMM21,     zmm21,      -1, ZMM,   21) \
+    EXT(ZMM22,     zmm22,      -1, ZMM,   22) \
+    EXT(ZMM23,     zmm23,      -1, ZMM,   23) \
+    EXT(ZMM24,     zmm24,      -1, ZMM,   24) \
+    EXT(ZMM25,     zmm25,      -1, ZMM,   25) \
+    EXT(ZMM26,     zmm26,      -1, ZMM,   26) \
+    EXT(ZMM27,     zmm27,      -1, ZMM,   27) \
+    EXT(ZMM28,     zmm28,      -1, ZMM,   28) \
+    EXT(ZMM29,     zmm29,      -1, ZMM,   29) \
+    EXT(ZMM30,     zmm30,      -1, ZMM,   30) \
+    EXT(ZMM31,     zmm31,      -1, ZMM,   31) \
+    EXT(K0,        k0,        118, K,      0) \
+    EXT(K1,        k1,        119, K,      1) \
+    EXT(K2,        k2,        120, K,      2) \
+    EXT(K3,        k3,        121, K,      3) \
+    EXT(K4,        k4,        122, K,      4) \
+    EXT(K5,        k5,        123, K,      5) \
+    EXT(K6,        k6,        124, K,      6) \
+    EXT(K7,        k7,        125, K,      7)
+
 enum struct Reg : int {
     DEFAULT,
 
-    RAX, RBX, RCX, RDX,
-    RDI, RSI, RBP, RSP,
-    R8,  R9,  R10, R11,
-    R12, R13, R14, R15,
-    RIP, RFLAGS,    CS,
-    ORIG_RAX, FS_BASE,
-    GS_BASE,
-    FS, GS, SS, DS, ES,
+#define DBG_REG_ENUM_GPR(e, field, dwarf) e,
+#define DBG_REG_ENUM_EXT(e, name, dwarf, kind, index) e,
+    DBG_REGISTERS(DBG_REG_ENUM_GPR, DBG_REG_ENUM_EXT)
+#undef DBG_REG_ENUM_GPR
+#undef DBG_REG_ENUM_EXT
 
     COUNT,
 };
 
-struct RegDesc {
-    RegDesc() : r(Reg::DEFAULT), dwarf(0), name("") {}
-    RegDesc(Reg r, int dwarf, std::string_view name) : r(r), dwarf(dwarf), name(name) {}
+enum struct RegKind : u8 {
+    NONE,
+    GPR,   // a 64 bit field in user_regs_struct
+    MXCSR, // everything below lives in the XSAVE area, fetched lazily with PTRACE_GETREGSET
+    XMM,
+    YMM,
+    ZMM,
+    K,
+};
 
+struct RegDesc {
     Reg r;
     int dwarf;
-    std::string name;
+    std::string_view name;
+    RegKind kind;
+    u32 index; // byte offset into user_regs_struct for GPR, register number otherwise
 };
 
-const RegDesc g_RegisterDescriptors[size_t(Reg::COUNT)] = {
-    { Reg::DEFAULT, -100, "not set" },
-    { Reg::R15, 15, "r15" },
-    { Reg::R14, 14, "r14" },
-    { Reg::R13, 13, "r13" },
-    { Reg::R12, 12, "r12" },
-    { Reg::RBP, 6, "rbp" },
-    { Reg::RBX, 3, "rbx" },
-    { Reg::R11, 11, "r11" },
-    { Reg::R10, 10, "r10" },
-    { Reg::R9, 9, "r9" },
-    { Reg::R8, 8, "r8" },
-    { Reg::RAX, 0, "rax" },
-    { Reg::RCX, 2, "rcx" },
-    { Reg::RDX, 1, "rdx" },
-    { Reg::RSI, 4, "rsi" },
-    { Reg::RDI, 5, "rdi" },
-    { Reg::ORIG_RAX, -1, "orig_rax" },
-    { Reg::RIP, -1, "rip" },
-    { Reg::CS, 51, "cs" },
-    { Reg::RFLAGS, 49, "eflags" },
-    { Reg::RSP, 7, "rsp" },
-    { Reg::SS, 52, "ss" },
-    { Reg::FS_BASE, 58, "fs_base" },
-    { Reg::GS_BASE, 59, "gs_base" },
-    { Reg::DS, 53, "ds" },
-    { Reg::ES, 50, "es" },
-    { Reg::FS, 54, "fs" },
-    { Reg::GS, 55, "gs" },
-};
-
-const RegDesc& GetRegDesc(Reg r) {
-    assert(size_t(r) < size_t(Reg::COUNT));
+constexpr RegDesc g_RegisterDescriptors[size_t(Reg::COUNT)] = {
+    { Reg::DEFAULT, -100, "not set", RegKind::NONE, 0 },
+#define DBG_REG_DESC_GPR(e, field, dwarf) { Reg::e, dwarf, #field, RegKind::GPR, u32(offsetof(user_regs_struct, field)) },
+#define DBG_REG_DESC_EXT(e, name, dwarf, kind, index) { Reg::e, dwarf, #name, RegKind::kind, index },
+    DBG_REGISTERS(DBG_REG_DESC_GPR, DBG_REG_DESC_EXT)
+#undef DBG_REG_DESC_GPR
+#undef DBG_REG_DESC_EXT
+};
+
+constexpr bool RegisterDescriptorsAreIndexed() {
     for (size_t i = 0; i < size_t(Reg::COUNT); i++) {
-        if (g_RegisterDescriptors[i].r == r) {
-            return g_RegisterDescriptors[i];
+        if (size_t(g_RegisterDescriptors[i].r) != i) return false;
+    }
+    return true;
+}
+static_assert(RegisterDescriptorsAreIndexed(), "g_RegisterDescriptors must be indexed by Reg");
+
+constexpr const RegDesc& GetRegDesc(Reg r) {
+    assert(size_t(r) < size_t(Reg::COUNT));
+    return g_RegisterDescriptors[size_t(r)];
+}
+
+// Registers that live in user_regs_struct. Everything else comes from the XSAVE area.
+constexpr bool IsGeneralRegister(Reg r) { return GetRegDesc(r).kind == RegKind::GPR; }
+
+// DWARF register number -> Reg.
+struct RegDwarfTable {
+    static constexpr int MAX_DWARF = 128;
+    Reg regs[MAX_DWARF];
+
+    constexpr Reg Find(int dwarf) const {
+        return (dwarf >= 0 && dwarf < MAX_DWARF) ? regs[dwarf] : Reg::DEFAULT;
+    }
+};
+
+constexpr RegDwarfTable BuildRegDwarfTable() {
+    RegDwarfTable t = {};
+    for (const RegDesc& d : g_RegisterDescriptors) {
+        if (d.dwarf < 0) continue;
+        if (d.dwarf >= RegDwarfTable::MAX_DWARF || t.regs[d.dwarf] != Reg::DEFAULT) {
+            throw "DWARF register number out of range or used twice";
         }
+        t.regs[d.dwarf] = d.r;
     }
-    return g_RegisterDescriptors[0];
+    return t;
 }
 
-bool GetRegisterValue(pid_t pid, Reg r, uint64_t& out) {
-    user_regs_struct regs;
-    if (ptrace(PTRACE_GETREGS, pid, nullptr, &regs) < 0) {
-        std::cerr << "Failed to get register value: " << strerror(errno) << std::endl;
-        return false;
+constexpr RegDwarfTable g_RegDwarfTable = BuildRegDwarfTable();
+
+constexpr u64 RegNameHash(std::string_view name) {
+    u64 h = 0xcbf29ce484222325ull;
+    for (char c : name) {
+        h ^= u8(c);
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+constexpr u64 RegNameMix(u64 h, u64 seed) {
+    h ^= seed * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 32;
+    return h;
+}
+
+// Perfect hash from register name to Reg (hash and displace). The name is hashed once, mixing with seed 0 picks a
+// bucket and mixing with the bucket's seed picks the slot. The seeds are searched at compile time so that no two names
+// share a slot.
+struct RegNameTable {
+    static constexpr size_t BUCKETS = 64;
+    static constexpr size_t SLOTS = 256;
+    u16 seeds[BUCKETS];
+    Reg slots[SLOTS];
+
+    constexpr Reg Find(std::string_view name) const {
+        u64 h = RegNameHash(name);
+        u64 b = RegNameMix(h, 0) % BUCKETS;
+        Reg r = slots[RegNameMix(h, seeds[b]) % SLOTS];
+        return GetRegDesc(r).name == name ? r : Reg::DEFAULT;
+    }
+};
+
+constexpr RegNameTable BuildRegNameTable() {
+    RegNameTable t = {};
+    size_t bucketOf[size_t(Reg::COUNT)] = {};
+    size_t bucketSize[RegNameTable::BUCKETS] = {};
+    size_t maxSize = 0;
+    for (size_t i = 1; i < size_t(Reg::COUNT); i++) {
+        bucketOf[i] = RegNameMix(RegNameHash(g_RegisterDescriptors[i].name), 0) % RegNameTable::BUCKETS;
+        maxSize = std::max(maxSize, ++bucketSize[bucketOf[i]]);
     }
 
+    bool used[RegNameTable::SLOTS] = {};
+    // Place the largest buckets first, they are the hardest to fit.
+    for (size_t size = maxSize; size > 0; size--) {
+        for (size_t b = 0; b < RegNameTable::BUCKETS; b++) {
+            if (bucketSize[b] != size) continue;
+
+            for (u32 seed = 1;; seed++) {
+                if (seed > 0xFFFF) throw "no perfect hash seed found, increase RegNameTable::SLOTS";
+                size_t slots[size_t(Reg::COUNT)] = {};
+                size_t n = 0;
+                bool ok = true;
+                for (size_t i = 1; i < size_t(Reg::COUNT) && ok; i++) {
+                    if (bucketOf[i] != b) continue;
+                    size_t slot = RegNameMix(RegNameHash(g_RegisterDescriptors[i].name), seed) % RegNameTable::SLOTS;
+                    if (used[slot]) ok = false;
+                    for (size_t j = 0; j < n && ok; j++) {
+                        if (slots[j] == slot) ok = false;
+                    }
+                    slots[n++] = slot;
+                }
+                if (!ok) continue;
+
+                t.seeds[b] = u16(seed);
+                n = 0;
+                for (size_t i = 1; i < size_t(Reg::COUNT); i++) {
+                    if (bucketOf[i] != b) continue;
+                    used[slots[n]] = true;
+                    t.slots[slots[n++]] = Reg(i);
+                }
+                break;
+            }
+        }
+    }
+    return t;
+}
+
+constexpr RegNameTable g_RegNameTable = BuildRegNameTable();
+
+bool GetRegisterValue(const user_regs_struct& regs, Reg r, uint64_t& out) {
+    const RegDesc& reg = GetRegDesc(r);
+    if (reg.kind != RegKind::GPR) return false;
+    std::memcpy(&out, reinterpret_cast<const uint8_t*>(&regs) + reg.index, sizeof(out));
+    return true;
+}
+
+bool SetRegisterValue(user_regs_struct& regs, Reg r, uint64_t value) {
     const RegDesc& reg = GetRegDesc(r);
-    switch (reg.r) {
-        case Reg::R15:        out = regs.r15; return true;
-        case Reg::R14:        out = regs.r14; return true;
-        case Reg::R13:        out = regs.r13; return true;
-        case Reg::R12:        out = regs.r12; return true;
-        case Reg::RBP:        out = regs.rbp; return true;
-        case Reg::RBX:        out = regs.rbx; return true;
-        case Reg::R11:        out = regs.r11; return true;
-        case Reg::R10:        out = regs.r10; return true;
-        case Reg::R9:         out = regs.r9; return true;
-        case Reg::R8:         out = regs.r8; return true;
-        case Reg::RAX:        out = regs.rax; return true;
-        case Reg::RCX:        out = regs.rcx; return true;
-        case Reg::RDX:        out = regs.rdx; return true;
-        case Reg::RSI:        out = regs.rsi; return true;
-        case Reg::RDI:        out = regs.rdi; return true;
-        case Reg::ORIG_RAX:   out = regs.orig_rax; return true;
-        case Reg::RIP:        out = regs.rip; return true;
-        case Reg::CS:         out = regs.cs; return true;
-        case Reg::RFLAGS:     out = regs.eflags; return true;
-        case Reg::RSP:        out = regs.rsp; return true;
-        case Reg::SS:         out = regs.ss; return true;
-        case Reg::FS_BASE:    out = regs.fs_base; return true;
-        case Reg::GS_BASE:    out = regs.gs_base; return true;
-        case Reg::DS:         out = regs.ds; return true;
-        case Reg::ES:         out = regs.es; return true;
-        case Reg::FS:         out = regs.fs; return true;
-        case Reg::GS:         out = regs.gs; return true;
-
-        case Reg::DEFAULT:  return false;
-        default:            return false;
-    }
-
-    return false;
-}
-
-bool SetRegisterValue(pid_t pid, Reg r, uint64_t value) {
-    user_regs_struct regs;
-    ptrace(PTRACE_GETREGS, pid, nullptr, &regs);
+    if (reg.kind != RegKind::GPR) return false;
+    std::memcpy(reinterpret_cast<uint8_t*>(&regs) + reg.index, &value, sizeof(value));
+    return true;
+}
 
+// Offsets of the XSAVE components in the standard (non-compacted) format that PTRACE_GETREGSET NT_X86_XSTATE uses.
+// They depend on the CPU and are read once from CPUID leaf 0xD.
+struct XStateLayout {
+    static constexpr size_t LEGACY_MXCSR = 24;
+    static constexpr size_t LEGACY_XMM = 160;
+    static constexpr size_t HEADER_XSTATE_BV = 512;
+
+    enum Component : int {
+        COMP_SSE = 1,       // xmm0-15 and mxcsr in the legacy area
+        COMP_AVX = 2,       // upper 128 bits of ymm0-15
+        COMP_OPMASK = 5,    // k0-7
+        COMP_ZMM_HI256 = 6, // upper 256 bits of zmm0-15
+        COMP_HI16_ZMM = 7,  // zmm16-31
+
+        COMP_COUNT = 8,
+    };
+
+    size_t size = 0;
+    size_t offsets[COMP_COUNT] = {};
+    uint64_t supported = 0; // bit per component enabled in XCR0
+
+    bool Has(Component c) const { return supported & (uint64_t(1) << c); }
+};
+
+const XStateLayout& GetXStateLayout() {
+    static const XStateLayout layout = []() {
+        XStateLayout l;
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid_count(0xD, 0, &eax, &ebx, &ecx, &edx)) {
+            return l;
+        }
+        l.size = ebx;
+        l.supported = eax;
+        for (int c = XStateLayout::COMP_AVX; c < XStateLayout::COMP_COUNT; c++) {
+            if (!l.Has(XStateLayout::Component(c))) continue;
+            __get_cpuid_count(0xD, c, &eax, &ebx, &ecx, &edx);
+            l.offsets[c] = ebx;
+        }
+        return l;
+    }();
+    return layout;
+}
+
+// A contiguous part of an extended register inside the XSAVE area. Wide registers are split across components, e.g.
+// zmm3 is xmm3 from the legacy area, the upper half of ymm3 from the AVX component and the rest from ZMM_Hi256.
+struct XStatePiece {
+    size_t offset;
+    size_t size;
+    int component; // -1 for fields that are always valid (mxcsr)
+};
+
+// Returns the number of pieces (at most 3) that make up r, or 0 when the CPU doesn't support it.
+size_t GetXStatePieces(Reg r, XStatePiece out[3]) {
+    const XStateLayout& l = GetXStateLayout();
     const RegDesc& reg = GetRegDesc(r);
-    switch (reg.r) {
-        case Reg::R15:         regs.r15 = value; break;
-        case Reg::R14:         regs.r14 = value; break;
-        case Reg::R13:         regs.r13 = value; break;
-        case Reg::R12:         regs.r12 = value; break;
-        case Reg::RBP:         regs.rbp = value; break;
-        case Reg::RBX:         regs.rbx = value; break;
-        case Reg::R11:         regs.r11 = value; break;
-        case Reg::R10:         regs.r10 = value; break;
-        case Reg::R9:          regs.r9 = value; break;
-        case Reg::R8:          regs.r8 = value; break;
-        case Reg::RAX:         regs.rax = value; break;
-        case Reg::RCX:         regs.rcx = value; break;
-        case Reg::RDX:         regs.rdx = value; break;
-        case Reg::RSI:         regs.rsi = value; break;
-        case Reg::RDI:         regs.rdi = value; break;
-        case Reg::ORIG_RAX:    regs.orig_rax = value; break;
-        case Reg::RIP:         regs.rip = value; break;
-        case Reg::CS:          regs.cs = value; break;
-        case Reg::RFLAGS:      regs.eflags = value; break;
-        case Reg::RSP:         regs.rsp = value; break;
-        case Reg::SS:          regs.ss = value; break;
-        case Reg::FS_BASE:     regs.fs_base = value; break;
-        case Reg::GS_BASE:     regs.gs_base = value; break;
-        case Reg::DS:          regs.ds = value; break;
-        case Reg::ES:          regs.es = value; break;
-        case Reg::FS:          regs.fs = value; break;
-        case Reg::GS:          regs.gs = value; break;
-
-        case Reg::DEFAULT:     return false;
-        default:               return false;
-    }
-
-    if (int err = ptrace(PTRACE_SETREGS, pid, nullptr, &regs); err < 0) {
-        std::cerr << "Failed to set register: " << std::strerror(errno) << std::endl;
-        return -3;
+    size_t idx = reg.index;
+
+    size_t width;
+    switch (reg.kind) {
+        case RegKind::MXCSR:
+            out[0] = { XStateLayout::LEGACY_MXCSR, 4, -1 };
+            return 1;
+        case RegKind::K:
+            if (!l.Has(XStateLayout::COMP_OPMASK)) return 0;
+            out[0] = { l.offsets[XStateLayout::COMP_OPMASK] + 8 * idx, 8, XStateLayout::COMP_OPMASK };
+            return 1;
+        case RegKind::XMM: width = 16; break;
+        case RegKind::YMM: width = 32; break;
+        case RegKind::ZMM: width = 64; break;
+        default:           return 0;
+    }
+
+    if (idx >= 16) {
+        // Registers 16-31 only exist with AVX-512 and are stored whole.
+        if (!l.Has(XStateLayout::COMP_HI16_ZMM)) return 0;
+        out[0] = { l.offsets[XStateLayout::COMP_HI16_ZMM] + 64 * (idx - 16), width, XStateLayout::COMP_HI16_ZMM };
+        return 1;
+    }
+
+    size_t n = 0;
+    out[n++] = { XStateLayout::LEGACY_XMM + 16 * idx, 16, XStateLayout::COMP_SSE };
+    if (width >= 32) {
+        if (!l.Has(XStateLayout::COMP_AVX)) return 0;
+        out[n++] = { l.offsets[XStateLayout::COMP_AVX] + 16 * idx, 16, XStateLayout::COMP_AVX };
+    }
+    if (width >= 64) {
+        if (!l.Has(XStateLayout::COMP_ZMM_HI256)) return 0;
+        out[n++] = { l.offsets[XStateLayout::COMP_ZMM_HI256] + 32 * idx, 32, XStateLayout::COMP_ZMM_HI256 };
+    }
+    return n;
+}
+
+size_t GetXStateRegisterSize(Reg r) {
+    XStatePiece pieces[3];
+    size_t n = GetXStatePieces(r, pieces);
+    size_t size = 0;
+    for (size_t i = 0; i < n; i++) size += pieces[i].size;
+    return size;
+}
+
+// Register state of one stopped thread. The general purpose registers are fetched with a single PTRACE_GETREGS on the
+// first access after a stop and writes are kept in the cache until Flush, which issues one PTRACE_SETREGS right
+// before the thread is resumed. The XSAVE area is several KB and is only fetched when an extended register is
+// actually accessed.
+struct RegisterCache {
+public:
+    RegisterCache() : m_tid(0), m_valid(false), m_dirty(0), m_offline(false), m_xstateValid(false), m_xstateDirty(false) {}
+    explicit RegisterCache(pid_t tid)
+        : m_tid(tid), m_valid(false), m_dirty(0), m_offline(false), m_xstateValid(false), m_xstateDirty(false) {}
+
+    // Serves the thread's registers from a saved copy (e.g. a core file) instead of ptrace. xstate may be empty.
+    void Load(const user_regs_struct& regs, const std::vector<uint8_t>& xstate) {
+        m_offline = true;
+        m_regs = regs;
+        m_valid = true;
+        m_xstate = xstate;
+        m_xstateValid = !xstate.empty();
+    }
+
+    // Extended registers up to 8 bytes wide (mxcsr, k0-7) can be accessed as integers as well.
+    bool Get(Reg r, uint64_t& out) {
+        if (!IsGeneralRegister(r)) {
+            uint8_t buf[64];
+            size_t size = 0;
+            if (!GetExtended(r, buf, size) || size > sizeof(out)) return false;
+            out = 0;
+            std::memcpy(&out, buf, size);
+            return true;
+        }
+        if (!Fill()) return false;
+        return GetRegisterValue(m_regs, r, out);
+    }
+
+    bool Set(Reg r, uint64_t value) {
+        if (!IsGeneralRegister(r)) {
+            size_t size = GetXStateRegisterSize(r);
+            if (size == 0 || size > sizeof(value)) return false;
+            return SetExtended(r, reinterpret_cast<const uint8_t*>(&value), size);
+        }
+        if (!Fill()) return false;
+        if (!SetRegisterValue(m_regs, r, value)) return false;
+        m_dirty |= uint64_t(1) << uint64_t(r);
+        return true;
+    }
+
+    // Copies the little-endian bytes of an XSAVE register into out (at least 64 bytes) and sets size to its width.
+    bool GetExtended(Reg r, uint8_t* out, size_t& size) {
+        XStatePiece pieces[3];
+        size_t n = GetXStatePieces(r, pieces);
+        if (n == 0 || !FillXState()) return false;
+
+        uint64_t xstateBV;
+        std::memcpy(&xstateBV, m_xstate.data() + XStateLayout::HEADER_XSTATE_BV, sizeof(xstateBV));
+        size = 0;
+        for (size_t i = 0; i < n; i++) {
+            const XStatePiece& p = pieces[i];
+            if (p.offset + p.size > m_xstate.size()) return false;
+            if (p.component >= 0 && !(xstateBV & (uint64_t(1) << p.component))) {
+                // Component is in its initial state, the kernel may leave its area untouched.
+                std::memset(out + size, 0, p.size);
+            }
+            else {
+                std::memcpy(out + size, m_xstate.data() + p.offset, p.size);
+            }
+            size += p.size;
+        }
+        return true;
+    }
+
+    // in must hold GetXStateRegisterSize(r) bytes, shorter values are zero extended.
+    bool SetExtended(Reg r, const uint8_t* in, size_t size) {
+        XStatePiece pieces[3];
+        size_t n = GetXStatePieces(r, pieces);
+        if (n == 0 || !FillXState()) return false;
+        for (size_t i = 0; i < n; i++) {
+            if (pieces[i].offset + pieces[i].size > m_xstate.size()) return false;
+        }
+
+        uint64_t xstateBV;
+        std::memcpy(&xstateBV, m_xstate.data() + XStateLayout::HEADER_XSTATE_BV, sizeof(xstateBV));
+        size_t done = 0;
+        for (size_t i = 0; i < n; i++) {
+            const XStatePiece& p = pieces[i];
+            uint8_t* dst = m_xstate.data() + p.offset;
+            size_t cnt = done < size ? std::min(p.size, size - done) : 0;
+            std::memcpy(dst, in + done, cnt);
+            std::memset(dst + cnt, 0, p.size - cnt);
+            // Mark the component as in use, otherwise the kernel restores it to its initial state.
+            xstateBV |= uint64_t(1) << (p.component >= 0 ? p.component : XStateLayout::COMP_SSE);
+            done += p.size;
+        }
+        std::memcpy(m_xstate.data() + XStateLayout::HEADER_XSTATE_BV, &xstateBV, sizeof(xstateBV));
+        m_xstateDirty = true;
+        return true;
+    }
+
+    bool IsDirty() const { return m_dirty != 0 || m_xstateDirty; }
+
+    bool Flush() {
+        if (m_dirty) {
+            if (ptrace(PTRACE_SETREGS, m_tid, nullptr, &m_regs) < 0) {
+                std::cerr << "Failed to set registers: " << std::strerror(errno) << std::endl;
+                return false;
+            }
+            m_dirty = 0;
+        }
+        if (m_xstateDirty) {
+            iovec iov = { m_xstate.data(), m_xstate.size() };
+            if (ptrace(PTRACE_SETREGSET, m_tid, NT_X86_XSTATE, &iov) < 0) {
+                std::cerr << "Failed to set extended registers: " << std::strerror(errno) << std::endl;
+                return false;
+            }
+            m_xstateDirty = false;
+        }
+        return true;
+    }
+
+    // Must be called after Flush, once the thread was resumed and the cached values are stale.
+    void Invalidate() {
+        assert(!IsDirty());
+        m_valid = false;
+        m_xstateValid = false;
+    }
+
+    const user_regs_struct* Raw() {
+        return Fill() ? &m_regs : nullptr;
+    }
+
+    // The whole XSAVE area in the PTRACE_GETREGSET layout. Its first 512 bytes are the FXSAVE image that
+    // user_fpregs_struct describes.
+    const std::vector<uint8_t>* RawXState() {
+        return FillXState() ? &m_xstate : nullptr;
+    }
+
+private:
+    static_assert(size_t(Reg::MXCSR) <= 64, "dirty mask holds one bit per general purpose register");
+
+    bool Fill() {
+        if (m_valid) return true;
+        if (m_offline) return false;
+        if (ptrace(PTRACE_GETREGS, m_tid, nullptr, &m_regs) < 0) {
+            std::cerr << "Failed to get registers: " << strerror(errno) << std::endl;
+            return false;
+        }
+        m_valid = true;
+        return true;
+    }
+
+    bool FillXState() {
+        if (m_xstateValid) return true;
+        if (m_offline) {
+            std::cerr << "Extended registers are not available" << std::endl;
+            return false;
+        }
+        const XStateLayout& l = GetXStateLayout();
+        if (l.size == 0) {
+            std::cerr << "XSAVE is not supported on this CPU" << std::endl;
+            return false;
+        }
+        m_xstate.assign(l.size, 0);
+        iovec iov = { m_xstate.data(), m_xstate.size() };
+        if (ptrace(PTRACE_GETREGSET, m_tid, NT_X86_XSTATE, &iov) < 0) {
+            std::cerr << "Failed to get extended registers: " << strerror(errno) << std::endl;
+            return false;
+        }
+        m_xstate.resize(iov.iov_len);
+        m_xstateValid = true;
+        return true;
+    }
+
+    pid_t m_tid;
+    bool m_valid;
+    uint64_t m_dirty; // bit per general purpose Reg
+    bool m_offline;
+    user_regs_struct m_regs = {};
+
+    bool m_xstateValid;
+    bool m_xstateDirty;
+    std::vector<uint8_t> m_xstate;
+};
+
+// Prints a register as lanes described by fmt: a kind (x hex, u unsigned, i signed, f float) followed by the lane
+// width in bits, e.g. "f32" or "x128". Lanes are printed from the lowest to the highest.
+bool PrintRegisterLanes(const uint8_t* data, size_t size, std::string_view fmt) {
+    if (fmt.size() < 2) return false;
+    char kind = fmt[0];
+    size_t bits = 0;
+    for (char c : fmt.substr(1)) {
+        if (c < '0' || c > '9') return false;
+        bits = bits * 10 + size_t(c - '0');
     }
+    size_t laneSize = bits / 8;
+    if (bits % 8 != 0 || laneSize == 0 || laneSize > size || size % laneSize != 0) return false;
+    if (kind == 'f' && laneSize != 4 && laneSize != 8) return false;
+    if ((kind == 'u' || kind == 'i') && laneSize > 8) return false;
+    if (kind != 'x' && kind != 'u' && kind != 'i' && kind != 'f') return false;
 
+    std::cout << "{ ";
+    for (size_t off = 0; off < size; off += laneSize) {
+        if (off) std::cout << ", ";
+        const uint8_t* lane = data + off;
+        if (kind == 'x') {
+            std::cout << "0x" << std::hex << std::setfill('0');
+            for (size_t b = laneSize; b > 0; b--) std::cout << std::setw(2) << uint32_t(lane[b - 1]);
+            continue;
+        }
+
+        uint64_t raw = 0;
+        std::memcpy(&raw, lane, laneSize);
+        if (kind == 'f' && laneSize == 4) {
+            float f;
+            std::memcpy(&f, lane, sizeof(f));
+            std::cout << std::defaultfloat << f;
+        }
+        else if (kind == 'f') {
+            double d;
+            std::memcpy(&d, lane, sizeof(d));
+            std::cout << std::defaultfloat << d;
+        }
+        else if (kind == 'i') {
+            // Sign extend from the lane width.
+            int64_t v = laneSize == 8 ? int64_t(raw) : int64_t(raw << (64 - bits)) >> (64 - bits);
+            std::cout << std::dec << v;
+        }
+        else {
+            std::cout << std::dec << raw;
+        }
+    }
+    std::cout << " }" << std::endl;
     return true;
 }
 
-bool GetRegisterValueFromDwarfRegister(pid_t pid, int regnum, uint64_t& out) {
-    const RegDesc* reg;
-    for (size_t i = 0; i < size_t(Reg::COUNT); i++) {
-        if (g_RegisterDescriptors[i].dwarf == regnum) {
-            reg = &g_RegisterDescriptors[i];
+// Parses a hex string of any length into little-endian bytes, e.g. for writing vector registers.
+bool ParseHexBytes(std::string_view hex, std::vector<uint8_t>& out) {
+    if (hex.size() >= 2 && hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X')) hex.remove_prefix(2);
+    if (hex.empty()) return false;
+    out.clear();
+    for (size_t end = hex.size(); end > 0; end -= std::min(end, size_t(2))) {
+        size_t start = end >= 2 ? end - 2 : 0;
+        uint8_t byte = 0;
+        for (size_t i = start; i < end; i++) {
+            char c = hex[i];
+            int v = (c >= '0' && c <= '9') ? c - '0'
+                  : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+                  : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+            if (v < 0) return false;
+            byte = uint8_t(byte << 4 | v);
         }
+        out.push_back(byte);
     }
-    if (reg == nullptr) {
+    return true;
+}
+
+Reg GetRegisterFromDwarf(int regnum) { return g_RegDwarfTable.Find(regnum); }
+
+bool GetRegisterValueFromDwarfRegister(RegisterCache& regs, int regnum, uint64_t& out) {
+    Reg r = GetRegisterFromDwarf(regnum);
+    if (r == Reg::DEFAULT) {
         return false;
     }
 
-    bool ret = GetRegisterValue(pid, reg->r, out);
+    bool ret = regs.Get(r, out);
     return ret;
 }
 
-std::string GetRegisterName(Reg r) { return GetRegDesc(r).name; }
+std::string GetRegisterName(Reg r) { return std::string(GetRegDesc(r).name); }
 
-Reg GetRegisterFromName(std::string_view name) {
-    for (size_t i = 0; i < size_t(Reg::COUNT); i++) {
-        if (g_RegisterDescriptors[i].name == name) {
-            return g_RegisterDescriptors[i].r;
+Reg GetRegisterFromName(std::string_view name) { return g_RegNameTable.Find(name); }
+
+// Times name and DWARF number lookups over every register.
+void BenchmarkRegisterLookups(size_t iterations) {
+    using Clock = std::chrono::steady_clock;
+    size_t sink = 0;
+
+    auto start = Clock::now();
+    for (size_t it = 0; it < iterations; it++) {
+        for (size_t i = 1; i < size_t(Reg::COUNT); i++) {
+            sink += size_t(GetRegisterFromName(g_RegisterDescriptors[i].name));
         }
     }
-    return g_RegisterDescriptors[0].r;
+    double nameNs = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+    start = Clock::now();
+    for (size_t it = 0; it < iterations; it++) {
+        for (int d = 0; d < RegDwarfTable::MAX_DWARF; d++) {
+            sink += size_t(GetRegisterFromDwarf(d));
+        }
+    }
+    double dwarfNs = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+    size_t nameLookups = iterations * (size_t(Reg::COUNT) - 1);
+    size_t dwarfLookups = iterations * size_t(RegDwarfTable::MAX_DWARF);
+    std::cout << std::dec << std::fixed << std::setprecision(2)
+              << "name lookup:  " << nameNs / double(nameLookups) << " ns\n"
+              << "dwarf lookup: " << dwarfNs / double(dwarfLookups) << " ns\n"
+              << "(checksum " << sink << ")" << std::endl;
 }
 
 inline std::vector<std::string_view> Split(std::string_view str, std::string_view delim) {
@@ -222,183 +783,8236 @@ bool HasPrefix(std::string_view s, std::string_view prefix) {
     return std::equal(s.begin(), s.end(), prefix.begin());
 }
 
-void LogArguments(std::vector<std::string_view> args) {
-    for (size_t i = 0; i < args.size(); i++) {
-        std::cout << "args[" << i << "] = " << args[i] << std::endl;
+constexpr uint64_t DBG_PAGE_SIZE = 4096;
+
+enum struct MemBackend : int {
+    ProcessVM, // process_vm_readv/writev, no kernel-side copy through the tracer
+    ProcMem,   // pread/pwrite on /proc/pid/mem, can access write-protected pages
+    Ptrace,    // PTRACE_PEEKDATA/POKEDATA, one word per syscall
+
+    COUNT,
+};
+
+const char* MemBackendName(MemBackend b) {
+    switch (b) {
+        case MemBackend::ProcessVM: return "process_vm";
+        case MemBackend::ProcMem:   return "proc_mem";
+        case MemBackend::Ptrace:    return "ptrace";
+        default:                    return "unknown";
     }
 }
 
-struct Breakpoint {
+// One element of a scatter/gather batch. Remote range [addr, addr+len) is transferred to/from buf.
+struct MemIoVec {
+    uint64_t addr;
+    void* buf;
+    size_t len;
+};
+
+// One line of /proc/pid/maps.
+struct MemoryMapping {
+    uint64_t start;
+    uint64_t end;
+    std::string perms; // e.g. "r-xp"
+    uint64_t offset;
+    uint64_t inode;
+    std::string path;  // file path, [heap], [stack]... or empty for anonymous mappings
+
+    bool IsReadable() const { return !perms.empty() && perms[0] == 'r'; }
+    bool IsWritable() const { return perms.size() > 1 && perms[1] == 'w'; }
+    bool IsExecutable() const { return perms.size() > 2 && perms[2] == 'x'; }
+    uint64_t Size() const { return end - start; }
+};
+
+// Read-only mmap of a whole file.
+struct MappedFile {
 public:
-    Breakpoint() : m_pid(0), m_addr(0), m_enabled(false), m_savedData(0) {}
-    Breakpoint(pid_t pid, intptr_t addr)
-        : m_pid(pid), m_addr(addr), m_enabled(false), m_savedData(0) {}
+    MappedFile() : m_data(nullptr), m_size(0) {}
+    ~MappedFile() { Close(); }
 
-    bool IsEnabled() const { return m_enabled; }
-    uint8_t GetAddr() const { return m_addr; }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& o) noexcept : m_data(o.m_data), m_size(o.m_size) { o.m_data = nullptr; o.m_size = 0; }
 
-    void Enable() {
-        long data = ptrace(PTRACE_PEEKDATA, m_pid, m_addr, nullptr);
-        m_savedData = static_cast<uint8_t>(data & 0xFF); // save last byte
-        uint64_t int3 = 0xCC;
-        uint64_t data_with_int3 = (data & ~0xFF) | int3; // set last byte to int3
-        ptrace(PTRACE_POKEDATA, m_pid, m_addr, data_with_int3);
+    bool Open(const std::string& path) {
+        Close();
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                m_data = reinterpret_cast<const uint8_t*>(p);
+                m_size = size_t(st.st_size);
+            }
+        }
+        close(fd);
+        return m_data != nullptr;
+    }
 
-        m_enabled = true;
+    void Close() {
+        if (m_data) munmap(const_cast<uint8_t*>(m_data), m_size);
+        m_data = nullptr;
+        m_size = 0;
     }
 
-    void Disable() {
-        long data = ptrace(PTRACE_PEEKDATA, m_pid, m_addr, nullptr);
-        long restored_data = (data & ~0xFF) | m_savedData;
-        ptrace(PTRACE_POKEDATA, m_pid, m_addr, restored_data);
+    const uint8_t* Data() const { return m_data; }
+    size_t Size() const { return m_size; }
 
-        m_enabled = false;
+    // Bounds checked pointer to count objects of type T at offset.
+    template <typename T>
+    const T* At(uint64_t offset, size_t count = 1) const {
+        if (offset > m_size || count > (m_size - offset) / sizeof(T)) return nullptr;
+        return reinterpret_cast<const T*>(m_data + offset);
     }
 
 private:
-    pid_t m_pid;
-    intptr_t m_addr;
-    bool m_enabled;
-    uint8_t m_savedData;
+    const uint8_t* m_data;
+    size_t m_size;
 };
 
-struct Debugger {
+// Section header of the named section, nullptr when the file has none.
+const Elf64_Shdr* FindElfSection(const MappedFile& file, std::string_view name) {
+    const Elf64_Ehdr* ehdr = file.At<Elf64_Ehdr>(0);
+    if (!ehdr || !ehdr->checkMagic() || ehdr->getFileClass() != ELFCLASS64) return nullptr;
+    const Elf64_Shdr* shdrs = file.At<Elf64_Shdr>(ehdr->e_shoff, ehdr->e_shnum);
+    if (!shdrs || ehdr->e_shstrndx >= ehdr->e_shnum) return nullptr;
+    const Elf64_Shdr& strtab = shdrs[ehdr->e_shstrndx];
+    const char* strs = file.At<char>(strtab.sh_offset, strtab.sh_size);
+    if (!strs) return nullptr;
+    for (size_t i = 0; i < ehdr->e_shnum; i++) {
+        if (shdrs[i].sh_name >= strtab.sh_size) continue;
+        const char* n = strs + shdrs[i].sh_name;
+        if (std::string_view(n, strnlen(n, strtab.sh_size - shdrs[i].sh_name)) == name) return &shdrs[i];
+    }
+    return nullptr;
+}
 
-    Debugger(std::string_view progName, pid_t pid)
-        : m_progName(progName), m_pid(pid) {}
+// Difference between the run time and link time addresses of an ELF file, given its mapping at the lowest file
+// offset, which corresponds to the first PT_LOAD.
+uint64_t ElfLoadBias(const Elf64_Ehdr* ehdr, const Elf64_Phdr* phdrs, const MemoryMapping& m) {
+    for (size_t i = 0; i < ehdr->e_phnum; i++) {
+        if (phdrs[i].p_type != PT_LOAD) continue;
+        uint64_t pageVaddr = phdrs[i].p_vaddr & ~(DBG_PAGE_SIZE - 1);
+        uint64_t pageOffset = phdrs[i].p_offset & ~(DBG_PAGE_SIZE - 1);
+        return m.start - m.offset + pageOffset - pageVaddr;
+    }
+    return 0;
+}
 
-    int Run() {
-        if (int ret = WaitForSignal(); ret < 0) {
-            return ret;
+// The mapping at the lowest file offset of every file mapped into the inferior, which is what ElfLoadBias needs.
+std::map<std::string, const MemoryMapping*> LowestMappings(const std::vector<MemoryMapping>& mappings) {
+    std::map<std::string, const MemoryMapping*> lowest;
+    for (const MemoryMapping& m : mappings) {
+        if (m.path.empty() || m.path[0] != '/') continue;
+        auto [it, inserted] = lowest.emplace(m.path, &m);
+        if (!inserted && m.offset < it->second->offset) it->second = &m;
+    }
+    return lowest;
+}
+
+// Path and load address of each of them. Tables built from the mapped files only need reloading when this changes.
+std::vector<std::pair<std::string, uint64_t>> ModuleSet(const std::map<std::string, const MemoryMapping*>& lowest) {
+    std::vector<std::pair<std::string, uint64_t>> modules;
+    for (const auto& [path, m] : lowest) modules.emplace_back(path, m->start);
+    return modules;
+}
+
+// Post-mortem view of an ELF core file. The file is mapped once and memory reads are served straight from the PT_LOAD
+// segments. Bytes a segment doesn't contain (file backed mappings the kernel only dumps partially) are taken from the
+// files listed in NT_FILE when they still exist.
+struct CoreFile {
+public:
+    struct Thread {
+        pid_t tid;
+        int signal;
+        user_regs_struct regs;
+        std::vector<uint8_t> xstate;
+    };
+
+    bool Open(const std::string& path) {
+        if (!m_file.Open(path)) {
+            std::cerr << "Failed to map " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        const Elf64_Ehdr* ehdr = m_file.At<Elf64_Ehdr>(0);
+        if (!ehdr || !ehdr->checkMagic() || ehdr->getFileClass() != ELFCLASS64 || ehdr->e_type != ET_CORE ||
+            ehdr->e_machine != EM_X86_64) {
+            std::cerr << path << " is not an x86-64 ELF core file" << std::endl;
+            return false;
+        }
+        const Elf64_Phdr* phdrs = m_file.At<Elf64_Phdr>(ehdr->e_phoff, ehdr->e_phnum);
+        if (!phdrs) {
+            std::cerr << path << ": truncated program headers" << std::endl;
+            return false;
         }
 
-        char* line = nullptr;
-        while ((line = linenoise("dbg> ")) != nullptr) {
-            std::cout << "line: " << line << std::endl;
-            if(int err = HandleCmd(line); err < 0) {
-                return err;
+        std::vector<FileEntry> files;
+        size_t truncated = 0;
+        for (size_t i = 0; i < ehdr->e_phnum; i++) {
+            const Elf64_Phdr& ph = phdrs[i];
+            bool fits = ph.p_offset <= m_file.Size() && ph.p_filesz <= m_file.Size() - ph.p_offset;
+            if (ph.p_type == PT_NOTE) {
+                ParseNotes(ph.p_offset, ph.p_filesz, files);
+            }
+            else if (ph.p_type == PT_LOAD && ph.p_memsz > 0) {
+                // A truncated core keeps whatever part of the segment made it to disk.
+                uint64_t inFile = fits ? ph.p_filesz : ph.p_offset < m_file.Size() ? m_file.Size() - ph.p_offset : 0;
+                inFile = std::min(inFile, ph.p_memsz);
+                truncated += !fits;
+                const uint8_t* data = inFile ? m_file.Data() + ph.p_offset : nullptr;
+                Segment s = { ph.p_vaddr, ph.p_vaddr + ph.p_memsz, inFile, data, nullptr, 0 };
+                m_segments.push_back(s);
+
+                MemoryMapping m;
+                m.start = s.start;
+                m.end = s.end;
+                m.perms = std::string(ph.p_flags & PF_R ? "r" : "-") + (ph.p_flags & PF_W ? "w" : "-") +
+                          (ph.p_flags & PF_X ? "x" : "-") + "p";
+                m.offset = 0;
+                m.inode = 0;
+                m_mappings.push_back(m);
             }
-            linenoiseHistoryAdd(line);
-            linenoiseFree(line);
         }
+        if (truncated) {
+            std::cerr << path << " is truncated, " << truncated << " segments are incomplete" << std::endl;
+        }
+        std::sort(m_segments.begin(), m_segments.end(), [](const Segment& a, const Segment& b) { return a.start < b.start; });
+        std::sort(m_mappings.begin(), m_mappings.end(), [](auto& a, auto& b) { return a.start < b.start; });
 
-        return 0;
-    }
+        // Attach the NT_FILE entries to the segments they describe, mapping each file at most once.
+        std::map<std::string, MappedFile*> opened;
+        for (const FileEntry& f : files) {
+            auto it = std::lower_bound(m_mappings.begin(), m_mappings.end(), f.start,
+                                       [](const MemoryMapping& m, uint64_t a) { return m.start < a; });
+            if (it == m_mappings.end() || it->start != f.start) continue;
+            size_t idx = size_t(it - m_mappings.begin());
+            it->path = f.path;
+            it->offset = f.offset;
 
-    void SetBreakpointAtAddress(intptr_t addr) {
-        Breakpoint bp(m_pid, addr);
-        bp.Enable();
-        m_breakpoints[addr] = bp;
+            auto [o, inserted] = opened.emplace(f.path, nullptr);
+            if (inserted) {
+                MappedFile mf;
+                if (mf.Open(f.path)) {
+                    m_backing.push_back(std::move(mf));
+                    o->second = &m_backing.back();
+                }
+            }
+            if (o->second) {
+                m_segments[idx].backing = o->second;
+                m_segments[idx].backingOffset = f.offset;
+            }
+        }
+        return true;
     }
 
-    void DumpRegisters() {
-        for (const auto& rd : g_RegisterDescriptors) {
-            uint64_t regVal;
-            if (!GetRegisterValue(m_pid, rd.r, regVal)) {
-                std::cout << "error getting register " << rd.name << std::endl;
-                continue;
+    // Copies [addr, addr+len) into dst and returns the number of bytes read. A short count means the byte at addr+ret is
+    // not part of the core. Safe to call from any thread.
+    size_t Read(uint64_t addr, void* dst, size_t len) const {
+        uint8_t* out = reinterpret_cast<uint8_t*>(dst);
+        size_t done = 0;
+        while (done < len) {
+            uint64_t a = addr + done;
+            auto it = std::upper_bound(m_segments.begin(), m_segments.end(), a,
+                                       [](uint64_t v, const Segment& s) { return v < s.start; });
+            if (it == m_segments.begin()) break;
+            const Segment& s = *--it;
+            if (a >= s.end) break;
+
+            uint64_t rel = a - s.start;
+            size_t n;
+            if (rel < s.fileSize) {
+                n = size_t(std::min<uint64_t>(len - done, s.fileSize - rel));
+                std::memcpy(out + done, s.data + rel, n);
             }
-            std::cout << rd.name << " 0x" << std::setfill('0') << std::setw(16) << std::hex << regVal << std::endl;
+            else if (s.backing && s.backingOffset + rel < s.backing->Size()) {
+                n = size_t(std::min<uint64_t>({ len - done, s.end - a, s.backing->Size() - s.backingOffset - rel }));
+                std::memcpy(out + done, s.backing->Data() + s.backingOffset + rel, n);
+            }
+            else {
+                break;
+            }
+            done += n;
         }
+        return done;
     }
 
-    uint64_t ReadMemory(uint64_t address) {
-        // mTODO: use https://man7.org/linux/man-pages/man2/process_vm_readv.2.html to bypass kernel space calls
-        return ptrace(PTRACE_PEEKDATA, m_pid, address, nullptr);
-    }
+    const std::vector<Thread>& Threads() const { return m_threads; }
+    const std::vector<MemoryMapping>& Mappings() const { return m_mappings; }
+    const std::string& ProgramName() const { return m_programName; }
 
-    int WriteMemory(uint64_t address, uint64_t value) {
-        // mTODO: use https://man7.org/linux/man-pages/man2/process_vm_readv.2.html to bypass kernel space calls
-        return ptrace(PTRACE_POKEDATA, m_pid, address, value);
-    }
+private:
+    struct Segment {
+        uint64_t start;
+        uint64_t end;
+        uint64_t fileSize;
+        const uint8_t* data;
+        const MappedFile* backing;
+        uint64_t backingOffset;
+    };
 
-    uint64_t GetPC() {
-        uint64_t ret;
-        if (!GetRegisterValue(m_pid, Reg::RIP, ret)) {
-            std::cout << "error getting PC" << std::endl;
-            return 0;
+    struct FileEntry {
+        uint64_t start;
+        uint64_t offset;
+        std::string path;
+    };
+
+    void ParseNotes(uint64_t offset, uint64_t size, std::vector<FileEntry>& files) {
+        uint64_t end = std::min<uint64_t>(offset + size, m_file.Size());
+        while (offset + sizeof(Elf64_Nhdr) <= end) {
+            const Elf64_Nhdr* n = m_file.At<Elf64_Nhdr>(offset);
+            uint64_t descOffset = offset + sizeof(Elf64_Nhdr) + ((uint64_t(n->n_namesz) + 3) & ~uint64_t(3));
+            uint64_t next = descOffset + ((uint64_t(n->n_descsz) + 3) & ~uint64_t(3));
+            if (descOffset + n->n_descsz > end) break;
+            const uint8_t* desc = m_file.Data() + descOffset;
+
+            if (n->n_type == NT_PRSTATUS && n->n_descsz >= sizeof(elf_prstatus)) {
+                // Every thread starts with its prstatus, the register sets that follow belong to it.
+                elf_prstatus st;
+                std::memcpy(&st, desc, sizeof(st));
+                Thread t = { st.pr_pid, st.pr_cursig, {}, {} };
+                std::memcpy(&t.regs, &st.pr_reg, sizeof(t.regs));
+                m_threads.push_back(std::move(t));
+            }
+            else if (n->n_type == NT_PRPSINFO && n->n_descsz >= sizeof(elf_prpsinfo)) {
+                elf_prpsinfo ps;
+                std::memcpy(&ps, desc, sizeof(ps));
+                m_programName.assign(ps.pr_fname, strnlen(ps.pr_fname, sizeof(ps.pr_fname)));
+            }
+            else if (n->n_type == NT_X86_XSTATE && !m_threads.empty()) {
+                m_threads.back().xstate.assign(desc, desc + n->n_descsz);
+            }
+            else if (n->n_type == NT_FPREGSET && !m_threads.empty() && m_threads.back().xstate.empty() &&
+                     n->n_descsz >= sizeof(user_fpregs_struct)) {
+                // Without NT_X86_XSTATE only the legacy area is known: x87 and SSE state in use, everything else in
+                // its initial state.
+                std::vector<uint8_t>& xs = m_threads.back().xstate;
+                xs.assign(std::max<size_t>(GetXStateLayout().size, XStateLayout::HEADER_XSTATE_BV + 64), 0);
+                std::memcpy(xs.data(), desc, sizeof(user_fpregs_struct));
+                uint64_t bv = 3;
+                std::memcpy(xs.data() + XStateLayout::HEADER_XSTATE_BV, &bv, sizeof(bv));
+            }
+            else if (n->n_type == NT_FILE && n->n_descsz >= 2 * sizeof(uint64_t)) {
+                ParseFileNote(desc, n->n_descsz, files);
+            }
+            offset = next;
         }
-        return ret;
     }
 
-    bool SetPC(uint64_t pc) {
-        if (!SetRegisterValue(m_pid, Reg::RIP, pc)) {
-            std::cout << "error setting PC" << std::endl;
-            return false;
+    // count, page size, {start, end, file offset in pages} per entry, then the NUL separated names.
+    static void ParseFileNote(const uint8_t* desc, size_t size, std::vector<FileEntry>& files) {
+        uint64_t count, pageSize;
+        std::memcpy(&count, desc, sizeof(count));
+        std::memcpy(&pageSize, desc + 8, sizeof(pageSize));
+        if (count > (size - 16) / 24) return;
+        const char* names = reinterpret_cast<const char*>(desc + 16 + count * 24);
+        const char* namesEnd = reinterpret_cast<const char*>(desc + size);
+        for (uint64_t i = 0; i < count && names < namesEnd; i++) {
+            uint64_t e[3];
+            std::memcpy(e, desc + 16 + i * 24, sizeof(e));
+            size_t len = strnlen(names, size_t(namesEnd - names));
+            files.push_back({ e[0], e[2] * pageSize, std::string(names, len) });
+            names += len + 1;
         }
-        return true;
     }
 
-    bool StepOverBreakpoint() {
-        uint64_t possibleBPLocation = GetPC() - 1;
+    MappedFile m_file;
+    std::vector<Segment> m_segments;
+    std::vector<MemoryMapping> m_mappings;
+    std::vector<Thread> m_threads;
+    std::deque<MappedFile> m_backing;
+    std::string m_programName;
+};
 
-        if (m_breakpoints.count(possibleBPLocation)) {
-            auto& bp = m_breakpoints[possibleBPLocation];
-            if (bp.IsEnabled()) {
-                auto prevInstrAddr = possibleBPLocation;
-                SetPC(prevInstrAddr);
+// Access layer for the memory of a stopped tracee. Every transfer is tried with process_vm_readv/writev first and
+// whatever it could not transfer (protected or unmapped pages) is retried through /proc/pid/mem and finally through
+// ptrace word access. When opened on a core file all reads are served from the core and writes fail.
+struct InferiorMemory {
+public:
+    InferiorMemory() : m_pid(0), m_memFd(-1), m_processVMUnavailable(false), m_core(nullptr) {}
+    ~InferiorMemory() { Close(); }
 
-                bp.Disable();
-                ptrace(PTRACE_SINGLESTEP, m_pid, nullptr, nullptr);
-                WaitForSignal();
-                bp.Enable();
-            }
+    InferiorMemory(const InferiorMemory&) = delete;
+    InferiorMemory& operator=(const InferiorMemory&) = delete;
+
+    void Open(pid_t pid) {
+        Close();
+        m_pid = pid;
+        std::string path = "/proc/" + std::to_string(pid) + "/mem";
+        m_memFd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (m_memFd < 0) {
+            std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
         }
+    }
 
-        return true;
+    void OpenCore(const CoreFile* core) {
+        Close();
+        m_core = core;
     }
 
-    int ContinueExecution() {
-        if (!StepOverBreakpoint()) return -1;
-        ptrace(PTRACE_CONT, m_pid, nullptr, nullptr);
-        return WaitForSignal();
+    void Close() {
+        if (m_memFd >= 0) close(m_memFd);
+        m_memFd = -1;
+        m_core = nullptr;
     }
 
-private:
-    int HandleCmd(std::string_view line) {
-        constexpr std::string_view COMMAND_SEPARATOR = " ";
-        auto args = Split(line, COMMAND_SEPARATOR);
-        if (args.empty()) return 0;
-        std::string_view command = args[0];
-        LogArguments(args);
+    // Returns the number of bytes read starting at addr. A short count means the byte at addr+ret is not accessible
+    // through any backend.
+    size_t Read(uint64_t addr, void* dst, size_t len) {
+        MemIoVec v = { addr, dst, len };
+        return ReadV(&v, 1);
+    }
+
+    size_t Write(uint64_t addr, const void* src, size_t len) {
+        MemIoVec v = { addr, const_cast<void*>(src), len };
+        return WriteV(&v, 1);
+    }
+
+    // Returns the total number of bytes transferred. Every element is attempted even when a previous one failed. When
+    // perVec is given it receives the number of bytes transferred for each element.
+    size_t ReadV(const MemIoVec* vecs, size_t count, size_t* perVec = nullptr) {
+        return TransferV(vecs, count, false, perVec);
+    }
+    size_t WriteV(const MemIoVec* vecs, size_t count, size_t* perVec = nullptr) {
+        return TransferV(vecs, count, true, perVec);
+    }
 
-        if (HasPrefix(command, "cont")) {
-            return ContinueExecution();
+    // Transfers with a single backend and no fallback. Used for benchmarking and by callers that need a specific
+    // access path (e.g. /proc/pid/mem for patching read-only text).
+    size_t ReadWith(MemBackend b, uint64_t addr, void* dst, size_t len) {
+        if (m_core) return m_core->Read(addr, dst, len);
+        switch (b) {
+            case MemBackend::ProcessVM: return ProcessVMTransfer(addr, dst, len, false);
+            case MemBackend::ProcMem:   return ProcMemTransfer(addr, dst, len, false);
+            case MemBackend::Ptrace:    return PtraceRead(addr, dst, len);
+            default:                    return 0;
         }
-        else if (HasPrefix(command, "break") && args.size() == 2) {
-            std::string addrStr (args[1].substr(2));
-            intptr_t addr = static_cast<intptr_t>(std::stol(addrStr, 0, 16));
-            SetBreakpointAtAddress(addr);
+    }
+
+    size_t WriteWith(MemBackend b, uint64_t addr, const void* src, size_t len) {
+        if (m_core) return 0;
+        void* buf = const_cast<void*>(src);
+        switch (b) {
+            case MemBackend::ProcessVM: return ProcessVMTransfer(addr, buf, len, true);
+            case MemBackend::ProcMem:   return ProcMemTransfer(addr, buf, len, true);
+            case MemBackend::Ptrace:    return PtraceWrite(addr, src, len);
+            default:                    return 0;
         }
-        else if (HasPrefix(command, "register") && args.size() >= 2) {
-            if (HasPrefix(args[1], "dump" ) && args.size() == 2) {
-                DumpRegisters();
+    }
+
+    // Reads [addr, addr+len) without ptrace, so it is safe to call from any thread. Pages that can't be read are zero
+    // filled. Returns the number of bytes that were not readable.
+    size_t ReadZeroFill(uint64_t addr, void* dst, size_t len) {
+        uint8_t* out = reinterpret_cast<uint8_t*>(dst);
+        size_t done = 0;
+        size_t missing = 0;
+        while (done < len) {
+            size_t n;
+            if (m_core) {
+                n = m_core->Read(addr + done, out + done, len - done);
+            }
+            else {
+                n = ProcessVMTransfer(addr + done, out + done, len - done, false);
+                if (n == 0) n = ProcMemTransfer(addr + done, out + done, len - done, false);
+            }
+            done += n;
+            if (done < len) {
+                // Skip to the next page boundary.
+                size_t skip = std::min(size_t(DBG_PAGE_SIZE - ((addr + done) & (DBG_PAGE_SIZE - 1))), len - done);
+                std::memset(out + done, 0, skip);
+                done += skip;
+                missing += skip;
+            }
+        }
+        return missing;
+    }
+
+    int MemFd() const { return m_memFd; }
+
+private:
+    static constexpr size_t MAX_IOV = IOV_MAX;
+
+    size_t TransferV(const MemIoVec* vecs, size_t count, bool write, size_t* perVec) {
+        if (m_core) return CoreTransferV(vecs, count, write, perVec);
+        size_t total = 0;
+        size_t i = 0;
+        while (i < count) {
+            // Batch as many elements as the kernel accepts in one call.
+            size_t batch = std::min(count - i, MAX_IOV);
+            size_t done = 0;
+            if (!m_processVMUnavailable) {
+                done = ProcessVMTransferV(vecs + i, batch, write);
+            }
+            total += done;
+
+            // Skip the fully transferred elements, then finish the one the kernel stopped in with the slower
+            // backends and continue batching after it.
+            size_t j = i;
+            while (j < i + batch && done >= vecs[j].len) {
+                if (perVec) perVec[j] = vecs[j].len;
+                done -= vecs[j].len;
+                j++;
+            }
+            if (j == i + batch) {
+                i = j;
+                continue;
+            }
+
+            const MemIoVec& v = vecs[j];
+            uint64_t addr = v.addr + done;
+            uint8_t* buf = reinterpret_cast<uint8_t*>(v.buf) + done;
+            size_t rest = FallbackTransfer(addr, buf, v.len - done, write);
+            if (perVec) perVec[j] = done + rest;
+            total += rest;
+            i = j + 1;
+        }
+        return total;
+    }
+
+    size_t CoreTransferV(const MemIoVec* vecs, size_t count, bool write, size_t* perVec) {
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++) {
+            size_t n = write ? 0 : m_core->Read(vecs[i].addr, vecs[i].buf, vecs[i].len);
+            if (perVec) perVec[i] = n;
+            total += n;
+        }
+        return total;
+    }
+
+    size_t FallbackTransfer(uint64_t addr, uint8_t* buf, size_t len, bool write) {
+        size_t done = ProcMemTransfer(addr, buf, len, write);
+        if (done < len) {
+            done += write ? PtraceWrite(addr + done, buf + done, len - done)
+                          : PtraceRead(addr + done, buf + done, len - done);
+        }
+        return done;
+    }
+
+    size_t ProcessVMTransferV(const MemIoVec* vecs, size_t count, bool write) {
+        iovec local[MAX_IOV];
+        iovec remote[MAX_IOV];
+        for (size_t i = 0; i < count; i++) {
+            local[i] = { vecs[i].buf, vecs[i].len };
+            remote[i] = { reinterpret_cast<void*>(vecs[i].addr), vecs[i].len };
+        }
+
+        ssize_t n = write ? process_vm_writev(m_pid, local, count, remote, count, 0)
+                          : process_vm_readv(m_pid, local, count, remote, count, 0);
+        if (n < 0) {
+            if (errno == ENOSYS || errno == EPERM) {
+                // Not available for this tracee (e.g. seccomp or missing CAP_SYS_PTRACE). Don't keep trying.
+                m_processVMUnavailable = true;
+            }
+            return 0;
+        }
+        return size_t(n);
+    }
+
+    size_t ProcessVMTransfer(uint64_t addr, void* buf, size_t len, bool write) {
+        size_t total = 0;
+        while (total < len) {
+            iovec local = { reinterpret_cast<uint8_t*>(buf) + total, len - total };
+            iovec remote = { reinterpret_cast<void*>(addr + total), len - total };
+            ssize_t n = write ? process_vm_writev(m_pid, &local, 1, &remote, 1, 0)
+                              : process_vm_readv(m_pid, &local, 1, &remote, 1, 0);
+            if (n <= 0) break;
+            total += size_t(n);
+        }
+        return total;
+    }
+
+    size_t ProcMemTransfer(uint64_t addr, void* buf, size_t len, bool write) {
+        if (m_memFd < 0) return 0;
+        size_t total = 0;
+        while (total < len) {
+            uint8_t* p = reinterpret_cast<uint8_t*>(buf) + total;
+            off_t off = off_t(addr + total);
+            ssize_t n = write ? pwrite(m_memFd, p, len - total, off)
+                              : pread(m_memFd, p, len - total, off);
+            if (n <= 0) break;
+            total += size_t(n);
+        }
+        return total;
+    }
+
+    size_t PtraceRead(uint64_t addr, void* dst, size_t len) {
+        uint8_t* out = reinterpret_cast<uint8_t*>(dst);
+        size_t total = 0;
+        while (total < len) {
+            uint64_t wordAddr = (addr + total) & ~uint64_t(7);
+            size_t skip = (addr + total) - wordAddr;
+            errno = 0;
+            long word = ptrace(PTRACE_PEEKDATA, m_pid, wordAddr, nullptr);
+            if (errno != 0) break;
+            size_t n = std::min(sizeof(word) - skip, len - total);
+            std::memcpy(out + total, reinterpret_cast<uint8_t*>(&word) + skip, n);
+            total += n;
+        }
+        return total;
+    }
+
+    size_t PtraceWrite(uint64_t addr, const void* src, size_t len) {
+        const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+        size_t total = 0;
+        while (total < len) {
+            uint64_t wordAddr = (addr + total) & ~uint64_t(7);
+            size_t skip = (addr + total) - wordAddr;
+            size_t n = std::min(sizeof(long) - skip, len - total);
+            long word = 0;
+            if (n != sizeof(word)) {
+                // Partial word, preserve the bytes around it.
+                errno = 0;
+                word = ptrace(PTRACE_PEEKDATA, m_pid, wordAddr, nullptr);
+                if (errno != 0) break;
+            }
+            std::memcpy(reinterpret_cast<uint8_t*>(&word) + skip, in + total, n);
+            if (ptrace(PTRACE_POKEDATA, m_pid, wordAddr, word) < 0) break;
+            total += n;
+        }
+        return total;
+    }
+
+    pid_t m_pid;
+    int m_memFd;
+    bool m_processVMUnavailable;
+    const CoreFile* m_core;
+};
+
+// Page granular cache in front of InferiorMemory. Only valid while the tracee is stopped: the debugger invalidates it
+// right before every resume or single-step. Writes go through to the tracee and update the cached copy.
+struct PageCache {
+public:
+    static constexpr size_t MAX_PREFETCH_PAGES = 32;
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t prefetched = 0;
+        uint64_t invalidations = 0;
+    };
+
+    explicit PageCache(InferiorMemory& memory)
+        : m_memory(memory), m_lastMissPage(0), m_prefetchPages(0) {}
+
+    size_t Read(uint64_t addr, void* dst, size_t len) {
+        uint8_t* out = reinterpret_cast<uint8_t*>(dst);
+        size_t total = 0;
+        while (total < len) {
+            uint64_t cur = addr + total;
+            uint64_t page = PageOf(cur);
+            const uint8_t* data = Lookup(page);
+            if (data) {
+                m_stats.hits++;
+            }
+            else {
+                m_stats.misses++;
+                data = Fill(page);
+            }
+            if (!data) {
+                // Not readable as a whole page (e.g. a guard page at the end of a mapping), don't cache it.
+                total += m_memory.Read(cur, out + total, len - total);
+                break;
+            }
+
+            size_t off = cur - page;
+            size_t n = std::min(size_t(DBG_PAGE_SIZE - off), len - total);
+            std::memcpy(out + total, data + off, n);
+            total += n;
+        }
+        return total;
+    }
+
+    size_t Write(uint64_t addr, const void* src, size_t len) {
+        size_t written = m_memory.Write(addr, src, len);
+        Update(addr, src, written);
+        return written;
+    }
+
+    // Copies bytes that were written to the tracee behind the cache's back into the cached pages.
+    void Update(uint64_t addr, const void* src, size_t len) {
+        const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+        size_t total = 0;
+        while (total < len) {
+            uint64_t cur = addr + total;
+            uint64_t page = PageOf(cur);
+            size_t off = cur - page;
+            size_t n = std::min(size_t(DBG_PAGE_SIZE - off), len - total);
+            if (auto it = m_index.find(page); it != m_index.end()) {
+                std::memcpy(SlotData(it->second) + off, in + total, n);
+            }
+            total += n;
+        }
+    }
+
+    void Invalidate() {
+        if (!m_index.empty()) m_stats.invalidations++;
+        m_index.clear();
+        m_slotsUsed = 0;
+        m_lastMissPage = 0;
+        m_prefetchPages = 0;
+    }
+
+    const Stats& GetStats() const { return m_stats; }
+    size_t CachedPages() const { return m_index.size(); }
+
+private:
+    static uint64_t PageOf(uint64_t addr) { return addr & ~(DBG_PAGE_SIZE - 1); }
+
+    uint8_t* SlotData(size_t slot) { return m_storage.data() + slot * DBG_PAGE_SIZE; }
+
+    const uint8_t* Lookup(uint64_t page) {
+        auto it = m_index.find(page);
+        return it != m_index.end() ? SlotData(it->second) : nullptr;
+    }
+
+    // Fetches the missing page and, when misses are sequential, a growing window of the pages after it. All of them
+    // are read with one batched call.
+    const uint8_t* Fill(uint64_t page) {
+        if (m_lastMissPage != 0 && page == m_lastMissPage + DBG_PAGE_SIZE) {
+            m_prefetchPages = std::min(std::max(m_prefetchPages * 2, size_t(1)), MAX_PREFETCH_PAGES);
+        }
+        else {
+            m_prefetchPages = 0;
+        }
+
+        std::vector<uint64_t> pages;
+        pages.push_back(page);
+        for (size_t i = 1; i <= m_prefetchPages; i++) {
+            uint64_t next = page + i * DBG_PAGE_SIZE;
+            if (m_index.count(next)) break;
+            pages.push_back(next);
+        }
+        m_lastMissPage = pages.back();
+
+        size_t firstSlot = m_slotsUsed;
+        if ((firstSlot + pages.size()) * DBG_PAGE_SIZE > m_storage.size()) {
+            m_storage.resize((firstSlot + pages.size()) * DBG_PAGE_SIZE * 2);
+        }
+
+        std::vector<MemIoVec> vecs(pages.size());
+        std::vector<size_t> done(pages.size(), 0);
+        for (size_t i = 0; i < pages.size(); i++) {
+            vecs[i] = { pages[i], SlotData(firstSlot + i), DBG_PAGE_SIZE };
+        }
+        m_memory.ReadV(vecs.data(), vecs.size(), done.data());
+
+        const uint8_t* ret = nullptr;
+        for (size_t i = 0; i < pages.size(); i++) {
+            if (done[i] != DBG_PAGE_SIZE) continue;
+            // Compact successfully read pages into consecutive slots.
+            size_t slot = m_slotsUsed++;
+            if (slot != firstSlot + i) {
+                std::memmove(SlotData(slot), SlotData(firstSlot + i), DBG_PAGE_SIZE);
+            }
+            m_index[pages[i]] = slot;
+            if (i == 0) ret = SlotData(slot);
+            else m_stats.prefetched++;
+        }
+        return ret;
+    }
+
+    InferiorMemory& m_memory;
+    std::unordered_map<uint64_t, size_t> m_index; // page address -> slot in m_storage
+    std::vector<uint8_t> m_storage;
+    size_t m_slotsUsed = 0;
+    uint64_t m_lastMissPage;
+    size_t m_prefetchPages;
+    Stats m_stats;
+};
+
+// Collects single byte code patches and applies them grouped by page: every affected page is read once, all of its
+// patches are applied in queue order and the modified span is written back with one pwrite to /proc/pid/mem.
+struct CodePatcher {
+public:
+    static constexpr uint8_t INT3 = 0xCC;
+
+    explicit CodePatcher(InferiorMemory& memory) : m_memory(memory) {}
+
+    // The byte found at addr right before the patch is applied is stored in *saved on Flush.
+    void Queue(uint64_t addr, uint8_t byte, uint8_t* saved = nullptr) {
+        m_pending.push_back({ addr, byte, saved });
+    }
+
+    bool HasPending() const { return !m_pending.empty(); }
+
+    // Returns the number of patches that could not be applied. onWrite is called with every written span so callers
+    // can keep copies of the tracee memory (e.g. the page cache) coherent, onLift with every address an int3 was
+    // removed from.
+    template <typename OnWrite, typename OnLift>
+    size_t Flush(OnWrite&& onWrite, OnLift&& onLift) {
+        std::stable_sort(m_pending.begin(), m_pending.end(), [](const Patch& a, const Patch& b) {
+            return PageOf(a.addr) < PageOf(b.addr);
+        });
+
+        size_t failed = 0;
+        uint8_t page[DBG_PAGE_SIZE];
+        size_t i = 0;
+        while (i < m_pending.size()) {
+            uint64_t pageAddr = PageOf(m_pending[i].addr);
+            size_t end = i;
+            size_t lo = DBG_PAGE_SIZE, hi = 0;
+            while (end < m_pending.size() && PageOf(m_pending[end].addr) == pageAddr) {
+                size_t off = m_pending[end].addr - pageAddr;
+                lo = std::min(lo, off);
+                hi = std::max(hi, off + 1);
+                end++;
+            }
+
+            size_t len = hi - lo;
+            bool ok = ReadSpan(pageAddr + lo, page + lo, len);
+            if (ok) {
+                for (size_t j = i; j < end; j++) {
+                    size_t off = m_pending[j].addr - pageAddr;
+                    if (m_pending[j].saved) *m_pending[j].saved = page[off];
+                    if (page[off] == INT3 && m_pending[j].byte != INT3) {
+                        onLift(m_pending[j].addr);
+                    }
+                    page[off] = m_pending[j].byte;
+                }
+                ok = WriteSpan(pageAddr + lo, page + lo, len);
+            }
+            if (ok) {
+                onWrite(pageAddr + lo, page + lo, len);
+            }
+            else {
+                std::cerr << "Failed to patch code at 0x" << std::hex << (pageAddr + lo) << ": "
+                          << strerror(errno) << std::endl;
+                failed += end - i;
+            }
+            i = end;
+        }
+
+        m_pending.clear();
+        return failed;
+    }
+
+private:
+    struct Patch {
+        uint64_t addr;
+        uint8_t byte;
+        uint8_t* saved;
+    };
+
+    static uint64_t PageOf(uint64_t addr) { return addr & ~(DBG_PAGE_SIZE - 1); }
+
+    bool ReadSpan(uint64_t addr, uint8_t* dst, size_t len) {
+        if (m_memory.ReadWith(MemBackend::ProcMem, addr, dst, len) == len) return true;
+        return m_memory.Read(addr, dst, len) == len;
+    }
+
+    bool WriteSpan(uint64_t addr, const uint8_t* src, size_t len) {
+        if (m_memory.WriteWith(MemBackend::ProcMem, addr, src, len) == len) return true;
+        return m_memory.Write(addr, src, len) == len;
+    }
+
+    InferiorMemory& m_memory;
+    std::vector<Patch> m_pending;
+};
+
+struct Breakpoint {
+public:
+    static constexpr uint8_t INT3 = 0xCC;
+
+    // Flags
+    static constexpr uint32_t CONDITIONAL = 1 << 0; // user data is the index of its Condition
+    static constexpr uint32_t TEMPORARY = 1 << 1;   // armed by a stepping command for its duration only
+    static constexpr uint32_t COVERAGE = 1 << 2;    // one-shot coverage breakpoint, removed on its first hit
+    static constexpr uint32_t TRACEPOINT = 1 << 3;  // hits are logged to the trace file and resumed
+
+    Breakpoint() : m_addr(0), m_enabled(false), m_savedData(0), m_hits(0), m_flags(0), m_userData(0) {}
+    Breakpoint(uintptr_t addr)
+        : m_addr(addr), m_enabled(false), m_savedData(0), m_hits(0), m_flags(0), m_userData(0) {}
+
+    bool IsEnabled() const { return m_enabled; }
+    uintptr_t GetAddr() const { return m_addr; }
+    uint8_t GetSavedByte() const { return m_savedData; }
+
+    uint64_t GetHits() const { return m_hits; }
+    void Hit() { m_hits++; }
+
+    // Per-location metadata for the owners of a breakpoint, e.g. a condition or tracepoint id.
+    uint32_t GetFlags() const { return m_flags; }
+    void SetFlags(uint32_t flags) { m_flags = flags; }
+    uint64_t GetUserData() const { return m_userData; }
+    void SetUserData(uint64_t data) { m_userData = data; }
+
+    // Enable and Disable only queue the patch, it is applied on the next CodePatcher::Flush. The breakpoint must not
+    // move in memory until then.
+    void Enable(CodePatcher& patcher) {
+        patcher.Queue(m_addr, INT3, &m_savedData);
+        m_enabled = true;
+    }
+
+    void Disable(CodePatcher& patcher) {
+        patcher.Queue(m_addr, m_savedData);
+        m_enabled = false;
+    }
+
+private:
+    uintptr_t m_addr;
+    bool m_enabled;
+    uint8_t m_savedData;
+    uint64_t m_hits;
+    uint32_t m_flags;
+    uint64_t m_userData;
+};
+
+// Breakpoints keyed by address. The index is a flat open addressing table with linear probing whose 16 byte slots
+// hold the address and a handle, so a lookup on a SIGTRAP usually touches one cache line. Breakpoints themselves live
+// in a deque and never move, which keeps handles and pointers stable across inserts and removals.
+struct BreakpointTable {
+public:
+    using Handle = uint32_t;
+    static constexpr Handle INVALID_HANDLE = ~Handle(0);
+
+    BreakpointTable() : m_count(0), m_mask(0), m_shift(64) {}
+
+    size_t Size() const { return m_count; }
+
+    // Returns the handle of the breakpoint at addr, creating it (disabled) if there is none.
+    Handle Insert(uintptr_t addr) {
+        assert(addr != EMPTY);
+        if ((m_count + 1) * 2 > m_slots.size()) Grow();
+        size_t i = SlotOf(addr);
+        while (m_slots[i].addr != EMPTY) {
+            if (m_slots[i].addr == addr) return m_slots[i].handle;
+            i = (i + 1) & m_mask;
+        }
+
+        Handle h;
+        if (!m_free.empty()) {
+            h = m_free.back();
+            m_free.pop_back();
+            m_breakpoints[h] = Breakpoint(addr);
+        }
+        else {
+            h = Handle(m_breakpoints.size());
+            m_breakpoints.emplace_back(addr);
+        }
+        m_slots[i] = { addr, h };
+        m_count++;
+        return h;
+    }
+
+    Handle Find(uintptr_t addr) const {
+        if (m_count == 0) return INVALID_HANDLE;
+        size_t i = SlotOf(addr);
+        while (m_slots[i].addr != EMPTY) {
+            if (m_slots[i].addr == addr) return m_slots[i].handle;
+            i = (i + 1) & m_mask;
+        }
+        return INVALID_HANDLE;
+    }
+
+    Breakpoint* Lookup(uintptr_t addr) {
+        Handle h = Find(addr);
+        return h == INVALID_HANDLE ? nullptr : &m_breakpoints[h];
+    }
+
+    Breakpoint& Get(Handle h) { return m_breakpoints[h]; }
+
+    // The breakpoint must already be disabled and flushed. Its handle may be reused by a later Insert.
+    bool Erase(uintptr_t addr) {
+        if (m_count == 0) return false;
+        size_t i = SlotOf(addr);
+        while (m_slots[i].addr != addr) {
+            if (m_slots[i].addr == EMPTY) return false;
+            i = (i + 1) & m_mask;
+        }
+        Handle h = m_slots[i].handle;
+        assert(!m_breakpoints[h].IsEnabled());
+        m_breakpoints[h] = Breakpoint();
+        m_free.push_back(h);
+        m_count--;
+
+        // Backward shift deletion: move later entries of the probe sequence into the hole so no tombstones are needed.
+        size_t hole = i;
+        for (size_t j = (i + 1) & m_mask; m_slots[j].addr != EMPTY; j = (j + 1) & m_mask) {
+            size_t home = SlotOf(m_slots[j].addr);
+            if (((j - home) & m_mask) >= ((j - hole) & m_mask)) {
+                m_slots[hole] = m_slots[j];
+                hole = j;
+            }
+        }
+        m_slots[hole] = { EMPTY, INVALID_HANDLE };
+        return true;
+    }
+
+    // Calls fn(Breakpoint&) for every breakpoint in address order.
+    template <typename Fn>
+    void ForEachSorted(Fn&& fn) {
+        std::vector<Slot> used;
+        used.reserve(m_count);
+        for (const Slot& s : m_slots) {
+            if (s.addr != EMPTY) used.push_back(s);
+        }
+        std::sort(used.begin(), used.end(), [](const Slot& a, const Slot& b) { return a.addr < b.addr; });
+        for (const Slot& s : used) fn(m_breakpoints[s.handle]);
+    }
+
+    // Calls fn(Breakpoint&) for every breakpoint, in no particular order.
+    template <typename Fn>
+    void ForEach(Fn&& fn) {
+        for (const Slot& s : m_slots) {
+            if (s.addr != EMPTY) fn(m_breakpoints[s.handle]);
+        }
+    }
+
+private:
+    static constexpr uintptr_t EMPTY = 0;
+
+    struct alignas(16) Slot {
+        uintptr_t addr;
+        Handle handle;
+    };
+    static_assert(sizeof(Slot) == 16);
+
+    // Fibonacci hashing, the high bits of the product pick the slot.
+    size_t SlotOf(uintptr_t addr) const {
+        return size_t((uint64_t(addr) * 0x9E3779B97F4A7C15ull) >> m_shift) & m_mask;
+    }
+
+    void Grow() {
+        std::vector<Slot> old = std::move(m_slots);
+        size_t capacity = old.empty() ? 64 : old.size() * 2;
+        m_slots.assign(capacity, { EMPTY, INVALID_HANDLE });
+        m_mask = capacity - 1;
+        m_shift = 64 - uint32_t(__builtin_ctzll(capacity));
+        for (const Slot& s : old) {
+            if (s.addr == EMPTY) continue;
+            size_t i = SlotOf(s.addr);
+            while (m_slots[i].addr != EMPTY) i = (i + 1) & m_mask;
+            m_slots[i] = s;
+        }
+    }
+
+    std::vector<Slot> m_slots;
+    size_t m_count;
+    size_t m_mask;
+    uint32_t m_shift;
+    std::deque<Breakpoint> m_breakpoints;
+    std::vector<Handle> m_free;
+};
+
+enum struct HwBreakType : uint8_t {
+    Execute   = 0b00,
+    Write     = 0b01,
+    ReadWrite = 0b11, // x86 has no read-only data breakpoints
+};
+
+const char* HwBreakTypeName(HwBreakType t) {
+    switch (t) {
+        case HwBreakType::Execute:   return "execute";
+        case HwBreakType::Write:     return "write";
+        case HwBreakType::ReadWrite: return "read/write";
+        default:                     return "unknown";
+    }
+}
+
+// The four x86 debug address registers DR0-DR3 and their DR7 control bits. Slots are allocated on demand and written
+// to a thread with PTRACE_POKEUSER. Execution breakpoints trap before the instruction runs and are stepped over with
+// RFLAGS.RF, data breakpoints trap after the access.
+struct DebugRegisters {
+public:
+    static constexpr size_t SLOT_COUNT = 4;
+    static constexpr uint64_t DR6_HIT_MASK = 0xf;
+    static constexpr uint64_t RFLAGS_RF = uint64_t(1) << 16;
+
+    struct Slot {
+        uint64_t addr;
+        HwBreakType type;
+        uint8_t len;
+        bool used;
+        uint64_t hits;
+    };
+
+    DebugRegisters() : m_slots() {}
+
+    // Returns the slot index or -1 when all slots are taken or the range can't be watched (len must be 1, 2, 4 or 8
+    // and addr aligned to it, execution breakpoints must have len 1).
+    int Allocate(uint64_t addr, HwBreakType type, uint8_t len) {
+        if (len != 1 && len != 2 && len != 4 && len != 8) return -1;
+        if ((addr & (len - 1)) || (type == HwBreakType::Execute && len != 1)) return -1;
+        for (size_t i = 0; i < SLOT_COUNT; i++) {
+            if (m_slots[i].used) continue;
+            m_slots[i] = { addr, type, len, true, 0 };
+            return int(i);
+        }
+        return -1;
+    }
+
+    int Find(uint64_t addr, HwBreakType type) const {
+        for (size_t i = 0; i < SLOT_COUNT; i++) {
+            if (m_slots[i].used && m_slots[i].addr == addr && m_slots[i].type == type) return int(i);
+        }
+        return -1;
+    }
+
+    void Release(int slot) { m_slots[slot] = {}; }
+
+    bool Any() const {
+        return std::any_of(std::begin(m_slots), std::end(m_slots), [](const Slot& s) { return s.used; });
+    }
+
+    Slot& Get(int slot) { return m_slots[slot]; }
+
+    // Writes DR0-DR3 and DR7 of tid. DR7 is cleared first so the kernel never validates a half updated state.
+    bool Apply(pid_t tid) const {
+        if (!PokeUser(tid, 7, 0)) return false;
+        for (size_t i = 0; i < SLOT_COUNT; i++) {
+            if (m_slots[i].used && !PokeUser(tid, i, m_slots[i].addr)) return false;
+        }
+        return PokeUser(tid, 7, Control());
+    }
+
+    // Returns the slot that caused the last SIGTRAP of tid or -1, and clears DR6 as the CPU never does.
+    int TakeHit(pid_t tid) {
+        errno = 0;
+        long dr6 = ptrace(PTRACE_PEEKUSER, tid, DebugRegOffset(6), nullptr);
+        if (errno != 0 || !(uint64_t(dr6) & DR6_HIT_MASK)) return -1;
+        PokeUser(tid, 6, 0);
+        for (size_t i = 0; i < SLOT_COUNT; i++) {
+            if ((uint64_t(dr6) & (uint64_t(1) << i)) && m_slots[i].used) {
+                m_slots[i].hits++;
+                return int(i);
+            }
+        }
+        return -1;
+    }
+
+private:
+    uint64_t Control() const {
+        uint64_t dr7 = 0;
+        for (size_t i = 0; i < SLOT_COUNT; i++) {
+            const Slot& s = m_slots[i];
+            if (!s.used) continue;
+            uint64_t lenBits = s.len == 8 ? 0b10 : uint64_t(s.len - 1);
+            dr7 |= uint64_t(1) << (i * 2); // local enable
+            dr7 |= (uint64_t(s.type) | (lenBits << 2)) << (16 + i * 4);
+        }
+        return dr7;
+    }
+
+    static size_t DebugRegOffset(size_t reg) {
+        return offsetof(struct user, u_debugreg) + reg * sizeof(uint64_t);
+    }
+
+    static bool PokeUser(pid_t tid, size_t reg, uint64_t value) {
+        if (ptrace(PTRACE_POKEUSER, tid, DebugRegOffset(reg), value) < 0) {
+            std::cerr << "Failed to set dr" << reg << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    Slot m_slots[SLOT_COUNT];
+};
+
+// Bookkeeping for watchpoints implemented with page protection. Watched ranges may be arbitrarily large, every page
+// they touch is write-protected in the tracee and remembers the protection it had before.
+struct PageWatchSet {
+public:
+    struct Range {
+        uint64_t start;
+        uint64_t end;
+        uint64_t hits;
+    };
+
+    struct Stats {
+        uint64_t faults = 0;
+        uint64_t unrelated = 0;
+        double unrelatedSeconds = 0;
+    };
+
+    static uint64_t PageOf(uint64_t addr) { return addr & ~(DBG_PAGE_SIZE - 1); }
+
+    bool Empty() const { return m_ranges.empty(); }
+    std::vector<Range>& Ranges() { return m_ranges; }
+    Stats& GetStats() { return m_stats; }
+
+    bool IsProtected(uint64_t addr) const { return m_pages.count(PageOf(addr)) != 0; }
+
+    int OriginalProt(uint64_t page) const {
+        auto it = m_pages.find(page);
+        return it == m_pages.end() ? -1 : it->second.prot;
+    }
+
+    Range* FindRange(uint64_t addr) {
+        for (Range& r : m_ranges) {
+            if (addr >= r.start && addr < r.end) return &r;
+        }
+        return nullptr;
+    }
+
+    // Returns the pages that were not protected before, they need an mprotect. prot gives the current protection of
+    // a page.
+    template <typename ProtOf>
+    std::vector<uint64_t> Add(uint64_t start, uint64_t end, ProtOf&& protOf) {
+        std::vector<uint64_t> newPages;
+        m_ranges.push_back({ start, end, 0 });
+        for (uint64_t p = PageOf(start); p < end; p += DBG_PAGE_SIZE) {
+            auto [it, inserted] = m_pages.emplace(p, Page{ 0, 0 });
+            if (inserted) {
+                it->second.prot = protOf(p);
+                newPages.push_back(p);
+            }
+            it->second.refs++;
+        }
+        return newPages;
+    }
+
+    // Returns the pages no range covers any more together with their original protection.
+    std::vector<std::pair<uint64_t, int>> Remove(uint64_t start) {
+        std::vector<std::pair<uint64_t, int>> released;
+        auto r = std::find_if(m_ranges.begin(), m_ranges.end(), [start](const Range& x) { return x.start == start; });
+        if (r == m_ranges.end()) return released;
+        for (uint64_t p = PageOf(r->start); p < r->end; p += DBG_PAGE_SIZE) {
+            auto it = m_pages.find(p);
+            if (--it->second.refs == 0) {
+                released.push_back({ p, it->second.prot });
+                m_pages.erase(it);
+            }
+        }
+        m_ranges.erase(r);
+        return released;
+    }
+
+private:
+    struct Page {
+        int prot;
+        uint32_t refs;
+    };
+
+    std::vector<Range> m_ranges;
+    std::unordered_map<uint64_t, Page> m_pages;
+    Stats m_stats;
+};
+
+// Addresses instrumented for coverage and which of them ran. The addresses are sorted so a hit is found by binary
+// search, the bitmap has one bit per address in that order.
+struct CoverageMap {
+public:
+    enum struct Mode : uint32_t { Functions, Blocks };
+
+    // Export file: this header, then count module relative offsets (u64) and the bitmap, (count + 7) / 8 bytes.
+    struct FileHeader {
+        char magic[8];     // "DBGCOV1"
+        Mode mode;
+        uint32_t reserved;
+        uint64_t count;
+        uint64_t base;     // run time address the offsets are relative to
+        char module[256];
+    };
+
+    void Reset(Mode mode, const std::string& module, uint64_t base, std::vector<uint64_t> addrs) {
+        std::sort(addrs.begin(), addrs.end());
+        addrs.erase(std::unique(addrs.begin(), addrs.end()), addrs.end());
+        m_mode = mode;
+        m_module = module;
+        m_base = base;
+        m_addrs = std::move(addrs);
+        m_bits.assign((m_addrs.size() + 63) / 64, 0);
+        m_hitCount = 0;
+    }
+
+    bool Empty() const { return m_addrs.empty(); }
+    Mode GetMode() const { return m_mode; }
+    const std::string& Module() const { return m_module; }
+    const std::vector<uint64_t>& Addrs() const { return m_addrs; }
+    size_t HitCount() const { return m_hitCount; }
+    bool IsHit(size_t i) const { return (m_bits[i / 64] >> (i % 64)) & 1; }
+
+    // Marks addr as hit. Returns false when addr isn't instrumented.
+    bool Record(uint64_t addr) {
+        auto it = std::lower_bound(m_addrs.begin(), m_addrs.end(), addr);
+        if (it == m_addrs.end() || *it != addr) return false;
+        size_t i = size_t(it - m_addrs.begin());
+        uint64_t mask = uint64_t(1) << (i % 64);
+        if (!(m_bits[i / 64] & mask)) {
+            m_bits[i / 64] |= mask;
+            m_hitCount++;
+        }
+        return true;
+    }
+
+    bool Export(const std::string& path) const {
+        FileHeader h = {};
+        std::memcpy(h.magic, "DBGCOV1", 8);
+        h.mode = m_mode;
+        h.count = m_addrs.size();
+        h.base = m_base;
+        std::strncpy(h.module, m_module.c_str(), sizeof(h.module) - 1);
+        std::vector<uint64_t> offsets(m_addrs.size());
+        for (size_t i = 0; i < m_addrs.size(); i++) offsets[i] = m_addrs[i] - m_base;
+        std::vector<uint8_t> bitmap((m_addrs.size() + 7) / 8);
+        for (size_t i = 0; i < m_addrs.size(); i++) bitmap[i / 8] |= uint8_t(IsHit(i) << (i % 8));
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        out.write(reinterpret_cast<const char*>(offsets.data()), std::streamsize(offsets.size() * sizeof(uint64_t)));
+        out.write(reinterpret_cast<const char*>(bitmap.data()), std::streamsize(bitmap.size()));
+        return bool(out);
+    }
+
+private:
+    Mode m_mode = Mode::Functions;
+    std::string m_module;
+    uint64_t m_base = 0;
+    std::vector<uint64_t> m_addrs;
+    std::vector<uint64_t> m_bits;
+    size_t m_hitCount = 0;
+};
+
+int MappingProt(const MemoryMapping& m) {
+    return (m.IsReadable() ? PROT_READ : 0) | (m.IsWritable() ? PROT_WRITE : 0) | (m.IsExecutable() ? PROT_EXEC : 0);
+}
+
+// Compares BreakpointTable with the std::unordered_map it replaced: insert, hit and miss lookups, erase.
+void BenchmarkBreakpointTable(size_t count) {
+    using Clock = std::chrono::steady_clock;
+    std::vector<uintptr_t> addrs(count), misses(count);
+    uint64_t x = 0x1234567;
+    for (size_t i = 0; i < count; i++) {
+        // Plausible code addresses: spread over a 256MB text range, distinct.
+        x = x * 6364136223846793005ull + 1442695040888963407ull;
+        addrs[i] = 0x400000 + i * 256 + ((x >> 33) & 0xff);
+        misses[i] = 0x400000 + i * 256 + 256 * count;
+    }
+    std::vector<uintptr_t> order = addrs;
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(42));
+
+    auto report = [count](const char* name, const char* op, Clock::time_point a, Clock::time_point b) {
+        double ns = std::chrono::duration<double, std::nano>(b - a).count() / double(count);
+        std::cout << std::left << std::setfill(' ') << std::setw(16) << name << std::setw(8) << op << std::right
+                  << std::fixed << std::setprecision(1) << std::setw(8) << ns << " ns/op" << std::endl;
+    };
+
+    size_t found = 0;
+    {
+        BreakpointTable table;
+        auto t0 = Clock::now();
+        for (uintptr_t a : addrs) table.Insert(a);
+        auto t1 = Clock::now();
+        for (uintptr_t a : order) found += table.Lookup(a) != nullptr;
+        auto t2 = Clock::now();
+        for (uintptr_t a : misses) found += table.Lookup(a) != nullptr;
+        auto t3 = Clock::now();
+        for (uintptr_t a : order) table.Erase(a);
+        auto t4 = Clock::now();
+        report("flat table", "insert", t0, t1);
+        report("flat table", "hit", t1, t2);
+        report("flat table", "miss", t2, t3);
+        report("flat table", "erase", t3, t4);
+    }
+    {
+        std::unordered_map<uintptr_t, Breakpoint> map;
+        auto t0 = Clock::now();
+        for (uintptr_t a : addrs) map.emplace(a, Breakpoint(a));
+        auto t1 = Clock::now();
+        for (uintptr_t a : order) found += map.find(a) != map.end();
+        auto t2 = Clock::now();
+        for (uintptr_t a : misses) found += map.find(a) != map.end();
+        auto t3 = Clock::now();
+        for (uintptr_t a : order) map.erase(a);
+        auto t4 = Clock::now();
+        report("unordered_map", "insert", t0, t1);
+        report("unordered_map", "hit", t1, t2);
+        report("unordered_map", "miss", t2, t3);
+        report("unordered_map", "erase", t3, t4);
+    }
+    std::cout << std::dec << count << " breakpoints, " << found << " found" << std::endl;
+}
+
+void HexDump(uint64_t addr, const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i += 16) {
+        std::cout << std::hex << "0x" << std::setfill('0') << std::setw(16) << (addr + i) << ": ";
+        for (size_t j = i; j < i + 16 && j < len; j++) {
+            std::cout << std::setw(2) << uint32_t(data[j]) << ' ';
+        }
+        std::cout << std::endl;
+    }
+}
+
+std::vector<MemoryMapping> ReadMemoryMappings(pid_t pid) {
+    std::vector<MemoryMapping> ret;
+    std::ifstream maps("/proc/" + std::to_string(pid) + "/maps");
+    if (!maps) {
+        std::cerr << "Failed to open /proc/" << pid << "/maps" << std::endl;
+        return ret;
+    }
+
+    std::string line;
+    while (std::getline(maps, line)) {
+        // start-end perms offset dev inode path
+        MemoryMapping m = {};
+        std::istringstream in(line);
+        std::string range, dev;
+        in >> range >> m.perms >> std::hex >> m.offset >> dev >> std::dec >> m.inode;
+        size_t dash = range.find('-');
+        if (dash == std::string::npos) continue;
+        m.start = std::stoull(range.substr(0, dash), nullptr, 16);
+        m.end = std::stoull(range.substr(dash + 1), nullptr, 16);
+        std::getline(in >> std::ws, m.path);
+        ret.push_back(std::move(m));
+    }
+    return ret;
+}
+
+// Mappings whose contents can be read through process_vm_readv or /proc/pid/mem. [vvar] and [vsyscall] are readable
+// on paper but fail or fault when accessed from another process.
+bool IsDumpableMapping(const MemoryMapping& m) {
+    return m.IsReadable() && m.path != "[vvar]" && m.path != "[vvar_vclock]" && m.path != "[vsyscall]";
+}
+
+// Whether a mapping is the one the user named: its path equals name or ends with "/name".
+bool MappingMatches(const MemoryMapping& m, std::string_view name) {
+    std::string_view mp = m.path;
+    return mp == name || (mp.size() > name.size() && mp.substr(mp.size() - name.size()) == name &&
+                          mp[mp.size() - name.size() - 1] == '/');
+}
+
+// Fixed set of worker threads that run index ranges in parallel.
+struct ThreadPool {
+public:
+    explicit ThreadPool(size_t threads = std::max(1u, std::thread::hardware_concurrency()))
+        : m_stop(false), m_generation(0), m_next(0), m_count(0), m_pending(0) {
+        for (size_t i = 0; i < threads; i++) {
+            m_workers.emplace_back([this, i]() { WorkerLoop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (auto& t : m_workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t Size() const { return m_workers.size(); }
+
+    // Calls fn(index, worker) for every index in [0, count) and blocks until all calls returned. worker is in
+    // [0, Size()) and can be used to index per-thread scratch state.
+    void ParallelFor(size_t count, const std::function<void(size_t, size_t)>& fn) {
+        if (count == 0) return;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_fn = &fn;
+        m_count = count;
+        m_next.store(0);
+        m_pending = m_workers.size();
+        m_generation++;
+        m_wake.notify_all();
+        m_done.wait(lock, [this]() { return m_pending == 0; });
+        m_fn = nullptr;
+    }
+
+private:
+    void WorkerLoop(size_t worker) {
+        uint64_t seen = 0;
+        for (;;) {
+            const std::function<void(size_t, size_t)>* fn;
+            size_t count;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [&]() { return m_stop || m_generation != seen; });
+                if (m_stop) return;
+                seen = m_generation;
+                fn = m_fn;
+                count = m_count;
+            }
+
+            for (size_t i = m_next.fetch_add(1); i < count; i = m_next.fetch_add(1)) {
+                (*fn)(i, worker);
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_pending == 0) m_done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    bool m_stop;
+    uint64_t m_generation;
+    const std::function<void(size_t, size_t)>* m_fn = nullptr;
+    std::atomic<size_t> m_next;
+    size_t m_count;
+    size_t m_pending;
+};
+
+bool IsZeroPage(const uint8_t* page) {
+    const uint64_t* words = reinterpret_cast<const uint64_t*>(page);
+    uint64_t acc = 0;
+    for (size_t i = 0; i < DBG_PAGE_SIZE / sizeof(uint64_t); i++) acc |= words[i];
+    return acc == 0;
+}
+
+// Writes data to fd at offset, skipping all-zero pages so the file stays sparse. Pages flagged in knownZero (one
+// entry per page, may be null) are skipped without looking at their contents. The caller sets the final file size
+// with ftruncate. Returns the number of bytes actually written or -1 on error.
+int64_t WriteSparse(int fd, const uint8_t* data, size_t len, uint64_t offset, const std::vector<bool>* knownZero) {
+    auto isZero = [&](size_t off, size_t n) {
+        if (knownZero && (*knownZero)[off / DBG_PAGE_SIZE]) return true;
+        return n == DBG_PAGE_SIZE && IsZeroPage(data + off);
+    };
+
+    int64_t written = 0;
+    size_t i = 0;
+    while (i < len) {
+        size_t n = std::min(size_t(DBG_PAGE_SIZE), len - i);
+        if (isZero(i, n)) {
+            i += n;
+            continue;
+        }
+        // Extend the run over following non-zero pages.
+        size_t runEnd = i + n;
+        while (runEnd < len) {
+            size_t m = std::min(size_t(DBG_PAGE_SIZE), len - runEnd);
+            if (isZero(runEnd, m)) break;
+            runEnd += m;
+        }
+        for (size_t off = i; off < runEnd;) {
+            ssize_t w = pwrite(fd, data + off, runEnd - off, off_t(offset + off));
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            off += size_t(w);
+        }
+        written += int64_t(runEnd - i);
+        i = runEnd;
+    }
+    return written;
+}
+
+// Reads /proc/pid/pagemap to find pages of anonymous mappings that were never touched. Those read as zeros, so bulk
+// readers can skip them instead of faulting in the zero page for every one of them.
+struct PageMap {
+public:
+    static constexpr uint64_t PRESENT = uint64_t(1) << 63;
+    static constexpr uint64_t SWAPPED = uint64_t(1) << 62;
+
+    // A pid of 0 (a core file) has no pagemap, then no page is known to be untouched.
+    explicit PageMap(pid_t pid) : m_fd(-1) {
+        if (pid == 0) return;
+        m_fd = open(("/proc/" + std::to_string(pid) + "/pagemap").c_str(), O_RDONLY | O_CLOEXEC);
+        for (const MemoryMapping& m : ReadMemoryMappings(pid)) {
+            if (m.inode == 0 && (m.path.empty() || m.path == "[heap]" || m.path == "[stack]")) {
+                m_anonymous.push_back({ m.start, m.end });
+            }
+        }
+    }
+    ~PageMap() { if (m_fd >= 0) close(m_fd); }
+
+    PageMap(const PageMap&) = delete;
+    PageMap& operator=(const PageMap&) = delete;
+
+    // Sets out[i] for every page of [addr, addr + pages * DBG_PAGE_SIZE) that is known to read as zero. Only preads the
+    // pagemap, so workers may call it concurrently.
+    void FindUntouchedPages(uint64_t addr, size_t pages, std::vector<bool>& out) {
+        out.assign(pages, false);
+        if (m_fd < 0) return;
+        std::vector<uint64_t> entries(pages);
+        ssize_t n = pread(m_fd, entries.data(), pages * sizeof(uint64_t), off_t(addr / DBG_PAGE_SIZE * sizeof(uint64_t)));
+        if (n < 0) return;
+        size_t valid = size_t(n) / sizeof(uint64_t);
+        for (size_t i = 0; i < valid; i++) {
+            if (entries[i] & (PRESENT | SWAPPED)) continue;
+            out[i] = IsAnonymous(addr + i * DBG_PAGE_SIZE);
+        }
+    }
+
+private:
+    bool IsAnonymous(uint64_t addr) const {
+        for (const auto& r : m_anonymous) {
+            if (addr >= r.first && addr < r.second) return true;
+        }
+        return false;
+    }
+
+    int m_fd;
+    std::vector<std::pair<uint64_t, uint64_t>> m_anonymous;
+};
+
+// 64-bit page hash built for SIMD: four independent u64 lanes each consume one word of every 32 byte stripe
+// (xor with a per-lane key, 32x32->64 multiply of the halves, add the word back), then the lanes are folded. The AVX2
+// and scalar versions produce identical values.
+constexpr uint64_t PAGE_HASH_KEYS[4] = {
+    0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull,
+};
+
+uint64_t FoldPageHash(const uint64_t acc[4]) {
+    uint64_t h = 0x27d4eb2f165667c5ull;
+    for (int i = 0; i < 4; i++) {
+        h ^= acc[i] + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+    }
+    return h;
+}
+
+uint64_t HashPageScalar(const uint8_t* page) {
+    uint64_t acc[4] = { PAGE_HASH_KEYS[0], PAGE_HASH_KEYS[1], PAGE_HASH_KEYS[2], PAGE_HASH_KEYS[3] };
+    for (size_t off = 0; off < DBG_PAGE_SIZE; off += 32) {
+        for (int i = 0; i < 4; i++) {
+            uint64_t w;
+            std::memcpy(&w, page + off + i * 8, sizeof(w));
+            uint64_t k = w ^ PAGE_HASH_KEYS[i];
+            acc[i] += (k & 0xFFFFFFFFull) * (k >> 32);
+            acc[i] += w;
+        }
+    }
+    return FoldPageHash(acc);
+}
+
+__attribute__((target("avx2")))
+uint64_t HashPageAVX2(const uint8_t* page) {
+    const __m256i keys = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(PAGE_HASH_KEYS));
+    __m256i acc = keys;
+    for (size_t off = 0; off < DBG_PAGE_SIZE; off += 32) {
+        __m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(page + off));
+        __m256i k = _mm256_xor_si256(w, keys);
+        acc = _mm256_add_epi64(acc, _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32)));
+        acc = _mm256_add_epi64(acc, w);
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    return FoldPageHash(lanes);
+}
+
+uint64_t HashPage(const uint8_t* page) {
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+    return hasAVX2 ? HashPageAVX2(page) : HashPageScalar(page);
+}
+
+// Page compression by zero word elision: a 64 byte bitmap of the non-zero u64 words followed by those words. Memory
+// pages are dominated by zero words (padding, unused slots, small integers), so this catches most of the redundancy
+// at memcpy speed. Returns 0 when the result wouldn't be smaller than the page.
+constexpr size_t PACKED_PAGE_BITMAP_SIZE = DBG_PAGE_SIZE / sizeof(uint64_t) / 8;
+
+size_t PackPage(const uint8_t* page, uint8_t* out) {
+    const uint64_t* words = reinterpret_cast<const uint64_t*>(page);
+    uint8_t* bitmap = out;
+    std::memset(bitmap, 0, PACKED_PAGE_BITMAP_SIZE);
+    size_t size = PACKED_PAGE_BITMAP_SIZE;
+    for (size_t i = 0; i < DBG_PAGE_SIZE / sizeof(uint64_t); i++) {
+        if (words[i] == 0) continue;
+        if (size + sizeof(uint64_t) >= DBG_PAGE_SIZE) return 0;
+        bitmap[i / 8] |= uint8_t(1 << (i % 8));
+        std::memcpy(out + size, &words[i], sizeof(uint64_t));
+        size += sizeof(uint64_t);
+    }
+    return size;
+}
+
+void UnpackPage(const uint8_t* in, uint8_t* page) {
+    const uint8_t* bitmap = in;
+    const uint8_t* src = in + PACKED_PAGE_BITMAP_SIZE;
+    for (size_t i = 0; i < DBG_PAGE_SIZE / sizeof(uint64_t); i++) {
+        uint64_t w = 0;
+        if (bitmap[i / 8] & (1 << (i % 8))) {
+            std::memcpy(&w, src, sizeof(w));
+            src += sizeof(w);
+        }
+        std::memcpy(page + i * sizeof(uint64_t), &w, sizeof(w));
+    }
+}
+
+// Append-only byte storage addressed by offsets. On the heap it grows in fixed blocks so nothing is ever copied; in a
+// file it is grown with ftruncate and remapped. Appends must be serialized by the caller.
+struct SnapshotArena {
+public:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024 * 1024;
+
+    SnapshotArena() : m_fd(-1), m_map(nullptr), m_mapSize(0), m_size(0), m_tail(0) {}
+    ~SnapshotArena() {
+        if (m_map) munmap(m_map, m_mapSize);
+        if (m_fd >= 0) close(m_fd);
+        if (!m_tmpPath.empty()) unlink(m_tmpPath.c_str()); // never finished
+    }
+
+    SnapshotArena(const SnapshotArena&) = delete;
+    SnapshotArena& operator=(const SnapshotArena&) = delete;
+
+    // The arena is built under a temporary name and renamed to path by Finish. Truncating path itself would pull the
+    // pages from under an older snapshot that still has it mapped.
+    bool OpenFile(const std::string& path) {
+        std::string tmpPath = path + ".tmp";
+        m_fd = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (m_fd < 0) {
+            std::cerr << "Failed to open " << tmpPath << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        m_path = path;
+        m_tmpPath = std::move(tmpPath);
+        return true;
+    }
+
+    bool IsFileBacked() const { return m_fd >= 0; }
+
+    // len must not exceed BLOCK_SIZE. Returns UINT64_MAX on failure.
+    uint64_t Append(const uint8_t* data, size_t len) {
+        assert(len <= BLOCK_SIZE);
+        uint64_t off;
+        if (IsFileBacked()) {
+            off = m_tail;
+            if (!ReserveFile(m_tail + len)) return UINT64_MAX;
+        }
+        else {
+            if (m_blocks.empty() || m_tail + len > m_blocks.size() * BLOCK_SIZE) {
+                m_blocks.emplace_back(new uint8_t[BLOCK_SIZE]);
+                m_tail = (m_blocks.size() - 1) * BLOCK_SIZE;
+            }
+            off = m_tail;
+        }
+        std::memcpy(Data(off), data, len);
+        m_tail = off + len;
+        m_size += len;
+        return off;
+    }
+
+    uint8_t* Data(uint64_t off) {
+        return IsFileBacked() ? m_map + off : m_blocks[off / BLOCK_SIZE].get() + off % BLOCK_SIZE;
+    }
+
+    // Bytes stored, not counting the unused block tails.
+    uint64_t Size() const { return m_size; }
+
+    // Trims the file to the used size once the snapshot is complete and moves it into place.
+    bool Finish() {
+        if (!IsFileBacked()) return true;
+        if (ftruncate(m_fd, off_t(m_tail)) < 0) {
+            std::cerr << "Failed to truncate snapshot file: " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (rename(m_tmpPath.c_str(), m_path.c_str()) < 0) {
+            std::cerr << "Failed to rename " << m_tmpPath << " to " << m_path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        m_tmpPath.clear();
+        return true;
+    }
+
+private:
+    bool ReserveFile(uint64_t size) {
+        if (size <= m_mapSize) return true;
+        size_t newSize = std::max(size_t(size), std::max(m_mapSize * 2, BLOCK_SIZE));
+        if (ftruncate(m_fd, off_t(newSize)) < 0) {
+            std::cerr << "Failed to grow snapshot file: " << strerror(errno) << std::endl;
+            return false;
+        }
+        void* p = m_map ? mremap(m_map, m_mapSize, newSize, MREMAP_MAYMOVE)
+                        : mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        if (p == MAP_FAILED) {
+            std::cerr << "Failed to map snapshot file: " << strerror(errno) << std::endl;
+            return false;
+        }
+        m_map = reinterpret_cast<uint8_t*>(p);
+        m_mapSize = newSize;
+        return true;
+    }
+
+    int m_fd;
+    uint8_t* m_map;
+    size_t m_mapSize;
+    std::vector<std::unique_ptr<uint8_t[]>> m_blocks;
+    uint64_t m_size;
+    uint64_t m_tail;
+    std::string m_path;
+    std::string m_tmpPath; // while the file is being written
+};
+
+struct SnapshotPage {
+    enum Encoding : uint8_t { ZERO, PACKED, RAW };
+
+    uint64_t addr;
+    uint64_t hash;
+    uint64_t offset; // into the arena
+    uint32_t size;
+    Encoding encoding;
+};
+
+// Page hashes and compressed contents of the tracee memory at one stop.
+struct Snapshot {
+    std::string name;
+    std::vector<SnapshotPage> pages; // sorted by address
+    SnapshotArena arena;
+    uint64_t rawBytes = 0;
+
+    void LoadPage(const SnapshotPage& p, uint8_t* out) {
+        switch (p.encoding) {
+            case SnapshotPage::ZERO:   std::memset(out, 0, DBG_PAGE_SIZE); break;
+            case SnapshotPage::PACKED: UnpackPage(arena.Data(p.offset), out); break;
+            case SnapshotPage::RAW:    std::memcpy(out, arena.Data(p.offset), DBG_PAGE_SIZE); break;
+        }
+    }
+};
+
+// Builds the contents of a PT_NOTE segment: Elf64_Nhdr, name and descriptor, each padded to 4 bytes.
+struct NoteBuilder {
+    std::vector<uint8_t> data;
+
+    void Add(Elf64_Word type, std::string_view name, const void* desc, size_t descSize) {
+        Elf64_Nhdr hdr = {};
+        hdr.n_namesz = Elf64_Word(name.size() + 1);
+        hdr.n_descsz = Elf64_Word(descSize);
+        hdr.n_type = type;
+        Append(&hdr, sizeof(hdr));
+        Append(name.data(), name.size());
+        data.push_back(0);
+        Pad();
+        Append(desc, descSize);
+        Pad();
+    }
+
+private:
+    void Append(const void* p, size_t n) {
+        const uint8_t* b = reinterpret_cast<const uint8_t*>(p);
+        data.insert(data.end(), b, b + n);
+    }
+    void Pad() { data.resize((data.size() + 3) & ~size_t(3)); }
+};
+
+std::string ReadProcFile(pid_t pid, const char* name) {
+    std::ifstream in("/proc/" + std::to_string(pid) + "/" + name, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+struct Symbol {
+    uint64_t addr;
+    uint64_t size;
+    std::string name;
+};
+
+// Function and data symbols of every ELF file mapped into the inferior, relocated to their load addresses. Built from
+// .symtab and .dynsym, so it works for stripped libraries as long as the function is exported.
+struct SymbolTable {
+public:
+    // Reloads only when the set of mapped files changed since the last call.
+    void Load(const std::vector<MemoryMapping>& mappings) {
+        std::map<std::string, const MemoryMapping*> lowest = LowestMappings(mappings);
+        std::vector<std::pair<std::string, uint64_t>> modules = ModuleSet(lowest);
+        if (modules == m_modules) return;
+
+        m_modules = std::move(modules);
+        m_symbols.clear();
+        for (const auto& [path, m] : lowest) {
+            LoadModule(path, *m);
+        }
+        std::sort(m_symbols.begin(), m_symbols.end(), [](const Symbol& a, const Symbol& b) {
+            return a.addr != b.addr ? a.addr < b.addr : a.size > b.size;
+        });
+        // .symtab and .dynsym overlap, keep one symbol per address.
+        m_symbols.erase(std::unique(m_symbols.begin(), m_symbols.end(),
+                                    [](const Symbol& a, const Symbol& b) { return a.addr == b.addr; }),
+                        m_symbols.end());
+    }
+
+    // Returns the function or object containing addr. Symbols without a size (e.g. _init, _fini) only match their address.
+    const Symbol* Find(uint64_t addr) const {
+        auto it = std::upper_bound(m_symbols.begin(), m_symbols.end(), addr,
+                                   [](uint64_t a, const Symbol& s) { return a < s.addr; });
+        if (it == m_symbols.begin()) return nullptr;
+        const Symbol& s = *--it;
+        if (addr >= s.addr + std::max<uint64_t>(s.size, 1)) return nullptr;
+        return &s;
+    }
+
+    size_t Size() const { return m_symbols.size(); }
+
+    // Calls fn(const Symbol&) for every symbol starting in [start, end), in address order.
+    template <typename Fn>
+    void ForEachIn(uint64_t start, uint64_t end, Fn&& fn) const {
+        auto it = std::lower_bound(m_symbols.begin(), m_symbols.end(), start,
+                                   [](const Symbol& s, uint64_t a) { return s.addr < a; });
+        for (; it != m_symbols.end() && it->addr < end; ++it) fn(*it);
+    }
+
+    const Symbol* FindByName(std::string_view name) const {
+        for (const Symbol& s : m_symbols) {
+            if (s.name == name) return &s;
+        }
+        return nullptr;
+    }
+
+private:
+    void LoadModule(const std::string& path, const MemoryMapping& m) {
+        MappedFile file;
+        if (!file.Open(path)) return;
+        const Elf64_Ehdr* ehdr = file.At<Elf64_Ehdr>(0);
+        if (!ehdr || !ehdr->checkMagic() || ehdr->getFileClass() != ELFCLASS64) return;
+        const Elf64_Phdr* phdrs = file.At<Elf64_Phdr>(ehdr->e_phoff, ehdr->e_phnum);
+        const Elf64_Shdr* shdrs = file.At<Elf64_Shdr>(ehdr->e_shoff, ehdr->e_shnum);
+        if (!phdrs || !shdrs) return;
+        uint64_t bias = ElfLoadBias(ehdr, phdrs, m);
+
+        for (size_t i = 0; i < ehdr->e_shnum; i++) {
+            const Elf64_Shdr& sh = shdrs[i];
+            if ((sh.sh_type != SHT_SYMTAB && sh.sh_type != SHT_DYNSYM) || sh.sh_link >= ehdr->e_shnum) continue;
+            const Elf64_Sym* syms = file.At<Elf64_Sym>(sh.sh_offset, sh.sh_size / sizeof(Elf64_Sym));
+            const Elf64_Shdr& strtab = shdrs[sh.sh_link];
+            const char* strs = file.At<char>(strtab.sh_offset, strtab.sh_size);
+            if (!syms || !strs) continue;
+            for (size_t j = 0; j < sh.sh_size / sizeof(Elf64_Sym); j++) {
+                const Elf64_Sym& s = syms[j];
+                unsigned char type = s.getType();
+                if ((type != STT_FUNC && type != STT_GNU_IFUNC && type != STT_OBJECT) || s.st_shndx == SHN_UNDEF ||
+                    s.st_value == 0 || s.st_name >= strtab.sh_size) continue;
+                m_symbols.push_back({ s.st_value + bias, s.st_size,
+                                      std::string(strs + s.st_name, strnlen(strs + s.st_name, strtab.sh_size - s.st_name)) });
+            }
+        }
+        LoadPltStubs(file, ehdr, shdrs, bias);
+    }
+
+    // PLT stubs get "name@plt" symbols. Every stub jumps through a GOT slot (jmp [rip + disp32]) and the JUMP_SLOT or
+    // GLOB_DAT relocation of that slot names the function.
+    void LoadPltStubs(const MappedFile& file, const Elf64_Ehdr* ehdr, const Elf64_Shdr* shdrs, uint64_t bias) {
+        std::unordered_map<uint64_t, std::string_view> slots;
+        for (size_t i = 0; i < ehdr->e_shnum; i++) {
+            const Elf64_Shdr& sh = shdrs[i];
+            if (sh.sh_type != SHT_RELA || sh.sh_link >= ehdr->e_shnum) continue;
+            const Elf64_Shdr& symtab = shdrs[sh.sh_link];
+            if (symtab.sh_link >= ehdr->e_shnum) continue;
+            const Elf64_Shdr& strtab = shdrs[symtab.sh_link];
+            size_t relaCount = sh.sh_size / sizeof(Elf64_Rela), symCount = symtab.sh_size / sizeof(Elf64_Sym);
+            const Elf64_Rela* relas = file.At<Elf64_Rela>(sh.sh_offset, relaCount);
+            const Elf64_Sym* syms = file.At<Elf64_Sym>(symtab.sh_offset, symCount);
+            const char* strs = file.At<char>(strtab.sh_offset, strtab.sh_size);
+            if (!relas || !syms || !strs) continue;
+            for (size_t j = 0; j < relaCount; j++) {
+                Elf64_Word type = relas[j].getType(), sym = relas[j].getSymbol();
+                if ((type != R_X86_64_JUMP_SLOT && type != R_X86_64_GLOB_DAT) || sym == 0 || sym >= symCount ||
+                    syms[sym].st_name >= strtab.sh_size) continue;
+                const char* name = strs + syms[sym].st_name;
+                size_t len = strnlen(name, strtab.sh_size - syms[sym].st_name);
+                slots.emplace(relas[j].r_offset, std::string_view(name, len));
+            }
+        }
+        if (slots.empty()) return;
+
+        for (const char* name : { ".plt", ".plt.sec", ".plt.got" }) {
+            const Elf64_Shdr* sh = FindElfSection(file, name);
+            const uint8_t* code = sh ? file.At<uint8_t>(sh->sh_offset, sh->sh_size) : nullptr;
+            if (!code) continue;
+            uint64_t entrySize = sh->sh_entsize ? sh->sh_entsize : 16;
+            for (uint64_t entry = 0; entry + entrySize <= sh->sh_size; entry += entrySize) {
+                for (uint64_t j = entry; j + 6 <= entry + entrySize; j++) {
+                    if (code[j] != 0xFF || code[j + 1] != 0x25) continue;
+                    int32_t disp;
+                    std::memcpy(&disp, code + j + 2, sizeof(disp));
+                    auto it = slots.find(sh->sh_addr + j + 6 + uint64_t(int64_t(disp)));
+                    if (it != slots.end()) {
+                        std::string pltName = std::string(it->second) + "@plt";
+                        m_symbols.push_back({ sh->sh_addr + entry + bias, entrySize, std::move(pltName) });
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    std::vector<Symbol> m_symbols;
+    std::vector<std::pair<std::string, uint64_t>> m_modules; // path and start of the loaded files
+};
+
+// Little-endian reader over a DWARF section. Reading past the end yields zeros and sets the error flag, so a
+// truncated section ends parsing instead of crashing it.
+struct DwarfReader {
+public:
+    DwarfReader(const uint8_t* data, size_t size) : m_p(data), m_end(data + size), m_error(false) {}
+
+    bool AtEnd() const { return m_p >= m_end; }
+    bool Error() const { return m_error; }
+    size_t Remaining() const { return size_t(m_end - m_p); }
+    const uint8_t* Pos() const { return m_p; }
+
+    template <typename T>
+    T Read() {
+        T v = 0;
+        if (Remaining() < sizeof(T)) {
+            m_error = true;
+            m_p = m_end;
+            return v;
+        }
+        std::memcpy(&v, m_p, sizeof(T));
+        m_p += sizeof(T);
+        return v;
+    }
+
+    uint64_t Uleb() {
+        uint64_t v = 0;
+        for (int shift = 0; m_p < m_end; shift += 7) {
+            uint8_t b = *m_p++;
+            if (shift < 64) v |= uint64_t(b & 0x7F) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        m_error = true;
+        return v;
+    }
+
+    int64_t Sleb() {
+        int64_t v = 0;
+        int shift = 0;
+        while (m_p < m_end) {
+            uint8_t b = *m_p++;
+            if (shift < 64) v |= int64_t(b & 0x7F) << shift;
+            shift += 7;
+            if (!(b & 0x80)) {
+                if (shift < 64 && (b & 0x40)) v |= -(int64_t(1) << shift);
+                return v;
+            }
+        }
+        m_error = true;
+        return v;
+    }
+
+    std::string_view CString() {
+        size_t len = strnlen(reinterpret_cast<const char*>(m_p), Remaining());
+        std::string_view s(reinterpret_cast<const char*>(m_p), len);
+        if (len == Remaining()) m_error = true;
+        m_p += std::min(len + 1, Remaining());
+        return s;
+    }
+
+    void Skip(size_t n) {
+        if (n > Remaining()) m_error = true;
+        m_p += std::min(n, Remaining());
+    }
+
+    // Splits off the next n bytes as their own reader.
+    DwarfReader Sub(size_t n) {
+        n = std::min(n, Remaining());
+        DwarfReader r(m_p, n);
+        m_p += n;
+        return r;
+    }
+
+private:
+    const uint8_t* m_p;
+    const uint8_t* m_end;
+    bool m_error;
+};
+
+struct LineRow {
+    uint64_t addr;
+    uint32_t line;
+    uint32_t file;        // index into LineTable's file names
+    bool isStmt;
+    bool endSequence;     // first address after a sequence, not a line of its own
+};
+
+// Address to source line mapping from .debug_line (DWARF 2 to 5) of every ELF file mapped into the inferior. Rows of
+// all modules are kept in one array sorted by address.
+struct LineTable {
+public:
+    struct Range {
+        uint64_t start;
+        uint64_t end;
+    };
+
+    // Reloads only when the set of mapped files changed since the last call.
+    void Load(const std::vector<MemoryMapping>& mappings) {
+        std::map<std::string, const MemoryMapping*> lowest = LowestMappings(mappings);
+        std::vector<std::pair<std::string, uint64_t>> modules = ModuleSet(lowest);
+        if (modules == m_modules) return;
+
+        m_modules = std::move(modules);
+        m_rows.clear();
+        m_files.clear();
+        for (const auto& [path, m] : lowest) LoadModule(path, *m);
+        // An end_sequence row sorts before a row starting at the same address so the next sequence wins.
+        std::stable_sort(m_rows.begin(), m_rows.end(), [](const LineRow& a, const LineRow& b) {
+            return a.addr != b.addr ? a.addr < b.addr : a.endSequence > b.endSequence;
+        });
+        // Optimized code has several rows at one address (inlined calls, views). Keep one row per address, the last
+        // statement row if there is one, and count the address as a statement if any of them is.
+        size_t out = 0;
+        for (size_t i = 0; i < m_rows.size();) {
+            size_t j = i, pick = NONE;
+            bool isStmt = false;
+            for (; j < m_rows.size() && m_rows[j].addr == m_rows[i].addr; j++) {
+                if (m_rows[j].endSequence) continue;
+                if (pick == NONE || m_rows[j].isStmt || !m_rows[pick].isStmt) pick = j;
+                isStmt = isStmt || m_rows[j].isStmt;
+            }
+            m_rows[out] = m_rows[pick == NONE ? i : pick];
+            m_rows[out++].isStmt = isStmt;
+            i = j;
+        }
+        m_rows.resize(out);
+    }
+
+    size_t Size() const { return m_rows.size(); }
+
+    // The row whose address range contains addr, nullptr outside every sequence.
+    const LineRow* Find(uint64_t addr) const {
+        size_t i = IndexOf(addr);
+        return i == NONE ? nullptr : &m_rows[i];
+    }
+
+    // True when a statement row starts exactly at addr.
+    bool IsStatementStart(uint64_t addr) const {
+        size_t i = IndexOf(addr);
+        return i != NONE && m_rows[i].addr == addr && m_rows[i].isStmt;
+    }
+
+    // The addresses around addr that belong to the same source line: consecutive rows with its line and file.
+    Range LineRange(uint64_t addr) const {
+        size_t i = IndexOf(addr);
+        if (i == NONE) return { addr, addr };
+        const LineRow& row = m_rows[i];
+        size_t first = i, last = i + 1;
+        while (first > 0 && SameLine(m_rows[first - 1], row)) first--;
+        while (last < m_rows.size() && SameLine(m_rows[last], row)) last++;
+        return { m_rows[first].addr, last < m_rows.size() ? m_rows[last].addr : row.addr + 1 };
+    }
+
+    // Address of the first row after the one containing addr, 0 at the end of a sequence. For a function entry that is
+    // where its prologue ends, as far as the compiler told.
+    uint64_t NextRowStart(uint64_t addr) const {
+        size_t i = IndexOf(addr);
+        if (i == NONE) return 0;
+        while (i < m_rows.size() && m_rows[i].addr <= addr) i++;
+        return i < m_rows.size() && !m_rows[i].endSequence ? m_rows[i].addr : 0;
+    }
+
+    const std::string& FileName(uint32_t file) const { return m_files[file]; }
+
+private:
+    static constexpr size_t NONE = ~size_t(0);
+
+    size_t IndexOf(uint64_t addr) const {
+        auto it = std::upper_bound(m_rows.begin(), m_rows.end(), addr,
+                                   [](uint64_t a, const LineRow& r) { return a < r.addr; });
+        if (it == m_rows.begin() || (--it)->endSequence) return NONE;
+        return size_t(it - m_rows.begin());
+    }
+
+    static bool SameLine(const LineRow& a, const LineRow& b) {
+        return !a.endSequence && a.line == b.line && a.file == b.file;
+    }
+
+    struct Sections {
+        const MappedFile* file;
+        const Elf64_Shdr* str;     // .debug_str
+        const Elf64_Shdr* lineStr; // .debug_line_str
+    };
+
+    void LoadModule(const std::string& path, const MemoryMapping& m) {
+        MappedFile file;
+        if (!file.Open(path)) return;
+        const Elf64_Ehdr* ehdr = file.At<Elf64_Ehdr>(0);
+        if (!ehdr || !ehdr->checkMagic() || ehdr->getFileClass() != ELFCLASS64) return;
+        const Elf64_Phdr* phdrs = file.At<Elf64_Phdr>(ehdr->e_phoff, ehdr->e_phnum);
+        const Elf64_Shdr* line = FindElfSection(file, ".debug_line");
+        if (!phdrs || !line || (line->sh_flags & SHF_COMPRESSED)) return;
+        const uint8_t* data = file.At<uint8_t>(line->sh_offset, line->sh_size);
+        if (!data) return;
+
+        Sections sections = { &file, FindElfSection(file, ".debug_str"), FindElfSection(file, ".debug_line_str") };
+        uint64_t bias = ElfLoadBias(ehdr, phdrs, m);
+        DwarfReader r(data, line->sh_size);
+        while (!r.AtEnd() && !r.Error()) {
+            uint64_t length = r.Read<uint32_t>();
+            bool dwarf64 = length == 0xFFFFFFFF;
+            if (dwarf64) length = r.Read<uint64_t>();
+            DwarfReader unit = r.Sub(length);
+            ParseUnit(unit, dwarf64, sections, bias);
+        }
+    }
+
+    std::string_view SectionString(const Elf64_Shdr* sh, const MappedFile& file, uint64_t offset) const {
+        if (!sh || offset >= sh->sh_size) return {};
+        const char* s = file.At<char>(sh->sh_offset + offset, sh->sh_size - offset);
+        return s ? std::string_view(s, strnlen(s, sh->sh_size - offset)) : std::string_view();
+    }
+
+    // Reads one attribute of a DWARF 5 directory or file entry. Returns false for forms a line table can't use.
+    bool ReadForm(DwarfReader& r, uint64_t form, bool dwarf64, const Sections& sections, std::string_view& str,
+                  uint64_t& value) const {
+        auto offset = [&]() { return dwarf64 ? r.Read<uint64_t>() : r.Read<uint32_t>(); };
+        switch (form) {
+            case 0x08: str = r.CString(); return true;                                      // DW_FORM_string
+            case 0x0e: str = SectionString(sections.str, *sections.file, offset()); return true; // DW_FORM_strp
+            case 0x1f: str = SectionString(sections.lineStr, *sections.file, offset()); return true; // line_strp
+            case 0x0b: value = r.Read<uint8_t>(); return true;                              // DW_FORM_data1
+            case 0x05: value = r.Read<uint16_t>(); return true;                             // DW_FORM_data2
+            case 0x06: value = r.Read<uint32_t>(); return true;                             // DW_FORM_data4
+            case 0x07: value = r.Read<uint64_t>(); return true;                             // DW_FORM_data8
+            case 0x0f: value = r.Uleb(); return true;                                       // DW_FORM_udata
+            case 0x1e: r.Skip(16); return true;                                             // DW_FORM_data16
+            case 0x09: r.Skip(r.Uleb()); return true;                                       // DW_FORM_block
+            default: return false;
+        }
+    }
+
+    // DWARF 5 directory and file name tables: a list of (content type, form) pairs, then the entries.
+    bool ReadEntryTable(DwarfReader& r, bool dwarf64, const Sections& sections,
+                        std::vector<std::pair<std::string_view, uint64_t>>& entries) const {
+        constexpr uint64_t DW_LNCT_PATH = 1, DW_LNCT_DIRECTORY_INDEX = 2;
+        uint8_t formatCount = r.Read<uint8_t>();
+        std::vector<std::pair<uint64_t, uint64_t>> format(formatCount);
+        for (auto& [type, form] : format) {
+            type = r.Uleb();
+            form = r.Uleb();
+        }
+        uint64_t count = r.Uleb();
+        for (uint64_t i = 0; i < count && !r.Error(); i++) {
+            std::string_view path;
+            uint64_t dir = 0;
+            for (const auto& [type, form] : format) {
+                std::string_view str;
+                uint64_t value = 0;
+                if (!ReadForm(r, form, dwarf64, sections, str, value)) return false;
+                if (type == DW_LNCT_PATH) path = str;
+                else if (type == DW_LNCT_DIRECTORY_INDEX) dir = value;
+            }
+            entries.emplace_back(path, dir);
+        }
+        return !r.Error();
+    }
+
+    void ParseUnit(DwarfReader& r, bool dwarf64, const Sections& sections, uint64_t bias) {
+        uint16_t version = r.Read<uint16_t>();
+        if (version < 2 || version > 5) return;
+        if (version >= 5) r.Skip(2); // address_size, segment_selector_size
+        uint64_t headerLength = dwarf64 ? r.Read<uint64_t>() : r.Read<uint32_t>();
+        DwarfReader header = r.Sub(headerLength);
+        uint8_t minInsnLength = header.Read<uint8_t>();
+        if (version >= 4) header.Read<uint8_t>(); // maximum_operations_per_instruction, VLIW only
+        bool defaultIsStmt = header.Read<uint8_t>();
+        int8_t lineBase = header.Read<int8_t>();
+        uint8_t lineRange = header.Read<uint8_t>();
+        uint8_t opcodeBase = header.Read<uint8_t>();
+        if (lineRange == 0 || opcodeBase == 0) return;
+        uint8_t standardLengths[256] = {};
+        for (int i = 1; i < opcodeBase; i++) standardLengths[i] = header.Read<uint8_t>();
+
+        // File names relative to their directory are joined with it. File indices are 1-based before DWARF 5.
+        std::vector<std::pair<std::string_view, uint64_t>> dirs, files;
+        if (version >= 5) {
+            if (!ReadEntryTable(header, dwarf64, sections, dirs) || !ReadEntryTable(header, dwarf64, sections, files)) {
+                return;
+            }
+        }
+        else {
+            dirs.emplace_back(std::string_view(), 0);
+            while (!header.Error()) {
+                std::string_view dir = header.CString();
+                if (dir.empty()) break;
+                dirs.emplace_back(dir, 0);
+            }
+            files.emplace_back(std::string_view(), 0);
+            while (!header.Error()) {
+                std::string_view name = header.CString();
+                if (name.empty()) break;
+                uint64_t dir = header.Uleb();
+                header.Uleb(); // modification time
+                header.Uleb(); // length
+                files.emplace_back(name, dir);
+            }
+        }
+        if (header.Error()) return;
+        uint32_t fileBase = uint32_t(m_files.size());
+        for (const auto& [name, dir] : files) {
+            if (name.empty() || name[0] == '/' || dir >= dirs.size() || dirs[dir].first.empty()) {
+                m_files.emplace_back(name);
+            }
+            else {
+                m_files.push_back(std::string(dirs[dir].first) + "/" + std::string(name));
+            }
+        }
+
+        // The line number program
+        uint64_t addr = 0, file = 1, line = 1;
+        bool isStmt = defaultIsStmt;
+        auto emit = [&](bool endSequence) {
+            if (file < files.size()) {
+                m_rows.push_back({ addr + bias, uint32_t(line), fileBase + uint32_t(file), isStmt, endSequence });
+            }
+        };
+        while (!r.AtEnd() && !r.Error()) {
+            uint8_t op = r.Read<uint8_t>();
+            if (op >= opcodeBase) {
+                uint8_t adjusted = uint8_t(op - opcodeBase);
+                addr += uint64_t(adjusted / lineRange) * minInsnLength;
+                line += uint64_t(int64_t(lineBase) + adjusted % lineRange);
+                emit(false);
+                continue;
+            }
+            switch (op) {
+                case 0: { // extended opcode
+                    DwarfReader ext = r.Sub(r.Uleb());
+                    uint8_t sub = ext.Read<uint8_t>();
+                    if (sub == 1) { // DW_LNE_end_sequence
+                        emit(true);
+                        addr = 0;
+                        file = 1;
+                        line = 1;
+                        isStmt = defaultIsStmt;
+                    }
+                    else if (sub == 2) { // DW_LNE_set_address
+                        addr = ext.Read<uint64_t>();
+                    }
+                    break;
+                }
+                case 1: emit(false); break;                                                     // DW_LNS_copy
+                case 2: addr += r.Uleb() * minInsnLength; break;                                // advance_pc
+                case 3: line += uint64_t(r.Sleb()); break;                                      // advance_line
+                case 4: file = r.Uleb(); break;                                                 // set_file
+                case 6: isStmt = !isStmt; break;                                                // negate_stmt
+                case 8: addr += uint64_t((255 - opcodeBase) / lineRange) * minInsnLength; break; // const_add_pc
+                case 9: addr += r.Read<uint16_t>(); break;                                      // fixed_advance_pc
+                default:
+                    for (int i = 0; i < standardLengths[op]; i++) r.Uleb();
+                    break;
+            }
+        }
+    }
+
+    std::vector<LineRow> m_rows;
+    std::vector<std::string> m_files;
+    std::vector<std::pair<std::string, uint64_t>> m_modules; // path and start of the loaded files
+};
+
+// Canonical frame address rules from .eh_frame of every ELF file mapped into the inferior. For code with unwind
+// tables this gives the CFA, and so the return address slot at CFA-8, at every instruction. Only the CFA rule is
+// evaluated, register rules are skipped.
+struct CallFrameTable {
+public:
+    // Reloads only when the set of mapped files changed since the last call.
+    void Load(const std::vector<MemoryMapping>& mappings) {
+        std::map<std::string, const MemoryMapping*> lowest = LowestMappings(mappings);
+        std::vector<std::pair<std::string, uint64_t>> modules = ModuleSet(lowest);
+        if (modules == m_modules) return;
+
+        m_modules = std::move(modules);
+        m_sections.clear();
+        m_fdes.clear();
+        for (const auto& [path, m] : lowest) LoadModule(path, *m);
+        std::sort(m_fdes.begin(), m_fdes.end(), [](const Fde& a, const Fde& b) { return a.start < b.start; });
+    }
+
+    size_t Size() const { return m_fdes.size(); }
+
+    // The CFA rule in effect at pc: the CFA is the value of DWARF register reg plus offset. False without unwind info
+    // for pc or when the CFA is computed by an expression.
+    bool Find(uint64_t pc, int& reg, int64_t& offset) const {
+        auto it = std::upper_bound(m_fdes.begin(), m_fdes.end(), pc,
+                                   [](uint64_t a, const Fde& f) { return a < f.start; });
+        if (it == m_fdes.begin() || pc >= (--it)->end) return false;
+        const Fde& fde = *it;
+        const Section& sec = m_sections[fde.section];
+        const Cie& cie = fde.cie;
+
+        CfaRule rule = { -1, 0, false };
+        std::vector<CfaRule> stack;
+        DwarfReader init(sec.data.data() + cie.insns, cie.insnsLen);
+        Execute(init, sec, cie, ~uint64_t(0), 0, rule, stack);
+        DwarfReader insns(sec.data.data() + fde.insns, fde.insnsLen);
+        Execute(insns, sec, cie, pc, fde.start, rule, stack);
+        if (rule.expression || rule.reg < 0) return false;
+        reg = rule.reg;
+        offset = rule.offset;
+        return true;
+    }
+
+private:
+    struct Section {
+        std::vector<uint8_t> data;
+        uint64_t addr; // run time address of data[0]
+    };
+    struct Cie {
+        uint64_t codeAlign;
+        int64_t dataAlign;
+        uint8_t fdeEncoding;
+        bool augData;     // 'z' augmentation: CIE and FDEs carry augmentation data with a length
+        uint32_t insns;   // offset of the initial instructions in the section
+        uint32_t insnsLen;
+    };
+    struct Fde {
+        uint64_t start;
+        uint64_t end;
+        uint32_t section;
+        uint32_t insns;
+        uint32_t insnsLen;
+        Cie cie;
+    };
+    struct CfaRule {
+        int reg;
+        int64_t offset;
+        bool expression;
+    };
+
+    static constexpr uint8_t DW_EH_PE_OMIT = 0xff;
+
+    // Reads a pointer in DW_EH_PE encoding enc, at run time address pos.
+    static uint64_t ReadEncoded(DwarfReader& r, uint8_t enc, uint64_t pos) {
+        if (enc == DW_EH_PE_OMIT) return 0;
+        uint64_t v = 0;
+        switch (enc & 0x0f) {
+            case 0x00: v = r.Read<uint64_t>(); break;                 // absptr
+            case 0x01: v = r.Uleb(); break;
+            case 0x02: v = r.Read<uint16_t>(); break;
+            case 0x03: v = r.Read<uint32_t>(); break;
+            case 0x04: v = r.Read<uint64_t>(); break;
+            case 0x09: v = uint64_t(r.Sleb()); break;
+            case 0x0a: v = uint64_t(int64_t(r.Read<int16_t>())); break;
+            case 0x0b: v = uint64_t(int64_t(r.Read<int32_t>())); break;
+            case 0x0c: v = r.Read<uint64_t>(); break;
+            default: r.Skip(r.Remaining()); return 0;                   // unknown, makes the reader fail
+        }
+        if ((enc & 0x70) == 0x10) v += pos;                              // pcrel
+        return v;
+    }
+
+    void LoadModule(const std::string& path, const MemoryMapping& m) {
+        MappedFile file;
+        if (!file.Open(path)) return;
+        const Elf64_Ehdr* ehdr = file.At<Elf64_Ehdr>(0);
+        if (!ehdr || !ehdr->checkMagic() || ehdr->getFileClass() != ELFCLASS64) return;
+        const Elf64_Phdr* phdrs = file.At<Elf64_Phdr>(ehdr->e_phoff, ehdr->e_phnum);
+        const Elf64_Shdr* eh = FindElfSection(file, ".eh_frame");
+        if (!phdrs || !eh || eh->sh_type == SHT_NOBITS) return;
+        const uint8_t* data = file.At<uint8_t>(eh->sh_offset, eh->sh_size);
+        if (!data) return;
+
+        uint32_t index = uint32_t(m_sections.size());
+        uint64_t addr = eh->sh_addr + ElfLoadBias(ehdr, phdrs, m);
+        m_sections.push_back({ std::vector<uint8_t>(data, data + eh->sh_size), addr });
+        const Section& sec = m_sections.back();
+        std::map<uint64_t, Cie> cies;
+        DwarfReader r(sec.data.data(), sec.data.size());
+        while (!r.AtEnd() && !r.Error()) {
+            uint64_t entry = Offset(sec, r);
+            uint64_t length = r.Read<uint32_t>();
+            if (length == 0) break; // terminator
+            if (length == 0xFFFFFFFF) length = r.Read<uint64_t>();
+            uint64_t body = Offset(sec, r);
+            DwarfReader e = r.Sub(length);
+            uint32_t id = e.Read<uint32_t>();
+            if (id == 0) {
+                Cie cie;
+                if (ParseCie(e, sec, cie)) cies[entry] = cie;
+                continue;
+            }
+            auto cie = cies.find(body - id); // the CIE pointer is relative to its own position
+            if (cie == cies.end()) continue;
+            Fde fde = {};
+            fde.start = ReadEncoded(e, cie->second.fdeEncoding, sec.addr + Offset(sec, e));
+            fde.end = fde.start + ReadEncoded(e, cie->second.fdeEncoding & 0x0f, 0);
+            if (cie->second.augData) e.Skip(e.Uleb());
+            fde.section = index;
+            fde.insns = uint32_t(Offset(sec, e));
+            fde.insnsLen = uint32_t(e.Remaining());
+            fde.cie = cie->second;
+            if (!e.Error() && fde.start < fde.end) m_fdes.push_back(fde);
+        }
+    }
+
+    static uint64_t Offset(const Section& sec, const DwarfReader& r) { return uint64_t(r.Pos() - sec.data.data()); }
+
+    bool ParseCie(DwarfReader& e, const Section& sec, Cie& cie) const {
+        uint8_t version = e.Read<uint8_t>();
+        std::string_view aug = e.CString();
+        if ((version != 1 && version != 3) || (!aug.empty() && aug[0] != 'z')) return false;
+        cie.codeAlign = e.Uleb();
+        cie.dataAlign = e.Sleb();
+        if (version == 1) e.Read<uint8_t>();
+        else e.Uleb(); // return address register
+        cie.fdeEncoding = 0;
+        cie.augData = !aug.empty();
+        if (cie.augData) {
+            DwarfReader a = e.Sub(e.Uleb());
+            for (char c : aug.substr(1)) {
+                if (c == 'R') cie.fdeEncoding = a.Read<uint8_t>();
+                else if (c == 'L') a.Read<uint8_t>();
+                else if (c == 'P') {
+                    uint8_t enc = a.Read<uint8_t>();
+                    ReadEncoded(a, enc & 0x7f, sec.addr + Offset(sec, a));
+                }
+                else if (c != 'S' && c != 'B') break;
+            }
+        }
+        cie.insns = uint32_t(Offset(sec, e));
+        cie.insnsLen = uint32_t(e.Remaining());
+        return !e.Error();
+    }
+
+    // Runs call frame instructions until the location passes pc.
+    static void Execute(DwarfReader& r, const Section& sec, const Cie& cie, uint64_t pc, uint64_t loc, CfaRule& rule,
+                        std::vector<CfaRule>& stack) {
+        auto advance = [&](uint64_t delta) {
+            loc += delta * cie.codeAlign;
+            return loc <= pc;
+        };
+        while (!r.AtEnd() && !r.Error()) {
+            uint8_t op = r.Read<uint8_t>();
+            switch (op >> 6) {
+                case 1: if (!advance(op & 0x3f)) return; continue;  // DW_CFA_advance_loc
+                case 2: r.Uleb(); continue;                           // DW_CFA_offset
+                case 3: continue;                                     // DW_CFA_restore
+                default: break;
+            }
+            switch (op) {
+                case 0x00: break;                                                          // nop
+                case 0x01:                                                                 // set_loc
+                    loc = ReadEncoded(r, cie.fdeEncoding, sec.addr + Offset(sec, r));
+                    if (loc > pc) return;
+                    break;
+                case 0x02: if (!advance(r.Read<uint8_t>())) return; break;                 // advance_loc1
+                case 0x03: if (!advance(r.Read<uint16_t>())) return; break;                // advance_loc2
+                case 0x04: if (!advance(r.Read<uint32_t>())) return; break;                // advance_loc4
+                case 0x05: case 0x09: case 0x14: case 0x2f: r.Uleb(); r.Uleb(); break;     // two ulebs
+                case 0x11: case 0x15: r.Uleb(); r.Sleb(); break;                           // uleb, sleb
+                case 0x06: case 0x07: case 0x08: case 0x2e: r.Uleb(); break;               // one uleb
+                case 0x0a: stack.push_back(rule); break;                                   // remember_state
+                case 0x0b:                                                                 // restore_state
+                    if (!stack.empty()) {
+                        rule = stack.back();
+                        stack.pop_back();
+                    }
+                    break;
+                case 0x0c: rule.reg = int(r.Uleb()); rule.offset = int64_t(r.Uleb()); rule.expression = false; break;
+                case 0x0d: rule.reg = int(r.Uleb()); rule.expression = false; break;       // def_cfa_register
+                case 0x0e: rule.offset = int64_t(r.Uleb()); break;                         // def_cfa_offset
+                case 0x0f: r.Skip(r.Uleb()); rule.expression = true; break;                // def_cfa_expression
+                case 0x10: case 0x16: r.Uleb(); r.Skip(r.Uleb()); break;                   // (val_)expression
+                case 0x12:                                                                 // def_cfa_sf
+                    rule.reg = int(r.Uleb());
+                    rule.offset = r.Sleb() * cie.dataAlign;
+                    rule.expression = false;
+                    break;
+                case 0x13: rule.offset = r.Sleb() * cie.dataAlign; break;                  // def_cfa_offset_sf
+                default: return;
+            }
+        }
+    }
+
+    std::vector<Section> m_sections;
+    std::vector<Fde> m_fdes;
+    std::vector<std::pair<std::string, uint64_t>> m_modules; // path and start of the loaded files
+};
+
+// Breakpoint conditions, e.g. "rdi == 1000 && u32[rsi + 8] == 3". Operands are integer literals, register names,
+// symbol names (their address) and sized memory loads u8/u16/u32/u64/i8/i16/i32/i64[expr]. Operators follow C
+// precedence and all arithmetic is signed 64-bit. A condition is compiled once into stack machine bytecode, symbols are
+// resolved at compile time.
+struct Condition {
+public:
+    enum struct Op : uint8_t {
+        Push, Reg, Load, Neg, Not, BitNot,
+        Mul, Div, Mod, Add, Sub, Shl, Shr, Lt, Le, Gt, Ge, Eq, Ne, And, Xor, Or,
+        JumpIfZero,    // pops; jumps when zero, used by && after pushing the 0 result
+        JumpIfNonZero, // pops; jumps when non-zero, used by ||
+    };
+
+    struct Instr {
+        Op op;
+        uint8_t size;    // Load: bytes, bit 7 set for sign extension
+        Reg reg;
+        int64_t imm;     // Push: value, jumps: target index
+    };
+
+    // Returns an empty string on success, otherwise the error.
+    std::string Compile(std::string_view text, const SymbolTable& symbols) {
+        m_code.clear();
+        m_text = std::string(text);
+        Parser p{ text, 0, symbols, m_code, {} };
+        p.Expr(0);
+        p.SkipSpace();
+        if (p.error.empty() && p.pos != text.size()) p.error = "unexpected '" + std::string(text.substr(p.pos)) + "'";
+        if (p.error.empty() && MaxDepth() > MAX_STACK) p.error = "expression too deep";
+        if (!p.error.empty()) m_code.clear();
+        return p.error;
+    }
+
+    const std::string& Text() const { return m_text; }
+
+    // read(addr, dst, len) returns false when the memory is not accessible, which makes the evaluation fail.
+    template <typename Read>
+    bool Evaluate(RegisterCache& regs, Read&& read, int64_t& result) const {
+        int64_t stack[MAX_STACK];
+        size_t sp = 0;
+        for (size_t pc = 0; pc < m_code.size(); pc++) {
+            const Instr& in = m_code[pc];
+            switch (in.op) {
+                case Op::Push: stack[sp++] = in.imm; break;
+                case Op::Reg: {
+                    uint64_t v;
+                    if (!regs.Get(in.reg, v)) return false;
+                    stack[sp++] = int64_t(v);
+                    break;
+                }
+                case Op::Load: {
+                    size_t len = in.size & 0x7f;
+                    uint64_t v = 0;
+                    if (!read(uint64_t(stack[sp - 1]), &v, len)) return false;
+                    if ((in.size & 0x80) && len < 8 && (v >> (len * 8 - 1)) & 1) v |= ~uint64_t(0) << (len * 8);
+                    stack[sp - 1] = int64_t(v);
+                    break;
+                }
+                case Op::Neg:    stack[sp - 1] = int64_t(0 - uint64_t(stack[sp - 1])); break;
+                case Op::Not:    stack[sp - 1] = !stack[sp - 1]; break;
+                case Op::BitNot: stack[sp - 1] = ~stack[sp - 1]; break;
+                case Op::JumpIfZero:
+                    if (stack[--sp] == 0) pc = size_t(in.imm) - 1;
+                    break;
+                case Op::JumpIfNonZero:
+                    if (stack[--sp] != 0) pc = size_t(in.imm) - 1;
+                    break;
+                default: {
+                    int64_t b = stack[--sp];
+                    int64_t& a = stack[sp - 1];
+                    if (!Binary(in.op, a, b)) return false;
+                    break;
+                }
+            }
+        }
+        if (sp != 1) return false;
+        result = stack[0];
+        return true;
+    }
+
+    size_t CodeSize() const { return m_code.size(); }
+
+private:
+    static constexpr size_t MAX_STACK = 64;
+
+    // Upper bound of the stack depth: both sides of every short circuit are counted.
+    size_t MaxDepth() const {
+        size_t depth = 0, maxDepth = 0;
+        for (const Instr& in : m_code) {
+            if (in.op == Op::Push || in.op == Op::Reg) depth++;
+            else if (in.op > Op::BitNot && depth > 0) depth--;
+            maxDepth = std::max(maxDepth, depth);
+        }
+        return maxDepth;
+    }
+
+    static bool Binary(Op op, int64_t& a, int64_t b) {
+        uint64_t ua = uint64_t(a), ub = uint64_t(b);
+        switch (op) {
+            case Op::Mul: a = int64_t(ua * ub); break;
+            case Op::Div: if (b == 0 || (a == INT64_MIN && b == -1)) return false; a /= b; break;
+            case Op::Mod: if (b == 0 || (a == INT64_MIN && b == -1)) return false; a %= b; break;
+            case Op::Add: a = int64_t(ua + ub); break;
+            case Op::Sub: a = int64_t(ua - ub); break;
+            case Op::Shl: a = int64_t(ua << (ub & 63)); break;
+            case Op::Shr: a = a >> (ub & 63); break;
+            case Op::Lt:  a = a < b; break;
+            case Op::Le:  a = a <= b; break;
+            case Op::Gt:  a = a > b; break;
+            case Op::Ge:  a = a >= b; break;
+            case Op::Eq:  a = a == b; break;
+            case Op::Ne:  a = a != b; break;
+            case Op::And: a &= b; break;
+            case Op::Xor: a ^= b; break;
+            case Op::Or:  a |= b; break;
+            default: return false;
+        }
+        return true;
+    }
+
+    // Precedence climbing parser emitting bytecode as it goes.
+    struct Parser {
+        std::string_view s;
+        size_t pos;
+        const SymbolTable& symbols;
+        std::vector<Instr>& code;
+        std::string error;
+
+        struct BinOp { std::string_view tok; int prec; Op op; };
+
+        void SkipSpace() { while (pos < s.size() && std::isspace(uint8_t(s[pos]))) pos++; }
+
+        bool Accept(std::string_view tok) {
+            SkipSpace();
+            if (s.substr(pos, tok.size()) != tok) return false;
+            pos += tok.size();
+            return true;
+        }
+
+        void Emit(Op op, int64_t imm = 0, Reg reg = Reg::DEFAULT, uint8_t size = 0) {
+            code.push_back({ op, size, reg, imm });
+        }
+
+        void Expr(int minPrec) {
+            static constexpr BinOp OPS[] = {
+                { "||", 1, Op::Or },  { "&&", 2, Op::And }, { "|", 3, Op::Or },   { "^", 4, Op::Xor },
+                { "&", 5, Op::And },  { "==", 6, Op::Eq },  { "!=", 6, Op::Ne },  { "<<", 8, Op::Shl },
+                { ">>", 8, Op::Shr }, { "<=", 7, Op::Le },  { ">=", 7, Op::Ge },  { "<", 7, Op::Lt },
+                { ">", 7, Op::Gt },   { "+", 9, Op::Add },  { "-", 9, Op::Sub },  { "*", 10, Op::Mul },
+                { "/", 10, Op::Div }, { "%", 10, Op::Mod },
+            };
+            Unary();
+            while (error.empty()) {
+                SkipSpace();
+                const BinOp* found = nullptr;
+                for (const BinOp& o : OPS) {
+                    if (s.substr(pos, o.tok.size()) == o.tok) { found = &o; break; }
+                }
+                if (!found || found->prec < minPrec) return;
+                pos += found->tok.size();
+                if (found->prec <= 2) {
+                    // Short circuit: a && b -> a; jz F; b; !!; jmp E; F: push 0; E:  (|| mirrored with jnz/1)
+                    bool isAnd = found->prec == 2;
+                    size_t jumpShort = code.size();
+                    Emit(isAnd ? Op::JumpIfZero : Op::JumpIfNonZero);
+                    Expr(found->prec + 1);
+                    Emit(Op::Not);
+                    Emit(Op::Not);
+                    size_t jumpEnd = code.size();
+                    Emit(Op::Push, 1);
+                    Emit(Op::JumpIfNonZero);
+                    code[jumpShort].imm = int64_t(code.size());
+                    Emit(Op::Push, isAnd ? 0 : 1);
+                    code[jumpEnd + 1].imm = int64_t(code.size());
+                }
+                else {
+                    Expr(found->prec + 1);
+                    Emit(found->op);
+                }
+            }
+        }
+
+        void Unary() {
+            if (Accept("-")) { Unary(); Emit(Op::Neg); }
+            else if (Accept("!")) { Unary(); Emit(Op::Not); }
+            else if (Accept("~")) { Unary(); Emit(Op::BitNot); }
+            else Primary();
+        }
+
+        void Primary() {
+            SkipSpace();
+            if (Accept("(")) {
+                Expr(0);
+                if (!Accept(")")) error = "missing ')'";
+                return;
+            }
+            if (pos < s.size() && std::isdigit(uint8_t(s[pos]))) {
+                size_t used = 0;
+                std::string num(s.substr(pos));
+                try {
+                    Emit(Op::Push, int64_t(std::stoull(num, &used, 0)));
+                }
+                catch (const std::exception&) {
+                    error = "invalid number";
+                }
+                pos += used;
+                return;
+            }
+            Accept("$");
+            size_t start = pos;
+            while (pos < s.size() && (std::isalnum(uint8_t(s[pos])) || s[pos] == '_' || s[pos] == '.' || s[pos] == '@')) {
+                pos++;
+            }
+            std::string_view name = s.substr(start, pos - start);
+            if (name.empty()) {
+                error = pos < s.size() ? "unexpected '" + std::string(1, s[pos]) + "'" : "unexpected end";
+                return;
+            }
+
+            static constexpr std::pair<std::string_view, uint8_t> LOADS[] = {
+                { "u8", 1 }, { "u16", 2 }, { "u32", 4 }, { "u64", 8 },
+                { "i8", 0x81 }, { "i16", 0x82 }, { "i32", 0x84 }, { "i64", 0x88 },
+            };
+            for (const auto& [loadName, size] : LOADS) {
+                if (name != loadName) continue;
+                if (!Accept("[")) { error = "expected '[' after " + std::string(name); return; }
+                Expr(0);
+                if (!Accept("]")) { error = "missing ']'"; return; }
+                Emit(Op::Load, 0, Reg::DEFAULT, size);
+                return;
+            }
+            if (Reg r = GetRegisterFromName(name); r != Reg::DEFAULT) {
+                Emit(Op::Reg, 0, r);
+                return;
+            }
+            if (const Symbol* sym = symbols.FindByName(name)) {
+                Emit(Op::Push, int64_t(sym->addr));
+                return;
+            }
+            error = "unknown register or symbol '" + std::string(name) + "'";
+        }
+    };
+
+    std::vector<Instr> m_code;
+    std::string m_text;
+};
+
+struct X86Insn {
+    // Instruction classes a relocator or stepper has to treat specially.
+    enum Kind : uint8_t {
+        OTHER,
+        JMP_REL,    // E9, EB
+        JCC_REL,    // 70-7F, 0F 80-8F
+        CALL_REL,   // E8
+        LOOP_REL,   // E0-E3: loop/jrcxz, rel8 only
+        CALL_IND,   // FF /2, FF /3
+        JMP_IND,    // FF /4, FF /5
+        RET,        // C2, C3, CA, CB, CF
+        SYSCALL,
+    };
+
+    uint8_t length;
+    uint8_t map;         // 0 one byte, 1 0F, 2 0F38, 3 0F3A, VEX/EVEX/XOP use their map number
+    uint8_t opcode;
+    uint8_t opcodeOffset;
+    uint8_t modrm;
+    bool hasModrm;
+    int8_t ripDispOffset; // offset of the disp32 of a [rip + disp32] operand or -1
+    int8_t immOffset;     // -1 when there is no immediate
+    uint8_t immSize;
+    Kind kind;
+
+    // Target of a relative branch.
+    uint64_t BranchTarget(uint64_t addr, const uint8_t* bytes) const {
+        int64_t rel = 0;
+        if (immSize == 1) rel = int8_t(bytes[immOffset]);
+        else {
+            int32_t r32;
+            std::memcpy(&r32, bytes + immOffset, sizeof(r32));
+            rel = r32;
+        }
+        return addr + length + uint64_t(rel);
+    }
+};
+
+// x86-64 instruction length decoder. Every step is a table lookup: a prefix table, per opcode map a 256 entry table
+// with the operand layout (ModRM present, immediate kind), a ModRM table with the length of ModRM, SIB and
+// displacement and an immediate size table indexed by kind and operand/address size. Only the 0F 38/0F 3A, VEX, EVEX
+// and XOP escapes and the opcode groups whose reg field matters leave that path. Besides the length it reports where
+// the RIP-relative displacement and the immediate are, which is what relocating an instruction needs.
+enum X86OpFlags : uint8_t {
+    X86_MODRM   = 1 << 0,
+    X86_GROUP   = 1 << 1, // F6/F7: test has an immediate, the rest of the group has not; FF: call/jmp indirect
+    X86_INVALID = 1 << 2,
+    X86_ESCAPE  = 1 << 3, // 0F 38, 0F 3A, VEX, EVEX and XOP select another map
+
+    // Immediate kind in bits 4-6.
+    X86_IMM8    = 1 << 4,
+    X86_IMM16   = 2 << 4,
+    X86_IMMZ    = 3 << 4, // 16 or 32 bits depending on the operand size
+    X86_IMMV    = 4 << 4, // 16, 32 or 64 bits (mov reg, imm)
+    X86_MOFFS   = 5 << 4, // 64 bit address, 32 with the 0x67 prefix
+    X86_IMM16_8 = 6 << 4, // enter
+    X86_REL32   = 7 << 4, // near branches take rel32 regardless of the operand size
+};
+
+// Prefix table entries. The low bits are the operand and address size state the immediate size table is indexed with.
+enum X86Mode : uint8_t {
+    X86_MODE_OPSIZE = 1 << 0, // 0x66
+    X86_MODE_REXW   = 1 << 1,
+    X86_MODE_ADDR32 = 1 << 2, // 0x67
+    X86_MODE_MASK   = 7,
+    X86_PREFIX      = 1 << 7,
+};
+
+constexpr uint8_t X86_SIB_NO_BASE = 0x80; // ModRM table: mod 00 with a SIB, base 101 adds a disp32
+
+struct X86OpcodeTables {
+    uint8_t prefix[256];
+    uint8_t opcodes[2][256];  // one byte map, 0F map
+    uint8_t modrmLength[256];
+    uint8_t immSize[8][8];    // [kind >> 4][mode]
+    X86Insn::Kind kinds[2][256];
+    X86Insn::Kind groupFFKind[8];
+};
+
+constexpr X86OpcodeTables BuildX86OpcodeTables() {
+    X86OpcodeTables t = {};
+    auto set = [](uint8_t* table, int first, int last, uint8_t flags) {
+        for (int i = first; i <= last; i++) table[i] = flags;
+    };
+
+    uint8_t* p = t.prefix;
+    for (int b : { 0xF0, 0xF2, 0xF3, 0x2E, 0x36, 0x3E, 0x26, 0x64, 0x65 }) p[b] = X86_PREFIX;
+    p[0x66] = X86_PREFIX | X86_MODE_OPSIZE;
+    p[0x67] = X86_PREFIX | X86_MODE_ADDR32;
+    set(p, 0x40, 0x47, X86_PREFIX);
+    set(p, 0x48, 0x4F, X86_PREFIX | X86_MODE_REXW);
+
+    uint8_t* o = t.opcodes[0];
+    // ALU ops 00-3F: op r/m,r (x4), op al,ib, op eax,iz, then 06/07 style legacy slots.
+    for (int base = 0x00; base < 0x40; base += 8) {
+        set(o, base, base + 3, X86_MODRM);
+        o[base + 4] = X86_IMM8;
+        o[base + 5] = X86_IMMZ;
+        o[base + 6] = X86_INVALID;
+        o[base + 7] = X86_INVALID;
+    }
+    o[0x0F] = 0; // selects the 0F table
+    o[0x26] = o[0x2E] = o[0x36] = o[0x3E] = 0; // segment prefixes
+    set(o, 0x40, 0x5F, 0);
+    set(o, 0x60, 0x61, X86_INVALID);
+    o[0x62] = X86_ESCAPE; // EVEX
+    o[0x63] = X86_MODRM;
+    o[0x68] = X86_IMMZ;
+    o[0x69] = X86_MODRM | X86_IMMZ;
+    o[0x6A] = X86_IMM8;
+    o[0x6B] = X86_MODRM | X86_IMM8;
+    set(o, 0x70, 0x7F, X86_IMM8);
+    o[0x80] = X86_MODRM | X86_IMM8;
+    o[0x81] = X86_MODRM | X86_IMMZ;
+    o[0x82] = X86_INVALID;
+    o[0x83] = X86_MODRM | X86_IMM8;
+    set(o, 0x84, 0x8E, X86_MODRM);
+    o[0x8F] = X86_ESCAPE; // pop r/m or XOP
+    o[0x9A] = X86_INVALID;
+    set(o, 0xA0, 0xA3, X86_MOFFS);
+    o[0xA8] = X86_IMM8;
+    o[0xA9] = X86_IMMZ;
+    set(o, 0xB0, 0xB7, X86_IMM8);
+    set(o, 0xB8, 0xBF, X86_IMMV);
+    o[0xC0] = o[0xC1] = X86_MODRM | X86_IMM8;
+    o[0xC2] = X86_IMM16;
+    o[0xC4] = o[0xC5] = X86_ESCAPE; // VEX
+    o[0xC6] = X86_MODRM | X86_IMM8;
+    o[0xC7] = X86_MODRM | X86_IMMZ;
+    o[0xC8] = X86_IMM16_8;
+    o[0xCA] = X86_IMM16;
+    o[0xCD] = X86_IMM8;
+    o[0xCE] = X86_INVALID;
+    set(o, 0xD0, 0xD3, X86_MODRM);
+    set(o, 0xD4, 0xD6, X86_INVALID);
+    set(o, 0xD8, 0xDF, X86_MODRM);
+    set(o, 0xE0, 0xE7, X86_IMM8);
+    o[0xE8] = o[0xE9] = X86_REL32;
+    o[0xEA] = X86_INVALID;
+    o[0xEB] = X86_IMM8;
+    o[0xF6] = o[0xF7] = X86_MODRM | X86_GROUP;
+    o[0xFE] = X86_MODRM;
+    o[0xFF] = X86_MODRM | X86_GROUP;
+
+    uint8_t* w = t.opcodes[1];
+    set(w, 0x00, 0xFF, X86_MODRM);
+    w[0x04] = w[0x0A] = w[0x0C] = X86_INVALID;
+    set(w, 0x05, 0x09, 0);
+    w[0x0B] = w[0x0E] = 0;
+    w[0x0F] = X86_MODRM | X86_IMM8; // 3DNow!
+    set(w, 0x24, 0x27, X86_INVALID);
+    set(w, 0x30, 0x37, 0);
+    w[0x38] = w[0x3A] = X86_ESCAPE;
+    w[0x39] = X86_INVALID;
+    set(w, 0x3B, 0x3F, X86_INVALID);
+    set(w, 0x70, 0x73, X86_MODRM | X86_IMM8);
+    w[0x77] = 0;
+    w[0x7A] = w[0x7B] = X86_INVALID;
+    set(w, 0x80, 0x8F, X86_REL32);
+    set(w, 0xA0, 0xA2, 0);
+    w[0xA4] = w[0xAC] = w[0xBA] = X86_MODRM | X86_IMM8;
+    w[0xA6] = w[0xA7] = X86_INVALID;
+    set(w, 0xA8, 0xAA, 0);
+    w[0xC2] = X86_MODRM | X86_IMM8;
+    set(w, 0xC4, 0xC6, X86_MODRM | X86_IMM8);
+    set(w, 0xC8, 0xCF, 0);
+
+    for (int m = 0; m < 256; m++) {
+        int mod = m >> 6, rm = m & 7;
+        if (mod == 3) t.modrmLength[m] = 1;
+        else if (mod == 0) t.modrmLength[m] = rm == 4 ? 2 | X86_SIB_NO_BASE : rm == 5 ? 5 : 1;
+        else t.modrmLength[m] = uint8_t((rm == 4 ? 2 : 1) + (mod == 1 ? 1 : 4));
+    }
+
+    for (int mode = 0; mode < 8; mode++) {
+        bool opsize16 = mode & X86_MODE_OPSIZE, rexW = mode & X86_MODE_REXW, addr32 = mode & X86_MODE_ADDR32;
+        t.immSize[X86_IMM8 >> 4][mode] = 1;
+        t.immSize[X86_IMM16 >> 4][mode] = 2;
+        t.immSize[X86_IMMZ >> 4][mode] = opsize16 && !rexW ? 2 : 4;
+        t.immSize[X86_IMMV >> 4][mode] = rexW ? 8 : opsize16 ? 2 : 4;
+        t.immSize[X86_MOFFS >> 4][mode] = addr32 ? 4 : 8;
+        t.immSize[X86_IMM16_8 >> 4][mode] = 3;
+        t.immSize[X86_REL32 >> 4][mode] = 4;
+    }
+
+    X86Insn::Kind* k = t.kinds[0];
+    k[0xE8] = X86Insn::CALL_REL;
+    k[0xE9] = k[0xEB] = X86Insn::JMP_REL;
+    for (int op = 0x70; op <= 0x7F; op++) k[op] = X86Insn::JCC_REL;
+    for (int op = 0xE0; op <= 0xE3; op++) k[op] = X86Insn::LOOP_REL;
+    k[0xC2] = k[0xC3] = k[0xCA] = k[0xCB] = k[0xCF] = X86Insn::RET;
+    for (int op = 0x80; op <= 0x8F; op++) t.kinds[1][op] = X86Insn::JCC_REL;
+    t.kinds[1][0x05] = X86Insn::SYSCALL;
+    t.groupFFKind[2] = t.groupFFKind[3] = X86Insn::CALL_IND;
+    t.groupFFKind[4] = t.groupFFKind[5] = X86Insn::JMP_IND;
+    return t;
+}
+
+constexpr X86OpcodeTables g_X86OpcodeTables = BuildX86OpcodeTables();
+
+// Decodes the instruction at code[0, avail). Returns false for invalid or truncated instructions.
+bool DecodeX86(const uint8_t* code, size_t avail, X86Insn& out) {
+    constexpr size_t MAX_LENGTH = 15;
+    // The decoder reads up to 21 bytes without checking, short buffers are decoded from a zero padded copy.
+    constexpr size_t READ_AHEAD = 24;
+    if (avail < READ_AHEAD) {
+        uint8_t padded[READ_AHEAD] = {};
+        std::memcpy(padded, code, avail);
+        return DecodeX86(padded, READ_AHEAD, out) && out.length <= avail;
+    }
+    const X86OpcodeTables& t = g_X86OpcodeTables;
+
+    // Legacy prefixes and REX. A REX that is not right in front of the opcode is ignored by the CPU.
+    size_t i = 0;
+    uint8_t mode = 0;
+    for (uint8_t p; (p = t.prefix[code[i]]) != 0;) {
+        mode = uint8_t((mode & ~X86_MODE_REXW) | (p & X86_MODE_MASK));
+        if (++i == MAX_LENGTH) return false;
+    }
+
+    // 0F xx is looked up in the second table like a one byte opcode.
+    size_t map = code[i] == 0x0F;
+    i += map;
+    uint8_t opcode = code[i];
+    uint8_t flags = t.opcodes[map][opcode];
+    out.map = uint8_t(map);
+    out.opcode = opcode;
+    out.opcodeOffset = uint8_t(i++);
+    out.kind = t.kinds[map][opcode];
+
+    if (flags & X86_ESCAPE) {
+        if (map == 1) {
+            // 0F 38 and 0F 3A
+            out.map = opcode == 0x38 ? 2 : 3;
+            flags = opcode == 0x38 ? X86_MODRM : X86_MODRM | X86_IMM8;
+            out.opcode = code[i];
+            out.opcodeOffset = uint8_t(i++);
+        }
+        else if (opcode == 0x8F && (code[i] & 0x1F) < 8) {
+            flags = X86_MODRM; // pop r/m, code[i] is its ModRM
+        }
+        else {
+            // VEX (C5: 1 payload byte, C4: 2), EVEX (62: 3) and XOP (8F: 2, maps 8-10). The operand size comes from
+            // VEX.W, a 0x66 in front is not allowed.
+            size_t payload = opcode == 0xC5 ? 1 : opcode == 0x62 ? 3 : 2;
+            uint8_t vexMap = opcode == 0xC5 ? 1 : uint8_t(code[i] & (opcode == 0x62 ? 0x07 : 0x1F));
+            mode &= X86_MODE_ADDR32;
+            if (opcode != 0xC5 && opcode != 0x62 && (code[i + 1] & 0x80)) mode |= X86_MODE_REXW;
+            i += payload;
+            out.map = vexMap;
+            if (vexMap == 1) flags = t.opcodes[1][code[i]] | X86_MODRM;
+            else if (vexMap == 3 || vexMap == 8) flags = X86_MODRM | X86_IMM8;
+            else if (vexMap == 10) flags = X86_MODRM | X86_IMMZ;
+            else flags = X86_MODRM;
+            if (vexMap == 1 && code[i] == 0x77 && opcode != 0x62) flags = 0; // vzeroupper/vzeroall
+            flags &= uint8_t(~(X86_INVALID | X86_ESCAPE));
+            out.kind = X86Insn::OTHER;
+            out.opcode = code[i];
+            out.opcodeOffset = uint8_t(i++);
+        }
+    }
+    if (flags & X86_INVALID) return false;
+
+    out.modrm = 0;
+    out.hasModrm = false;
+    out.ripDispOffset = -1;
+    if (flags & X86_MODRM) {
+        // ModRM, SIB and displacement
+        uint8_t modrm = code[i];
+        size_t length = t.modrmLength[modrm];
+        if (length & X86_SIB_NO_BASE) length = (length & ~size_t(X86_SIB_NO_BASE)) + ((code[i + 1] & 7) == 5 ? 4 : 0);
+        out.modrm = modrm;
+        out.hasModrm = true;
+        if ((modrm & 0xC7) == 0x05) out.ripDispOffset = int8_t(i + 1);
+        i += length;
+        if (flags & X86_GROUP) {
+            uint8_t reg = (modrm >> 3) & 7;
+            if (out.opcode == 0xFF) out.kind = t.groupFFKind[reg];
+            else if (reg < 2) flags |= out.opcode == 0xF6 ? X86_IMM8 : X86_IMMZ;
+        }
+    }
+
+    uint8_t imm = t.immSize[flags >> 4][mode];
+    out.immOffset = imm ? int8_t(i) : -1;
+    out.immSize = imm;
+    i += imm;
+    out.length = uint8_t(i);
+    return i <= MAX_LENGTH;
+}
+
+// Copies the instructions in code[0, len), which were at address from, so they can run at address to. RIP-relative
+// operands and relative branches are adjusted, short branches are widened to rel32. Returns false when an
+// instruction can't be moved (loop/jrcxz, targets out of rel32 range, undecodable bytes).
+bool RelocateX86(const uint8_t* code, size_t len, uint64_t from, uint64_t to, std::vector<uint8_t>& out) {
+    auto fitsRel32 = [](int64_t v) { return v >= INT32_MIN && v <= INT32_MAX; };
+    size_t off = 0;
+    while (off < len) {
+        X86Insn insn;
+        if (!DecodeX86(code + off, len - off, insn)) return false;
+        const uint8_t* p = code + off;
+        uint64_t addr = from + off;
+        uint64_t newAddr = to + out.size();
+
+        if (insn.kind == X86Insn::JMP_REL || insn.kind == X86Insn::CALL_REL || insn.kind == X86Insn::JCC_REL) {
+            uint64_t target = insn.BranchTarget(addr, p);
+            uint8_t opcode[2];
+            size_t opLen;
+            if (insn.kind == X86Insn::JCC_REL) {
+                opcode[0] = 0x0F;
+                opcode[1] = uint8_t(0x80 | (insn.opcode & 0x0F));
+                opLen = 2;
+            }
+            else {
+                opcode[0] = insn.kind == X86Insn::CALL_REL ? 0xE8 : 0xE9;
+                opLen = 1;
+            }
+            int64_t rel = int64_t(target - (newAddr + opLen + 4));
+            if (!fitsRel32(rel)) return false;
+            int32_t rel32 = int32_t(rel);
+            out.insert(out.end(), opcode, opcode + opLen);
+            out.insert(out.end(), reinterpret_cast<uint8_t*>(&rel32), reinterpret_cast<uint8_t*>(&rel32) + 4);
+        }
+        else if (insn.kind == X86Insn::LOOP_REL) {
+            return false;
+        }
+        else {
+            size_t start = out.size();
+            out.insert(out.end(), p, p + insn.length);
+            if (insn.ripDispOffset >= 0) {
+                int32_t disp;
+                std::memcpy(&disp, p + insn.ripDispOffset, sizeof(disp));
+                int64_t moved = int64_t(disp) + int64_t(addr - newAddr);
+                if (!fitsRel32(moved)) return false;
+                disp = int32_t(moved);
+                std::memcpy(out.data() + start + insn.ripDispOffset, &disp, sizeof(disp));
+            }
+        }
+        off += insn.length;
+    }
+    return true;
+}
+
+// Decoded instructions keyed by address, so stepping and disassembly don't read and decode the same code at every
+// stop. Direct mapped: a decode that lands in a taken slot replaces it. Entries hold the original bytes (breakpoints
+// substituted) and stay valid across resumes; whoever writes code must call Invalidate. Code the tracee modifies on
+// its own (JITs) is not tracked.
+struct X86DecodeCache {
+public:
+    static constexpr size_t SLOT_BITS = 14;
+    static constexpr size_t MAX_INSN = 15;
+
+    struct Entry {
+        uint64_t addr;
+        X86Insn insn;
+        uint8_t bytes[MAX_INSN];
+    };
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t invalidations;
+    };
+
+    X86DecodeCache() : m_slots(size_t(1) << SLOT_BITS) { Clear(); }
+
+    const Entry* Find(uint64_t addr) {
+        const Entry& e = m_slots[Slot(addr)];
+        if (e.addr == addr) {
+            m_stats.hits++;
+            return &e;
+        }
+        m_stats.misses++;
+        return nullptr;
+    }
+
+    const Entry* Insert(uint64_t addr, const X86Insn& insn, const uint8_t* bytes) {
+        Entry& e = m_slots[Slot(addr)];
+        e.addr = addr;
+        e.insn = insn;
+        std::memcpy(e.bytes, bytes, insn.length);
+        return &e;
+    }
+
+    // Drops every instruction overlapping [addr, addr + len).
+    void Invalidate(uint64_t addr, size_t len) {
+        if (len >= m_slots.size()) {
+            Clear();
+            return;
+        }
+        for (uint64_t a = addr - std::min<uint64_t>(addr, MAX_INSN - 1); a < addr + len; a++) {
+            Entry& e = m_slots[Slot(a)];
+            if (e.addr == a && a + e.insn.length > addr) {
+                e.addr = EMPTY;
+                m_stats.invalidations++;
+            }
+        }
+    }
+
+    void Clear() {
+        for (Entry& e : m_slots) e.addr = EMPTY;
+    }
+
+    const Stats& GetStats() const { return m_stats; }
+
+private:
+    static constexpr uint64_t EMPTY = ~uint64_t(0);
+
+    static size_t Slot(uint64_t addr) { return size_t((addr * 0x9E3779B97F4A7C15ull) >> (64 - SLOT_BITS)); }
+
+    std::vector<Entry> m_slots;
+    Stats m_stats = {};
+};
+
+// Encodings the decoder got wrong before, with their expected length and opcode.
+bool CheckX86Decoder() {
+    struct Case {
+        std::vector<uint8_t> code;
+        uint8_t length;
+        uint8_t opcode;
+    };
+    static const Case CASES[] = {
+        // pop r/m (8F /0) with every ModRM form
+        { { 0x8F, 0x00 }, 2, 0x8F },                                     // pop [rax]
+        { { 0x8F, 0x04, 0x24 }, 3, 0x8F },                               // pop [rsp]
+        { { 0x8F, 0x04, 0x25, 0x10, 0x20, 0x30, 0x00 }, 7, 0x8F },       // pop [disp32], SIB without base
+        { { 0x8F, 0x05, 0x10, 0x20, 0x30, 0x00 }, 6, 0x8F },             // pop [rip+disp32]
+        { { 0x8F, 0x40, 0x08 }, 3, 0x8F },                               // pop [rax+disp8]
+        { { 0x8F, 0x44, 0x24, 0x08 }, 4, 0x8F },                         // pop [rsp+disp8]
+        { { 0x8F, 0x80, 0x10, 0x20, 0x30, 0x00 }, 6, 0x8F },             // pop [rax+disp32]
+        { { 0x8F, 0x84, 0x24, 0x10, 0x20, 0x30, 0x00 }, 7, 0x8F },       // pop [rsp+disp32]
+        { { 0x8F, 0xC0 }, 2, 0x8F },                                     // pop rax
+        { { 0x41, 0x8F, 0x00 }, 3, 0x8F },                               // pop [r8]
+        { { 0x66, 0x8F, 0x00 }, 3, 0x8F },                               // pop word [rax]
+        // escapes that do take the next byte as the opcode
+        { { 0x8F, 0xE8, 0x78, 0xC0, 0xC1, 0x05 }, 6, 0xC0 },             // XOP vprotb xmm0, xmm1, 5
+        { { 0x0F, 0x38, 0x00, 0xC1 }, 4, 0x00 },                         // pshufb mm0, mm1
+        { { 0x66, 0x0F, 0x3A, 0x0F, 0xC1, 0x08 }, 6, 0x0F },             // palignr xmm0, xmm1, 8
+        { { 0xC5, 0xF8, 0x77 }, 3, 0x77 },                               // vzeroupper
+        { { 0xC4, 0xE2, 0x79, 0x18, 0x05, 0x10, 0x20, 0x30, 0x00 }, 9, 0x18 }, // vbroadcastss xmm0, [rip+disp32]
+    };
+    size_t failed = 0;
+    for (const Case& c : CASES) {
+        X86Insn insn;
+        bool ok = DecodeX86(c.code.data(), c.code.size(), insn);
+        if (ok && insn.length == c.length && insn.opcode == c.opcode) continue;
+        failed++;
+        std::cout << "decoder check failed for";
+        for (uint8_t b : c.code) std::cout << ' ' << std::hex << std::setw(2) << std::setfill('0') << unsigned(b);
+        std::cout << std::dec << std::setfill(' ') << ": ";
+        if (ok) std::cout << "length " << unsigned(insn.length) << " opcode 0x" << std::hex << unsigned(insn.opcode);
+        else std::cout << "not decoded";
+        std::cout << std::dec << ", expected length " << unsigned(c.length) << std::endl;
+    }
+    std::cout << std::size(CASES) - failed << " of " << std::size(CASES) << " decoder checks passed" << std::endl;
+    return failed == 0;
+}
+
+// Decodes the .text section of an ELF file linearly, raw and through X86DecodeCache, and reports the throughput.
+// Undecodable bytes are skipped one at a time and counted.
+void BenchmarkX86Decoder(const std::string& path) {
+    using Clock = std::chrono::steady_clock;
+    MappedFile file;
+    const Elf64_Shdr* text = file.Open(path) ? FindElfSection(file, ".text") : nullptr;
+    const uint8_t* code = text ? file.At<uint8_t>(text->sh_offset, text->sh_size) : nullptr;
+    if (!code) {
+        std::cout << "no .text section in " << path << std::endl;
+        return;
+    }
+    size_t size = text->sh_size;
+
+    size_t insns = 0, invalid = 0, passes = 0;
+    uint64_t lengthSum = 0;
+    auto t0 = Clock::now();
+    double secs = 0;
+    do {
+        for (size_t off = 0; off < size;) {
+            X86Insn insn;
+            if (DecodeX86(code + off, size - off, insn)) {
+                off += insn.length;
+                lengthSum += insn.length;
+                insns++;
+            }
+            else {
+                off++;
+                invalid++;
+            }
+        }
+        passes++;
+        secs = std::chrono::duration<double>(Clock::now() - t0).count();
+    } while (secs < 0.5);
+
+    X86DecodeCache cache;
+    std::vector<uint64_t> starts;
+    for (size_t off = 0; off < size;) {
+        X86Insn insn;
+        if (!DecodeX86(code + off, size - off, insn)) {
+            off++;
+            continue;
+        }
+        cache.Insert(text->sh_addr + off, insn, code + off);
+        starts.push_back(text->sh_addr + off);
+        off += insn.length;
+    }
+    size_t lookups = 0, found = 0;
+    auto t1 = Clock::now();
+    double cachedSecs = 0;
+    do {
+        for (uint64_t a : starts) found += cache.Find(a) != nullptr;
+        lookups += starts.size();
+        cachedSecs = std::chrono::duration<double>(Clock::now() - t1).count();
+    } while (cachedSecs < 0.2);
+
+    std::cout << std::dec << size << " bytes of .text, " << insns / passes << " instructions, " << invalid / passes
+              << " undecodable bytes, average length " << std::fixed << std::setprecision(2)
+              << double(lengthSum) / double(insns) << '\n'
+              << "decode:        " << std::setprecision(1) << double(insns) / secs / 1e6 << "M insn/s ("
+              << double(size * passes) / secs / (1 << 20) << " MB/s)\n"
+              << "cached lookup: " << double(lookups) / cachedSecs / 1e6 << "M insn/s, "
+              << std::setprecision(1) << 100.0 * double(found) / double(lookups) << "% resident" << std::endl;
+}
+
+// Collects text in a fixed buffer and hands it to the stream in large writes, for commands that print many lines.
+struct BufferedWriter {
+public:
+    explicit BufferedWriter(std::ostream& os) : m_os(os), m_buf(CAPACITY), m_len(0), m_column(0) {}
+    ~BufferedWriter() { Flush(); }
+
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator=(const BufferedWriter&) = delete;
+
+    void Put(char c) {
+        if (m_len == CAPACITY) Flush();
+        m_buf[m_len++] = c;
+        m_column = c == '\n' ? 0 : m_column + 1;
+    }
+
+    void Write(std::string_view s) {
+        if (m_len + s.size() > CAPACITY) Flush();
+        if (s.size() > CAPACITY) {
+            m_os.write(s.data(), std::streamsize(s.size()));
+        }
+        else {
+            std::memcpy(m_buf.data() + m_len, s.data(), s.size());
+            m_len += s.size();
+        }
+        size_t nl = s.rfind('\n');
+        m_column = nl == std::string_view::npos ? m_column + s.size() : s.size() - nl - 1;
+    }
+
+    // Lowercase hex without 0x, at least minDigits digits.
+    void Hex(uint64_t v, int minDigits = 1) {
+        char tmp[16];
+        int n = 0;
+        do {
+            tmp[n++] = "0123456789abcdef"[v & 15];
+            v >>= 4;
+        } while (v || n < minDigits);
+        while (n) Put(tmp[--n]);
+    }
+
+    void Dec(uint64_t v) {
+        char tmp[20];
+        int n = 0;
+        do {
+            tmp[n++] = char('0' + v % 10);
+            v /= 10;
+        } while (v);
+        while (n) Put(tmp[--n]);
+    }
+
+    size_t Column() const { return m_column; }
+
+    void PadTo(size_t column) {
+        while (m_column < column) Put(' ');
+    }
+
+    void Flush() {
+        if (m_len) m_os.write(m_buf.data(), std::streamsize(m_len));
+        m_len = 0;
+        m_os.flush();
+    }
+
+private:
+    static constexpr size_t CAPACITY = 64 * 1024;
+
+    std::ostream& m_os;
+    std::vector<char> m_buf;
+    size_t m_len;
+    size_t m_column;
+};
+
+// Mnemonic and operand layout of an opcode, in the notation of the Intel opcode maps:
+//   E/G   general register from ModRM.rm (or memory) / ModRM.reg; B general register from VEX.vvvv
+//   M     memory only; O moffs; Z register in the low opcode bits; A accumulator; C cl; D dx; S segment register
+//   V/W   xmm register from ModRM.reg / ModRM.rm or memory; U xmm register from ModRM.rm; H VEX.vvvv, omitted without
+//         VEX; h like H but also omitted for a memory operand; L xmm register from the high nibble of an imm8
+//   K/R/k opmask register from ModRM.reg / ModRM.rm / VEX.vvvv
+//   P/Q/N mmx register from reg / rm or memory / rm; with a 0x66 prefix or VEX they are xmm registers
+//   X     memory with a vector index (VSIB); Y the implicit xmm0
+//   I     immediate, J relative branch target, 1 the constant 1, F st(i) from ModRM.rm, T st(0)
+// followed by the size: b byte, w word, d dword, q qword, t tbyte, o 16 bytes, x xmm or ymm by VEX.L, v operand
+// size, y dword or qword by REX.W, s (I only) imm8 sign extended to the operand size, z (I only) imm16/32.
+// A mnemonic with '/' picks the variant by operand size 16/32/64, "sb"/"sv" operands append the string op suffix.
+struct X86Mnemonic {
+    const char* name;     // nullptr: invalid, or the instruction is described by group
+    const char* operands;
+    uint8_t group;        // index into X86MnemonicTables::groups, selected by ModRM.reg
+};
+
+struct X86MnemonicTables {
+    X86Mnemonic oneByte[256];
+    X86Mnemonic maps[3][256][4]; // 0F, 0F 38, 0F 3A by mandatory prefix: none, 66, F3, F2
+    X86Mnemonic groups[20][8];
+};
+
+constexpr X86MnemonicTables BuildX86MnemonicTables() {
+    X86MnemonicTables t = {};
+    const char* alu[8] = { "add", "or", "adc", "sbb", "and", "sub", "xor", "cmp" };
+    const char* jcc[16] = { "jo", "jno", "jb", "jae", "je", "jne", "jbe", "ja",
+                            "js", "jns", "jp", "jnp", "jl", "jge", "jle", "jg" };
+    const char* setcc[16] = { "seto", "setno", "setb", "setae", "sete", "setne", "setbe", "seta",
+                              "sets", "setns", "setp", "setnp", "setl", "setge", "setle", "setg" };
+    const char* cmovcc[16] = { "cmovo", "cmovno", "cmovb", "cmovae", "cmove", "cmovne", "cmovbe", "cmova",
+                               "cmovs", "cmovns", "cmovp", "cmovnp", "cmovl", "cmovge", "cmovle", "cmovg" };
+
+    enum : uint8_t { G1 = 1, G2, G3B, G3V, G4, G5, G1A, G11, G6, G7, G8, G9, G12, G13, G14, G15, G16, G17 };
+
+    X86Mnemonic* o = t.oneByte;
+    for (int i = 0; i < 8; i++) {
+        o[i * 8 + 0] = { alu[i], "Eb,Gb", 0 };
+        o[i * 8 + 1] = { alu[i], "Ev,Gv", 0 };
+        o[i * 8 + 2] = { alu[i], "Gb,Eb", 0 };
+        o[i * 8 + 3] = { alu[i], "Gv,Ev", 0 };
+        o[i * 8 + 4] = { alu[i], "Ab,Ib", 0 };
+        o[i * 8 + 5] = { alu[i], "Av,Iz", 0 };
+    }
+    for (int r = 0; r < 8; r++) {
+        o[0x50 + r] = { "push", "Zq", 0 };
+        o[0x58 + r] = { "pop", "Zq", 0 };
+        o[0xB0 + r] = { "mov", "Zb,Ib", 0 };
+        o[0xB8 + r] = { "mov", "Zv,Iv", 0 };
+    }
+    for (int c = 0; c < 16; c++) o[0x70 + c] = { jcc[c], "Jb", 0 };
+    o[0x63] = { "movsxd", "Gv,Ed", 0 };
+    o[0x68] = { "push", "Iz", 0 };
+    o[0x69] = { "imul", "Gv,Ev,Iz", 0 };
+    o[0x6A] = { "push", "Is", 0 };
+    o[0x6B] = { "imul", "Gv,Ev,Is", 0 };
+    o[0x6C] = { "ins", "sb", 0 };
+    o[0x6D] = { "ins", "sv", 0 };
+    o[0x6E] = { "outs", "sb", 0 };
+    o[0x6F] = { "outs", "sv", 0 };
+    o[0x80] = { nullptr, "Eb,Ib", G1 };
+    o[0x81] = { nullptr, "Ev,Iz", G1 };
+    o[0x83] = { nullptr, "Ev,Is", G1 };
+    o[0x84] = { "test", "Eb,Gb", 0 };
+    o[0x85] = { "test", "Ev,Gv", 0 };
+    o[0x86] = { "xchg", "Eb,Gb", 0 };
+    o[0x87] = { "xchg", "Ev,Gv", 0 };
+    o[0x88] = { "mov", "Eb,Gb", 0 };
+    o[0x89] = { "mov", "Ev,Gv", 0 };
+    o[0x8A] = { "mov", "Gb,Eb", 0 };
+    o[0x8B] = { "mov", "Gv,Ev", 0 };
+    o[0x8C] = { "mov", "Ew,Sw", 0 };
+    o[0x8D] = { "lea", "Gv,M", 0 };
+    o[0x8E] = { "mov", "Sw,Ew", 0 };
+    o[0x8F] = { nullptr, "Eq", G1A };
+    o[0x90] = { "nop", "", 0 };
+    for (int r = 1; r < 8; r++) o[0x90 + r] = { "xchg", "Zv,Av", 0 };
+    o[0x98] = { "cbw/cwde/cdqe", "", 0 };
+    o[0x99] = { "cwd/cdq/cqo", "", 0 };
+    o[0x9B] = { "fwait", "", 0 };
+    o[0x9C] = { "pushf/pushfq/pushfq", "", 0 };
+    o[0x9D] = { "popf/popfq/popfq", "", 0 };
+    o[0x9E] = { "sahf", "", 0 };
+    o[0x9F] = { "lahf", "", 0 };
+    o[0xA0] = { "movabs", "Ab,Ob", 0 };
+    o[0xA1] = { "movabs", "Av,Ov", 0 };
+    o[0xA2] = { "movabs", "Ob,Ab", 0 };
+    o[0xA3] = { "movabs", "Ov,Av", 0 };
+    o[0xA4] = { "movs", "sb", 0 };
+    o[0xA5] = { "movs", "sv", 0 };
+    o[0xA6] = { "cmps", "sb", 0 };
+    o[0xA7] = { "cmps", "sv", 0 };
+    o[0xA8] = { "test", "Ab,Ib", 0 };
+    o[0xA9] = { "test", "Av,Iz", 0 };
+    o[0xAA] = { "stos", "sb", 0 };
+    o[0xAB] = { "stos", "sv", 0 };
+    o[0xAC] = { "lods", "sb", 0 };
+    o[0xAD] = { "lods", "sv", 0 };
+    o[0xAE] = { "scas", "sb", 0 };
+    o[0xAF] = { "scas", "sv", 0 };
+    o[0xC0] = { nullptr, "Eb,Ib", G2 };
+    o[0xC1] = { nullptr, "Ev,Ib", G2 };
+    o[0xC2] = { "ret", "Iw", 0 };
+    o[0xC3] = { "ret", "", 0 };
+    o[0xC6] = { nullptr, "Eb,Ib", G11 };
+    o[0xC7] = { nullptr, "Ev,Iz", G11 };
+    o[0xC8] = { "enter", "Iw,Ib", 0 };
+    o[0xC9] = { "leave", "", 0 };
+    o[0xCA] = { "retf", "Iw", 0 };
+    o[0xCB] = { "retf", "", 0 };
+    o[0xCC] = { "int3", "", 0 };
+    o[0xCD] = { "int", "Ib", 0 };
+    o[0xCF] = { "iret/iretd/iretq", "", 0 };
+    o[0xD0] = { nullptr, "Eb,1", G2 };
+    o[0xD1] = { nullptr, "Ev,1", G2 };
+    o[0xD2] = { nullptr, "Eb,Cb", G2 };
+    o[0xD3] = { nullptr, "Ev,Cb", G2 };
+    o[0xD7] = { "xlat", "", 0 };
+    o[0xE0] = { "loopne", "Jb", 0 };
+    o[0xE1] = { "loope", "Jb", 0 };
+    o[0xE2] = { "loop", "Jb", 0 };
+    o[0xE3] = { "jrcxz", "Jb", 0 };
+    o[0xE4] = { "in", "Ab,Ib", 0 };
+    o[0xE5] = { "in", "Ad,Ib", 0 };
+    o[0xE6] = { "out", "Ib,Ab", 0 };
+    o[0xE7] = { "out", "Ib,Ad", 0 };
+    o[0xE8] = { "call", "Jz", 0 };
+    o[0xE9] = { "jmp", "Jz", 0 };
+    o[0xEB] = { "jmp", "Jb", 0 };
+    o[0xEC] = { "in", "Ab,Dw", 0 };
+    o[0xED] = { "in", "Ad,Dw", 0 };
+    o[0xEE] = { "out", "Dw,Ab", 0 };
+    o[0xEF] = { "out", "Dw,Ad", 0 };
+    o[0xF1] = { "int1", "", 0 };
+    o[0xF4] = { "hlt", "", 0 };
+    o[0xF5] = { "cmc", "", 0 };
+    o[0xF6] = { nullptr, "", G3B };
+    o[0xF7] = { nullptr, "", G3V };
+    o[0xF8] = { "clc", "", 0 };
+    o[0xF9] = { "stc", "", 0 };
+    o[0xFA] = { "cli", "", 0 };
+    o[0xFB] = { "sti", "", 0 };
+    o[0xFC] = { "cld", "", 0 };
+    o[0xFD] = { "std", "", 0 };
+    o[0xFE] = { nullptr, "", G4 };
+    o[0xFF] = { nullptr, "", G5 };
+
+    auto& g = t.groups;
+    for (int r = 0; r < 8; r++) g[G1][r] = { alu[r], nullptr, 0 };
+    const char* shifts[8] = { "rol", "ror", "rcl", "rcr", "shl", "shr", "shl", "sar" };
+    for (int r = 0; r < 8; r++) g[G2][r] = { shifts[r], nullptr, 0 };
+    const char* group3[8] = { "test", "test", "not", "neg", "mul", "imul", "div", "idiv" };
+    for (int r = 0; r < 8; r++) {
+        g[G3B][r] = { group3[r], r < 2 ? "Eb,Ib" : "Eb", 0 };
+        g[G3V][r] = { group3[r], r < 2 ? "Ev,Iz" : "Ev", 0 };
+    }
+    g[G4][0] = { "inc", "Eb", 0 };
+    g[G4][1] = { "dec", "Eb", 0 };
+    g[G5][0] = { "inc", "Ev", 0 };
+    g[G5][1] = { "dec", "Ev", 0 };
+    g[G5][2] = { "call", "Eq", 0 };
+    g[G5][3] = { "call far", "M", 0 };
+    g[G5][4] = { "jmp", "Eq", 0 };
+    g[G5][5] = { "jmp far", "M", 0 };
+    g[G5][6] = { "push", "Eq", 0 };
+    g[G1A][0] = { "pop", nullptr, 0 };
+    g[G11][0] = { "mov", nullptr, 0 };
+    const char* group6[6] = { "sldt", "str", "lldt", "ltr", "verr", "verw" };
+    for (int r = 0; r < 6; r++) g[G6][r] = { group6[r], "Ew", 0 };
+    const char* group7[8] = { "sgdt", "sidt", "lgdt", "lidt", "smsw", nullptr, "lmsw", "invlpg" };
+    for (int r = 0; r < 8; r++) g[G7][r] = { group7[r], "M", 0 };
+    g[G8][4] = { "bt", nullptr, 0 };
+    g[G8][5] = { "bts", nullptr, 0 };
+    g[G8][6] = { "btr", nullptr, 0 };
+    g[G8][7] = { "btc", nullptr, 0 };
+    g[G9][1] = { "cmpxchg8b/cmpxchg8b/cmpxchg16b", "M", 0 };
+    g[G9][6] = { "rdrand", "Ev", 0 };
+    g[G9][7] = { "rdseed", "Ev", 0 };
+    g[G12][2] = { "psrlw", nullptr, 0 };
+    g[G12][4] = { "psraw", nullptr, 0 };
+    g[G12][6] = { "psllw", nullptr, 0 };
+    g[G13][2] = { "psrld", nullptr, 0 };
+    g[G13][4] = { "psrad", nullptr, 0 };
+    g[G13][6] = { "pslld", nullptr, 0 };
+    g[G14][2] = { "psrlq", nullptr, 0 };
+    g[G14][3] = { "psrldq", nullptr, 0 };
+    g[G14][6] = { "psllq", nullptr, 0 };
+    g[G14][7] = { "pslldq", nullptr, 0 };
+    const char* group15[8] = { "fxsave", "fxrstor", "ldmxcsr", "stmxcsr", "xsave", "xrstor", "xsaveopt", "clflush" };
+    const char* group15Operands[8] = { "M", "M", "Md", "Md", "M", "M", "M", "Mb" };
+    for (int r = 0; r < 8; r++) g[G15][r] = { group15[r], group15Operands[r], 0 };
+    const char* group16[4] = { "prefetchnta", "prefetcht0", "prefetcht1", "prefetcht2" };
+    for (int r = 0; r < 8; r++) g[G16][r] = { r < 4 ? group16[r] : "nop", r < 4 ? "Mb" : "Ev", 0 };
+
+    // 0F map. sse(op, name, ...) fills the ps/pd/ss/sd variants of the SSE arithmetic.
+    auto& w = t.maps[0];
+    auto all = [&w](int op, X86Mnemonic m) { w[op][0] = w[op][1] = w[op][2] = w[op][3] = m; };
+    auto mmx = [&w](int op, const char* name, const char* operands) { w[op][0] = w[op][1] = { name, operands, 0 }; };
+    auto sse = [&w](int op, const char* ps, const char* pd, const char* ss, const char* sd) {
+        if (ps) w[op][0] = { ps, "Vx,Hx,Wx", 0 };
+        if (pd) w[op][1] = { pd, "Vx,Hx,Wx", 0 };
+        if (ss) w[op][2] = { ss, "Vx,Hx,Wd", 0 };
+        if (sd) w[op][3] = { sd, "Vx,Hx,Wq", 0 };
+    };
+    all(0x00, { nullptr, nullptr, G6 });
+    all(0x01, { nullptr, nullptr, G7 });
+    all(0x05, { "syscall", "", 0 });
+    all(0x06, { "clts", "", 0 });
+    all(0x07, { "sysret", "", 0 });
+    all(0x08, { "invd", "", 0 });
+    all(0x09, { "wbinvd", "", 0 });
+    all(0x0B, { "ud2", "", 0 });
+    all(0x0D, { "prefetchw", "Mb", 0 });
+    w[0x0E][0] = { "femms", "", 0 };
+    w[0x10][0] = { "movups", "Vx,Wx", 0 };
+    w[0x10][1] = { "movupd", "Vx,Wx", 0 };
+    w[0x10][2] = { "movss", "Vx,hx,Wd", 0 };
+    w[0x10][3] = { "movsd", "Vx,hx,Wq", 0 };
+    w[0x11][0] = { "movups", "Wx,Vx", 0 };
+    w[0x11][1] = { "movupd", "Wx,Vx", 0 };
+    w[0x11][2] = { "movss", "Wd,hx,Vx", 0 };
+    w[0x11][3] = { "movsd", "Wq,hx,Vx", 0 };
+    w[0x12][0] = { "movlps", "Vx,Hx,Mq", 0 };
+    w[0x12][1] = { "movlpd", "Vx,Hx,Mq", 0 };
+    w[0x12][2] = { "movsldup", "Vx,Wx", 0 };
+    w[0x12][3] = { "movddup", "Vx,Wq", 0 };
+    w[0x13][0] = { "movlps", "Mq,Vx", 0 };
+    w[0x13][1] = { "movlpd", "Mq,Vx", 0 };
+    sse(0x14, "unpcklps", "unpcklpd", nullptr, nullptr);
+    sse(0x15, "unpckhps", "unpckhpd", nullptr, nullptr);
+    w[0x16][0] = { "movhps", "Vx,Hx,Mq", 0 };
+    w[0x16][1] = { "movhpd", "Vx,Hx,Mq", 0 };
+    w[0x16][2] = { "movshdup", "Vx,Wx", 0 };
+    w[0x17][0] = { "movhps", "Mq,Vx", 0 };
+    w[0x17][1] = { "movhpd", "Mq,Vx", 0 };
+    all(0x18, { nullptr, nullptr, G16 });
+    for (int op = 0x19; op <= 0x1F; op++) all(op, { "nop", "Ev", 0 });
+    w[0x28][0] = { "movaps", "Vx,Wx", 0 };
+    w[0x28][1] = { "movapd", "Vx,Wx", 0 };
+    w[0x29][0] = { "movaps", "Wx,Vx", 0 };
+    w[0x29][1] = { "movapd", "Wx,Vx", 0 };
+    w[0x2A][2] = { "cvtsi2ss", "Vx,Hx,Ey", 0 };
+    w[0x2A][3] = { "cvtsi2sd", "Vx,Hx,Ey", 0 };
+    w[0x2B][0] = { "movntps", "Mx,Vx", 0 };
+    w[0x2B][1] = { "movntpd", "Mx,Vx", 0 };
+    w[0x2C][2] = { "cvttss2si", "Gy,Wd", 0 };
+    w[0x2C][3] = { "cvttsd2si", "Gy,Wq", 0 };
+    w[0x2D][2] = { "cvtss2si", "Gy,Wd", 0 };
+    w[0x2D][3] = { "cvtsd2si", "Gy,Wq", 0 };
+    w[0x2E][0] = { "ucomiss", "Vx,Wd", 0 };
+    w[0x2E][1] = { "ucomisd", "Vx,Wq", 0 };
+    w[0x2F][0] = { "comiss", "Vx,Wd", 0 };
+    w[0x2F][1] = { "comisd", "Vx,Wq", 0 };
+    all(0x30, { "wrmsr", "", 0 });
+    all(0x31, { "rdtsc", "", 0 });
+    all(0x32, { "rdmsr", "", 0 });
+    all(0x33, { "rdpmc", "", 0 });
+    all(0x34, { "sysenter", "", 0 });
+    all(0x35, { "sysexit", "", 0 });
+    for (int c = 0; c < 16; c++) {
+        all(0x40 + c, { cmovcc[c], "Gv,Ev", 0 });
+        all(0x80 + c, { jcc[c], "Jz", 0 });
+        all(0x90 + c, { setcc[c], "Eb", 0 });
+    }
+    w[0x50][0] = { "movmskps", "Gd,Ux", 0 };
+    w[0x50][1] = { "movmskpd", "Gd,Ux", 0 };
+    w[0x51][0] = { "sqrtps", "Vx,Wx", 0 };
+    w[0x51][1] = { "sqrtpd", "Vx,Wx", 0 };
+    w[0x51][2] = { "sqrtss", "Vx,Hx,Wd", 0 };
+    w[0x51][3] = { "sqrtsd", "Vx,Hx,Wq", 0 };
+    w[0x52][0] = { "rsqrtps", "Vx,Wx", 0 };
+    w[0x52][2] = { "rsqrtss", "Vx,Hx,Wd", 0 };
+    w[0x53][0] = { "rcpps", "Vx,Wx", 0 };
+    w[0x53][2] = { "rcpss", "Vx,Hx,Wd", 0 };
+    sse(0x54, "andps", "andpd", nullptr, nullptr);
+    sse(0x55, "andnps", "andnpd", nullptr, nullptr);
+    sse(0x56, "orps", "orpd", nullptr, nullptr);
+    sse(0x57, "xorps", "xorpd", nullptr, nullptr);
+    sse(0x58, "addps", "addpd", "addss", "addsd");
+    sse(0x59, "mulps", "mulpd", "mulss", "mulsd");
+    w[0x5A][0] = { "cvtps2pd", "Vx,Wq", 0 };
+    w[0x5A][1] = { "cvtpd2ps", "Vx,Wx", 0 };
+    w[0x5A][2] = { "cvtss2sd", "Vx,Hx,Wd", 0 };
+    w[0x5A][3] = { "cvtsd2ss", "Vx,Hx,Wq", 0 };
+    w[0x5B][0] = { "cvtdq2ps", "Vx,Wx", 0 };
+    w[0x5B][1] = { "cvtps2dq", "Vx,Wx", 0 };
+    w[0x5B][2] = { "cvttps2dq", "Vx,Wx", 0 };
+    sse(0x5C, "subps", "subpd", "subss", "subsd");
+    sse(0x5D, "minps", "minpd", "minss", "minsd");
+    sse(0x5E, "divps", "divpd", "divss", "divsd");
+    sse(0x5F, "maxps", "maxpd", "maxss", "maxsd");
+    const char* mmx60[12] = { "punpcklbw", "punpcklwd", "punpckldq", "packsswb", "pcmpgtb", "pcmpgtw", "pcmpgtd",
+                              "packuswb", "punpckhbw", "punpckhwd", "punpckhdq", "packssdw" };
+    for (int i = 0; i < 12; i++) mmx(0x60 + i, mmx60[i], "Px,Hx,Qx");
+    w[0x6C][1] = { "punpcklqdq", "Vx,Hx,Wx", 0 };
+    w[0x6D][1] = { "punpckhqdq", "Vx,Hx,Wx", 0 };
+    w[0x6E][0] = { "movd/movd/movq", "Pq,Ey", 0 };
+    w[0x6E][1] = { "movd/movd/movq", "Vo,Ey", 0 };
+    w[0x6F][0] = { "movq", "Pq,Qq", 0 };
+    w[0x6F][1] = { "movdqa", "Vx,Wx", 0 };
+    w[0x6F][2] = { "movdqu", "Vx,Wx", 0 };
+    w[0x70][0] = { "pshufw", "Pq,Qq,Ib", 0 };
+    w[0x70][1] = { "pshufd", "Vx,Wx,Ib", 0 };
+    w[0x70][2] = { "pshufhw", "Vx,Wx,Ib", 0 };
+    w[0x70][3] = { "pshuflw", "Vx,Wx,Ib", 0 };
+    mmx(0x71, nullptr, "Hx,Nx,Ib");
+    mmx(0x72, nullptr, "Hx,Nx,Ib");
+    mmx(0x73, nullptr, "Hx,Nx,Ib");
+    w[0x71][0].group = w[0x71][1].group = G12;
+    w[0x72][0].group = w[0x72][1].group = G13;
+    w[0x73][0].group = w[0x73][1].group = G14;
+    mmx(0x74, "pcmpeqb", "Px,Hx,Qx");
+    mmx(0x75, "pcmpeqw", "Px,Hx,Qx");
+    mmx(0x76, "pcmpeqd", "Px,Hx,Qx");
+    w[0x77][0] = { "emms", "", 0 };
+    w[0x7C][1] = { "haddpd", "Vx,Hx,Wx", 0 };
+    w[0x7C][3] = { "haddps", "Vx,Hx,Wx", 0 };
+    w[0x7D][1] = { "hsubpd", "Vx,Hx,Wx", 0 };
+    w[0x7D][3] = { "hsubps", "Vx,Hx,Wx", 0 };
+    w[0x7E][0] = { "movd/movd/movq", "Ey,Pq", 0 };
+    w[0x7E][1] = { "movd/movd/movq", "Ey,Vo", 0 };
+    w[0x7E][2] = { "movq", "Vo,Wq", 0 };
+    w[0x7F][0] = { "movq", "Qq,Pq", 0 };
+    w[0x7F][1] = { "movdqa", "Wx,Vx", 0 };
+    w[0x7F][2] = { "movdqu", "Wx,Vx", 0 };
+    all(0xA2, { "cpuid", "", 0 });
+    all(0xA3, { "bt", "Ev,Gv", 0 });
+    all(0xA4, { "shld", "Ev,Gv,Ib", 0 });
+    all(0xA5, { "shld", "Ev,Gv,Cb", 0 });
+    all(0xAB, { "bts", "Ev,Gv", 0 });
+    all(0xAC, { "shrd", "Ev,Gv,Ib", 0 });
+    all(0xAD, { "shrd", "Ev,Gv,Cb", 0 });
+    all(0xAE, { nullptr, nullptr, G15 });
+    all(0xAF, { "imul", "Gv,Ev", 0 });
+    all(0xB0, { "cmpxchg", "Eb,Gb", 0 });
+    all(0xB1, { "cmpxchg", "Ev,Gv", 0 });
+    all(0xB3, { "btr", "Ev,Gv", 0 });
+    all(0xB6, { "movzx", "Gv,Eb", 0 });
+    all(0xB7, { "movzx", "Gv,Ew", 0 });
+    w[0xB8][2] = { "popcnt", "Gv,Ev", 0 };
+    all(0xBA, { nullptr, "Ev,Ib", G8 });
+    all(0xBB, { "btc", "Ev,Gv", 0 });
+    all(0xBC, { "bsf", "Gv,Ev", 0 });
+    w[0xBC][2] = { "tzcnt", "Gv,Ev", 0 };
+    all(0xBD, { "bsr", "Gv,Ev", 0 });
+    w[0xBD][2] = { "lzcnt", "Gv,Ev", 0 };
+    all(0xBE, { "movsx", "Gv,Eb", 0 });
+    all(0xBF, { "movsx", "Gv,Ew", 0 });
+    all(0xC0, { "xadd", "Eb,Gb", 0 });
+    all(0xC1, { "xadd", "Ev,Gv", 0 });
+    w[0xC2][0] = { "cmpps", "Vx,Hx,Wx,Ib", 0 };
+    w[0xC2][1] = { "cmppd", "Vx,Hx,Wx,Ib", 0 };
+    w[0xC2][2] = { "cmpss", "Vx,Hx,Wd,Ib", 0 };
+    w[0xC2][3] = { "cmpsd", "Vx,Hx,Wq,Ib", 0 };
+    w[0xC3][0] = { "movnti", "My,Gy", 0 };
+    mmx(0xC4, "pinsrw", "Px,Hx,Ed,Ib");
+    mmx(0xC5, "pextrw", "Gd,Nx,Ib");
+    w[0xC6][0] = { "shufps", "Vx,Hx,Wx,Ib", 0 };
+    w[0xC6][1] = { "shufpd", "Vx,Hx,Wx,Ib", 0 };
+    all(0xC7, { nullptr, nullptr, G9 });
+    for (int r = 0; r < 8; r++) all(0xC8 + r, { "bswap", "Zy", 0 });
+    w[0xD0][1] = { "addsubpd", "Vx,Hx,Wx", 0 };
+    w[0xD0][3] = { "addsubps", "Vx,Hx,Wx", 0 };
+    const char* mmxD0[48] = {
+        nullptr, "psrlw", "psrld", "psrlq", "paddq", "pmullw", nullptr, nullptr,
+        "psubusb", "psubusw", "pminub", "pand", "paddusb", "paddusw", "pmaxub", "pandn",
+        "pavgb", "psraw", "psrad", "pavgw", "pmulhuw", "pmulhw", nullptr, nullptr,
+        "psubsb", "psubsw", "pminsw", "por", "paddsb", "paddsw", "pmaxsw", "pxor",
+        nullptr, "psllw", "pslld", "psllq", "pmuludq", "pmaddwd", "psadbw", nullptr,
+        "psubb", "psubw", "psubd", "psubq", "paddb", "paddw", "paddd", nullptr,
+    };
+    for (int i = 0; i < 48; i++) {
+        if (mmxD0[i]) mmx(0xD0 + i, mmxD0[i], "Px,Hx,Qx");
+    }
+    w[0xD6][1] = { "movq", "Wq,Vo", 0 };
+    mmx(0xD7, "pmovmskb", "Gd,Nx");
+    w[0xE6][1] = { "cvttpd2dq", "Vx,Wx", 0 };
+    w[0xE6][2] = { "cvtdq2pd", "Vx,Wq", 0 };
+    w[0xE6][3] = { "cvtpd2dq", "Vx,Wx", 0 };
+    w[0xE7][0] = { "movntq", "Mq,Pq", 0 };
+    w[0xE7][1] = { "movntdq", "Mx,Vx", 0 };
+    w[0xF0][3] = { "lddqu", "Vx,Mx", 0 };
+
+    // 0F 38
+    auto& m38 = t.maps[1];
+    const char* ssse3[12] = { "pshufb", "phaddw", "phaddd", "phaddsw", "pmaddubsw", "phsubw", "phsubd", "phsubsw",
+                              "psignb", "psignw", "psignd", "pmulhrsw" };
+    for (int i = 0; i < 12; i++) m38[i][0] = m38[i][1] = { ssse3[i], "Px,Hx,Qx", 0 };
+    m38[0x1C][0] = m38[0x1C][1] = { "pabsb", "Px,Qx", 0 };
+    m38[0x1D][0] = m38[0x1D][1] = { "pabsw", "Px,Qx", 0 };
+    m38[0x1E][0] = m38[0x1E][1] = { "pabsd", "Px,Qx", 0 };
+    m38[0x17][1] = { "ptest", "Vx,Wx", 0 };
+    m38[0x16][1] = { "vpermps", "Vx,Hx,Wx", 0 };
+    m38[0x18][1] = { "vbroadcastss", "Vx,Wd", 0 };
+    m38[0x19][1] = { "vbroadcastsd", "Vx,Wq", 0 };
+    m38[0x1A][1] = { "vbroadcastf128", "Vx,Mo", 0 };
+    m38[0x36][1] = { "vpermd", "Vx,Hx,Wx", 0 };
+    m38[0x45][1] = { "vpsrlvd/vpsrlvd/vpsrlvq", "Vx,Hx,Wx", 0 };
+    m38[0x46][1] = { "vpsravd", "Vx,Hx,Wx", 0 };
+    m38[0x47][1] = { "vpsllvd/vpsllvd/vpsllvq", "Vx,Hx,Wx", 0 };
+    m38[0x5A][1] = { "vbroadcasti128", "Vx,Mo", 0 };
+    m38[0x8C][1] = { "vpmaskmovd/vpmaskmovd/vpmaskmovq", "Vx,Hx,Mx", 0 };
+    m38[0x8E][1] = { "vpmaskmovd/vpmaskmovd/vpmaskmovq", "Mx,Hx,Vx", 0 };
+    m38[0x90][1] = { "vpgatherdd/vpgatherdd/vpgatherdq", "Vx,Xy,Hx", 0 };
+    m38[0x91][1] = { "vpgatherqd/vpgatherqd/vpgatherqq", "Vx,Xy,Hx", 0 };
+    m38[0x92][1] = { "vgatherdps/vgatherdps/vgatherdpd", "Vx,Xy,Hx", 0 };
+    m38[0x93][1] = { "vgatherqps/vgatherqps/vgatherqpd", "Vx,Xy,Hx", 0 };
+    const char* sha[6] = { "sha1nexte", "sha1msg1", "sha1msg2", "sha256rnds2", "sha256msg1", "sha256msg2" };
+    for (int i = 0; i < 6; i++) m38[0xC8 + i][0] = { sha[i], i == 3 ? "Vo,Wo,Yo" : "Vo,Wo", 0 };
+    const char* pmovsx[6] = { "pmovsxbw", "pmovsxbd", "pmovsxbq", "pmovsxwd", "pmovsxwq", "pmovsxdq" };
+    const char* pmovzx[6] = { "pmovzxbw", "pmovzxbd", "pmovzxbq", "pmovzxwd", "pmovzxwq", "pmovzxdq" };
+    for (int i = 0; i < 6; i++) {
+        m38[0x20 + i][1] = { pmovsx[i], "Vx,Wq", 0 };
+        m38[0x30 + i][1] = { pmovzx[i], "Vx,Wq", 0 };
+    }
+    const char* sse41[] = { "pminsb", "pminsd", "pminuw", "pminud", "pmaxsb", "pmaxsd", "pmaxuw", "pmaxud", "pmulld" };
+    for (int i = 0; i < 9; i++) m38[0x38 + i][1] = { sse41[i], "Vx,Hx,Wx", 0 };
+    m38[0x29][1] = { "pcmpeqq", "Vx,Hx,Wx", 0 };
+    m38[0x2B][1] = { "packusdw", "Vx,Hx,Wx", 0 };
+    m38[0x37][1] = { "pcmpgtq", "Vx,Hx,Wx", 0 };
+    m38[0x58][1] = { "vpbroadcastd", "Vx,Wd", 0 };
+    m38[0x59][1] = { "vpbroadcastq", "Vx,Wq", 0 };
+    m38[0x78][1] = { "vpbroadcastb", "Vx,Wb", 0 };
+    m38[0x79][1] = { "vpbroadcastw", "Vx,Ww", 0 };
+    const char* aes[5] = { "aesimc", "aesenc", "aesenclast", "aesdec", "aesdeclast" };
+    m38[0xDB][1] = { aes[0], "Vx,Wx", 0 };
+    for (int i = 1; i < 5; i++) m38[0xDB + i][1] = { aes[i], "Vx,Hx,Wx", 0 };
+    m38[0xF0][0] = { "movbe", "Gv,Mv", 0 };
+    m38[0xF1][0] = { "movbe", "Mv,Gv", 0 };
+    m38[0xF0][3] = { "crc32", "Gd,Eb", 0 };
+    m38[0xF1][3] = { "crc32", "Gd,Ev", 0 };
+    m38[0xF2][0] = { "andn", "Gy,By,Ey", 0 };
+    m38[0xF3][0] = { nullptr, "By,Ey", G17 };
+    g[G17][1] = { "blsr", nullptr, 0 };
+    g[G17][2] = { "blsmsk", nullptr, 0 };
+    g[G17][3] = { "blsi", nullptr, 0 };
+    m38[0xF5][0] = { "bzhi", "Gy,Ey,By", 0 };
+    m38[0xF5][2] = { "pext", "Gy,By,Ey", 0 };
+    m38[0xF5][3] = { "pdep", "Gy,By,Ey", 0 };
+    m38[0xF6][1] = { "adcx", "Gy,Ey", 0 };
+    m38[0xF6][2] = { "adox", "Gy,Ey", 0 };
+    m38[0xF6][3] = { "mulx", "Gy,By,Ey", 0 };
+    m38[0xF7][0] = { "bextr", "Gy,Ey,By", 0 };
+    m38[0xF7][1] = { "shlx", "Gy,Ey,By", 0 };
+    m38[0xF7][2] = { "sarx", "Gy,Ey,By", 0 };
+    m38[0xF7][3] = { "shrx", "Gy,Ey,By", 0 };
+
+    // 0F 3A
+    auto& m3a = t.maps[2];
+    m3a[0x00][1] = { "vpermq", "Vx,Wx,Ib", 0 };
+    m3a[0x01][1] = { "vpermpd", "Vx,Wx,Ib", 0 };
+    m3a[0x02][1] = { "vpblendd", "Vx,Hx,Wx,Ib", 0 };
+    m3a[0x04][1] = { "vpermilps", "Vx,Wx,Ib", 0 };
+    m3a[0x05][1] = { "vpermilpd", "Vx,Wx,Ib", 0 };
+    m3a[0x06][1] = { "vperm2f128", "Vx,Hx,Wx,Ib", 0 };
+    m3a[0x08][1] = { "roundps", "Vx,Wx,Ib", 0 };
+    m3a[0x09][1] = { "roundpd", "Vx,Wx,Ib", 0 };
+    m3a[0x0A][1] = { "roundss", "Vx,Hx,Wd,Ib", 0 };
+    m3a[0x0B][1] = { "roundsd", "Vx,Hx,Wq,Ib", 0 };
+    m3a[0x0C][1] = { "blendps", "Vx,Hx,Wx,Ib", 0 };
+    m3a[0x0D][1] = { "blendpd", "Vx,Hx,Wx,Ib", 0 };
+    m3a[0x0E][1] = { "pblendw", "Vx,Hx,Wx,Ib", 0 };
+    m3a[0x0F][0] = m3a[0x0F][1] = { "palignr", "Px,Hx,Qx,Ib", 0 };
+    m3a[0x14][1] = { "pextrb", "Ed,Vo,Ib", 0 };
+    m3a[0x16][1] = { "pextrd/pextrd/pextrq", "Ey,Vo,Ib", 0 };
+    m3a[0x17][1] = { "extractps", "Ed,Vo,Ib", 0 };
+    m3a[0x18][1] = { "vinsertf128", "Vx,Hx,Wo,Ib", 0 };
+    m3a[0x19][1] = { "vextractf128", "Wo,Vx,Ib", 0 };
+    m3a[0x20][1] = { "pinsrb", "Vo,Ho,Ed,Ib", 0 };
+    m3a[0x21][1] = { "insertps", "Vo,Ho,Wd,Ib", 0 };
+    m3a[0x22][1] = { "pinsrd/pinsrd/pinsrq", "Vo,Ho,Ey,Ib", 0 };
+    m3a[0x38][1] = { "vinserti128", "Vx,Hx,Wo,Ib", 0 };
+    m3a[0x39][1] = { "vextracti128", "Wo,Vx,Ib", 0 };
+    m3a[0x40][1] = { "dpps", "Vx,Hx,Wx,Ib", 0 };
+    m3a[0x41][1] = { "dppd", "Vx,Hx,Wx,Ib", 0 };
+    m3a[0x44][1] = { "pclmulqdq", "Vx,Hx,Wx,Ib", 0 };
+    m3a[0x46][1] = { "vperm2i128", "Vx,Hx,Wx,Ib", 0 };
+    m3a[0x4A][1] = { "vblendvps", "Vx,Hx,Wx,Lx", 0 };
+    m3a[0x4B][1] = { "vblendvpd", "Vx,Hx,Wx,Lx", 0 };
+    m3a[0x4C][1] = { "vpblendvb", "Vx,Hx,Wx,Lx", 0 };
+    m3a[0x60][1] = { "pcmpestrm", "Vx,Wx,Ib", 0 };
+    m3a[0x61][1] = { "pcmpestri", "Vx,Wx,Ib", 0 };
+    m3a[0x62][1] = { "pcmpistrm", "Vx,Wx,Ib", 0 };
+    m3a[0x63][1] = { "pcmpistri", "Vx,Wx,Ib", 0 };
+    m3a[0xCC][0] = { "sha1rnds4", "Vo,Wo,Ib", 0 };
+    m3a[0xDF][1] = { "aeskeygenassist", "Vx,Wx,Ib", 0 };
+    m3a[0xF0][3] = { "rorx", "Gy,Ey,Ib", 0 };
+    return t;
+}
+
+constexpr X86MnemonicTables g_X86MnemonicTables = BuildX86MnemonicTables();
+
+// Intel syntax for an instruction decoded by DecodeX86, e.g. "add    qword ptr [rip+0x2f0d], rdi". Covers the
+// general purpose, x87, SSE and the common VEX instructions; others are printed as "(bad)". Branch targets and
+// RIP-relative addresses are printed through symbolize(addr, out), which appends " <name+off>" when it knows the
+// address.
+struct X86Formatter {
+public:
+    template <typename Symbolize>
+    static void Format(const X86Insn& insn, const uint8_t* bytes, uint64_t addr, Symbolize&& symbolize,
+                       BufferedWriter& out) {
+        X86Formatter f(insn, bytes, addr);
+        if (!f.Build()) {
+            out.Write("(bad)");
+            return;
+        }
+        // Prefixes and mnemonic
+        size_t start = out.Column();
+        for (int k = 0; k < f.m_extraOpsize; k++) out.Write("data16 ");
+        if (f.m_ignoredSegment) {
+            bool notrack = f.m_insn.kind == X86Insn::JMP_IND || f.m_insn.kind == X86Insn::CALL_IND;
+            out.Write(notrack && f.m_ignoredSegment[0] == 'd' ? "notrack " : f.m_ignoredSegment);
+        }
+        if (f.m_lock) out.Write("lock ");
+        if (f.m_repPrinted) out.Write(f.m_rep == 0xF3 ? (f.m_repz ? "repz " : "rep ") : f.m_branch ? "bnd " : "repnz ");
+        if (f.m_vexPrefix) out.Put('v');
+        out.Write(f.m_name);
+        if (!f.m_suffix.empty()) out.Write(f.m_suffix);
+
+        bool first = true;
+        uint64_t ripTarget = 0;
+        bool hasRipTarget = false;
+        for (std::string_view op = f.m_operands; !op.empty();) {
+            size_t comma = op.find(',');
+            std::string_view token = op.substr(0, comma);
+            op = comma == std::string_view::npos ? std::string_view() : op.substr(comma + 1);
+            if (!f.Present(token)) continue;
+            if (first) {
+                out.Put(' ');
+                out.PadTo(start + 7);
+            }
+            else out.Write(", ");
+            first = false;
+            f.Operand(token, out, symbolize, ripTarget, hasRipTarget);
+        }
+        if (hasRipTarget) {
+            out.Write("    # 0x");
+            out.Hex(ripTarget);
+            symbolize(ripTarget, out);
+        }
+    }
+
+private:
+    X86Formatter(const X86Insn& insn, const uint8_t* bytes, uint64_t addr)
+        : m_insn(insn), m_bytes(bytes), m_addr(addr), m_immCursor(insn.immOffset) {}
+
+    // Parses the prefixes and picks the table entry. Returns false for encodings without an entry.
+    bool Build() {
+        const X86OpcodeTables& t = g_X86OpcodeTables;
+        size_t i = 0;
+        for (uint8_t p; i < m_insn.opcodeOffset && (p = t.prefix[m_bytes[i]]) != 0; i++) {
+            uint8_t b = m_bytes[i];
+            m_rex = (b & 0xF0) == 0x40 ? b : 0;
+            if (b == 0x66) m_extraOpsize += m_opsize16;
+            if (b == 0x66) m_opsize16 = true;
+            else if (b == 0x67) m_addr32 = true;
+            else if (b == 0xF0) m_lock = true;
+            else if (b == 0xF2 || b == 0xF3) m_rep = b;
+            else if (b == 0x64 || b == 0x65) m_segment = b == 0x64 ? "fs" : "gs";
+            else if (b == 0x2E || b == 0x36) m_ignoredSegment = b == 0x2E ? "cs " : "ss ";
+            else if (b == 0x3E || b == 0x26) m_ignoredSegment = b == 0x3E ? "ds " : "es ";
+        }
+        uint8_t escape = m_bytes[i];
+        if (m_insn.map != 0 && escape != 0x0F) {
+            if (escape != 0xC4 && escape != 0xC5) return false; // EVEX and XOP
+            uint8_t b1 = m_bytes[i + 1];
+            uint8_t rxb = escape == 0xC5 ? uint8_t((~b1 >> 5) & 4) : uint8_t((~b1 >> 5) & 7);
+            uint8_t last = escape == 0xC5 ? b1 : m_bytes[i + 2];
+            m_rex = uint8_t(0x40 | rxb | (escape == 0xC4 && (last & 0x80) ? 8 : 0));
+            m_vvvv = (~last >> 3) & 15;
+            m_vexL = (last >> 2) & 1;
+            static constexpr uint8_t PP[4] = { 0, 0x66, 0xF3, 0xF2 };
+            m_opsize16 = PP[last & 3] == 0x66;
+            m_rep = PP[last & 3] == 0x66 ? 0 : PP[last & 3];
+            m_vex = true;
+            if (m_insn.map > 3) return false;
+        }
+        if (m_insn.hasModrm) {
+            m_mod = m_insn.modrm >> 6;
+            m_reg = uint8_t(((m_insn.modrm >> 3) & 7) | (m_rex & 4 ? 8 : 0));
+            m_rm = uint8_t((m_insn.modrm & 7) | (m_rex & 1 ? 8 : 0));
+        }
+
+        uint8_t op = m_insn.opcode;
+        const X86Mnemonic* m;
+        if (m_insn.map == 0) {
+            if (op >= 0xD8 && op <= 0xDF) return BuildX87();
+            m = &g_X86MnemonicTables.oneByte[op];
+            if ((op == 0xC6 || op == 0xC7) && m_insn.modrm == 0xF8) {
+                m_name = op == 0xC6 ? "xabort" : "xbegin";
+                m_operands = op == 0xC6 ? "Ib" : "Jz";
+                return true;
+            }
+            if (op == 0x90 && ((m_rex & 1) || m_opsize16)) m = &g_X86MnemonicTables.oneByte[0x91];
+            else if (op == 0x90 && m_rep == 0xF3) {
+                m_name = "pause";
+                return true;
+            }
+            if (m_rep && ((op >= 0xA4 && op <= 0xAF) || (op >= 0x6C && op <= 0x6F))) {
+                m_repPrinted = true;
+                m_repz = m_rep == 0xF3 && (op == 0xA6 || op == 0xA7 || op == 0xAE || op == 0xAF);
+            }
+            else if (m_rep == 0xF3 && op == 0xC3) {
+                m_repPrinted = m_repz = true;
+            }
+            else if (m_rep == 0xF2 && m_insn.kind != X86Insn::OTHER) {
+                m_repPrinted = m_branch = true;
+            }
+        }
+        else {
+            if (m_insn.map == 1 && !BuildSpecial0F()) return !m_name.empty();
+            if (m_insn.map == 2 && m_vex && op >= 0x96 && op <= 0xBF && (op & 15) >= 6) return BuildFma();
+            // Mandatory prefix: F2/F3 before 66. An opcode with no entry for it treats the prefix as an ordinary one.
+            const X86Mnemonic* variants = g_X86MnemonicTables.maps[m_insn.map - 1][op];
+            int v = m_rep == 0xF3 ? 2 : m_rep == 0xF2 ? 3 : m_opsize16 ? 1 : 0;
+            if (!variants[v].name && !variants[v].group && v >= 2 && m_opsize16) v = 1;
+            if (!variants[v].name && !variants[v].group) v = 0;
+            bool same = variants[v].name == variants[0].name && variants[v].operands == variants[0].operands &&
+                        variants[v].group == variants[0].group;
+            if (same && m_rep != 0xF2 && m_rep != 0xF3) v = 0;
+            m_mmxAsXmm = m_opsize16 || m_vex;
+            if (v == 1) m_opsize16 = false;
+            if (v >= 2) m_rep = 0;
+            m = &variants[v];
+        }
+
+        m_operands = m->operands ? m->operands : "";
+        if (m->group) {
+            if (!m_insn.hasModrm) return false;
+            const X86Mnemonic& g = g_X86MnemonicTables.groups[m->group][m_reg & 7];
+            if (g.operands) m_operands = g.operands;
+            m = &g;
+        }
+        if (!m->name) return false;
+        m_name = m->name;
+
+        // VEX either widens a vector instruction (printed with a v) or encodes one of the BMI instructions; legacy
+        // encodings of the VEX only instructions are invalid.
+        bool vector = m_operands.find_first_of(m_mmxAsXmm ? "VWHhUPQN" : "VWHhU") != std::string_view::npos ||
+                      (m_vex && (m_name == "ldmxcsr" || m_name == "stmxcsr"));
+        bool vexOnly = m_operands.find('B') != std::string_view::npos || m_name == "rorx" ||
+                       (vector && m_name[0] == 'v');
+        if (m_vex ? !vector && !vexOnly : vexOnly) return false;
+        m_vexPrefix = m_vex && vector && m_name[0] != 'v';
+
+        OperandSize();
+        if (m_name.find('/') != std::string_view::npos) {
+            // Variants by operand size 16/32/64
+            int index = m_opSize == 2 ? 0 : m_opSize == 4 ? 1 : 2;
+            for (int k = 0; k < index; k++) m_name = m_name.substr(m_name.find('/') + 1);
+            m_name = m_name.substr(0, m_name.find('/'));
+        }
+        if (m_operands == "sb" || m_operands == "sv") {
+            static constexpr const char* SUFFIX[9] = { "", "b", "w", "", "d", "", "", "", "q" };
+            m_suffix = SUFFIX[m_operands == "sb" ? 1 : m_opSize];
+            m_operands = "";
+        }
+        if (m_insn.map == 0 && op >= 0xB8 && op <= 0xBF && m_opSize == 8) m_name = "movabs";
+        if (m_insn.map == 0 && m_opsize16 && (m_rex & 8)) m_extraOpsize++; // REX.W overrides 0x66
+        if (m_insn.map == 1 && op == 0xC2 && m_bytes[m_insn.immOffset] < (m_vex ? 32 : 8)) {
+            // Comparison predicates are spelled out: cmpltsd instead of cmpsd with imm 1.
+            static constexpr const char* PRED[32] = {
+                "eq", "lt", "le", "unord", "neq", "nlt", "nle", "ord", "eq_uq", "nge", "ngt", "false", "neq_oq", "ge",
+                "gt", "true", "eq_os", "lt_oq", "le_oq", "unord_s", "neq_us", "nlt_uq", "nle_uq", "ord_s", "eq_us",
+                "nge_uq", "ngt_uq", "false_os", "neq_os", "ge_oq", "gt_oq", "true_us",
+            };
+            std::string_view pred = PRED[m_bytes[m_insn.immOffset]];
+            std::string_view type = m_name.substr(3);
+            std::memcpy(m_nameBuf, "cmp", 3);
+            std::memcpy(m_nameBuf + 3, pred.data(), pred.size());
+            std::memcpy(m_nameBuf + 3 + pred.size(), type.data(), type.size());
+            m_name = std::string_view(m_nameBuf, 3 + pred.size() + type.size());
+            m_operands = m_operands.substr(0, m_operands.size() - 3);
+        }
+        return true;
+    }
+
+    // 0F opcodes whose meaning depends on more than the table can express. Returns false when the instruction is
+    // complete (m_name set) or invalid (m_name empty).
+    bool BuildSpecial0F() {
+        uint8_t op = m_insn.opcode;
+        if (m_vex && ((op >= 0x41 && op <= 0x4B) || (op >= 0x90 && op <= 0x93) || op == 0x98 || op == 0x99)) {
+            BuildMaskOp();
+            return false;
+        }
+        if ((op == 0x12 || op == 0x16) && m_mod == 3 && !m_opsize16 && !m_rep) {
+            m_name = op == 0x12 ? "movhlps" : "movlhps";
+            m_operands = "Vx,Hx,Ux";
+            m_vexPrefix = m_vex;
+            return false;
+        }
+        if (op == 0x1E && m_rep == 0xF3 && (m_insn.modrm == 0xFA || m_insn.modrm == 0xFB)) {
+            m_name = m_insn.modrm == 0xFA ? "endbr64" : "endbr32";
+            return false;
+        }
+        if (op == 0x77 && m_vex) {
+            m_name = m_vexL ? "vzeroall" : "vzeroupper";
+            return false;
+        }
+        if (op == 0x01 && m_mod == 3) {
+            switch (m_insn.modrm) {
+                case 0xD0: m_name = "xgetbv"; break;
+                case 0xD1: m_name = "xsetbv"; break;
+                case 0xD5: m_name = "xend"; break;
+                case 0xD6: m_name = "xtest"; break;
+                case 0xCA: m_name = "clac"; break;
+                case 0xCB: m_name = "stac"; break;
+                case 0xF8: m_name = "swapgs"; break;
+                case 0xF9: m_name = "rdtscp"; break;
+                default: break;
+            }
+            return false;
+        }
+        if (op == 0xAE && m_mod == 3) {
+            uint8_t reg = m_reg & 7;
+            m_name = reg == 5 ? "lfence" : reg == 6 ? "mfence" : reg == 7 ? "sfence" : "";
+            return false;
+        }
+        return true;
+    }
+
+    // FMA3: the operation is in the low nibble, the operand order (132, 213, 231) in the high one and VEX.W selects
+    // single or double precision.
+    bool BuildFma() {
+        static constexpr const char* OPS[10] = { "fmaddsub", "fmsubadd", "fmadd", "fmadd", "fmsub", "fmsub",
+                                                 "fnmadd", "fnmadd", "fnmsub", "fnmsub" };
+        static constexpr const char* ORDER[3] = { "132", "213", "231" };
+        uint8_t op = m_insn.opcode;
+        bool scalar = op & 1 && (op & 15) >= 9;
+        std::string_view name = OPS[(op & 15) - 6];
+        size_t n = 0;
+        m_nameBuf[n++] = 'v';
+        std::memcpy(m_nameBuf + n, name.data(), name.size());
+        n += name.size();
+        std::memcpy(m_nameBuf + n, ORDER[(op >> 4) - 9], 3);
+        n += 3;
+        m_nameBuf[n++] = scalar ? 's' : 'p';
+        m_nameBuf[n++] = m_rex & 8 ? 'd' : 's';
+        m_name = std::string_view(m_nameBuf, n);
+        m_operands = scalar ? "Vx,Hx,Wy" : "Vx,Hx,Wx";
+        return true;
+    }
+
+    // AVX-512 opmask instructions, VEX encoded in the 0F map. The suffix comes from VEX.pp and VEX.W.
+    void BuildMaskOp() {
+        uint8_t op = m_insn.opcode;
+        bool w = m_rex & 8;
+        if (m_mod != 3 && op != 0x90 && op != 0x91) return;
+        if (op == 0x4B) {
+            m_name = "kunpck";
+            m_suffix = m_opsize16 ? "bw" : w ? "dq" : "wd";
+            m_operands = "K,k,R";
+            return;
+        }
+        if (op == 0x92 || op == 0x93) {
+            m_suffix = m_rep == 0xF2 ? (w ? "q" : "d") : m_opsize16 ? "b" : "w";
+            m_operands = op == 0x92 ? "K,Ed" : "Gd,R";
+            if (w) m_operands = op == 0x92 ? "K,Eq" : "Gq,R";
+        }
+        else {
+            m_suffix = m_opsize16 ? (w ? "d" : "b") : (w ? "q" : "w");
+        }
+        static constexpr const char* LOGIC[11] = { "kand", "kandn", nullptr, "knot", "kor", "kxnor", "kxor", nullptr,
+                                                   nullptr, "kadd", nullptr };
+        switch (op) {
+            case 0x90: m_name = "kmov"; m_operands = m_mod == 3 ? "K,R" : "K,Mq"; break;
+            case 0x91: m_name = "kmov"; m_operands = "Mq,K"; break;
+            case 0x92: case 0x93: m_name = "kmov"; break;
+            case 0x98: m_name = "kortest"; m_operands = "K,R"; break;
+            case 0x99: m_name = "ktest"; m_operands = "K,R"; break;
+            default:
+                if (!LOGIC[op - 0x41]) return;
+                m_name = LOGIC[op - 0x41];
+                m_operands = op == 0x44 ? "K,R" : "K,k,R";
+                break;
+        }
+        if (m_name.empty()) m_suffix = {};
+    }
+
+    bool BuildX87() {
+        static constexpr const char* ARITH[8] = { "fadd", "fmul", "fcom", "fcomp", "fsub", "fsubr", "fdiv", "fdivr" };
+        // Memory forms: mnemonic and operand per escape byte and ModRM.reg.
+        static constexpr const char* MEM[8][8] = {
+            { "fadd", "fmul", "fcom", "fcomp", "fsub", "fsubr", "fdiv", "fdivr" },
+            { "fld", nullptr, "fst", "fstp", "fldenv", "fldcw", "fnstenv", "fnstcw" },
+            { "fiadd", "fimul", "ficom", "ficomp", "fisub", "fisubr", "fidiv", "fidivr" },
+            { "fild", "fisttp", "fist", "fistp", nullptr, "fld", nullptr, "fstp" },
+            { "fadd", "fmul", "fcom", "fcomp", "fsub", "fsubr", "fdiv", "fdivr" },
+            { "fld", "fisttp", "fst", "fstp", "frstor", nullptr, "fnsave", "fnstsw" },
+            { "fiadd", "fimul", "ficom", "ficomp", "fisub", "fisubr", "fidiv", "fidivr" },
+            { "fild", "fisttp", "fist", "fistp", "fbld", "fild", "fbstp", "fistp" },
+        };
+        static constexpr const char* MEM_OPERAND[8][8] = {
+            { "Md", "Md", "Md", "Md", "Md", "Md", "Md", "Md" },
+            { "Md", "", "Md", "Md", "M", "Mw", "M", "Mw" },
+            { "Md", "Md", "Md", "Md", "Md", "Md", "Md", "Md" },
+            { "Md", "Md", "Md", "Md", "", "Mt", "", "Mt" },
+            { "Mq", "Mq", "Mq", "Mq", "Mq", "Mq", "Mq", "Mq" },
+            { "Mq", "Mq", "Mq", "Mq", "M", "", "M", "Mw" },
+            { "Mw", "Mw", "Mw", "Mw", "Mw", "Mw", "Mw", "Mw" },
+            { "Mw", "Mw", "Mw", "Mw", "Mt", "Mq", "Mt", "Mq" },
+        };
+        int esc = m_insn.opcode - 0xD8, reg = m_reg & 7;
+        if (m_mod != 3) {
+            if (!MEM[esc][reg]) return false;
+            m_name = MEM[esc][reg];
+            m_operands = MEM_OPERAND[esc][reg];
+            return true;
+        }
+        uint8_t modrm = m_insn.modrm;
+        switch (esc) {
+            case 0: m_name = ARITH[reg]; m_operands = "Tt,Ft"; return true;
+            case 1:
+                if (reg == 0) { m_name = "fld"; m_operands = "Ft"; return true; }
+                if (reg == 1) { m_name = "fxch"; m_operands = "Ft"; return true; }
+                switch (modrm) {
+                    case 0xD0: m_name = "fnop"; return true;
+                    case 0xE0: m_name = "fchs"; return true;
+                    case 0xE1: m_name = "fabs"; return true;
+                    case 0xE4: m_name = "ftst"; return true;
+                    case 0xE5: m_name = "fxam"; return true;
+                    case 0xE8: m_name = "fld1"; return true;
+                    case 0xE9: m_name = "fldl2t"; return true;
+                    case 0xEA: m_name = "fldl2e"; return true;
+                    case 0xEB: m_name = "fldpi"; return true;
+                    case 0xEC: m_name = "fldlg2"; return true;
+                    case 0xED: m_name = "fldln2"; return true;
+                    case 0xEE: m_name = "fldz"; return true;
+                    case 0xF0: m_name = "f2xm1"; return true;
+                    case 0xF1: m_name = "fyl2x"; return true;
+                    case 0xF2: m_name = "fptan"; return true;
+                    case 0xF3: m_name = "fpatan"; return true;
+                    case 0xF4: m_name = "fxtract"; return true;
+                    case 0xF5: m_name = "fprem1"; return true;
+                    case 0xF6: m_name = "fdecstp"; return true;
+                    case 0xF7: m_name = "fincstp"; return true;
+                    case 0xF8: m_name = "fprem"; return true;
+                    case 0xF9: m_name = "fyl2xp1"; return true;
+                    case 0xFA: m_name = "fsqrt"; return true;
+                    case 0xFC: m_name = "frndint"; return true;
+                    case 0xFD: m_name = "fscale"; return true;
+                    case 0xFE: m_name = "fsin"; return true;
+                    case 0xFF: m_name = "fcos"; return true;
+                    default: return false;
+                }
+            case 2:
+                if (modrm == 0xE9) { m_name = "fucompp"; return true; }
+                if (reg > 3) return false;
+                m_name = (const char*[]){ "fcmovb", "fcmove", "fcmovbe", "fcmovu" }[reg];
+                m_operands = "Tt,Ft";
+                return true;
+            case 3:
+                if (modrm == 0xE2) { m_name = "fnclex"; return true; }
+                if (modrm == 0xE3) { m_name = "fninit"; return true; }
+                if (reg == 4 || reg > 6) return false;
+                m_name = (const char*[]){ "fcmovnb", "fcmovne", "fcmovnbe", "fcmovnu", "", "fucomi", "fcomi" }[reg];
+                m_operands = "Tt,Ft";
+                return true;
+            case 4:
+                // The register forms swap sub/subr and div/divr relative to D8.
+                if (reg == 2 || reg == 3) return false;
+                m_name = ARITH[reg >= 4 ? reg ^ 1 : reg];
+                m_operands = "Ft,Tt";
+                return true;
+            case 5:
+                if (reg == 0) { m_name = "ffree"; m_operands = "Ft"; return true; }
+                if (reg == 2) { m_name = "fst"; m_operands = "Ft"; return true; }
+                if (reg == 3) { m_name = "fstp"; m_operands = "Ft"; return true; }
+                if (reg == 4) { m_name = "fucom"; m_operands = "Ft"; return true; }
+                if (reg == 5) { m_name = "fucomp"; m_operands = "Ft"; return true; }
+                return false;
+            case 6:
+                if (modrm == 0xD9) { m_name = "fcompp"; return true; }
+                if (reg == 2 || reg == 3) return false;
+                m_name = (const char*[]){ "faddp", "fmulp", "", "", "fsubrp", "fsubp", "fdivrp", "fdivp" }[reg];
+                m_operands = "Ft,Tt";
+                return true;
+            default:
+                if (modrm == 0xE0) { m_name = "fnstsw"; m_operands = "Aw"; return true; }
+                if (reg == 0) { m_name = "ffreep"; m_operands = "Ft"; return true; }
+                if (reg == 5 || reg == 6) {
+                    m_name = reg == 5 ? "fucomip" : "fcomip";
+                    m_operands = "Tt,Ft";
+                    return true;
+                }
+                return false;
+        }
+    }
+
+    void OperandSize() {
+        m_opSize = m_rex & 8 ? 8 : m_opsize16 ? 2 : 4;
+    }
+
+    // H and h exist only with VEX, h not for memory forms either; B needs VEX too.
+    bool Present(std::string_view token) const {
+        if (token.empty()) return false;
+        if (token[0] == 'H' || token[0] == 'B') return m_vex;
+        if (token[0] == 'h') return m_vex && m_mod == 3;
+        return true;
+    }
+
+    int Size(char c) const {
+        switch (c) {
+            case 'b': return 1;
+            case 'w': return 2;
+            case 'd': return 4;
+            case 'q': return 8;
+            case 't': return 10;
+            case 'o': return 16;
+            case 'x': return m_vexL ? 32 : 16;
+            case 'v': return m_opSize;
+            case 'y': return m_rex & 8 ? 8 : 4;
+            default: return 0;
+        }
+    }
+
+    static const char* Gpr(int reg, int size, bool rex) {
+        static constexpr const char* R64[16] = { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+                                                 "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" };
+        static constexpr const char* R32[16] = { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+                                                 "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" };
+        static constexpr const char* R16[16] = { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+                                                 "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w" };
+        static constexpr const char* R8[16] = { "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+                                                "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" };
+        static constexpr const char* R8_LEGACY[8] = { "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh" };
+        reg &= 15;
+        switch (size) {
+            case 1: return rex || reg >= 8 ? R8[reg] : R8_LEGACY[reg];
+            case 2: return R16[reg];
+            case 4: return R32[reg];
+            default: return R64[reg];
+        }
+    }
+
+    static void VectorReg(BufferedWriter& out, int reg, int size, bool mmx) {
+        out.Write(mmx ? "mm" : size == 32 ? "ymm" : "xmm");
+        out.Dec(uint64_t(mmx ? reg & 7 : reg));
+    }
+
+    template <typename Symbolize>
+    void Operand(std::string_view token, BufferedWriter& out, Symbolize& symbolize, uint64_t& ripTarget,
+                 bool& hasRipTarget) {
+        char kind = token[0];
+        char sizeCode = token.size() > 1 ? token[1] : 0;
+        int size = Size(sizeCode);
+        bool mmx = !m_mmxAsXmm;
+        switch (kind) {
+            case 'E':
+                if (m_mod == 3) out.Write(Gpr(m_rm, size, m_rex));
+                else Memory(out, size, ripTarget, hasRipTarget);
+                break;
+            case 'M': Memory(out, size, ripTarget, hasRipTarget); break;
+            case 'X': Memory(out, size, ripTarget, hasRipTarget, Size('x')); break;
+            case 'Y': out.Write("xmm0"); break;
+            case 'G': out.Write(Gpr(m_reg, size, m_rex)); break;
+            case 'B': out.Write(Gpr(m_vvvv, size, true)); break;
+            case 'Z': out.Write(Gpr((m_insn.opcode & 7) | (m_rex & 1 ? 8 : 0), size, m_rex)); break;
+            case 'A': out.Write(Gpr(0, size, false)); break;
+            case 'C': out.Write("cl"); break;
+            case 'D': out.Write("dx"); break;
+            case '1': out.Write("1"); break;
+            case 'S': {
+                static constexpr const char* SEG[8] = { "es", "cs", "ss", "ds", "fs", "gs", "?", "?" };
+                out.Write(SEG[m_reg & 7]);
+                break;
+            }
+            case 'T': out.Write("st"); break;
+            case 'K': case 'R': case 'k':
+                out.Put('k');
+                out.Dec(uint64_t((kind == 'K' ? m_reg : kind == 'R' ? m_rm : m_vvvv) & 7));
+                break;
+            case 'F':
+                out.Write("st(");
+                out.Dec(m_rm & 7);
+                out.Put(')');
+                break;
+            case 'O':
+                out.Write(m_segment ? m_segment : "ds");
+                out.Write(":0x");
+                out.Hex(Immediate(m_insn.immSize, false));
+                break;
+            case 'V': VectorReg(out, m_reg, sizeCode == 'x' ? size : 16, false); break;
+            case 'H': case 'h': VectorReg(out, m_vvvv, sizeCode == 'x' ? size : 16, false); break;
+            case 'L': VectorReg(out, int(Immediate(1, false) >> 4), size, false); break;
+            case 'U': VectorReg(out, m_rm, sizeCode == 'x' ? size : 16, false); break;
+            case 'W':
+                if (m_mod == 3) VectorReg(out, m_rm, sizeCode == 'x' ? size : 16, false);
+                else Memory(out, size, ripTarget, hasRipTarget);
+                break;
+            case 'P': VectorReg(out, m_reg, mmx ? 8 : Size('x'), mmx); break;
+            case 'N': VectorReg(out, m_rm, mmx ? 8 : Size('x'), mmx); break;
+            case 'Q':
+                if (m_mod == 3) VectorReg(out, m_rm, mmx ? 8 : Size('x'), mmx);
+                else Memory(out, mmx ? 8 : Size('x'), ripTarget, hasRipTarget);
+                break;
+            case 'I': {
+                int bytes = sizeCode == 'b' || sizeCode == 's' ? 1 : sizeCode == 'w' ? 2 : sizeCode == 'z' ? 4
+                          : m_insn.immSize;
+                if (sizeCode == 'z' && m_opSize == 2) bytes = 2;
+                bool signExtend = sizeCode == 's' || sizeCode == 'z';
+                uint64_t v = Immediate(bytes, signExtend);
+                int opSize = m_name == "push" ? (m_opsize16 ? 2 : 8) : m_opSize; // push imm is 64-bit by default
+                if (signExtend && opSize < 8) v &= (uint64_t(1) << (opSize * 8)) - 1;
+                out.Write("0x");
+                out.Hex(v);
+                break;
+            }
+            case 'J': {
+                uint64_t target = m_addr + m_insn.length + Immediate(m_insn.immSize, true);
+                out.Write("0x");
+                out.Hex(target);
+                symbolize(target, out);
+                break;
+            }
+            default: out.Write("?"); break;
+        }
+    }
+
+    // Reads the next size bytes of immediate data.
+    uint64_t Immediate(int size, bool signExtend) {
+        uint64_t v = 0;
+        std::memcpy(&v, m_bytes + m_immCursor, size_t(size));
+        m_immCursor += size;
+        if (signExtend && size < 8 && (v >> (size * 8 - 1)) & 1) v |= ~uint64_t(0) << (size * 8);
+        return v;
+    }
+
+    static const char* PtrName(int size) {
+        switch (size) {
+            case 1: return "byte ptr ";
+            case 2: return "word ptr ";
+            case 4: return "dword ptr ";
+            case 8: return "qword ptr ";
+            case 10: return "tbyte ptr ";
+            case 16: return "xmmword ptr ";
+            case 32: return "ymmword ptr ";
+            default: return "";
+        }
+    }
+
+    // vectorIndex is the register size of a VSIB index (gathers), 0 for a general purpose index.
+    void Memory(BufferedWriter& out, int size, uint64_t& ripTarget, bool& hasRipTarget, int vectorIndex = 0) {
+        const uint8_t* p = m_bytes + m_insn.opcodeOffset + 2;
+        int base = m_rm, index = -1, scale = 1;
+        bool hasDisp = m_mod != 0;
+        if ((m_rm & 7) == 4) {
+            uint8_t sib = *p++;
+            scale = 1 << (sib >> 6);
+            index = ((sib >> 3) & 7) | (m_rex & 2 ? 8 : 0);
+            base = (sib & 7) | (m_rex & 1 ? 8 : 0);
+            if (index == 4 && !vectorIndex) index = -1;
+            if ((sib & 7) == 5 && m_mod == 0) {
+                base = -1;
+                hasDisp = true;
+            }
+        }
+        else if (m_mod == 0 && (m_rm & 7) == 5) {
+            base = -2; // rip
+            hasDisp = true;
+        }
+        int64_t disp = 0;
+        if (m_mod == 1) disp = int8_t(*p);
+        else if (hasDisp) {
+            int32_t d32;
+            std::memcpy(&d32, p, sizeof(d32));
+            disp = d32;
+        }
+
+        out.Write(PtrName(size));
+        if (base == -1 && index < 0) {
+            // Absolute address
+            out.Write(m_segment ? m_segment : "ds");
+            out.Write(":0x");
+            out.Hex(m_addr32 ? uint32_t(disp) : uint64_t(disp));
+            return;
+        }
+        if (m_segment) {
+            out.Write(m_segment);
+            out.Put(':');
+        }
+        out.Put('[');
+        int addrSize = m_addr32 ? 4 : 8;
+        if (base == -2) {
+            out.Write(m_addr32 ? "eip" : "rip");
+            ripTarget = m_addr + m_insn.length + uint64_t(disp);
+            hasRipTarget = true;
+        }
+        else if (base >= 0) {
+            out.Write(Gpr(base, addrSize, true));
+        }
+        if (index >= 0) {
+            if (base != -1) out.Put('+');
+            if (vectorIndex) VectorReg(out, index, vectorIndex, false);
+            else out.Write(Gpr(index, addrSize, true));
+            out.Put('*');
+            out.Dec(uint64_t(scale));
+        }
+        if (hasDisp) {
+            out.Put(disp < 0 ? '-' : '+');
+            out.Write("0x");
+            out.Hex(disp < 0 ? uint64_t(-disp) : uint64_t(disp));
+        }
+        out.Put(']');
+    }
+
+    const X86Insn& m_insn;
+    const uint8_t* m_bytes;
+    uint64_t m_addr;
+    int m_immCursor;
+
+    std::string_view m_name;
+    char m_nameBuf[16];
+    std::string_view m_suffix;
+    std::string_view m_operands;
+    const char* m_segment = nullptr;
+    const char* m_ignoredSegment = nullptr; // cs, ss, ds and es overrides have no effect in 64-bit mode
+    int m_extraOpsize = 0;
+    uint8_t m_rex = 0;
+    uint8_t m_rep = 0;
+    bool m_opsize16 = false;
+    bool m_addr32 = false;
+    bool m_lock = false;
+    bool m_repPrinted = false;
+    bool m_repz = false;
+    bool m_branch = false;
+    bool m_vex = false;
+    bool m_vexPrefix = false;
+    bool m_mmxAsXmm = false;
+    uint8_t m_vexL = 0;
+    uint8_t m_vvvv = 0;
+    uint8_t m_mod = 3;
+    uint8_t m_reg = 0;
+    uint8_t m_rm = 0;
+    int m_opSize = 4;
+};
+
+// Shared memory ring the in-process tracepoint trampolines write to. Producers claim a record with lock xadd on head,
+// clear its sequence number before writing the payload and publish it by storing the sequence number (index + 1)
+// last, so the tracee never waits: when the reader falls behind, records are overwritten and the reader counts them as
+// dropped.
+struct TraceRingHeader {
+    uint64_t head;
+    uint8_t pad[56]; // head gets its own cache line
+};
+
+constexpr size_t TRACE_MAX_REGS = 6;
+constexpr size_t TRACE_MAX_MEM = 56;
+constexpr size_t TRACE_RING_RECORDS = 64 * 1024;
+
+struct TraceRecord {
+    uint64_t seq;
+    uint32_t site;
+    uint32_t memLen;
+    uint64_t tsc;
+    uint64_t regs[TRACE_MAX_REGS];
+    uint8_t mem[TRACE_MAX_MEM];
+};
+static_assert(sizeof(TraceRecord) == 128, "the trampoline computes record addresses with a shift");
+static_assert(sizeof(TraceRingHeader) == 64);
+
+constexpr size_t TRACE_RING_SIZE = sizeof(TraceRingHeader) + TRACE_RING_RECORDS * sizeof(TraceRecord);
+
+// What a fast tracepoint records: up to TRACE_MAX_REGS general purpose registers (rip and rsp hold their values at
+// the tracepoint) and optionally memLen bytes at memBase + memOffset.
+struct FastTraceSpec {
+    std::vector<Reg> regs;
+    Reg memBase = Reg::DEFAULT;
+    int32_t memOffset = 0;
+    uint32_t memLen = 0;
+};
+
+// Emits the machine code of a tracepoint trampoline:
+//     lea rsp, [rsp - 128]                  skip the red zone
+//     pushfq; push rax, rcx, rdx, rsi, rdi, r8
+//     rdtsc; rdi = tsc
+//     rdx = ring; rax = 1; lock xadd [rdx], rax; r8 = rax
+//     rdx = &records[r8 & mask]; [rdx] = 0            unpublish the slot while it's rewritten
+//     store site, memLen, tsc, registers, rep movsb the memory
+//     [rdx] = r8 + 1                        publish
+//     pop r8, rdi, rsi, rdx, rcx, rax; popfq; lea rsp, [rsp + 128]
+//     <relocated original instructions>
+//     jmp back
+struct TrampolineBuilder {
+public:
+    // Stack slots of the saved registers relative to rsp after the pushes.
+    static constexpr uint8_t SLOT_R8 = 0, SLOT_RDI = 8, SLOT_RSI = 16, SLOT_RDX = 24, SLOT_RCX = 32, SLOT_RAX = 40;
+    static constexpr int32_t FRAME_SIZE = 128 + 7 * 8;
+
+    std::vector<uint8_t> code;
+
+    // The 16 general purpose registers and rip.
+    static bool CanRecord(Reg r) { return r == Reg::RIP || Encoding(r) >= 0; }
+
+    void Build(uint64_t ring, uint32_t site, uint64_t siteAddr, const FastTraceSpec& spec) {
+        Emit({ 0x48, 0x8D, 0x64, 0x24, 0x80 });                   // lea rsp, [rsp - 128]
+        Emit({ 0x9C, 0x50, 0x51, 0x52, 0x56, 0x57, 0x41, 0x50 }); // pushfq; push rax..rdi; push r8
+        Emit({ 0xFC });                                           // cld
+        Emit({ 0x0F, 0x31, 0x48, 0xC1, 0xE2, 0x20, 0x48, 0x09, 0xD0, 0x48, 0x89, 0xC7 }); // rdtsc; shl rdx,32; or rax,rdx; mov rdi,rax
+        Emit({ 0x48, 0xBA });                                     // movabs rdx, ring
+        Emit64(ring);
+        Emit({ 0xB8, 0x01, 0x00, 0x00, 0x00 });                   // mov eax, 1
+        Emit({ 0xF0, 0x48, 0x0F, 0xC1, 0x02 });                   // lock xadd [rdx], rax
+        Emit({ 0x49, 0x89, 0xC0 });                               // mov r8, rax
+        Emit({ 0x48, 0x25 });                                     // and rax, mask
+        Emit32(uint32_t(TRACE_RING_RECORDS - 1));
+        Emit({ 0x48, 0xC1, 0xE0, 0x07 });                         // shl rax, 7
+        Emit({ 0x48, 0x8D, 0x94, 0x02 });                         // lea rdx, [rdx + rax + header]
+        Emit32(uint32_t(sizeof(TraceRingHeader)));
+        Emit({ 0x48, 0xC7, 0x02, 0x00, 0x00, 0x00, 0x00 });       // mov qword [rdx], 0
+        Emit({ 0xC7, 0x42, uint8_t(offsetof(TraceRecord, site)) }); // mov dword [rdx + site], imm32
+        Emit32(site);
+        Emit({ 0xC7, 0x42, uint8_t(offsetof(TraceRecord, memLen)) });
+        Emit32(spec.memLen);
+        Emit({ 0x48, 0x89, 0x7A, uint8_t(offsetof(TraceRecord, tsc)) }); // mov [rdx + tsc], rdi
+
+        for (size_t i = 0; i < spec.regs.size(); i++) {
+            uint8_t disp = uint8_t(offsetof(TraceRecord, regs) + i * 8);
+            Reg r = spec.regs[i];
+            int enc = Encoding(r);
+            if (enc < 0 || IsSaved(r)) {
+                LoadRegister(0, r, siteAddr);                     // rax = value
+                Emit({ 0x48, 0x89, 0x42, disp });                 // mov [rdx + disp], rax
+            }
+            else {
+                // Untouched register, store it directly: mov [rdx + disp], reg
+                Emit({ uint8_t(0x48 | (enc >= 8 ? 0x04 : 0)), 0x89, uint8_t(0x42 | ((enc & 7) << 3)), disp });
+            }
+        }
+
+        if (spec.memLen) {
+            LoadRegister(6, spec.memBase, siteAddr);              // rsi = base
+            Emit({ 0x48, 0x81, 0xC6 });                           // add rsi, offset
+            Emit32(uint32_t(spec.memOffset));
+            Emit({ 0x48, 0x8D, 0x7A, uint8_t(offsetof(TraceRecord, mem)) }); // lea rdi, [rdx + mem]
+            Emit({ 0xB9 });                                       // mov ecx, len
+            Emit32(spec.memLen);
+            Emit({ 0xF3, 0xA4 });                                 // rep movsb
+        }
+
+        Emit({ 0x49, 0x8D, 0x40, 0x01, 0x48, 0x89, 0x02 });       // lea rax, [r8 + 1]; mov [rdx], rax
+        Emit({ 0x41, 0x58, 0x5F, 0x5E, 0x5A, 0x59, 0x58, 0x9D }); // pop r8, rdi, rsi, rdx, rcx, rax; popfq
+        Emit({ 0x48, 0x8D, 0xA4, 0x24 });                         // lea rsp, [rsp + 128]
+        Emit32(128);
+    }
+
+    // Appends jmp rel32 from codeAddr + code.size() to target.
+    bool EmitJump(uint64_t codeAddr, uint64_t target) {
+        int64_t rel = int64_t(target - (codeAddr + code.size() + 5));
+        if (rel < INT32_MIN || rel > INT32_MAX) return false;
+        Emit({ 0xE9 });
+        Emit32(uint32_t(int32_t(rel)));
+        return true;
+    }
+
+private:
+    // x86 register number, -1 for rip.
+    static int Encoding(Reg r) {
+        switch (r) {
+            case Reg::RAX: return 0;  case Reg::RCX: return 1;  case Reg::RDX: return 2;  case Reg::RBX: return 3;
+            case Reg::RSP: return 4;  case Reg::RBP: return 5;  case Reg::RSI: return 6;  case Reg::RDI: return 7;
+            case Reg::R8:  return 8;  case Reg::R9:  return 9;  case Reg::R10: return 10; case Reg::R11: return 11;
+            case Reg::R12: return 12; case Reg::R13: return 13; case Reg::R14: return 14; case Reg::R15: return 15;
+            default:       return -1;
+        }
+    }
+
+    static bool IsSaved(Reg r) {
+        return r == Reg::RAX || r == Reg::RCX || r == Reg::RDX || r == Reg::RSI || r == Reg::RDI || r == Reg::R8 ||
+               r == Reg::RSP;
+    }
+
+    static uint8_t SlotOf(Reg r) {
+        switch (r) {
+            case Reg::RAX: return SLOT_RAX; case Reg::RCX: return SLOT_RCX; case Reg::RDX: return SLOT_RDX;
+            case Reg::RSI: return SLOT_RSI; case Reg::RDI: return SLOT_RDI; default:       return SLOT_R8;
+        }
+    }
+
+    // Loads the tracee's value of r at the tracepoint into dst (rax = 0 or rsi = 6).
+    void LoadRegister(uint8_t dst, Reg r, uint64_t siteAddr) {
+        int enc = Encoding(r);
+        if (enc < 0) {
+            Emit({ 0x48, uint8_t(0xB8 | dst) });                  // movabs dst, rip
+            Emit64(siteAddr);
+        }
+        else if (r == Reg::RSP) {
+            Emit({ 0x48, 0x8D, uint8_t(0x84 | (dst << 3)), 0x24 }); // lea dst, [rsp + frame]
+            Emit32(uint32_t(FRAME_SIZE));
+        }
+        else if (IsSaved(r)) {
+            Emit({ 0x48, 0x8B, uint8_t(0x44 | (dst << 3)), 0x24, SlotOf(r) }); // mov dst, [rsp + slot]
+        }
+        else {
+            Emit({ uint8_t(0x48 | (enc >= 8 ? 0x04 : 0)), 0x89, uint8_t(0xC0 | ((enc & 7) << 3) | dst) }); // mov dst, reg
+        }
+    }
+
+    void Emit(std::initializer_list<uint8_t> bytes) { code.insert(code.end(), bytes); }
+    void Emit32(uint32_t v) { code.insert(code.end(), reinterpret_cast<uint8_t*>(&v), reinterpret_cast<uint8_t*>(&v) + 4); }
+    void Emit64(uint64_t v) { code.insert(code.end(), reinterpret_cast<uint8_t*>(&v), reinterpret_cast<uint8_t*>(&v) + 8); }
+};
+
+// Debugger side of the fast tracepoints: maps the ring the tracee writes to and drains it on a background thread, so
+// tracepoint hits never stop the tracee.
+struct TraceRingReader {
+public:
+    struct SiteStats {
+        uint64_t hits = 0;
+    };
+
+    TraceRingReader() : m_ring(nullptr), m_tail(0), m_drained(0), m_dropped(0), m_stop(false) {}
+    ~TraceRingReader() { Close(); }
+
+    TraceRingReader(const TraceRingReader&) = delete;
+    TraceRingReader& operator=(const TraceRingReader&) = delete;
+
+    bool Open(const std::string& path) {
+        int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        void* p = mmap(nullptr, TRACE_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            std::cerr << "Failed to map the trace ring: " << strerror(errno) << std::endl;
+            return false;
+        }
+        m_ring = reinterpret_cast<uint8_t*>(p);
+        m_thread = std::thread([this] { Drain(); });
+        return true;
+    }
+
+    void Close() {
+        if (!m_ring) return;
+        m_stop = true;
+        m_thread.join();
+        munmap(m_ring, TRACE_RING_SIZE);
+        m_ring = nullptr;
+    }
+
+    bool IsOpen() const { return m_ring != nullptr; }
+
+    // Copies the most recent records (up to max) and the per site hit counts.
+    void Snapshot(std::vector<TraceRecord>& recent, size_t max, std::vector<SiteStats>& sites, uint64_t& drained,
+                  uint64_t& dropped) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t n = std::min(max, m_recent.size());
+        recent.assign(m_recent.end() - std::ptrdiff_t(n), m_recent.end());
+        sites = m_sites;
+        drained = m_drained;
+        dropped = m_dropped;
+    }
+
+private:
+    static constexpr size_t KEEP_RECENT = 4096;
+
+    const TraceRecord& RecordAt(uint64_t index) const {
+        return reinterpret_cast<const TraceRecord*>(m_ring + sizeof(TraceRingHeader))[index & (TRACE_RING_RECORDS - 1)];
+    }
+
+    void Drain() {
+        while (!m_stop) {
+            size_t batch = 0;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                while (batch < TRACE_RING_RECORDS) {
+                    const TraceRecord& r = RecordAt(m_tail);
+                    uint64_t seq = __atomic_load_n(&r.seq, __ATOMIC_ACQUIRE);
+                    if (seq <= m_tail) break; // not published yet, or being rewritten (0)
+                    if (seq > m_tail + 1) {
+                        // Overwritten by a writer that lapped us, skip to the oldest record that can still be intact.
+                        uint64_t head = __atomic_load_n(&reinterpret_cast<TraceRingHeader*>(m_ring)->head, __ATOMIC_ACQUIRE);
+                        uint64_t oldest = head > TRACE_RING_RECORDS ? head - TRACE_RING_RECORDS : 0;
+                        m_dropped += std::max(oldest, m_tail + 1) - m_tail;
+                        m_tail = std::max(oldest, m_tail + 1);
+                        continue;
+                    }
+                    TraceRecord copy = r;
+                    __atomic_thread_fence(__ATOMIC_ACQUIRE); // the copy completes before seq is checked again
+                    if (__atomic_load_n(&r.seq, __ATOMIC_RELAXED) != seq) continue; // rewritten while copying
+                    if (copy.site >= m_sites.size()) m_sites.resize(copy.site + 1);
+                    m_sites[copy.site].hits++;
+                    if (m_recent.size() == KEEP_RECENT) m_recent.pop_front();
+                    m_recent.push_back(copy);
+                    m_tail++;
+                    m_drained++;
+                    batch++;
+                }
+            }
+            if (batch == 0) std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+    }
+
+    uint8_t* m_ring;
+    uint64_t m_tail;
+    uint64_t m_drained;
+    uint64_t m_dropped;
+    std::atomic<bool> m_stop;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::deque<TraceRecord> m_recent;
+    std::vector<SiteStats> m_sites;
+};
+
+constexpr size_t TRACE_FILE_MAX_SITES = 64;
+constexpr size_t TRACE_MAX_MEM_RANGES = 4;
+constexpr uint32_t TRACE_FILE_DEFAULT_RECORDS = 256 * 1024;
+
+// Trace file written by the tracepoints that stop the tracee: this header, then a ring of TraceRecords (the layout the
+// fast tracepoints use, tsc is read by the debugger at the stop). The file is mmap'd, records are plain stores and
+// the kernel writes them back, a crash of the debugger loses nothing but the header's tsc rate.
+struct TraceFileHeader {
+    char magic[8];         // "DBGTRC1"
+    uint32_t siteCount;
+    uint32_t recordCount;  // ring capacity, a power of two
+    uint64_t head;         // records written so far, the ring holds the last recordCount of them
+    uint64_t tscPerSec;    // 0 if unknown
+    struct Site {
+        uint64_t addr;
+        char name[64];
+        uint8_t regs[TRACE_MAX_REGS]; // Reg values
+        uint8_t regCount;
+        uint8_t memCount;
+        struct { uint8_t base; int32_t offset; uint32_t len; } mem[TRACE_MAX_MEM_RANGES];
+    } sites[TRACE_FILE_MAX_SITES];
+};
+static_assert(size_t(Reg::COUNT) <= 256, "sites store registers in a byte");
+
+// What a tracepoint records: registers, then memory ranges at register + offset packed into the record's mem area.
+struct TraceSpec {
+    struct MemRange {
+        Reg base;
+        int32_t offset;
+        uint32_t len;
+    };
+    std::vector<Reg> regs;
+    std::vector<MemRange> mem;
+};
+
+// Writer side of the trace file.
+struct TraceFile {
+public:
+    TraceFile() : m_header(nullptr), m_size(0) {}
+    ~TraceFile() { Close(); }
+
+    TraceFile(const TraceFile&) = delete;
+    TraceFile& operator=(const TraceFile&) = delete;
+
+    bool Open(const std::string& path, uint32_t records) {
+        Close();
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        size_t size = sizeof(TraceFileHeader) + size_t(records) * sizeof(TraceRecord);
+        void* p = ftruncate(fd, off_t(size)) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                                                  : MAP_FAILED;
+        close(fd);
+        if (p == MAP_FAILED) {
+            std::cerr << "Failed to map " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        m_header = reinterpret_cast<TraceFileHeader*>(p);
+        m_size = size;
+        m_path = path;
+        std::memcpy(m_header->magic, "DBGTRC1", 8);
+        m_header->recordCount = records;
+        m_startTsc = __rdtsc();
+        m_start = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    void Close() {
+        if (!m_header) return;
+        Calibrate();
+        munmap(m_header, m_size);
+        m_header = nullptr;
+    }
+
+    bool IsOpen() const { return m_header != nullptr; }
+    const std::string& Path() const { return m_path; }
+    uint64_t Written() const { return m_header ? m_header->head : 0; }
+
+    // Returns the site index or -1 when the file has no room left.
+    int AddSite(uint64_t addr, const std::string& name, const TraceSpec& spec) {
+        if (m_header->siteCount == TRACE_FILE_MAX_SITES) return -1;
+        TraceFileHeader::Site& s = m_header->sites[m_header->siteCount];
+        s.addr = addr;
+        std::strncpy(s.name, name.c_str(), sizeof(s.name) - 1);
+        s.regCount = uint8_t(spec.regs.size());
+        for (size_t i = 0; i < spec.regs.size(); i++) s.regs[i] = uint8_t(spec.regs[i]);
+        s.memCount = uint8_t(spec.mem.size());
+        for (size_t i = 0; i < spec.mem.size(); i++) {
+            s.mem[i] = { uint8_t(spec.mem[i].base), spec.mem[i].offset, spec.mem[i].len };
+        }
+        return int(m_header->siteCount++);
+    }
+
+    // Claims the next record, the oldest one is overwritten once the ring is full. Publish it with Commit.
+    TraceRecord& Next() {
+        TraceRecord* records = reinterpret_cast<TraceRecord*>(m_header + 1);
+        return records[m_header->head & (m_header->recordCount - 1)];
+    }
+
+    void Commit(TraceRecord& r) { r.seq = ++m_header->head; }
+
+    // Stores the tsc rate measured since Open, the converter turns timestamps into microseconds with it.
+    void Calibrate() {
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+        if (secs > 0.01) m_header->tscPerSec = uint64_t(double(__rdtsc() - m_startTsc) / secs);
+    }
+
+private:
+    TraceFileHeader* m_header;
+    size_t m_size;
+    std::string m_path;
+    uint64_t m_startTsc = 0;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// Offline converter: writes the records of a trace file oldest first, as text or as CSV with one column per register
+// and the memory in hex.
+bool ConvertTraceFile(const std::string& path, bool csv, std::ostream& out) {
+    MappedFile file;
+    if (!file.Open(path)) {
+        std::cout << "can't open " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    const TraceFileHeader* h = reinterpret_cast<const TraceFileHeader*>(file.Data());
+    if (file.Size() < sizeof(TraceFileHeader) || std::memcmp(h->magic, "DBGTRC1", 8) != 0 ||
+        h->siteCount > TRACE_FILE_MAX_SITES || h->recordCount == 0 || (h->recordCount & (h->recordCount - 1)) ||
+        file.Size() < sizeof(TraceFileHeader) + size_t(h->recordCount) * sizeof(TraceRecord)) {
+        std::cout << path << " is not a trace file" << std::endl;
+        return false;
+    }
+    const TraceRecord* records = reinterpret_cast<const TraceRecord*>(h + 1);
+    uint64_t first = h->head > h->recordCount ? h->head - h->recordCount : 0;
+    uint64_t startTsc = h->head ? records[first & (h->recordCount - 1)].tsc : 0;
+
+    if (csv) {
+        out << "seq,time_us,site,addr,name";
+        for (size_t i = 0; i < TRACE_MAX_REGS; i++) out << ",reg" << i << ",value" << i;
+        out << ",mem\n";
+    }
+    char hex[2 * TRACE_MAX_MEM + 1];
+    for (uint64_t seq = first; seq < h->head; seq++) {
+        const TraceRecord& r = records[seq & (h->recordCount - 1)];
+        if (r.seq != seq + 1 || r.site >= h->siteCount) continue; // torn by a crash while writing
+        const TraceFileHeader::Site& s = h->sites[r.site];
+        double us = h->tscPerSec ? double(r.tsc - startTsc) * 1e6 / double(h->tscPerSec) : double(r.tsc - startTsc);
+        size_t memLen = std::min<size_t>(r.memLen, TRACE_MAX_MEM);
+        for (size_t i = 0; i < memLen; i++) std::snprintf(hex + 2 * i, 3, "%02x", r.mem[i]);
+        hex[2 * memLen] = '\0';
+
+        out << std::dec << r.seq << (csv ? ',' : ' ') << std::fixed << std::setprecision(3) << us
+            << (csv ? "," : (h->tscPerSec ? "us " : "tsc ")) << r.site << (csv ? ",0x" : " 0x") << std::hex
+            << s.addr << (csv ? ',' : ' ') << std::string_view(s.name, strnlen(s.name, sizeof(s.name)));
+        for (size_t i = 0; i < TRACE_MAX_REGS; i++) {
+            if (i >= s.regCount) {
+                if (csv) out << ",,";
+                continue;
+            }
+            std::string_view name = s.regs[i] < size_t(Reg::COUNT) ? GetRegDesc(Reg(s.regs[i])).name : "?";
+            if (csv) out << ',' << name << ",0x" << r.regs[i];
+            else out << ' ' << name << "=0x" << r.regs[i];
+        }
+        if (csv) out << ',' << hex;
+        else if (memLen) out << " mem=" << hex;
+        out << '\n';
+    }
+    out << std::dec;
+    return bool(out);
+}
+
+// Byte pattern with a per-byte mask: data matches when (data[i] & mask[i]) == (bytes[i] & mask[i]). The search
+// kernels first filter candidates on two anchor bytes that are fully masked in, then verify the whole pattern.
+struct SearchPattern {
+    std::vector<uint8_t> bytes;
+    std::vector<uint8_t> mask;
+    size_t firstAnchor = 0;
+    size_t lastAnchor = 0;
+    bool hasAnchor = false;
+
+    size_t Size() const { return bytes.size(); }
+
+    void Prepare() {
+        if (mask.size() != bytes.size()) mask.assign(bytes.size(), 0xFF);
+        for (size_t i = 0; i < bytes.size(); i++) bytes[i] &= mask[i];
+        hasAnchor = false;
+        for (size_t i = 0; i < mask.size(); i++) {
+            if (mask[i] != 0xFF) continue;
+            if (!hasAnchor) firstAnchor = i;
+            lastAnchor = i;
+            hasAnchor = true;
+        }
+    }
+
+    bool MatchesAt(const uint8_t* p) const {
+        for (size_t i = 0; i < bytes.size(); i++) {
+            if ((p[i] & mask[i]) != bytes[i]) return false;
+        }
+        return true;
+    }
+};
+
+// Counts every match and keeps the addresses of the first `limit` ones, so patterns that match everywhere don't
+// exhaust memory.
+struct SearchResults {
+    std::vector<uint64_t> addrs;
+    size_t count = 0;
+    size_t limit = 0;
+
+    void Add(uint64_t addr) {
+        if (count++ < limit) addrs.push_back(addr);
+    }
+};
+
+// Records base+offset for every match that starts in [0, searchLen). data must hold dataLen bytes, matches are only
+// reported when the whole pattern fits in it.
+void SearchBufferScalar(const uint8_t* data, size_t dataLen, size_t searchLen, const SearchPattern& p,
+                        uint64_t base, SearchResults& out) {
+    if (dataLen < p.Size()) return;
+    size_t end = std::min(searchLen, dataLen - p.Size() + 1);
+    for (size_t i = 0; i < end; i++) {
+        if (p.hasAnchor) {
+            const void* hit = memchr(data + i + p.firstAnchor, p.bytes[p.firstAnchor], end - i);
+            if (!hit) break;
+            i = size_t(reinterpret_cast<const uint8_t*>(hit) - data) - p.firstAnchor;
+        }
+        if (p.MatchesAt(data + i)) out.Add(base + i);
+    }
+}
+
+__attribute__((target("avx2")))
+void SearchBufferAVX2(const uint8_t* data, size_t dataLen, size_t searchLen, const SearchPattern& p,
+                      uint64_t base, SearchResults& out) {
+    if (dataLen < p.Size()) return;
+    size_t end = std::min(searchLen, dataLen - p.Size() + 1);
+    const __m256i first = _mm256_set1_epi8(char(p.bytes[p.firstAnchor]));
+    const __m256i last = _mm256_set1_epi8(char(p.bytes[p.lastAnchor]));
+
+    size_t i = 0;
+    for (; i + 32 <= end; i += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + p.firstAnchor));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + p.lastAnchor));
+        uint32_t candidates = uint32_t(_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last))));
+        while (candidates) {
+            size_t off = i + size_t(__builtin_ctz(candidates));
+            if (p.MatchesAt(data + off)) out.Add(base + off);
+            candidates &= candidates - 1;
+        }
+    }
+    SearchBufferScalar(data + i, dataLen - i, end - i, p, base + i, out);
+}
+
+void SearchBuffer(const uint8_t* data, size_t dataLen, size_t searchLen, const SearchPattern& p,
+                  uint64_t base, SearchResults& out) {
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+    if (hasAVX2 && p.hasAnchor) SearchBufferAVX2(data, dataLen, searchLen, p, base, out);
+    else SearchBufferScalar(data, dataLen, searchLen, p, base, out);
+}
+
+// Parses "<bytes|string|u8|u16|u32|u64> <value> [mask <hex>]" into a pattern. Integers are little-endian.
+bool ParseSearchPattern(const std::vector<std::string_view>& args, size_t first, SearchPattern& out) {
+    if (args.size() < first + 2) return false;
+    std::string_view kind = args[first];
+    std::string_view value = args[first + 1];
+    out = {};
+
+    if (kind == "bytes") {
+        // Written in memory order, unlike ParseHexBytes which produces a little-endian number.
+        if (value.size() >= 2 && value[0] == '0' && value[1] == 'x') value.remove_prefix(2);
+        if (value.empty() || value.size() % 2 != 0) return false;
+        for (size_t i = 0; i < value.size(); i += 2) {
+            out.bytes.push_back(uint8_t(std::stoul(std::string(value.substr(i, 2)), nullptr, 16)));
+        }
+    }
+    else if (kind == "string") {
+        out.bytes.assign(value.begin(), value.end());
+    }
+    else if (kind == "u8" || kind == "u16" || kind == "u32" || kind == "u64") {
+        size_t width = std::stoul(std::string(kind.substr(1))) / 8;
+        uint64_t v = std::stoull(std::string(value), nullptr, 0);
+        out.bytes.resize(width);
+        std::memcpy(out.bytes.data(), &v, width);
+    }
+    else {
+        return false;
+    }
+
+    if (args.size() >= first + 4 && args[first + 2] == "mask") {
+        std::string_view m = args[first + 3];
+        if (m.size() >= 2 && m[0] == '0' && m[1] == 'x') m.remove_prefix(2);
+        if (m.size() != out.bytes.size() * 2) return false;
+        for (size_t i = 0; i < m.size(); i += 2) {
+            out.mask.push_back(uint8_t(std::stoul(std::string(m.substr(i, 2)), nullptr, 16)));
+        }
+    }
+
+    out.Prepare();
+    return !out.bytes.empty();
+}
+
+// Splits what arrives on a non-blocking read into lines, for piped input and control connections.
+struct LineBuffer {
+public:
+    static constexpr size_t MAX_LINE = 64 * 1024;
+
+    // Reads what is available. Returns false at end of input, the remaining text is still handed out as a line.
+    // A line longer than MAX_LINE ends the input without it.
+    bool Fill(int fd) {
+        char chunk[4096];
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return true;
+        if (n <= 0) {
+            m_eof = true;
+            return false;
+        }
+        m_data.append(chunk, size_t(n));
+        size_t last = m_data.rfind('\n');
+        size_t tail = last == std::string::npos || last < m_pos ? m_data.size() - m_pos : m_data.size() - last - 1;
+        if (tail > MAX_LINE) {
+            m_data.resize(last == std::string::npos || last < m_pos ? m_pos : last + 1);
+            m_eof = m_overflowed = true;
+            return false;
+        }
+        return true;
+    }
+
+    bool Overflowed() const { return m_overflowed; }
+
+    bool Next(std::string& line) {
+        size_t end = m_data.find('\n', m_pos);
+        if (end == std::string::npos) {
+            if (!m_eof || m_pos == m_data.size()) {
+                m_data.erase(0, m_pos);
+                m_pos = 0;
+                return false;
+            }
+            end = m_data.size();
+        }
+        line.assign(m_data, m_pos, end - m_pos);
+        m_pos = std::min(end + 1, m_data.size());
+        return true;
+    }
+
+private:
+    std::string m_data;
+    size_t m_pos = 0;
+    bool m_eof = false;
+    bool m_overflowed = false;
+};
+
+// Everything the debugger waits for goes through epoll. SIGCHLD is blocked and read from a signalfd, each tracee
+// process also has a pidfd that becomes readable when it is gone. Those two are in an inner set that is a member of the
+// outer one next to the terminal and the control sockets: a running command only waits on the inner set, the prompt
+// on the outer one, so a tracee stop, a keypress and a control request all wake the same epoll_wait.
+struct EventLoop {
+public:
+    enum class Source : uint32_t { Tracee, Signal, Process, Terminal, ControlListener, ControlClient };
+    struct Event {
+        Source source;
+        int fd;
+    };
+
+    EventLoop() = default;
+    ~EventLoop() { Close(); }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Blocked signals survive fork and exec, so this runs after the tracee was started.
+    bool Open() {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        if (sigprocmask(SIG_BLOCK, &mask, nullptr) < 0) return false;
+        m_signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        m_outer = epoll_create1(EPOLL_CLOEXEC);
+        m_inner = epoll_create1(EPOLL_CLOEXEC);
+        if (m_signalFd < 0 || m_outer < 0 || m_inner < 0) return false;
+        return Add(m_inner, m_signalFd, Source::Signal) && Add(m_outer, m_inner, Source::Tracee);
+    }
+
+    void Close() {
+        for (int fd : { m_signalFd, m_inner, m_outer }) {
+            if (fd >= 0) close(fd);
+        }
+        for (auto& [fd, pid] : m_processes) close(fd);
+        m_processes.clear();
+        for (auto& [fd, path] : m_listeners) {
+            close(fd);
+            unlink(path.c_str());
+        }
+        m_listeners.clear();
+        m_signalFd = m_inner = m_outer = -1;
+    }
+
+    bool WatchProcess(pid_t pid) {
+        int fd = int(syscall(SYS_pidfd_open, pid, 0));
+        if (fd < 0) return false;
+        if (!Add(m_inner, fd, Source::Process)) {
+            close(fd);
+            return false;
+        }
+        m_processes[fd] = pid;
+        return true;
+    }
+
+    // A pidfd stays readable once its process is gone, it is dropped after the first report.
+    void UnwatchProcess(int fd) {
+        epoll_ctl(m_inner, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        m_processes.erase(fd);
+    }
+
+    // Listens for control connections on a unix socket at path, Close removes it. A socket file left over from an
+    // earlier run is replaced, one that still has a server behind it is not.
+    bool AddListener(const std::string& path) {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        std::memcpy(addr.sun_path, path.c_str(), path.size());
+        const sockaddr* sa = reinterpret_cast<const sockaddr*>(&addr);
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+            int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            bool served = probe >= 0 && connect(probe, sa, sizeof(addr)) == 0;
+            if (probe >= 0) close(probe);
+            if (served) {
+                errno = EADDRINUSE;
+                return false;
+            }
+            unlink(path.c_str());
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return false;
+        if (bind(fd, sa, sizeof(addr)) < 0) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return false;
+        }
+        if (listen(fd, 8) < 0 || !Add(m_outer, fd, Source::ControlListener)) {
+            int err = errno;
+            close(fd);
+            unlink(path.c_str());
+            errno = err;
+            return false;
+        }
+        m_listeners.push_back({ fd, path });
+        return true;
+    }
+
+    // Regular files and /dev/null can't be added to epoll, like poll they count as always readable.
+    bool AddInput(int fd, Source source) {
+        if (Add(m_outer, fd, source)) return true;
+        if (errno != EPERM) return false;
+        m_alwaysReady.push_back({ source, fd });
+        return true;
+    }
+
+    void RemoveInput(int fd) {
+        epoll_ctl(m_outer, EPOLL_CTL_DEL, fd, nullptr);
+        m_alwaysReady.erase(std::remove_if(m_alwaysReady.begin(), m_alwaysReady.end(),
+                                           [fd](const Event& ev) { return ev.fd == fd; }),
+                            m_alwaysReady.end());
+    }
+
+    // Consumes the queued SIGCHLDs. They only say that some wait status is ready, waitpid finds out which.
+    void DrainSignals() {
+        signalfd_siginfo info[16];
+        while (read(m_signalFd, info, sizeof(info)) == ssize_t(sizeof(info))) {}
+    }
+
+    // Waits for the next events, of the tracees only or of every source when prompt is set. Returns false on error.
+    bool Wait(bool prompt, std::vector<Event>& out) {
+        epoll_event events[32];
+        bool ready = prompt && !m_alwaysReady.empty();
+        int n = epoll_wait(prompt ? m_outer : m_inner, events, 32, ready ? 0 : -1);
+        if (n < 0) return errno == EINTR;
+        if (ready) out.insert(out.end(), m_alwaysReady.begin(), m_alwaysReady.end());
+        for (int i = 0; i < n; i++) {
+            Source source = Source(events[i].data.u64 >> 32);
+            if (source != Source::Tracee) {
+                out.push_back({ source, int(uint32_t(events[i].data.u64)) });
+                continue;
+            }
+            epoll_event inner[32];
+            int m = epoll_wait(m_inner, inner, 32, 0);
+            for (int j = 0; j < m; j++) {
+                out.push_back({ Source(inner[j].data.u64 >> 32), int(uint32_t(inner[j].data.u64)) });
+            }
+        }
+        return true;
+    }
+
+private:
+    bool Add(int epoll, int fd, Source source) {
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = (uint64_t(source) << 32) | uint32_t(fd);
+        return epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+
+    int m_signalFd = -1;
+    int m_inner = -1;
+    int m_outer = -1;
+    std::map<int, pid_t> m_processes; // pidfd -> pid
+    std::vector<Event> m_alwaysReady;
+    std::vector<std::pair<int, std::string>> m_listeners;
+};
+
+struct Debugger {
+
+    Debugger(std::string_view progName, pid_t pid)
+        : m_progName(progName), m_pid(pid), m_tid(pid), m_cache(m_memory), m_patcher(m_memory) {}
+
+    // Post-mortem debugging of a core file. The first thread in the core takes the place of the tracee.
+    Debugger(std::string_view progName, std::unique_ptr<CoreFile> core)
+        : m_progName(progName), m_pid(0), m_tid(0), m_cache(m_memory), m_patcher(m_memory), m_core(std::move(core)) {}
+
+    int Run() {
+        if (m_core) {
+            OpenCore();
+        }
+        else {
+            if (int ret = Attach(); ret < 0) {
+                return ret;
+            }
+
+            // /proc/pid/mem is bound to the address space at open time, so it can only be opened after the exec stop.
+            m_memory.Open(m_pid);
+        }
+
+        if (!m_events.Open() || (!m_core && !m_events.WatchProcess(m_pid)) ||
+            !m_events.AddInput(STDIN_FILENO, EventLoop::Source::Terminal)) {
+            std::cerr << "Failed to set up the event loop: " << strerror(errno) << std::endl;
+            return -5;
+        }
+        m_tty = isatty(STDIN_FILENO) &&
+                linenoiseEditStart(&m_lineState, -1, -1, m_lineBuf, sizeof(m_lineBuf), "dbg> ") == 0;
+        while (true) {
+            int ret = PollEvents(true);
+            if (ret) return ret < 0 ? ret : 0;
+        }
+    }
+
+    // One round of the event loop. Tracee events only collect wait statuses, except that stops of running threads at
+    // the prompt (non-stop) are decoded and reported right away. Input runs commands, which is only waited for at the
+    // prompt. Returns 1 at the end of the terminal input.
+    int PollEvents(bool prompt) {
+        std::vector<EventLoop::Event> events;
+        if (!m_events.Wait(prompt, events)) {
+            std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+            return -5;
+        }
+        bool traceeEvent = false;
+        for (const EventLoop::Event& ev : events) {
+            switch (ev.source) {
+            case EventLoop::Source::Signal:
+                m_events.DrainSignals();
+                traceeEvent = true;
+                break;
+            case EventLoop::Source::Process:
+                m_events.UnwatchProcess(ev.fd);
+                traceeEvent = true;
+                break;
+            case EventLoop::Source::Terminal:
+                if (int ret = OnTerminalInput(); ret) return ret;
+                break;
+            case EventLoop::Source::ControlListener:
+                AcceptControlClient(ev.fd);
+                break;
+            case EventLoop::Source::ControlClient:
+                if (int ret = OnControlInput(ev.fd); ret < 0) return ret;
+                break;
+            default:
+                break;
+            }
+        }
+        if (traceeEvent) CollectStatus();
+        if (!prompt || !m_nonStop || m_queuedStatus.empty()) return 0;
+        if (m_tty) linenoiseHide(&m_lineState);
+        int ret = 0;
+        // One stop is reported per pass. Whatever is left has no SIGCHLD pending any more and would wait for the next.
+        for (size_t left = 0; ret >= 0 && !m_queuedStatus.empty() && left != m_queuedStatus.size();) {
+            left = m_queuedStatus.size();
+            ret = ContinueExecution(false, false);
+        }
+        if (m_tty) linenoiseShow(&m_lineState);
+        return ret < 0 ? ret : 0;
+    }
+
+    int RunCommand(const std::string& line) {
+        int ret = 0;
+        try {
+            ret = HandleCmd(line);
+        }
+        catch (const std::logic_error&) {
+            // std::stoul and friends on an argument that isn't a number, bad input must not end the session.
+            std::cout << "invalid argument" << std::endl;
+        }
+        if (ret >= 0) linenoiseHistoryAdd(line.c_str());
+        return ret;
+    }
+
+    int OnTerminalInput() {
+        if (m_tty) {
+            char* line = linenoiseEditFeed(&m_lineState);
+            if (line == linenoiseEditMore) return 0;
+            linenoiseEditStop(&m_lineState);
+            if (!line) return 1;
+            int ret = RunCommand(line);
+            linenoiseFree(line);
+            if (ret < 0) return ret;
+            linenoiseEditStart(&m_lineState, -1, -1, m_lineBuf, sizeof(m_lineBuf), "dbg> ");
+            return 0;
+        }
+        bool open = m_stdinLines.Fill(STDIN_FILENO);
+        std::string line;
+        while (m_stdinLines.Next(line)) {
+            if (int ret = RunCommand(line); ret < 0) return ret;
+        }
+        if (m_stdinLines.Overflowed()) std::cerr << "input line too long" << std::endl;
+        return open ? 0 : 1;
+    }
+
+    // Commands from a unix socket run like typed ones. Their output goes back over the socket, followed by the prompt
+    // so a client knows where it ends.
+    bool ListenControl(const std::string& path) {
+        if (!m_events.AddListener(path)) {
+            std::cout << "can't listen on " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        std::cout << "listening on " << path << std::endl;
+        return true;
+    }
+
+    void AcceptControlClient(int listener) {
+        int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) return;
+        if (!m_events.AddInput(fd, EventLoop::Source::ControlClient)) {
+            close(fd);
+            return;
+        }
+        m_controlClients[fd];
+        SendControl(fd, "dbg> ");
+    }
+
+    int OnControlInput(int fd) {
+        LineBuffer& in = m_controlClients[fd];
+        bool open = in.Fill(fd);
+        std::string line;
+        while (in.Next(line)) {
+            std::ostringstream out;
+            std::streambuf* cout = std::cout.rdbuf(out.rdbuf());
+            std::streambuf* cerr = std::cerr.rdbuf(out.rdbuf());
+            int ret = RunCommand(line);
+            std::cout.rdbuf(cout);
+            std::cerr.rdbuf(cerr);
+            if (ret < 0) return ret;
+            if (!SendControl(fd, out.str() + "dbg> ")) open = false;
+        }
+        if (in.Overflowed()) SendControl(fd, "line too long\n");
+        if (!open) {
+            m_events.RemoveInput(fd);
+            close(fd);
+            m_controlClients.erase(fd);
+        }
+        return 0;
+    }
+
+    bool SendControl(int fd, const std::string& text) {
+        for (size_t done = 0; done < text.size();) {
+            ssize_t n = send(fd, text.data() + done, text.size() - done, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += size_t(n);
+        }
+        return true;
+    }
+
+    void SetBreakpointAtAddress(uintptr_t addr) {
+        SetBreakpointsAtAddresses(&addr, 1);
+    }
+
+    void SetBreakpointsAtAddresses(const uintptr_t* addrs, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            Breakpoint& bp = m_breakpoints.Get(m_breakpoints.Insert(addrs[i]));
+            bp.SetFlags(bp.GetFlags() & ~Breakpoint::COVERAGE);
+            if (bp.IsEnabled()) continue;
+            bp.Enable(m_patcher);
+        }
+        FlushCodePatches();
+    }
+
+    bool SetBreakpointEnabled(uintptr_t addr, bool enable) {
+        Breakpoint* bp = m_breakpoints.Lookup(addr);
+        if (!bp) return false;
+        if (bp->IsEnabled() != enable) {
+            if (enable) bp->Enable(m_patcher);
+            else bp->Disable(m_patcher);
+        }
+        return FlushCodePatches();
+    }
+
+    // Uses a debug register when one is free, otherwise falls back to an int3.
+    void SetHardwareBreakpoint(uintptr_t addr) {
+        if (m_debugRegs.Find(addr, HwBreakType::Execute) >= 0) return;
+        int slot = m_debugRegs.Allocate(addr, HwBreakType::Execute, 1);
+        if (slot >= 0 && ApplyDebugRegisters()) return;
+        if (slot >= 0) m_debugRegs.Release(slot);
+        std::cout << "no free debug register, using a software breakpoint" << std::endl;
+        SetBreakpointAtAddress(addr);
+    }
+
+    bool SetWatchpoint(uintptr_t addr, uint8_t len, HwBreakType type) {
+        int slot = m_debugRegs.Allocate(addr, type, len);
+        if (slot < 0) {
+            std::cout << "no free debug register or unaligned range" << std::endl;
+            return false;
+        }
+        if (!ApplyDebugRegisters()) {
+            m_debugRegs.Release(slot);
+            ApplyDebugRegisters();
+            return false;
+        }
+        return true;
+    }
+
+    bool SetCondition(uintptr_t addr, std::string_view text) {
+        Breakpoint* bp = m_breakpoints.Lookup(addr);
+        if (!bp) {
+            std::cout << "no breakpoint at 0x" << std::hex << addr << std::dec << std::endl;
+            return false;
+        }
+        if (text.empty()) {
+            ClearCondition(*bp);
+            return true;
+        }
+        std::unique_ptr<Condition> cond = CompileCondition(text);
+        if (!cond) return false;
+        AttachCondition(*bp, std::move(cond));
+        return true;
+    }
+
+    std::unique_ptr<Condition> CompileCondition(std::string_view text) {
+        auto cond = std::make_unique<Condition>();
+        if (std::string err = cond->Compile(text, Symbols()); !err.empty()) {
+            std::cout << "invalid condition: " << err << std::endl;
+            return nullptr;
+        }
+        return cond;
+    }
+
+    // Replaces the condition of bp. The slots of cleared conditions are reused.
+    void AttachCondition(Breakpoint& bp, std::unique_ptr<Condition> cond) {
+        ClearCondition(bp);
+        size_t slot = m_conditions.size();
+        if (m_freeConditions.empty()) {
+            m_conditions.push_back(std::move(cond));
+        }
+        else {
+            slot = m_freeConditions.back();
+            m_freeConditions.pop_back();
+            m_conditions[slot] = std::move(cond);
+        }
+        bp.SetFlags(bp.GetFlags() | Breakpoint::CONDITIONAL);
+        bp.SetUserData(slot);
+    }
+
+    void ClearCondition(Breakpoint& bp) {
+        if (!(bp.GetFlags() & Breakpoint::CONDITIONAL)) return;
+        m_conditions[bp.GetUserData()].reset();
+        m_freeConditions.push_back(bp.GetUserData());
+        bp.SetFlags(bp.GetFlags() & ~Breakpoint::CONDITIONAL);
+    }
+
+    // Evaluates the breakpoint's condition at the current stop. A condition that can't be evaluated (e.g. unreadable
+    // memory) stops as well.
+    bool ShouldStop(Breakpoint& bp) {
+        if (!(bp.GetFlags() & Breakpoint::CONDITIONAL)) return true;
+        const Condition& cond = *m_conditions[bp.GetUserData()];
+        int64_t value = 0;
+        auto read = [this](uint64_t addr, void* dst, size_t len) { return ReadMemory(addr, dst, len); };
+        if (!cond.Evaluate(Regs(), read, value)) {
+            std::cout << "failed to evaluate condition '" << cond.Text() << "'" << std::endl;
+            return true;
+        }
+        return value != 0;
+    }
+
+    bool RemoveBreakpoint(uintptr_t addr) {
+        bool removed = false;
+        for (size_t i = 0; i < DebugRegisters::SLOT_COUNT; i++) {
+            const DebugRegisters::Slot& s = m_debugRegs.Get(int(i));
+            if (s.used && s.addr == addr) {
+                m_debugRegs.Release(int(i));
+                removed = true;
+            }
+        }
+        if (removed) return ApplyDebugRegisters();
+        if (!SetBreakpointEnabled(addr, false)) return false;
+        ClearCondition(*m_breakpoints.Lookup(addr));
+        m_tracepoints.erase(addr);
+        m_displaced.erase(addr);
+        return m_breakpoints.Erase(addr);
+    }
+
+    void ListBreakpoints() {
+        for (size_t i = 0; i < DebugRegisters::SLOT_COUNT; i++) {
+            const DebugRegisters::Slot& s = m_debugRegs.Get(int(i));
+            if (!s.used) continue;
+            std::cout << "dr" << i << ' ' << std::left << std::setfill(' ') << std::setw(10) << HwBreakTypeName(s.type)
+                      << std::right << std::dec << std::setw(2) << int(s.len) << " bytes  " << std::setw(8) << s.hits
+                      << " hits  ";
+            PrintLocation(s.addr);
+        }
+        m_breakpoints.ForEachSorted([this](Breakpoint& bp) {
+            if (bp.GetFlags() & Breakpoint::COVERAGE) return;
+            std::cout << (bp.IsEnabled() ? "enabled   " : "disabled  ") << std::dec << std::setfill(' ') << std::setw(8)
+                      << bp.GetHits() << " hits  ";
+            PrintLocation(bp.GetAddr());
+            if (bp.GetFlags() & Breakpoint::CONDITIONAL) {
+                std::cout << "          if " << m_conditions[bp.GetUserData()]->Text() << std::endl;
+            }
+            if (bp.GetFlags() & Breakpoint::TRACEPOINT) std::cout << "          trace" << std::endl;
+        });
+    }
+
+    bool FlushCodePatches() {
+        size_t failed = m_patcher.Flush([this](uint64_t addr, const uint8_t* data, size_t len) {
+            m_cache.Update(addr, data, len);
+        }, [this](uint64_t addr) { OnBreakpointLifted(addr); });
+        return failed == 0;
+    }
+
+    // A thread that was running when the int3 at addr was removed may have executed it already, its SIGTRAP is
+    // recognized by the address until every such thread has stopped once.
+    void OnBreakpointLifted(uint64_t addr) {
+        if (!AnyRunning()) return;
+        auto [it, added] = m_liftedBreakpoints.try_emplace(addr, 0);
+        if (!added) m_liftOrder.erase(it->second);
+        it->second = ++m_liftSeq;
+        m_liftOrder[m_liftSeq] = addr;
+    }
+
+    void PruneLiftedBreakpoints() {
+        uint64_t seen = m_liftSeq;
+        for (const auto& [tid, t] : m_threads) {
+            if (t.state != ThreadState::Stopped) seen = std::min(seen, t.liftSeq);
+        }
+        while (!m_liftOrder.empty() && m_liftOrder.begin()->first <= seen) {
+            m_liftedBreakpoints.erase(m_liftOrder.begin()->second);
+            m_liftOrder.erase(m_liftOrder.begin());
+        }
+    }
+
+    void DumpRegisters() {
+        for (const auto& rd : g_RegisterDescriptors) {
+            if (!IsGeneralRegister(rd.r)) continue;
+            uint64_t regVal;
+            if (!Regs().Get(rd.r, regVal)) {
+                std::cout << "error getting register " << rd.name << std::endl;
+                continue;
+            }
+            std::cout << rd.name << " 0x" << std::setfill('0') << std::setw(16) << std::hex << regVal << std::endl;
+        }
+    }
+
+    uint64_t ReadMemory(uint64_t address) {
+        uint64_t value = 0;
+        m_cache.Read(address, &value, sizeof(value));
+        return value;
+    }
+
+    int WriteMemory(uint64_t address, uint64_t value) {
+        return WriteMemory(address, &value, sizeof(value)) ? 0 : -1;
+    }
+
+    // A core file is already mapped, caching it would only add a copy.
+    bool ReadMemory(uint64_t address, void* dst, size_t len) {
+        if (m_core) return m_memory.Read(address, dst, len) == len;
+        return m_cache.Read(address, dst, len) == len;
+    }
+
+    bool WriteMemory(uint64_t address, const void* src, size_t len) {
+        if (m_core) return false;
+        m_decodeCache.Invalidate(address, len);
+        InvalidateDisplaced(address, len);
+        return m_cache.Write(address, src, len) == len;
+    }
+
+    // Reads code as the program sees it: the bytes under software breakpoints and fast tracepoint jumps are replaced
+    // with the original ones. Returns the number of bytes read. Ranges larger than a page are read in one transfer
+    // past the page cache.
+    size_t ReadOriginalCode(uint64_t address, uint8_t* dst, size_t len) {
+        size_t n = m_core || len > DBG_PAGE_SIZE ? m_memory.Read(address, dst, len) : m_cache.Read(address, dst, len);
+        if (m_breakpoints.Size() < n) {
+            m_breakpoints.ForEach([&](const Breakpoint& bp) {
+                uint64_t a = bp.GetAddr();
+                if (bp.IsEnabled() && a >= address && a < address + n) dst[a - address] = bp.GetSavedByte();
+            });
+        }
+        else {
+            for (size_t i = 0; i < n; i++) {
+                const Breakpoint* bp = m_breakpoints.Lookup(address + i);
+                if (bp && bp->IsEnabled()) dst[i] = bp->GetSavedByte();
+            }
+        }
+        for (const FastTracepoint& ft : m_fastTraces) {
+            for (size_t i = 0; i < ft.original.size(); i++) {
+                uint64_t a = ft.addr + i;
+                if (a >= address && a < address + n) dst[a - address] = ft.original[i];
+            }
+        }
+        return n;
+    }
+
+    // The instruction at address, decoded once and then served from m_decodeCache. nullptr when it can't be read or
+    // decoded.
+    const X86DecodeCache::Entry* DecodeAt(uint64_t address) {
+        if (const X86DecodeCache::Entry* e = m_decodeCache.Find(address)) return e;
+        uint8_t code[X86DecodeCache::MAX_INSN];
+        size_t n = ReadOriginalCode(address, code, sizeof(code));
+        X86Insn insn;
+        if (n == 0 || !DecodeX86(code, n, insn)) return nullptr;
+        return m_decodeCache.Insert(address, insn, code);
+    }
+
+    void DumpDecodeCacheStats() {
+        const X86DecodeCache::Stats& st = m_decodeCache.GetStats();
+        uint64_t lookups = st.hits + st.misses;
+        std::cout << std::dec
+                  << "hits:          " << st.hits << '\n'
+                  << "misses:        " << st.misses << '\n'
+                  << "hit rate:      " << std::fixed << std::setprecision(1)
+                  << (lookups ? 100.0 * double(st.hits) / double(lookups) : 0) << "%\n"
+                  << "invalidations: " << st.invalidations << std::endl;
+    }
+
+    // Prints count instructions starting at address in Intel syntax; count 0 means the whole function containing
+    // address, or 16 instructions when its size is unknown. The code is read in one transfer with the original bytes
+    // under breakpoints, "=>" marks the pc and "B" an enabled breakpoint.
+    void Disassemble(uint64_t address, size_t count) {
+        constexpr size_t DEFAULT_COUNT = 16;
+        const SymbolTable& symbols = Symbols();
+        size_t len = (count ? count : DEFAULT_COUNT) * X86DecodeCache::MAX_INSN;
+        const Symbol* func = symbols.Find(address);
+        if (!count && func && func->size) len = size_t(func->addr + func->size - address);
+
+        std::vector<uint8_t> code(len + X86DecodeCache::MAX_INSN);
+        size_t n = ReadOriginalCode(address, code.data(), len);
+        if (n == 0) {
+            std::cout << "can't read code at 0x" << std::hex << address << std::dec << std::endl;
+            return;
+        }
+
+        bool exited = !m_core && (WIFEXITED(m_waitStatus) || WIFSIGNALED(m_waitStatus));
+        uint64_t pc = exited ? 0 : GetPC();
+        auto symbolize = [&symbols](uint64_t addr, BufferedWriter& out) {
+            const Symbol* sym = symbols.Find(addr);
+            if (!sym) return;
+            out.Write(" <");
+            out.Write(sym->name);
+            if (addr != sym->addr) {
+                out.Write("+0x");
+                out.Hex(addr - sym->addr);
+            }
+            out.Put('>');
+        };
+
+        BufferedWriter out(std::cout);
+        size_t printed = 0;
+        for (size_t off = 0; off < n && (count ? printed < count : (func && func->size) || printed < DEFAULT_COUNT);
+             printed++) {
+            uint64_t addr = address + off;
+            X86Insn insn;
+            bool valid = DecodeX86(code.data() + off, n - off, insn);
+            size_t length = valid ? insn.length : 1;
+
+            const Breakpoint* bp = m_breakpoints.Lookup(addr);
+            out.Write(addr == pc ? "=>" : "  ");
+            out.Put(bp && bp->IsEnabled() ? 'B' : ' ');
+            out.Write(" 0x");
+            out.Hex(addr);
+            symbolize(addr, out);
+            out.Write(":  ");
+            size_t bytesColumn = out.Column();
+            for (size_t i = 0; i < length; i++) {
+                out.Hex(code[off + i], 2);
+                out.Put(' ');
+            }
+            out.PadTo(bytesColumn + 3 * 8);
+            out.Put(' ');
+            if (valid) X86Formatter::Format(insn, code.data() + off, addr, symbolize, out);
+            else out.Write("(bad)");
+            out.Put('\n');
+            off += length;
+        }
+    }
+
+    // Bulk transfers bypass the page cache, they are meant for data that is read once.
+    bool ReadMemoryV(const MemIoVec* vecs, size_t count) {
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++) total += vecs[i].len;
+        return m_memory.ReadV(vecs, count) == total;
+    }
+
+    void DumpCacheStats() {
+        const PageCache::Stats& st = m_cache.GetStats();
+        uint64_t lookups = st.hits + st.misses;
+        double hitRate = lookups ? 100.0 * double(st.hits) / double(lookups) : 0;
+        std::cout << std::dec
+                  << "hits:          " << st.hits << '\n'
+                  << "misses:        " << st.misses << '\n'
+                  << "hit rate:      " << std::fixed << std::setprecision(1) << hitRate << "%\n"
+                  << "prefetched:    " << st.prefetched << '\n'
+                  << "invalidations: " << st.invalidations << '\n'
+                  << "cached pages:  " << m_cache.CachedPages() << std::endl;
+    }
+
+    // Reads [address, address+len) repeatedly with every backend and reports the throughput of each.
+    void BenchmarkMemory(uint64_t address, size_t len, int iterations) {
+        std::vector<uint8_t> buf(len);
+        for (int b = 0; b < int(MemBackend::COUNT); b++) {
+            MemBackend backend = MemBackend(b);
+            size_t total = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                size_t n = m_memory.ReadWith(backend, address, buf.data(), len);
+                total += n;
+                if (n < len) break;
+            }
+            auto end = std::chrono::steady_clock::now();
+            double secs = std::chrono::duration<double>(end - start).count();
+            double mbps = secs > 0 ? double(total) / secs / (1024.0 * 1024.0) : 0;
+            std::cout << std::dec << std::setfill(' ') << std::left << std::setw(12) << MemBackendName(backend)
+                      << std::right << std::setw(12) << total << " bytes  "
+                      << std::fixed << std::setprecision(1) << std::setw(10) << mbps << " MB/s" << std::endl;
+        }
+    }
+
+    uint64_t GetPC() {
+        uint64_t ret;
+        if (!Regs().Get(Reg::RIP, ret)) {
+            std::cout << "error getting PC" << std::endl;
+            return 0;
+        }
+        return ret;
+    }
+
+    bool SetPC(uint64_t pc) {
+        if (!Regs().Set(Reg::RIP, pc)) {
+            std::cout << "error setting PC" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Scans every readable mapping of the tracee for the pattern. Adjacent mappings are merged into regions which are
+    // split into chunks that the thread pool reads with process_vm_readv and searches independently. Each chunk reads
+    // pattern size - 1 bytes past its end, so matches spanning chunk or mapping boundaries are found exactly once.
+    void FindInMemory(const SearchPattern& pattern, size_t maxPrinted) {
+        constexpr uint64_t CHUNK_SIZE = 16 * 1024 * 1024;
+        using Clock = std::chrono::steady_clock;
+        auto start = Clock::now();
+
+        struct Region { uint64_t start, end; };
+        std::vector<Region> regions;
+        for (const MemoryMapping& m : Mappings()) {
+            if (!IsDumpableMapping(m)) continue;
+            if (!regions.empty() && regions.back().end == m.start) regions.back().end = m.end;
+            else regions.push_back({ m.start, m.end });
+        }
+
+        struct Chunk { uint64_t start, searchEnd, readEnd; };
+        std::vector<Chunk> chunks;
+        uint64_t totalBytes = 0;
+        for (const Region& r : regions) {
+            totalBytes += r.end - r.start;
+            for (uint64_t a = r.start; a < r.end; a += CHUNK_SIZE) {
+                uint64_t searchEnd = std::min(a + CHUNK_SIZE, r.end);
+                chunks.push_back({ a, searchEnd, std::min(searchEnd + pattern.Size() - 1, r.end) });
+            }
+        }
+
+        ThreadPool& pool = Pool();
+        std::vector<std::vector<uint8_t>> buffers(pool.Size());
+        std::vector<SearchResults> results(chunks.size());
+        std::vector<std::vector<Region>> skipped(chunks.size());
+        for (SearchResults& r : results) r.limit = maxPrinted;
+        pool.ParallelFor(chunks.size(), [&](size_t i, size_t worker) {
+            const Chunk& c = chunks[i];
+            std::vector<uint8_t>& buf = buffers[worker];
+            buf.resize(c.readEnd - c.start);
+            const size_t searchLen = c.searchEnd - c.start;
+            // A read stops at the first page that can't be read (e.g. a file mapping past the end of the file). Search
+            // what was read, step over that page and go on with the rest of the chunk.
+            for (size_t pos = 0; pos < searchLen;) {
+                size_t n = m_memory.ReadWith(MemBackend::ProcessVM, c.start + pos, buf.data() + pos, buf.size() - pos);
+                if (pos + n < buf.size()) {
+                    // ptrace can only be used from this thread, /proc/pid/mem is the only safe fallback here.
+                    n += m_memory.ReadWith(MemBackend::ProcMem, c.start + pos + n, buf.data() + pos + n,
+                                           buf.size() - pos - n);
+                }
+                SearchBuffer(buf.data() + pos, n, searchLen - pos, pattern, c.start + pos, results[i]);
+                pos += n;
+                if (pos >= buf.size()) break;
+                uint64_t bad = c.start + pos;
+                uint64_t next = std::min((bad & ~uint64_t(DBG_PAGE_SIZE - 1)) + DBG_PAGE_SIZE, c.readEnd);
+                if (bad < c.searchEnd) skipped[i].push_back({ bad, std::min(next, c.searchEnd) });
+                pos = next - c.start;
+            }
+        });
+
+        size_t total = 0;
+        size_t printed = 0;
+        for (const SearchResults& r : results) {
+            total += r.count;
+            for (size_t j = 0; j < r.addrs.size() && printed < maxPrinted; j++, printed++) {
+                std::cout << "0x" << std::hex << r.addrs[j] << std::endl;
+            }
+        }
+
+        std::vector<Region> unreadable;
+        uint64_t unreadableBytes = 0;
+        for (const std::vector<Region>& s : skipped) {
+            for (const Region& r : s) {
+                if (!unreadable.empty() && unreadable.back().end == r.start) unreadable.back().end = r.end;
+                else unreadable.push_back(r);
+                unreadableBytes += r.end - r.start;
+            }
+        }
+        for (const Region& r : unreadable) {
+            std::cout << "skipped unreadable 0x" << std::hex << r.start << "-0x" << r.end << std::endl;
+        }
+
+        double secs = std::chrono::duration<double>(Clock::now() - start).count();
+        std::cout << std::dec << total << " matches";
+        if (total > maxPrinted) std::cout << " (" << maxPrinted << " shown)";
+        std::cout << ", scanned " << (totalBytes - unreadableBytes) / (1024 * 1024) << " MB in " << std::fixed
+                  << std::setprecision(1) << secs * 1000.0 << " ms (" << std::setprecision(2)
+                  << (secs > 0 ? double(totalBytes) / secs / 1e9 : 0) << " GB/s)";
+        if (unreadableBytes) std::cout << ", " << std::dec << unreadableBytes << " bytes unreadable";
+        std::cout << std::endl;
+    }
+
+    // Streams [start, end) of the tracee into path. Chunks are read with large process_vm_readv transfers into one of
+    // two buffers while the previous chunk is written from the other one on a separate thread. All-zero pages are
+    // skipped, so the output is sparse and mostly empty regions cost almost no disk space or write time.
+    bool DumpMemoryToFile(const std::string& path, uint64_t start, uint64_t end) {
+        constexpr size_t DUMP_CHUNK_SIZE = 8 * 1024 * 1024;
+        using Clock = std::chrono::steady_clock;
+        if (end <= start) {
+            std::cerr << "invalid range" << std::endl;
+            return false;
+        }
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        auto begin = Clock::now();
+        PageMap pageMap(LivePid());
+        std::vector<uint8_t> buffers[2] = { std::vector<uint8_t>(DUMP_CHUNK_SIZE), std::vector<uint8_t>(DUMP_CHUNK_SIZE) };
+        std::vector<bool> untouched[2];
+        std::vector<bool> realPages;
+        std::future<int64_t> pendingWrite;
+        int64_t written = 0;
+        uint64_t unreadable = 0;
+        bool ok = true;
+        int cur = 0;
+        const uint64_t skew = start & (DBG_PAGE_SIZE - 1);
+
+        for (uint64_t addr = start; addr < end && ok; addr += DUMP_CHUNK_SIZE) {
+            size_t len = size_t(std::min(uint64_t(DUMP_CHUNK_SIZE), end - addr));
+            uint8_t* buf = buffers[cur].data();
+            std::vector<bool>& zero = untouched[cur];
+
+            // Read only the runs of pages that may hold data. With an unaligned start every page of the buffer
+            // straddles two pages of the tracee, and it's only known to be zero if both of them are.
+            size_t pages = (len + DBG_PAGE_SIZE - 1) / DBG_PAGE_SIZE;
+            if (skew == 0) {
+                pageMap.FindUntouchedPages(addr, pages, zero);
+            }
+            else {
+                pageMap.FindUntouchedPages(addr - skew, pages + 1, realPages);
+                zero.assign(pages, false);
+                for (size_t i = 0; i < pages; i++) zero[i] = realPages[i] && realPages[i + 1];
+            }
+            for (size_t p = 0; p < pages;) {
+                if (zero[p]) { p++; continue; }
+                size_t q = p;
+                while (q < pages && !zero[q]) q++;
+                size_t off = p * DBG_PAGE_SIZE;
+                unreadable += m_memory.ReadZeroFill(addr + off, buf + off, std::min(q * DBG_PAGE_SIZE, len) - off);
+                p = q;
+            }
+
+            if (pendingWrite.valid()) {
+                int64_t w = pendingWrite.get();
+                if (w < 0) ok = false;
+                else written += w;
+            }
+            pendingWrite = std::async(std::launch::async, WriteSparse, fd, buf, len, addr - start, &zero);
+            cur ^= 1;
+        }
+        if (pendingWrite.valid()) {
+            int64_t w = pendingWrite.get();
+            if (w < 0) ok = false;
+            else written += w;
+        }
+
+        if (ok && ftruncate(fd, off_t(end - start)) < 0) ok = false;
+        if (!ok) std::cerr << "Failed to write " << path << ": " << strerror(errno) << std::endl;
+        close(fd);
+
+        double secs = std::chrono::duration<double>(Clock::now() - begin).count();
+        uint64_t total = end - start;
+        std::cout << std::dec << "dumped " << total << " bytes to " << path << " (" << written << " written, "
+                  << unreadable << " unreadable) in " << std::fixed << std::setprecision(1) << secs * 1000.0
+                  << " ms (" << std::setprecision(2) << (secs > 0 ? double(total) / secs / 1e9 : 0) << " GB/s)"
+                  << std::endl;
+        return ok;
+    }
+
+    // Dumps the span covering every mapping whose path equals name (or ends with "/name").
+    bool DumpMappingToFile(std::string_view name, std::string path) {
+        uint64_t start = UINT64_MAX, end = 0;
+        for (const MemoryMapping& m : Mappings()) {
+            if (!MappingMatches(m, name) || !IsDumpableMapping(m)) continue;
+            start = std::min(start, m.start);
+            end = std::max(end, m.end);
+        }
+        if (start >= end) {
+            std::cerr << "no readable mapping named " << name << std::endl;
+            return false;
+        }
+
+        if (path.empty()) {
+            std::string base(name.substr(name.rfind('/') == std::string_view::npos ? 0 : name.rfind('/') + 1));
+            base.erase(std::remove_if(base.begin(), base.end(), [](char c) { return c == '[' || c == ']'; }), base.end());
+            std::ostringstream out;
+            out << base << "@0x" << std::hex << start << ".bin";
+            path = out.str();
+        }
+        return DumpMemoryToFile(path, start, end);
+    }
+
+    // Hashes and stores every page of the readable mappings (or only the ones named mappingFilter). Chunks of pages
+    // are read, hashed and compressed on the thread pool and appended to the snapshot arena.
+    bool SaveSnapshot(const std::string& name, const std::string& file, std::string_view mappingFilter) {
+        constexpr size_t PAGES_PER_CHUNK = 1024;
+        using Clock = std::chrono::steady_clock;
+        auto begin = Clock::now();
+
+        auto snap = std::make_unique<Snapshot>();
+        snap->name = name;
+        if (!file.empty() && !snap->arena.OpenFile(file)) return false;
+
+        struct Chunk { uint64_t start; size_t pages; };
+        std::vector<Chunk> chunks;
+        for (const MemoryMapping& m : Mappings()) {
+            if (!IsDumpableMapping(m)) continue;
+            if (!mappingFilter.empty() && !MappingMatches(m, mappingFilter)) continue;
+            for (uint64_t a = m.start; a < m.end; a += PAGES_PER_CHUNK * DBG_PAGE_SIZE) {
+                size_t pages = size_t(std::min(uint64_t(PAGES_PER_CHUNK), (m.end - a) / DBG_PAGE_SIZE));
+                chunks.push_back({ a, pages });
+            }
+        }
+
+        std::vector<std::vector<SnapshotPage>> results(chunks.size());
+        ThreadPool& pool = Pool();
+        std::vector<std::vector<uint8_t>> buffers(pool.Size());
+        std::vector<std::vector<uint8_t>> packedBuffers(pool.Size());
+        PageMap pageMap(LivePid());
+        std::mutex arenaMutex;
+        bool ok = true;
+
+        pool.ParallelFor(chunks.size(), [&](size_t ci, size_t worker) {
+            const Chunk& c = chunks[ci];
+            std::vector<uint8_t>& buf = buffers[worker];
+            buf.resize(c.pages * DBG_PAGE_SIZE);
+            std::vector<bool> untouched;
+            pageMap.FindUntouchedPages(c.start, c.pages, untouched);
+            for (size_t p = 0; p < c.pages;) {
+                if (untouched[p]) { p++; continue; }
+                size_t q = p;
+                while (q < c.pages && !untouched[q]) q++;
+                m_memory.ReadZeroFill(c.start + p * DBG_PAGE_SIZE, buf.data() + p * DBG_PAGE_SIZE,
+                                      (q - p) * DBG_PAGE_SIZE);
+                p = q;
+            }
+
+            std::vector<SnapshotPage>& pages = results[ci];
+            std::vector<uint8_t>& packedBuf = packedBuffers[worker];
+            packedBuf.resize(c.pages * DBG_PAGE_SIZE);
+            size_t packedSize = 0;
+            pages.resize(c.pages);
+            for (size_t p = 0; p < c.pages; p++) {
+                const uint8_t* page = buf.data() + p * DBG_PAGE_SIZE;
+                SnapshotPage& sp = pages[p];
+                sp.addr = c.start + p * DBG_PAGE_SIZE;
+                if (untouched[p] || IsZeroPage(page)) {
+                    sp.hash = ZeroPageHash();
+                    sp.offset = 0;
+                    sp.size = 0;
+                    sp.encoding = SnapshotPage::ZERO;
+                    continue;
+                }
+                sp.hash = HashPage(page);
+                sp.offset = packedSize;
+                size_t n = PackPage(page, packedBuf.data() + packedSize);
+                if (n) {
+                    sp.encoding = SnapshotPage::PACKED;
+                }
+                else {
+                    sp.encoding = SnapshotPage::RAW;
+                    n = DBG_PAGE_SIZE;
+                    std::memcpy(packedBuf.data() + packedSize, page, n);
+                }
+                sp.size = uint32_t(n);
+                packedSize += n;
+            }
+            if (packedSize == 0) return;
+
+            // Chunks are appended in completion order, the pages keep their own offsets.
+            std::lock_guard<std::mutex> lock(arenaMutex);
+            uint64_t base = snap->arena.Append(packedBuf.data(), packedSize);
+            if (base == UINT64_MAX) {
+                ok = false;
+                return;
+            }
+            for (SnapshotPage& sp : pages) {
+                if (sp.encoding != SnapshotPage::ZERO) sp.offset += base;
+            }
+        });
+        if (!ok) return false;
+
+        for (const auto& pages : results) {
+            snap->pages.insert(snap->pages.end(), pages.begin(), pages.end());
+        }
+        if (!snap->arena.Finish()) return false;
+        snap->rawBytes = snap->pages.size() * DBG_PAGE_SIZE;
+
+        double secs = std::chrono::duration<double>(Clock::now() - begin).count();
+        std::cout << std::dec << "snapshot " << name << ": " << snap->pages.size() << " pages, "
+                  << snap->rawBytes / 1024 << " KB -> " << snap->arena.Size() / 1024 << " KB stored in "
+                  << std::fixed << std::setprecision(1) << secs * 1000.0 << " ms" << std::endl;
+        m_snapshots[name] = std::move(snap);
+        return true;
+    }
+
+    // Compares the page hashes of two snapshots and byte-diffs only the pages whose hashes differ. Changed bytes are
+    // reported as coalesced ranges.
+    bool DiffSnapshots(const std::string& nameA, const std::string& nameB, size_t maxPrinted) {
+        using Clock = std::chrono::steady_clock;
+        auto itA = m_snapshots.find(nameA);
+        auto itB = m_snapshots.find(nameB);
+        if (itA == m_snapshots.end() || itB == m_snapshots.end()) {
+            std::cerr << "unknown snapshot " << (itA == m_snapshots.end() ? nameA : nameB) << std::endl;
+            return false;
+        }
+        Snapshot& a = *itA->second;
+        Snapshot& b = *itB->second;
+        auto begin = Clock::now();
+
+        // Merge walk over the two sorted page lists.
+        std::vector<std::pair<size_t, size_t>> changed;
+        size_t onlyA = 0, onlyB = 0;
+        size_t i = 0, j = 0;
+        while (i < a.pages.size() || j < b.pages.size()) {
+            if (j == b.pages.size() || (i < a.pages.size() && a.pages[i].addr < b.pages[j].addr)) { onlyA++; i++; }
+            else if (i == a.pages.size() || b.pages[j].addr < a.pages[i].addr) { onlyB++; j++; }
+            else {
+                if (a.pages[i].hash != b.pages[j].hash) changed.push_back({ i, j });
+                i++;
+                j++;
+            }
+        }
+
+        struct Range { uint64_t start, end; };
+        std::vector<std::vector<Range>> ranges(changed.size());
+        Pool().ParallelFor(changed.size(), [&](size_t k, size_t) {
+            uint8_t pa[DBG_PAGE_SIZE] = {}, pb[DBG_PAGE_SIZE] = {};
+            const SnapshotPage& spa = a.pages[changed[k].first];
+            a.LoadPage(spa, pa);
+            b.LoadPage(b.pages[changed[k].second], pb);
+            for (size_t off = 0; off < DBG_PAGE_SIZE;) {
+                if (pa[off] == pb[off]) { off++; continue; }
+                size_t end = off;
+                while (end < DBG_PAGE_SIZE && pa[end] != pb[end]) end++;
+                ranges[k].push_back({ spa.addr + off, spa.addr + end });
+                off = end;
+            }
+        });
+
+        uint64_t changedBytes = 0;
+        size_t printed = 0;
+        std::vector<Range> all;
+        for (auto& r : ranges) {
+            for (const Range& x : r) {
+                changedBytes += x.end - x.start;
+                // Coalesce ranges that continue across a page boundary.
+                if (!all.empty() && all.back().end == x.start) all.back().end = x.end;
+                else all.push_back(x);
+            }
+        }
+        for (const Range& x : all) {
+            if (printed++ >= maxPrinted) break;
+            std::cout << "0x" << std::hex << x.start << "-0x" << x.end << std::dec << " (" << x.end - x.start
+                      << " bytes)" << std::endl;
+        }
+
+        double secs = std::chrono::duration<double>(Clock::now() - begin).count();
+        std::cout << std::dec << changed.size() << " pages changed, " << all.size() << " ranges, " << changedBytes
+                  << " bytes; " << onlyA << " pages only in " << nameA << ", " << onlyB << " only in " << nameB
+                  << "; " << std::fixed << std::setprecision(1) << secs * 1000.0 << " ms" << std::endl;
+        return true;
+    }
+
+    static uint64_t ZeroPageHash() {
+        static const uint64_t hash = []() {
+            uint8_t zero[DBG_PAGE_SIZE] = {};
+            return HashPage(zero);
+        }();
+        return hash;
+    }
+
+    // Writes an ELF64 core file of the stopped tracee: a PT_NOTE segment with NT_PRSTATUS, NT_PRPSINFO,
+    // NT_FPREGSET, NT_X86_XSTATE, NT_SIGINFO, NT_AUXV and NT_FILE followed by one PT_LOAD per mapping. Mapping
+    // contents are copied in parallel with process_vm_readv and the output is sparse.
+    bool WriteCoreFile(const std::string& path) {
+        constexpr uint64_t CORE_CHUNK_SIZE = 8 * 1024 * 1024;
+        using Clock = std::chrono::steady_clock;
+        auto begin = Clock::now();
+
+        std::vector<MemoryMapping> mappings = Mappings();
+        NoteBuilder notes;
+        if (!BuildCoreNotes(notes, mappings)) return false;
+
+        // Layout: ELF header, program headers, notes, then page aligned segment data.
+        size_t phnum = 1 + mappings.size();
+        uint64_t notesOffset = sizeof(Elf64_Ehdr) + phnum * sizeof(Elf64_Phdr);
+        uint64_t dataOffset = (notesOffset + notes.data.size() + DBG_PAGE_SIZE - 1) & ~(DBG_PAGE_SIZE - 1);
+
+        Elf64_Ehdr ehdr = {};
+        std::memcpy(ehdr.e_ident, ElfMagic, 4);
+        ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+        ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+        ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+        ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+        ehdr.e_type = ET_CORE;
+        ehdr.e_machine = EM_X86_64;
+        ehdr.e_version = EV_CURRENT;
+        ehdr.e_phoff = sizeof(Elf64_Ehdr);
+        ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+        ehdr.e_phentsize = sizeof(Elf64_Phdr);
+        ehdr.e_phnum = Elf64_Half(phnum);
+
+        std::vector<Elf64_Phdr> phdrs(phnum);
+        phdrs[0].p_type = PT_NOTE;
+        phdrs[0].p_offset = notesOffset;
+        phdrs[0].p_filesz = notes.data.size();
+        phdrs[0].p_align = 4;
+
+        struct Chunk { uint64_t addr, len, fileOffset; };
+        std::vector<Chunk> chunks;
+        uint64_t offset = dataOffset;
+        for (size_t i = 0; i < mappings.size(); i++) {
+            const MemoryMapping& m = mappings[i];
+            Elf64_Phdr& ph = phdrs[i + 1];
+            ph.p_type = PT_LOAD;
+            ph.p_offset = offset;
+            ph.p_vaddr = m.start;
+            ph.p_memsz = m.Size();
+            ph.p_filesz = IsDumpableMapping(m) ? m.Size() : 0;
+            ph.p_flags = (m.IsReadable() ? Elf64_Word(PF_R) : 0) | (m.IsWritable() ? Elf64_Word(PF_W) : 0) |
+                         (m.IsExecutable() ? Elf64_Word(PF_X) : 0);
+            ph.p_align = DBG_PAGE_SIZE;
+            for (uint64_t a = 0; a < ph.p_filesz; a += CORE_CHUNK_SIZE) {
+                chunks.push_back({ m.start + a, std::min(CORE_CHUNK_SIZE, ph.p_filesz - a), offset + a });
+            }
+            offset += ph.p_filesz;
+        }
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        bool ok = pwrite(fd, &ehdr, sizeof(ehdr), 0) == ssize_t(sizeof(ehdr)) &&
+                  pwrite(fd, phdrs.data(), phnum * sizeof(Elf64_Phdr), off_t(ehdr.e_phoff)) ==
+                      ssize_t(phnum * sizeof(Elf64_Phdr)) &&
+                  pwrite(fd, notes.data.data(), notes.data.size(), off_t(notesOffset)) == ssize_t(notes.data.size());
+
+        ThreadPool& pool = Pool();
+        std::vector<std::vector<uint8_t>> buffers(pool.Size());
+        PageMap pageMap(LivePid());
+        std::atomic<bool> writeFailed(false);
+        std::atomic<uint64_t> written(0);
+        pool.ParallelFor(ok ? chunks.size() : 0, [&](size_t ci, size_t worker) {
+            const Chunk& c = chunks[ci];
+            std::vector<uint8_t>& buf = buffers[worker];
+            buf.resize(c.len);
+            size_t pages = (c.len + DBG_PAGE_SIZE - 1) / DBG_PAGE_SIZE;
+            std::vector<bool> untouched;
+            pageMap.FindUntouchedPages(c.addr, pages, untouched);
+            for (size_t p = 0; p < pages;) {
+                if (untouched[p]) { p++; continue; }
+                size_t q = p;
+                while (q < pages && !untouched[q]) q++;
+                size_t off = p * DBG_PAGE_SIZE;
+                m_memory.ReadZeroFill(c.addr + off, buf.data() + off, std::min(q * DBG_PAGE_SIZE, c.len) - off);
+                p = q;
+            }
+            int64_t w = WriteSparse(fd, buf.data(), c.len, c.fileOffset, &untouched);
+            if (w < 0) writeFailed = true;
+            else written += uint64_t(w);
+        });
+
+        ok = ok && !writeFailed && ftruncate(fd, off_t(offset)) == 0;
+        if (!ok) std::cerr << "Failed to write " << path << ": " << strerror(errno) << std::endl;
+        close(fd);
+
+        double secs = std::chrono::duration<double>(Clock::now() - begin).count();
+        std::cout << std::dec << "wrote " << path << ": " << mappings.size() << " segments, "
+                  << (offset - dataOffset) / (1024 * 1024) << " MB of memory, " << written / (1024 * 1024)
+                  << " MB written; process stopped for " << std::fixed << std::setprecision(1) << secs * 1000.0
+                  << " ms" << std::endl;
+        return ok;
+    }
+
+    bool BuildCoreNotes(NoteBuilder& notes, const std::vector<MemoryMapping>& mappings) {
+        std::vector<pid_t> threads = { m_pid };
+        for (const auto& [tid, t] : m_threads) {
+            if (tid != m_pid) threads.push_back(tid);
+        }
+        for (pid_t tid : threads) {
+            RegisterCache& regs = Regs(tid);
+            const user_regs_struct* gp = regs.Raw();
+            if (!gp) {
+                std::cout << "can't read the registers of thread " << tid << ", no core written" << std::endl;
+                return false;
+            }
+
+            siginfo_t si = {};
+            ptrace(PTRACE_GETSIGINFO, tid, nullptr, &si);
+
+            elf_prstatus st = {};
+            st.pr_info.si_signo = si.si_signo;
+            st.pr_info.si_code = si.si_code;
+            st.pr_info.si_errno = si.si_errno;
+            st.pr_cursig = short(si.si_signo);
+            st.pr_pid = tid;
+            st.pr_ppid = getpid();
+            st.pr_pgrp = getpgid(m_pid);
+            st.pr_sid = getsid(m_pid);
+            static_assert(sizeof(st.pr_reg) == sizeof(user_regs_struct));
+            std::memcpy(&st.pr_reg, gp, sizeof(user_regs_struct));
+            notes.Add(NT_PRSTATUS, "CORE", &st, sizeof(st));
+
+            // The main thread's prpsinfo follows its prstatus, like the kernel does it.
+            if (tid == m_pid) {
+                elf_prpsinfo ps = {};
+                ps.pr_state = 't' - 'a';
+                ps.pr_sname = 't';
+                ps.pr_pid = m_pid;
+                ps.pr_ppid = getpid();
+                ps.pr_pgrp = getpgid(m_pid);
+                ps.pr_sid = getsid(m_pid);
+                ps.pr_uid = getuid();
+                ps.pr_gid = getgid();
+                size_t slash = m_progName.rfind('/');
+                std::string fname = slash == std::string::npos ? m_progName : m_progName.substr(slash + 1);
+                std::strncpy(ps.pr_fname, fname.c_str(), sizeof(ps.pr_fname) - 1);
+                std::string args = ReadProcFile(m_pid, "cmdline");
+                std::replace(args.begin(), args.end(), '\0', ' ');
+                std::strncpy(ps.pr_psargs, args.c_str(), sizeof(ps.pr_psargs) - 1);
+                notes.Add(NT_PRPSINFO, "CORE", &ps, sizeof(ps));
+            }
+
+            if (const std::vector<uint8_t>* xs = regs.RawXState()) {
+                notes.Add(NT_FPREGSET, "CORE", xs->data(), sizeof(user_fpregs_struct));
+                notes.Add(NT_X86_XSTATE, "LINUX", xs->data(), xs->size());
+            }
+            notes.Add(NT_SIGINFO, "CORE", &si, sizeof(si));
+        }
+
+        std::string auxv = ReadProcFile(m_pid, "auxv");
+        notes.Add(NT_AUXV, "CORE", auxv.data(), auxv.size());
+
+        // NT_FILE: count, page size, {start, end, file offset in pages} per mapping, then the NUL separated names.
+        std::vector<uint64_t> files = { 0, DBG_PAGE_SIZE };
+        std::string names;
+        for (const MemoryMapping& m : mappings) {
+            if (m.path.empty() || m.path[0] != '/') continue;
+            files[0]++;
+            files.insert(files.end(), { m.start, m.end, m.offset / DBG_PAGE_SIZE });
+            names += m.path;
+            names.push_back('\0');
+        }
+        std::vector<uint8_t> fileNote(files.size() * sizeof(uint64_t) + names.size());
+        std::memcpy(fileNote.data(), files.data(), files.size() * sizeof(uint64_t));
+        std::memcpy(fileNote.data() + files.size() * sizeof(uint64_t), names.data(), names.size());
+        notes.Add(NT_FILE, "CORE", fileNote.data(), fileNote.size());
+        return true;
+    }
+
+    ThreadPool& Pool() {
+        if (!m_pool) m_pool = std::make_unique<ThreadPool>();
+        return *m_pool;
+    }
+
+    RegisterCache& Regs() { return Regs(m_tid); }
+
+    std::vector<MemoryMapping> Mappings() const {
+        return m_core ? m_core->Mappings() : ReadMemoryMappings(m_pid);
+    }
+
+    // The pid procfs and ptrace queries may use, 0 when debugging a core file.
+    pid_t LivePid() const { return m_core ? 0 : m_pid; }
+
+    const SymbolTable& Symbols() {
+        // Once the tracee is gone the last table is kept for symbolizing what it left behind.
+        bool exited = !m_core && (WIFEXITED(m_waitStatus) || WIFSIGNALED(m_waitStatus));
+        if (!m_symbolsValid && !exited) {
+            m_symbols.Load(Mappings());
+            m_symbolsValid = true;
+        }
+        return m_symbols;
+    }
+
+    const LineTable& Lines() {
+        bool exited = !m_core && (WIFEXITED(m_waitStatus) || WIFSIGNALED(m_waitStatus));
+        if (!m_linesValid && !exited) {
+            m_lines.Load(Mappings());
+            m_linesValid = true;
+        }
+        return m_lines;
+    }
+
+    const CallFrameTable& CallFrames() {
+        bool exited = !m_core && (WIFEXITED(m_waitStatus) || WIFSIGNALED(m_waitStatus));
+        if (!m_callFramesValid && !exited) {
+            m_callFrames.Load(Mappings());
+            m_callFramesValid = true;
+        }
+        return m_callFrames;
+    }
+
+    void PrintLocation(uint64_t addr) {
+        std::cout << "0x" << std::hex << std::setfill('0') << std::setw(16) << addr;
+        if (const Symbol* sym = Symbols().Find(addr)) {
+            std::cout << " in " << sym->name;
+            if (addr != sym->addr) std::cout << "+0x" << std::hex << addr - sym->addr;
+        }
+        std::cout << std::dec << std::endl;
+    }
+
+    // Walks the frame pointer chain of the current thread. Frames of code built without frame pointers are skipped,
+    // the walk stops at the first frame pointer that doesn't point further up the stack.
+    void Backtrace(size_t maxFrames) {
+        uint64_t pc, fp, sp;
+        if (!Regs().Get(Reg::RIP, pc) || !Regs().Get(Reg::RBP, fp) || !Regs().Get(Reg::RSP, sp)) {
+            std::cout << "error getting registers" << std::endl;
+            return;
+        }
+        for (size_t i = 0; i < maxFrames && pc != 0; i++) {
+            std::cout << "#" << std::dec << std::left << std::setfill(' ') << std::setw(3) << i << std::right << ' ';
+            PrintLocation(pc);
+
+            // Stopped at a function entry (typically on a breakpoint) before push rbp; mov rbp, rsp ran: the frame
+            // pointer still belongs to the caller and the return address is on top of the stack.
+            const Symbol* sym = i == 0 ? Symbols().Find(pc) : nullptr;
+            uint8_t first = 0;
+            if (sym && pc <= sym->addr + 1 && ReadMemory(sym->addr, &first, 1) && (pc == sym->addr || first == 0x55)) {
+                uint64_t retAddr = 0;
+                uint64_t at = sp + (pc - sym->addr) * 8;
+                if (!ReadMemory(at, &retAddr, sizeof(retAddr))) break;
+                sp = at + 8;
+                pc = retAddr;
+                continue;
+            }
+
+            uint64_t frame[2]; // saved rbp, return address
+            if (fp < sp || (fp & 7) || !ReadMemory(fp, frame, sizeof(frame))) break;
+            sp = fp + sizeof(frame);
+            fp = frame[0];
+            pc = frame[1];
+        }
+    }
+
+    RegisterCache& Regs(pid_t tid) {
+        auto it = m_regs.find(tid);
+        if (it == m_regs.end()) {
+            it = m_regs.emplace(tid, RegisterCache(tid)).first;
+        }
+        return it->second;
+    }
+
+    // Writes back everything that is buffered for the stopped tracee and drops all state that is only valid for the
+    // current stop. Must be called right before every PTRACE_CONT/PTRACE_SINGLESTEP.
+    bool PrepareResume() {
+        m_symbolsValid = false;
+        m_linesValid = false;
+        m_callFramesValid = false;
+        bool ok = FlushCodePatches();
+        for (auto& [tid, regs] : m_regs) {
+            if (!regs.Flush()) ok = false;
+            else regs.Invalidate();
+        }
+        m_cache.Invalidate();
+        return ok;
+    }
+
+    // If the tracee stopped on one of our int3s, rewinds the PC onto the breakpoint and counts the hit. Returns the
+    // breakpoint or nullptr for any other stop.
+    Breakpoint* OnStop() {
+        if (!WIFSTOPPED(m_waitStatus) || WSTOPSIG(m_waitStatus) != SIGTRAP) return nullptr;
+        uint64_t pc = GetPC();
+        Breakpoint* bp = m_breakpoints.Lookup(pc - 1);
+        if (!bp || !bp->IsEnabled()) return nullptr;
+        SetPC(pc - 1);
+        bp->Hit();
+        return bp;
+    }
+
+    // Address of a syscall instruction in the tracee, preferably in the vdso so the program text stays untouched.
+    uint64_t SyscallSite() {
+        if (m_syscallSite) return m_syscallSite;
+        std::vector<MemoryMapping> maps = Mappings();
+        std::stable_partition(maps.begin(), maps.end(), [](const MemoryMapping& m) { return m.path == "[vdso]"; });
+        for (const MemoryMapping& m : maps) {
+            if (!m.IsExecutable() || !m.IsReadable() || m.path == "[vsyscall]") continue;
+            std::vector<uint8_t> text(m.Size());
+            size_t n = m_memory.Read(m.start, text.data(), text.size());
+            for (size_t i = 0; i + 1 < n; i++) {
+                if (text[i] == 0x0f && text[i + 1] == 0x05) return m_syscallSite = m.start + i;
+            }
+        }
+        return 0;
+    }
+
+    // Runs one system call in the stopped tracee and returns its result (-errno on failure). All registers are
+    // restored afterwards.
+    int64_t InjectSyscall(long nr, std::initializer_list<uint64_t> args) {
+        uint64_t site = SyscallSite();
+        const user_regs_struct* cur = Regs().Raw();
+        if (!site || !cur) return -ENOSYS;
+        // Buffered writes (a rewound pc) go out first, ResumeThread would otherwise write them over the call.
+        if (!FlushCodePatches() || !Regs().Flush()) return -EIO;
+
+        user_regs_struct saved = *cur;
+        user_regs_struct call = saved;
+        constexpr Reg ARG_REGS[] = { Reg::RDI, Reg::RSI, Reg::RDX, Reg::R10, Reg::R8, Reg::R9 };
+        size_t i = 0;
+        for (uint64_t a : args) SetRegisterValue(call, ARG_REGS[i++], a);
+        call.rax = uint64_t(nr);
+        call.orig_rax = ~uint64_t(0); // no syscall restart for the stop we came from
+        call.rip = site;
+
+        int status = m_waitStatus;
+        int64_t ret = -EIO;
+        if (ptrace(PTRACE_SETREGS, m_tid, nullptr, &call) == 0 && ResumeThread(m_tid, PTRACE_SINGLESTEP) &&
+            WaitForThread(m_tid) == 0 && ptrace(PTRACE_GETREGS, m_tid, nullptr, &call) == 0) {
+            ret = int64_t(call.rax);
+        }
+        ptrace(PTRACE_SETREGS, m_tid, nullptr, &saved);
+        m_waitStatus = status;
+        return ret;
+    }
+
+    bool ProtectPages(uint64_t addr, uint64_t len, int prot) {
+        int64_t ret = InjectSyscall(SYS_mprotect, { addr, len, uint64_t(prot) });
+        if (ret < 0) {
+            std::cout << "mprotect(0x" << std::hex << addr << ", 0x" << len << ") in the tracee failed: "
+                      << strerror(int(-ret)) << std::dec << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Watches writes to [addr, addr+len) by write-protecting its pages in the tracee.
+    bool AddPageWatch(uint64_t addr, uint64_t len) {
+        std::vector<MemoryMapping> maps = Mappings();
+        auto mappingOf = [&maps](uint64_t page) -> const MemoryMapping* {
+            for (const MemoryMapping& m : maps) {
+                if (page >= m.start && page < m.end) return &m;
+            }
+            return nullptr;
+        };
+        for (uint64_t p = PageWatchSet::PageOf(addr); p < addr + len; p += DBG_PAGE_SIZE) {
+            const MemoryMapping* m = mappingOf(p);
+            if (!m || !m->IsWritable()) {
+                std::cout << "0x" << std::hex << p << std::dec << " is not in a writable mapping" << std::endl;
+                return false;
+            }
+        }
+
+        std::vector<uint64_t> pages = m_pageWatches.Add(addr, addr + len, [&](uint64_t p) {
+            return MappingProt(*mappingOf(p));
+        });
+        // One mprotect per run of contiguous pages with the same protection.
+        for (size_t i = 0; i < pages.size();) {
+            int prot = m_pageWatches.OriginalProt(pages[i]);
+            size_t j = i + 1;
+            while (j < pages.size() && pages[j] == pages[j - 1] + DBG_PAGE_SIZE &&
+                   m_pageWatches.OriginalProt(pages[j]) == prot) j++;
+            if (!ProtectPages(pages[i], (j - i) * DBG_PAGE_SIZE, prot & ~PROT_WRITE)) return false;
+            i = j;
+        }
+        return true;
+    }
+
+    bool RemovePageWatch(uint64_t addr) {
+        bool ok = true;
+        for (const auto& [page, prot] : m_pageWatches.Remove(addr)) {
+            ok = ProtectPages(page, DBG_PAGE_SIZE, prot) && ok;
+        }
+        return ok;
+    }
+
+    void ListPageWatches() {
+        for (const PageWatchSet::Range& r : m_pageWatches.Ranges()) {
+            std::cout << "0x" << std::hex << r.start << "-0x" << r.end << std::dec << "  " << r.end - r.start
+                      << " bytes  " << r.hits << " hits" << std::endl;
+        }
+        const PageWatchSet::Stats& st = m_pageWatches.GetStats();
+        std::cout << st.faults << " faults, " << st.unrelated << " on watched pages outside the ranges";
+        if (st.unrelated) {
+            std::cout << " (" << std::fixed << std::setprecision(1) << st.unrelatedSeconds * 1e6 / double(st.unrelated)
+                      << " us each)";
+        }
+        std::cout << std::endl;
+    }
+
+    enum struct FaultKind { NotOurs, Watched, Unrelated };
+
+    // Handles a SIGSEGV stop caused by a page watch: the faulting instruction is single-stepped with the page writable
+    // again, then the page is protected again. Unrelated means the write hit a watched page outside every range and
+    // the tracee can simply be continued.
+    FaultKind OnProtectionFault() {
+        if (m_pageWatches.Empty() || !WIFSTOPPED(m_waitStatus) || WSTOPSIG(m_waitStatus) != SIGSEGV) {
+            return FaultKind::NotOurs;
+        }
+        siginfo_t si;
+        if (ptrace(PTRACE_GETSIGINFO, m_tid, nullptr, &si) < 0 || si.si_code != SEGV_ACCERR) return FaultKind::NotOurs;
+        uint64_t addr = uint64_t(si.si_addr);
+        if (!m_pageWatches.IsProtected(addr)) return FaultKind::NotOurs;
+
+        auto begin = std::chrono::steady_clock::now();
+        PageWatchSet::Stats& st = m_pageWatches.GetStats();
+        st.faults++;
+        uint64_t pc = GetPC();
+        uint64_t page = PageWatchSet::PageOf(addr);
+        int prot = m_pageWatches.OriginalProt(page);
+        PageWatchSet::Range* range = m_pageWatches.FindRange(addr);
+        uint64_t before = 0;
+        size_t shown = range ? size_t(std::min<uint64_t>(sizeof(before), range->end - addr)) : 0;
+        ReadMemory(addr, &before, shown);
+
+        // An unaligned access may span into the next page, lift both.
+        uint64_t len = m_pageWatches.IsProtected(page + DBG_PAGE_SIZE) ? 2 * DBG_PAGE_SIZE : DBG_PAGE_SIZE;
+        // Other threads would write to the lifted pages unnoticed, they wait until the protection is back.
+        bool lifted = false;
+        WithAllStopped([&] {
+            if (!(lifted = ProtectPages(page, len, prot))) return false;
+            PrepareResume();
+            ResumeThread(m_tid, PTRACE_SINGLESTEP);
+            WaitForThread(m_tid);
+            return ProtectPages(page, len, prot & ~PROT_WRITE);
+        });
+        if (!lifted) return FaultKind::NotOurs;
+
+        if (!range) {
+            st.unrelated++;
+            st.unrelatedSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            return FaultKind::Unrelated;
+        }
+        range->hits++;
+        uint64_t after = 0;
+        m_cache.Invalidate();
+        ReadMemory(addr, &after, shown);
+        std::cout << "page watchpoint 0x" << std::hex << range->start << ": write to 0x" << addr << " (0x" << before
+                  << " -> 0x" << after << ") by ";
+        PrintLocation(pc);
+        return FaultKind::Watched;
+    }
+
+    // Finds a free range of size bytes within rel32 reach of addr and maps it executable in the tracee.
+    uint64_t MapNear(uint64_t addr, uint64_t size) {
+        constexpr uint64_t REACH = uint64_t(1) << 30;
+        std::vector<MemoryMapping> maps = Mappings();
+        std::vector<uint64_t> candidates;
+        for (size_t i = 0; i + 1 < maps.size(); i++) {
+            uint64_t gapStart = maps[i].end, gapEnd = maps[i + 1].start;
+            if (gapEnd - gapStart < size) continue;
+            if (gapStart >= addr && gapStart - addr < REACH) candidates.push_back(gapStart);
+            if (gapEnd <= addr && addr - (gapEnd - size) < REACH) candidates.push_back(gapEnd - size);
+        }
+        std::sort(candidates.begin(), candidates.end(), [addr](uint64_t a, uint64_t b) {
+            return (a > addr ? a - addr : addr - a) < (b > addr ? b - addr : addr - b);
+        });
+        for (uint64_t c : candidates) {
+            int64_t ret = InjectSyscall(SYS_mmap, { c, size, PROT_READ | PROT_EXEC,
+                                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, ~uint64_t(0), 0 });
+            if (ret == int64_t(c)) return c;
+            if (ret > 0) InjectSyscall(SYS_munmap, { uint64_t(ret), size }); // kernel without MAP_FIXED_NOREPLACE
+        }
+        return 0;
+    }
+
+    // Returns an address for size bytes of trampoline code within rel32 reach of site.
+    uint64_t AllocateTrampoline(uint64_t site, size_t size) {
+        constexpr uint64_t AREA_SIZE = 64 * 1024;
+        constexpr uint64_t REACH = uint64_t(1) << 31;
+        for (TrampolineArea& a : m_trampolineAreas) {
+            uint64_t at = a.start + a.used;
+            if (a.used + size <= AREA_SIZE && (at > site ? at - site : site - at) + AREA_SIZE < REACH) {
+                a.used += size;
+                return at;
+            }
+        }
+        uint64_t start = MapNear(site, AREA_SIZE);
+        if (!start) return 0;
+        m_trampolineAreas.push_back({ start, size });
+        return start;
+    }
+
+    // Creates the shared ring: memfd_create, ftruncate and mmap MAP_SHARED run inside the tracee, the debugger maps the
+    // same file through /proc/pid/fd.
+    bool SetupTraceRing() {
+        if (m_traceReader.IsOpen()) return true;
+        static constexpr char NAME[] = "dbg-trace";
+        uint64_t name = AllocateTrampoline(GetPC(), sizeof(NAME));
+        if (!name || m_memory.WriteWith(MemBackend::ProcMem, name, NAME, sizeof(NAME)) != sizeof(NAME)) return false;
+        m_decodeCache.Invalidate(name, sizeof(NAME));
+
+        int64_t fd = InjectSyscall(SYS_memfd_create, { name, 0 });
+        if (fd < 0) {
+            std::cout << "memfd_create in the tracee failed: " << strerror(int(-fd)) << std::endl;
+            return false;
+        }
+        int64_t ring = -1;
+        if (InjectSyscall(SYS_ftruncate, { uint64_t(fd), TRACE_RING_SIZE }) == 0) {
+            ring = InjectSyscall(SYS_mmap, { 0, TRACE_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, uint64_t(fd), 0 });
+        }
+        bool ok = ring > 0 && m_traceReader.Open("/proc/" + std::to_string(m_pid) + "/fd/" + std::to_string(fd));
+        InjectSyscall(SYS_close, { uint64_t(fd) });
+        if (!ok) {
+            std::cout << "failed to set up the trace ring" << std::endl;
+            return false;
+        }
+        m_traceRing = uint64_t(ring);
+        m_traceStart = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    // Replaces the instructions at addr with a jmp to a trampoline that records spec into the shared ring and then
+    // runs the displaced instructions. The tracee never stops for it.
+    bool AddFastTracepoint(uint64_t addr, const FastTraceSpec& spec) {
+        constexpr size_t JMP_SIZE = 5;
+        if (!SetupTraceRing()) return false;
+
+        uint8_t code[32];
+        size_t n = m_memory.Read(addr, code, sizeof(code));
+        if (n < JMP_SIZE) {
+            std::cout << "can't read code at 0x" << std::hex << addr << std::dec << std::endl;
+            return false;
+        }
+        size_t len = 0;
+        while (len < JMP_SIZE) {
+            X86Insn insn;
+            if (len >= n || !DecodeX86(code + len, n - len, insn)) {
+                std::cout << "can't decode the instruction at 0x" << std::hex << addr + len << std::dec << std::endl;
+                return false;
+            }
+            if (insn.kind == X86Insn::RET || insn.kind == X86Insn::JMP_IND || code[len] == Breakpoint::INT3) {
+                // Padding after it may be another function or a jump target.
+                if (len + insn.length < JMP_SIZE) {
+                    std::cout << "not enough room for a jump at 0x" << std::hex << addr << std::dec << std::endl;
+                    return false;
+                }
+            }
+            len += insn.length;
+        }
+        for (uint64_t a = addr; a < addr + len; a++) {
+            if (m_breakpoints.Lookup(a)) {
+                std::cout << "0x" << std::hex << a << std::dec << " is a breakpoint" << std::endl;
+                return false;
+            }
+        }
+        // The jmp replaces several instructions at once: no thread may be stopped inside them or run them meanwhile.
+        return WithAllStopped([&] { return PatchFastTracepoint(addr, spec, code, len); });
+    }
+
+    bool PatchFastTracepoint(uint64_t addr, const FastTraceSpec& spec, const uint8_t* code, size_t len) {
+        constexpr size_t JMP_SIZE = 5;
+        for (const auto& [tid, t] : m_threads) {
+            uint64_t pc = 0;
+            if (Regs(tid).Get(Reg::RIP, pc) && pc > addr && pc < addr + len) {
+                std::cout << "thread " << tid << " is stopped at 0x" << std::hex << pc << std::dec
+                          << ", inside the instructions the jump replaces" << std::endl;
+                return false;
+            }
+        }
+
+        TrampolineBuilder tb;
+        tb.Build(m_traceRing, uint32_t(m_fastTraces.size()), addr, spec);
+        size_t maxSize = tb.code.size() + len * 2 + 16 + JMP_SIZE;
+        uint64_t tramp = AllocateTrampoline(addr, maxSize);
+        if (!tramp || !RelocateX86(code, len, addr, tramp, tb.code) || !tb.EmitJump(tramp, addr + len)) {
+            std::cout << "can't relocate the instructions at 0x" << std::hex << addr << std::dec << std::endl;
+            return false;
+        }
+        if (m_memory.WriteWith(MemBackend::ProcMem, tramp, tb.code.data(), tb.code.size()) != tb.code.size()) {
+            return false;
+        }
+        m_decodeCache.Invalidate(tramp, tb.code.size());
+
+        FastTracepoint ft = { addr, spec, std::vector<uint8_t>(code, code + len), tramp };
+        int32_t rel = int32_t(tramp - (addr + JMP_SIZE));
+        uint8_t jump[JMP_SIZE + X86DecodeCache::MAX_INSN];
+        if (len < JMP_SIZE || len > sizeof(jump)) return false;
+        jump[0] = 0xE9;
+        std::memcpy(jump + 1, &rel, sizeof(rel));
+        std::memset(jump + JMP_SIZE, 0x90, len - JMP_SIZE);
+        for (size_t i = 0; i < len; i++) m_patcher.Queue(addr + i, jump[i]);
+        if (!FlushCodePatches()) return false;
+        m_fastTraces.push_back(std::move(ft));
+        return true;
+    }
+
+    bool RemoveFastTracepoint(uint64_t addr) {
+        for (FastTracepoint& ft : m_fastTraces) {
+            if (ft.addr != addr || ft.original.empty()) continue;
+            for (size_t i = 0; i < ft.original.size(); i++) m_patcher.Queue(addr + i, ft.original[i]);
+            // The trampoline stays mapped, a thread may still be inside it.
+            ft.original.clear();
+            return WithAllStopped([this] { return FlushCodePatches(); });
+        }
+        return false;
+    }
+
+    void ListFastTracepoints(size_t showRecords) {
+        std::vector<TraceRecord> recent;
+        std::vector<TraceRingReader::SiteStats> sites;
+        uint64_t drained = 0, dropped = 0;
+        if (m_traceReader.IsOpen()) m_traceReader.Snapshot(recent, showRecords, sites, drained, dropped);
+
+        for (const TraceRecord& r : recent) {
+            const FastTracepoint& ft = m_fastTraces[r.site];
+            std::cout << std::dec << std::setfill(' ') << std::setw(10) << r.seq - 1 << " tsc " << r.tsc << " ";
+            PrintLocation(ft.addr);
+            for (size_t i = 0; i < ft.spec.regs.size(); i++) {
+                std::cout << "    " << GetRegDesc(ft.spec.regs[i]).name << " = 0x" << std::hex << r.regs[i] << std::dec
+                          << std::endl;
+            }
+            if (r.memLen) HexDump(0, r.mem, r.memLen);
+        }
+        if (showRecords) return;
+
+        for (size_t i = 0; i < m_fastTraces.size(); i++) {
+            uint64_t hits = i < sites.size() ? sites[i].hits : 0;
+            std::cout << std::dec << std::setfill(' ') << std::setw(12) << hits << " hits  "
+                      << (m_fastTraces[i].original.empty() ? "(removed) " : "");
+            PrintLocation(m_fastTraces[i].addr);
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_traceStart).count();
+        std::cout << std::dec << drained << " records drained (" << std::fixed << std::setprecision(0)
+                  << (secs > 0 ? double(drained) / secs : 0) << "/s), " << dropped << " dropped" << std::endl;
+    }
+
+    bool OpenTraceFile(const std::string& path, uint32_t records) {
+        if ((records & (records - 1)) || records == 0) {
+            std::cout << "the record count must be a power of two" << std::endl;
+            return false;
+        }
+        if (!m_tracepoints.empty()) {
+            std::cout << "delete the tracepoints first, their sites are in " << m_traceFile.Path() << std::endl;
+            return false;
+        }
+        return m_traceFile.Open(path, records);
+    }
+
+    // Makes addr a breakpoint whose hits append a record to the trace file and resume right away. A condition on the
+    // breakpoint filters the records.
+    bool AddTracepoint(uint64_t addr, const TraceSpec& spec) {
+        if (m_tracepoints.count(addr)) {
+            std::cout << "0x" << std::hex << addr << std::dec << " is already a tracepoint" << std::endl;
+            return false;
+        }
+        if (!m_traceFile.IsOpen() && !OpenTraceFile(m_progName + ".trace", TRACE_FILE_DEFAULT_RECORDS)) return false;
+        const Symbol* sym = Symbols().Find(addr);
+        int site = m_traceFile.AddSite(addr, sym ? sym->name : "", spec);
+        if (site < 0) {
+            std::cout << "no more than " << TRACE_FILE_MAX_SITES << " tracepoints per trace file" << std::endl;
+            return false;
+        }
+        SetBreakpointAtAddress(addr);
+        Breakpoint* bp = m_breakpoints.Lookup(addr);
+        bp->SetFlags(bp->GetFlags() | Breakpoint::TRACEPOINT);
+        m_tracepoints[addr] = { uint32_t(site), spec };
+        return true;
+    }
+
+    // Called at a stop on a tracepoint. Registers come from the one PTRACE_GETREGS of the register cache, all memory
+    // ranges from one scatter read.
+    void RecordTracepoint(Breakpoint& bp) {
+        auto it = m_tracepoints.find(bp.GetAddr());
+        if (it == m_tracepoints.end() || !ShouldStop(bp)) return;
+        const Tracepoint& tp = it->second;
+        TraceRecord& r = m_traceFile.Next();
+        r.site = tp.site;
+        r.tsc = __rdtsc();
+        RegisterCache& regs = Regs();
+        for (size_t i = 0; i < tp.spec.regs.size(); i++) {
+            if (!regs.Get(tp.spec.regs[i], r.regs[i])) r.regs[i] = 0;
+        }
+        MemIoVec vecs[TRACE_MAX_MEM_RANGES];
+        uint32_t memLen = 0;
+        for (size_t i = 0; i < tp.spec.mem.size(); i++) {
+            const TraceSpec::MemRange& m = tp.spec.mem[i];
+            uint64_t base = 0;
+            regs.Get(m.base, base);
+            vecs[i] = { base + uint64_t(int64_t(m.offset)), r.mem + memLen, m.len };
+            memLen += m.len;
+        }
+        if (memLen) {
+            std::memset(r.mem, 0, memLen);
+            m_memory.ReadV(vecs, tp.spec.mem.size());
+        }
+        r.memLen = memLen;
+        m_traceFile.Commit(r);
+    }
+
+    void ListTracepoints() {
+        if (!m_traceFile.IsOpen()) {
+            std::cout << "no trace file" << std::endl;
+            return;
+        }
+        for (const auto& [addr, tp] : m_tracepoints) {
+            const Breakpoint* bp = m_breakpoints.Lookup(addr);
+            std::cout << std::dec << std::setfill(' ') << std::setw(12) << (bp ? bp->GetHits() : 0) << " hits  ";
+            PrintLocation(addr);
+            std::cout << "           ";
+            for (Reg r : tp.spec.regs) std::cout << ' ' << GetRegDesc(r).name;
+            for (const TraceSpec::MemRange& m : tp.spec.mem) {
+                std::cout << " mem " << GetRegDesc(m.base).name << std::showpos << m.offset << std::noshowpos << ' '
+                          << m.len;
+            }
+            std::cout << std::endl;
+        }
+        m_traceFile.Calibrate();
+        std::cout << m_traceFile.Written() << " records written to " << m_traceFile.Path() << std::endl;
+    }
+
+    // Basic block leaders of a function found by decoding it linearly: the entry, direct branch targets inside it and
+    // the instructions after branches and returns. Only addresses the decode reached as instruction boundaries are
+    // returned, an int3 inside an instruction would corrupt it.
+    void FindBasicBlocks(const Symbol& sym, std::vector<uint64_t>& out) {
+        std::vector<uint8_t> code(sym.size);
+        size_t n = ReadOriginalCode(sym.addr, code.data(), code.size());
+        std::vector<uint64_t> boundaries, leaders = { sym.addr };
+        for (size_t off = 0; off < n;) {
+            X86Insn insn;
+            if (!DecodeX86(code.data() + off, n - off, insn)) break;
+            uint64_t a = sym.addr + off;
+            boundaries.push_back(a);
+            switch (insn.kind) {
+                case X86Insn::JMP_REL:
+                case X86Insn::JCC_REL:
+                case X86Insn::LOOP_REL:
+                    leaders.push_back(insn.BranchTarget(a, code.data() + off));
+                    leaders.push_back(a + insn.length);
+                    break;
+                case X86Insn::JMP_IND:
+                case X86Insn::RET:
+                    leaders.push_back(a + insn.length);
+                    break;
+                default:
+                    break;
+            }
+            off += insn.length;
+        }
+        std::sort(leaders.begin(), leaders.end());
+        leaders.erase(std::unique(leaders.begin(), leaders.end()), leaders.end());
+        for (uint64_t l : leaders) {
+            if (std::binary_search(boundaries.begin(), boundaries.end(), l)) out.push_back(l);
+        }
+    }
+
+    // Puts a one-shot breakpoint on every function entry (or basic block) of the module whose path contains
+    // moduleName, the main executable when it's empty. All int3s go in with one batch of code patches.
+    bool StartCoverage(CoverageMap::Mode mode, std::string_view moduleName) {
+        if (!m_coverage.Empty()) StopCoverage();
+        std::string module;
+        if (moduleName.empty()) {
+            char exe[PATH_MAX];
+            ssize_t len = readlink(("/proc/" + std::to_string(m_pid) + "/exe").c_str(), exe, sizeof(exe) - 1);
+            if (len > 0) module.assign(exe, size_t(len));
+        }
+        std::vector<MemoryMapping> maps = Mappings();
+        uint64_t base = ~uint64_t(0);
+        for (const MemoryMapping& m : maps) {
+            bool match = moduleName.empty() ? m.path == module : m.path.find(moduleName) != std::string::npos;
+            if (!match || (!module.empty() && m.path != module)) continue;
+            module = m.path;
+            base = std::min(base, m.start);
+        }
+        if (module.empty() || base == ~uint64_t(0)) {
+            std::cout << "no mapped module matches '" << moduleName << "'" << std::endl;
+            return false;
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+        const SymbolTable& symbols = Symbols();
+        std::vector<uint64_t> addrs;
+        size_t functions = 0;
+        for (const MemoryMapping& m : maps) {
+            if (m.path != module || !m.IsExecutable()) continue;
+            symbols.ForEachIn(m.start, m.end, [&](const Symbol& sym) {
+                if (sym.name.ends_with("@plt")) return;
+                functions++;
+                if (mode == CoverageMap::Mode::Blocks && sym.size) FindBasicBlocks(sym, addrs);
+                else addrs.push_back(sym.addr);
+            });
+        }
+        m_coverage.Reset(mode, module, base, std::move(addrs));
+
+        // The current instruction runs next anyway. Addresses that already have a breakpoint keep it, hits on it are
+        // recorded as well.
+        uint64_t pc = GetPC();
+        m_coverage.Record(pc);
+        size_t inserted = 0;
+        for (uint64_t a : m_coverage.Addrs()) {
+            if (a == pc || m_breakpoints.Lookup(a)) continue;
+            Breakpoint& bp = m_breakpoints.Get(m_breakpoints.Insert(a));
+            bp.SetFlags(Breakpoint::COVERAGE);
+            bp.Enable(m_patcher);
+            inserted++;
+        }
+        bool ok = FlushCodePatches();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        std::cout << std::dec << inserted << " coverage breakpoints on "
+                  << (mode == CoverageMap::Mode::Blocks ? "basic blocks of " : "") << functions << " functions in "
+                  << module << " (" << std::fixed << std::setprecision(1) << ms << " ms)" << std::endl;
+        return ok;
+    }
+
+    // Records a stop at bp. A coverage breakpoint is removed, the patch goes out with the next resume. Returns true
+    // when bp was a coverage breakpoint, so the stop concerns nobody else.
+    bool OnCoverageHit(Breakpoint& bp) {
+        uint64_t addr = bp.GetAddr();
+        if (!m_coverage.Record(addr) || !(bp.GetFlags() & Breakpoint::COVERAGE)) return false;
+        bp.Disable(m_patcher);
+        m_breakpoints.Erase(addr);
+        return true;
+    }
+
+    // Removes the coverage breakpoints that weren't hit. The bitmap is kept for the report.
+    bool StopCoverage() {
+        std::vector<uint64_t> remaining;
+        for (uint64_t a : m_coverage.Addrs()) {
+            Breakpoint* bp = m_breakpoints.Lookup(a);
+            if (!bp || !(bp->GetFlags() & Breakpoint::COVERAGE)) continue;
+            bp->Disable(m_patcher);
+            remaining.push_back(a);
+        }
+        bool ok = FlushCodePatches();
+        for (uint64_t a : remaining) m_breakpoints.Erase(a);
+        return ok;
+    }
+
+    // Per function: instrumented addresses hit and total, then the totals. Functions that never ran are listed only
+    // with all.
+    void CoverageReport(std::ostream& out, bool all) {
+        const SymbolTable& symbols = Symbols();
+        const std::vector<uint64_t>& addrs = m_coverage.Addrs();
+        size_t functions = 0, functionsHit = 0, inserted = 0;
+        for (size_t i = 0; i < addrs.size();) {
+            const Symbol* sym = symbols.Find(addrs[i]);
+            size_t j = i, hit = 0;
+            for (; j < addrs.size() && (j == i || (sym && symbols.Find(addrs[j]) == sym)); j++) {
+                hit += m_coverage.IsHit(j);
+                const Breakpoint* bp = m_breakpoints.Lookup(addrs[j]);
+                inserted += bp && (bp->GetFlags() & Breakpoint::COVERAGE);
+            }
+            functions++;
+            functionsHit += hit != 0;
+            if (hit || all) {
+                out << std::dec << std::setfill(' ') << std::setw(6) << hit << '/' << std::left << std::setw(6)
+                    << j - i << std::right << " 0x" << std::hex << std::setfill('0') << std::setw(16) << addrs[i]
+                    << ' ' << (sym ? sym->name : "?") << std::endl;
+            }
+            i = j;
+        }
+        bool blocks = m_coverage.GetMode() == CoverageMap::Mode::Blocks;
+        out << std::dec << std::fixed << std::setprecision(1) << functionsHit << '/' << functions << " functions ("
+            << (functions ? 100.0 * double(functionsHit) / double(functions) : 0.0) << "%)";
+        if (blocks) {
+            out << ", " << m_coverage.HitCount() << '/' << addrs.size() << " blocks ("
+                << (addrs.empty() ? 0.0 : 100.0 * double(m_coverage.HitCount()) / double(addrs.size())) << "%)";
+        }
+        out << " in " << m_coverage.Module() << ", " << inserted << " breakpoints still inserted" << std::endl;
+    }
+
+    bool ExportCoverage(const std::string& path) {
+        std::ofstream report(path + ".txt", std::ios::trunc);
+        CoverageReport(report, true);
+        if (!m_coverage.Export(path) || !report) {
+            std::cout << "failed to write " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        std::cout << "wrote " << path << " and " << path << ".txt" << std::endl;
+        return true;
+    }
+
+    // Reports a SIGTRAP caused by a debug register. Returns the slot or -1.
+    int OnHardwareStop() {
+        if (!m_debugRegs.Any() || !WIFSTOPPED(m_waitStatus) || WSTOPSIG(m_waitStatus) != SIGTRAP) return -1;
+        int slot = m_debugRegs.TakeHit(m_tid);
+        if (slot < 0) return -1;
+
+        const DebugRegisters::Slot& s = m_debugRegs.Get(slot);
+        PrintThreadOfStop();
+        if (s.type == HwBreakType::Execute) {
+            std::cout << "hit hardware breakpoint at ";
+            PrintLocation(s.addr);
+            return slot;
+        }
+        uint64_t value = 0;
+        ReadMemory(s.addr, &value, s.len);
+        std::cout << "watchpoint dr" << std::dec << slot << " (" << HwBreakTypeName(s.type) << " 0x" << std::hex
+                  << s.addr << ") value 0x" << value << " after ";
+        PrintLocation(GetPC());
+        return slot;
+    }
+
+    bool StepOverBreakpoint() {
+        if (m_debugRegs.Find(GetPC(), HwBreakType::Execute) >= 0) {
+            // Resume flag: the instruction at the breakpoint executes once without faulting again.
+            uint64_t flags;
+            if (!Regs().Get(Reg::RFLAGS, flags) || !Regs().Set(Reg::RFLAGS, flags | DebugRegisters::RFLAGS_RF)) {
+                return false;
+            }
+        }
+
+        Breakpoint* bp = m_breakpoints.Lookup(GetPC());
+        if (!bp || !bp->IsEnabled()) return true;
+        if ((bp->GetFlags() & Breakpoint::COVERAGE) && OnCoverageHit(*bp)) return true; // reached by a single step
+        if (m_displacedStepping && DisplacedStep(*bp)) return true;
+
+        // In place: the int3 is lifted for one instruction, no other thread may run meanwhile.
+        return WithAllStopped([this, bp] {
+            bp->Disable(m_patcher);
+            if (!PrepareResume()) return false;
+            ResumeThread(m_tid, PTRACE_SINGLESTEP);
+            WaitForThread(m_tid);
+            bp->Enable(m_patcher);
+            return FlushCodePatches();
+        });
+    }
+
+    // The original instruction under a breakpoint, relocated into a scratch area so it can be single-stepped there
+    // while the int3 stays in place.
+    struct DisplacedCopy {
+        uint64_t scratch;
+        uint8_t length;   // relocated length
+        uint8_t origLength;
+        X86Insn::Kind kind;
+        uint64_t target;  // call rel32, which is emulated instead
+        bool usable;
+        bool stale;       // the original bytes were overwritten, relocate them again into the same scratch area
+    };
+
+    // Marks the displaced copies of instructions that overlap [address, address + len) stale.
+    void InvalidateDisplaced(uint64_t address, size_t len) {
+        constexpr size_t MAX_INSN = X86DecodeCache::MAX_INSN;
+        uint64_t first = address - std::min<uint64_t>(address, MAX_INSN - 1);
+        if (m_displaced.size() < len + MAX_INSN) {
+            for (auto& [a, copy] : m_displaced) {
+                if (a >= first && a < address + len) copy.stale = true;
+            }
+        }
+        else {
+            for (uint64_t a = first; a < address + len; a++) {
+                if (auto it = m_displaced.find(a); it != m_displaced.end()) it->second.stale = true;
+            }
+        }
+    }
+
+    DisplacedCopy PrepareDisplaced(const Breakpoint& bp, uint64_t scratch = 0) {
+        DisplacedCopy copy = {};
+        copy.scratch = scratch;
+        uint64_t addr = bp.GetAddr();
+        const X86DecodeCache::Entry* decoded = DecodeAt(addr);
+        if (!decoded) return copy;
+        const X86Insn& insn = decoded->insn;
+        const uint8_t* code = decoded->bytes;
+        for (uint64_t a = addr + 1; a < addr + insn.length; a++) {
+            if (m_breakpoints.Lookup(a)) return copy; // another int3 inside the instruction
+        }
+        copy.origLength = insn.length;
+        copy.kind = insn.kind;
+        if (insn.kind == X86Insn::CALL_REL) {
+            copy.target = insn.BranchTarget(addr, code);
+            copy.usable = true;
+            return copy;
+        }
+
+        std::vector<uint8_t> relocated;
+        if (!scratch) scratch = copy.scratch = AllocateTrampoline(addr, 32);
+        if (!scratch || !RelocateX86(code, insn.length, addr, scratch, relocated) ||
+            m_memory.WriteWith(MemBackend::ProcMem, scratch, relocated.data(), relocated.size()) != relocated.size()) {
+            return copy;
+        }
+        m_decodeCache.Invalidate(scratch, relocated.size());
+        copy.length = uint8_t(relocated.size());
+        copy.usable = true;
+        return copy;
+    }
+
+    // Executes the instruction under bp without removing the int3: a relocated copy is single-stepped in a scratch
+    // area (call rel32 is emulated), then rip and anything else that captured the scratch address is mapped back.
+    // Returns false when the instruction can't be displaced and the caller has to step in place.
+    bool DisplacedStep(const Breakpoint& bp) {
+        uint64_t addr = bp.GetAddr();
+        auto it = m_displaced.find(addr);
+        if (it == m_displaced.end()) it = m_displaced.emplace(addr, PrepareDisplaced(bp)).first;
+        else if (it->second.stale) it->second = PrepareDisplaced(bp, it->second.scratch);
+        const DisplacedCopy& copy = it->second;
+        if (!copy.usable) return false;
+
+        RegisterCache& regs = Regs();
+        uint64_t next = addr + copy.origLength;
+        if (copy.kind == X86Insn::SYSCALL) {
+            // A new process or thread would return from the syscall into the scratch area, and a forked child isn't
+            // traced so its rip can't be mapped back. Those are stepped in place.
+            uint64_t nr = 0;
+            if (!regs.Get(Reg::RAX, nr) || nr == SYS_clone || nr == SYS_fork || nr == SYS_vfork || nr == SYS_clone3) {
+                return false;
+            }
+        }
+        if (copy.kind == X86Insn::CALL_REL) {
+            uint64_t sp;
+            if (!regs.Get(Reg::RSP, sp) || !WriteMemory(sp - 8, &next, sizeof(next))) return false;
+            return regs.Set(Reg::RSP, sp - 8) && regs.Set(Reg::RIP, copy.target);
+        }
+
+        uint64_t scratchEnd = copy.scratch + copy.length;
+        if (!regs.Set(Reg::RIP, copy.scratch) || !PrepareResume()) return false;
+        ResumeThread(m_tid, PTRACE_SINGLESTEP);
+        if (WaitForThread(m_tid) < 0) return true;
+
+        uint64_t pc = GetPC();
+        if (pc == scratchEnd) SetPC(next);
+        else if (pc == copy.scratch) SetPC(addr); // faulted, report it at the original address
+        if (copy.kind == X86Insn::CALL_IND) {
+            uint64_t sp = 0, ret = 0;
+            if (regs.Get(Reg::RSP, sp) && ReadMemory(sp, &ret, sizeof(ret)) && ret == scratchEnd) {
+                WriteMemory(sp, &next, sizeof(next));
+            }
+        }
+        else if (copy.kind == X86Insn::SYSCALL) {
+            uint64_t rcx = 0;
+            if (regs.Get(Reg::RCX, rcx) && rcx == scratchEnd) regs.Set(Reg::RCX, next);
+        }
+        return true;
+    }
+
+    // Resumes until a stop the user has to see. Breakpoints whose condition is false, coverage breakpoints and writes
+    // that only share a page with a watched range are handled here without returning to the prompt.
+    // In non-stop mode only the current thread is resumed unless all is set, and when it is already running this just
+    // waits for the next stop of any thread. Without block it only handles the stops that are already pending, which is
+    // how the event loop decodes them at the prompt.
+    int ContinueExecution(bool all, bool block = true) {
+        auto begin = std::chrono::steady_clock::now();
+        uint64_t falseHits = 0, coverageHits = 0, traceHits = 0;
+        Breakpoint* bp = nullptr;
+        pid_t current = m_tid;
+        bool resume = block && IsStopped(m_tid);
+        if (!resume && !all && !AnyRunning()) return 0;
+        while (true) {
+            if (resume || all) {
+                if (resume && !StepOverBreakpoint()) return -1;
+                bool one = m_nonStop && !all;
+                if (!PrepareResume() || !(one ? ResumeThread(m_tid, PTRACE_CONT) : ResumeAll())) return -1;
+            }
+            resume = true;
+            all = false;
+            if (int ret = WaitForSignal(block); ret < 0) {
+                return ret;
+            }
+            else if (ret) {
+                // Nothing to report, the current thread stays what it was.
+                if (m_threads.count(current)) m_tid = current;
+                return 0;
+            }
+            if (OnProtectionFault() == FaultKind::Unrelated) continue;
+            bp = OnStop();
+            if (bp && OnCoverageHit(*bp)) {
+                coverageHits++;
+                continue;
+            }
+            if (bp && (bp->GetFlags() & Breakpoint::TRACEPOINT)) {
+                RecordTracepoint(*bp);
+                traceHits++;
+                continue;
+            }
+            if (!bp || ShouldStop(*bp)) break;
+            falseHits++;
+        }
+
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        if (falseHits) {
+            std::cout << std::dec << falseHits << " false condition hits resumed (" << std::fixed << std::setprecision(0)
+                      << double(falseHits) / secs << " hits/s, " << std::setprecision(1)
+                      << secs * 1e6 / double(falseHits) << " us/hit)" << std::endl;
+        }
+        if (coverageHits) {
+            std::cout << std::dec << coverageHits << " coverage breakpoints hit and removed (" << std::fixed
+                      << std::setprecision(0) << double(coverageHits) / secs << " hits/s)" << std::endl;
+        }
+        if (traceHits) {
+            std::cout << std::dec << traceHits << " tracepoint hits logged (" << std::fixed << std::setprecision(0)
+                      << double(traceHits) / secs << " events/s, " << std::setprecision(1)
+                      << secs * 1e6 / double(traceHits) << " us/event)" << std::endl;
+        }
+        if (bp) {
+            PrintThreadOfStop();
+            std::cout << "hit breakpoint at ";
+            PrintLocation(bp->GetAddr());
+        }
+        else {
+            OnHardwareStop();
+        }
+        return 0;
+    }
+
+    enum struct StepKind : uint8_t { Step, Next, Until, Finish, COUNT };
+
+    struct StepStats {
+        uint64_t commands;
+        uint64_t stops;        // ptrace stops, single steps included
+        uint64_t singleSteps;
+        uint64_t breakpoints;  // temporary breakpoints inserted
+    };
+
+    struct TemporaryBreakpoint {
+        uint64_t addr;
+        bool borrowed; // a disabled user breakpoint, enabled for the command
+    };
+
+    // Breakpoints to run to, plus a range that has to be single-stepped because it couldn't be decoded.
+    struct StepPlan {
+        std::vector<uint64_t> breakpoints;
+        uint64_t stepFrom = 0;
+        uint64_t stepTo = 0;
+    };
+
+    // A stack frame, identified by the address of its return address slot.
+    struct FrameRef {
+        uint64_t slot;
+        uint64_t rsp;
+        bool exact; // false when the slot is unknown and only rsp describes the frame
+    };
+
+    // The frame executing at pc with the given rsp and rbp, other registers are the current ones. Its slot comes from
+    // the unwind tables or, without them, from what is known about the function's code: at the entry and at a ret
+    // it's the top of the stack, after a frame pointer prologue it's rbp+8.
+    FrameRef FrameAt(uint64_t pc, uint64_t sp, uint64_t fp, const SymbolTable& symbols, const CallFrameTable& cfi) {
+        static constexpr uint8_t ENDBR64[] = { 0xf3, 0x0f, 0x1e, 0xfa };
+        static constexpr uint8_t PROLOGUE[] = { 0x55, 0x48, 0x89, 0xe5 }; // push rbp; mov rbp, rsp
+        FrameRef frame = { sp, sp, true };
+        int reg = 0;
+        int64_t offset = 0;
+        if (cfi.Find(pc, reg, offset)) {
+            Reg r = GetRegisterFromDwarf(reg);
+            uint64_t base = 0;
+            if (r == Reg::RSP || r == Reg::RBP || Regs().Get(r, base)) {
+                frame.slot = (r == Reg::RSP ? sp : r == Reg::RBP ? fp : base) + uint64_t(offset) - 8;
+                return frame;
+            }
+        }
+
+        const X86DecodeCache::Entry* decoded = DecodeAt(pc);
+        if (decoded && decoded->insn.kind == X86Insn::RET) return frame;
+        const Symbol* sym = symbols.Find(pc);
+        if (!sym) {
+            frame.exact = false;
+            return frame;
+        }
+        uint8_t code[8] = {};
+        ReadOriginalCode(sym->addr, code, sizeof(code));
+        uint64_t push = sym->addr + (std::memcmp(code, ENDBR64, sizeof(ENDBR64)) == 0 ? sizeof(ENDBR64) : 0);
+        bool prologue = std::memcmp(code + (push - sym->addr), PROLOGUE, sizeof(PROLOGUE)) == 0;
+        if (pc <= push) return frame;
+        if (prologue && pc == push + 1) frame.slot = sp + 8;
+        else if (prologue && pc >= push + sizeof(PROLOGUE)) frame.slot = fp + 8;
+        else frame.exact = false;
+        return frame;
+    }
+
+    FrameRef CurrentFrame(const SymbolTable& symbols, const CallFrameTable& cfi) {
+        uint64_t sp = 0, fp = 0;
+        Regs().Get(Reg::RSP, sp);
+        Regs().Get(Reg::RBP, fp);
+        return FrameAt(GetPC(), sp, fp, symbols, cfi);
+    }
+
+    // True when cur runs below start, e.g. a recursive call reaching one of the stepping breakpoints. Frames that
+    // can't be told apart count as the same.
+    static bool IsDeeper(const FrameRef& cur, const FrameRef& start) {
+        return cur.exact && start.exact && cur.slot < start.slot;
+    }
+
+    // Leaves exactly addrs armed for the running stepping command. User breakpoints at those addresses are reused.
+    bool ArmTemporaryBreakpoints(std::vector<uint64_t>& addrs, StepStats& stats) {
+        std::sort(addrs.begin(), addrs.end());
+        addrs.erase(std::unique(addrs.begin(), addrs.end()), addrs.end());
+        for (const TemporaryBreakpoint& t : m_tempBreakpoints) {
+            Breakpoint* bp = m_breakpoints.Lookup(t.addr);
+            if (bp->IsEnabled() && !std::binary_search(addrs.begin(), addrs.end(), t.addr)) bp->Disable(m_patcher);
+        }
+        for (uint64_t a : addrs) {
+            Breakpoint* bp = m_breakpoints.Lookup(a);
+            if (!bp) {
+                bp = &m_breakpoints.Get(m_breakpoints.Insert(a));
+                bp->SetFlags(Breakpoint::TEMPORARY);
+                m_tempBreakpoints.push_back({ a, false });
+                stats.breakpoints++;
+            }
+            else if (!bp->IsEnabled() && !(bp->GetFlags() & Breakpoint::TEMPORARY)) {
+                bp->SetFlags(bp->GetFlags() | Breakpoint::TEMPORARY);
+                m_tempBreakpoints.push_back({ a, true });
+            }
+            if (!bp->IsEnabled()) bp->Enable(m_patcher);
+        }
+        return FlushCodePatches();
+    }
+
+    // Disables all temporary breakpoints in one batch of code patches, then drops the ones the command created. Their
+    // displaced copies are kept, the next command likely stops at the same addresses.
+    bool ClearTemporaryBreakpoints() {
+        bool exited = WIFEXITED(m_waitStatus) || WIFSIGNALED(m_waitStatus);
+        for (const TemporaryBreakpoint& t : m_tempBreakpoints) {
+            Breakpoint* bp = m_breakpoints.Lookup(t.addr);
+            if (bp->IsEnabled() && !exited) bp->Disable(m_patcher);
+            bp->SetFlags(bp->GetFlags() & ~Breakpoint::TEMPORARY);
+        }
+        bool ok = exited || FlushCodePatches();
+        for (const TemporaryBreakpoint& t : m_tempBreakpoints) {
+            if (!t.borrowed) m_breakpoints.Erase(t.addr);
+        }
+        m_tempBreakpoints.clear();
+        return ok;
+    }
+
+    // Fills plan with every way out of [range.start, range.end): the fall through and direct branch targets outside
+    // the range get breakpoints, instructions that leave it for an unknown address (indirect jumps, returns and, when
+    // stepping into calls, indirect calls) get one too so they can be single-stepped. Direct calls that are stepped
+    // into get a breakpoint at their target if it has line info.
+    void PlanRange(const LineTable::Range& range, bool stepInto, const LineTable& lines, StepPlan& plan) {
+        plan.breakpoints.clear();
+        plan.stepFrom = plan.stepTo = 0;
+        uint64_t a = range.start;
+        while (a < range.end) {
+            const X86DecodeCache::Entry* decoded = DecodeAt(a);
+            if (!decoded) {
+                plan.stepFrom = a;
+                plan.stepTo = range.end;
+                break;
+            }
+            const X86Insn& insn = decoded->insn;
+            switch (insn.kind) {
+                case X86Insn::JMP_REL:
+                case X86Insn::JCC_REL:
+                case X86Insn::LOOP_REL:
+                    if (uint64_t t = insn.BranchTarget(a, decoded->bytes); t < range.start || t >= range.end) {
+                        plan.breakpoints.push_back(t);
+                    }
+                    break;
+                case X86Insn::CALL_REL:
+                    if (uint64_t t = insn.BranchTarget(a, decoded->bytes); stepInto && lines.Find(t)) {
+                        plan.breakpoints.push_back(t);
+                    }
+                    break;
+                case X86Insn::CALL_IND:
+                    if (stepInto) plan.breakpoints.push_back(a);
+                    break;
+                case X86Insn::JMP_IND:
+                case X86Insn::RET:
+                    plan.breakpoints.push_back(a);
+                    break;
+                default:
+                    break;
+            }
+            a += insn.length;
+        }
+        plan.breakpoints.push_back(range.end);
+    }
+
+    enum struct StepAction { Stop, Continue, Replan };
+
+    // Runs the tracee to the breakpoints of plan and lets classify(pc) decide at each stop whether the command is done
+    // (StepAction::Stop), goes on (Continue) or goes on with a new plan (Replan). Returns 1 when classify stopped,
+    // 0 for any other stop, which is reported here, and a negative value on errors.
+
+    template <typename Classify>
+    int RunStepping(StepStats& stats, StepPlan& plan, Classify&& classify) {
+        uint64_t stops = m_ptraceStops;
+        pid_t thread = m_tid;
+        int ret = ArmTemporaryBreakpoints(plan.breakpoints, stats) ? 0 : -1;
+        while (ret == 0) {
+            if (m_tid != thread) {
+                // Another thread ran into one of the command's breakpoints. Move it past and go on with ours.
+                if (!StepOverBreakpoint() || (m_nonStop && !(PrepareResume() && ResumeThread(m_tid, PTRACE_CONT)))) {
+                    ret = -1;
+                    break;
+                }
+                m_tid = thread;
+            }
+            bool step = false;
+            if (!IsStopped(thread)) {
+                // Non-stop: another thread stopped while ours kept running.
+                if (WaitForSignal() < 0) {
+                    ret = -1;
+                    break;
+                }
+            }
+            else {
+                uint64_t pc = GetPC();
+                Breakpoint* here = m_breakpoints.Lookup(pc);
+                bool onBreakpoint = here && here->IsEnabled();
+                step = onBreakpoint || (pc >= plan.stepFrom && pc < plan.stepTo);
+                if (step) stats.singleSteps++;
+                if (!StepOverBreakpoint()) {
+                    ret = -1;
+                    break;
+                }
+                if (!onBreakpoint) {
+                    if (!PrepareResume()) {
+                        ret = -1;
+                        break;
+                    }
+                    bool resumed = step        ? ResumeThread(m_tid, PTRACE_SINGLESTEP)
+                                   : m_nonStop ? ResumeThread(m_tid, PTRACE_CONT)
+                                               : ResumeAll();
+                    if (!resumed || WaitForSignal() < 0) {
+                        ret = -1;
+                        break;
+                    }
+                }
+            }
+            if (m_tid != thread) step = false; // our single step hasn't finished
+
+            if (WIFEXITED(m_waitStatus) || WIFSIGNALED(m_waitStatus)) {
+                if (WIFEXITED(m_waitStatus)) std::cout << "program exited with code " << WEXITSTATUS(m_waitStatus);
+                else std::cout << "program terminated by signal " << strsignal(WTERMSIG(m_waitStatus));
+                std::cout << std::endl;
+                break;
+            }
+            FaultKind fault = OnProtectionFault();
+            if (fault == FaultKind::Watched) break;
+            Breakpoint* hit = nullptr;
+            if (fault == FaultKind::NotOurs) {
+                if (WSTOPSIG(m_waitStatus) != SIGTRAP) {
+                    PrintThreadOfStop();
+                    std::cout << "program received signal " << strsignal(WSTOPSIG(m_waitStatus)) << " at ";
+                    PrintLocation(GetPC());
+                    break;
+                }
+                if (OnHardwareStop() >= 0) break;
+                hit = step ? nullptr : OnStop();
+                if (!step && !hit) {
+                    std::cout << "trace trap at ";
+                    PrintLocation(GetPC());
+                    break;
+                }
+            }
+            if (hit && (hit->GetFlags() & Breakpoint::COVERAGE) &&
+                std::binary_search(plan.breakpoints.begin(), plan.breakpoints.end(), hit->GetAddr())) {
+                // Still a stepping target: the int3 stays and the breakpoint becomes one of the command's own.
+                m_coverage.Record(hit->GetAddr());
+                hit->SetFlags((hit->GetFlags() & ~Breakpoint::COVERAGE) | Breakpoint::TEMPORARY);
+                m_tempBreakpoints.push_back({ hit->GetAddr(), false });
+                hit = nullptr;
+            }
+            else if (hit && (hit->GetFlags() & Breakpoint::COVERAGE) && OnCoverageHit(*hit)) {
+                hit = nullptr;
+            }
+            else if (hit) {
+                m_coverage.Record(hit->GetAddr());
+            }
+            if (hit && (hit->GetFlags() & Breakpoint::TRACEPOINT)) {
+                RecordTracepoint(*hit);
+            }
+            else if (hit && !(hit->GetFlags() & Breakpoint::TEMPORARY) && ShouldStop(*hit)) {
+                PrintThreadOfStop();
+                std::cout << "hit breakpoint at ";
+                PrintLocation(hit->GetAddr());
+                if (!m_nonStop || m_tid == thread) break;
+                m_tid = thread; // the other thread stays stopped, ours goes on
+                continue;
+            }
+            if (m_tid != thread) continue;
+
+            StepAction action = classify(GetPC());
+            if (action == StepAction::Stop) ret = 1;
+            else if (action == StepAction::Replan && !ArmTemporaryBreakpoints(plan.breakpoints, stats)) ret = -1;
+        }
+        stats.stops += m_ptraceStops - stops;
+        if (!ClearTemporaryBreakpoints()) ret = -1;
+        return ret;
+    }
+
+    // Source line stepping. The current line is decoded and run with breakpoints on its exits (see PlanRange), so the
+    // tracee stops a few times per line no matter how many instructions it executes, calls stepped over included.
+    // Stops in deeper frames (recursion) are ignored. Landing in the middle of a line or on another part of the same
+    // line continues with that line.
+    int StepLine(StepKind kind) {
+        const SymbolTable& symbols = Symbols();
+        const LineTable& lines = Lines();
+        const CallFrameTable& cfi = CallFrames();
+        uint64_t pc = GetPC();
+        const LineRow* row = lines.Find(pc);
+        if (!row) {
+            std::cout << "no line information at ";
+            PrintLocation(pc);
+            return 0;
+        }
+        StepStats& stats = m_stepStats[size_t(kind)];
+        stats.commands++;
+
+        const Symbol* func = symbols.Find(pc);
+        LineRow line = *row;
+        FrameRef frame = CurrentFrame(symbols, cfi);
+        uint64_t returnTo = 0, returnSlot = 0; // running back out of code without line info
+        uint64_t prologueEnd = 0;              // running to the first line of a function stepped into
+        LineTable::Range range;
+        StepPlan plan;
+        auto replan = [&](uint64_t at) {
+            range = lines.LineRange(at);
+            // until doesn't stop at lines before the current one, which is how it leaves loops
+            if (kind == StepKind::Until && func && func->addr <= range.start) range.start = func->addr;
+            PlanRange(range, kind == StepKind::Step, lines, plan);
+        };
+        // The return address of a function just entered or jumped to, if it leads back to code with line info.
+        auto runToReturn = [&](const FrameRef& cur) {
+            uint64_t retAddr = 0;
+            if (!ReadMemory(cur.rsp, &retAddr, sizeof(retAddr)) || !lines.Find(retAddr)) return false;
+            returnTo = retAddr;
+            returnSlot = cur.rsp;
+            plan.breakpoints.assign(1, retAddr);
+            plan.stepFrom = plan.stepTo = 0;
+            return true;
+        };
+        replan(pc);
+
+        int ret = RunStepping(stats, plan, [&](uint64_t at) {
+            FrameRef cur = CurrentFrame(symbols, cfi);
+            const Symbol* curFunc = symbols.Find(at);
+            if (prologueEnd) return at == prologueEnd && curFunc == func ? StepAction::Stop : StepAction::Continue;
+            if (returnTo) {
+                if (at != returnTo || cur.rsp <= returnSlot) return StepAction::Continue;
+                returnTo = 0;
+                frame = cur;
+                func = curFunc;
+                replan(at);
+                return StepAction::Replan;
+            }
+            // Returning to the caller ends the command in the middle of the line with the call
+            if (IsDeeper(frame, cur)) return StepAction::Stop;
+            bool deeper = IsDeeper(cur, frame);
+            if (at >= range.start && at < range.end) return StepAction::Continue;
+
+            const LineRow* r = lines.Find(at);
+            bool entry = curFunc && curFunc->addr == at && curFunc != func;
+            if (kind == StepKind::Step && entry && r) {
+                // Step into the callee if the call came from the line being stepped, in this frame
+                uint64_t retAddr = 0, fp = 0;
+                if (!ReadMemory(cur.rsp, &retAddr, sizeof(retAddr)) || retAddr <= range.start || retAddr > range.end ||
+                    !Regs().Get(Reg::RBP, fp)) {
+                    return StepAction::Continue;
+                }
+                FrameRef caller = FrameAt(retAddr, cur.rsp + 8, fp, symbols, cfi);
+                if (caller.exact && frame.exact && caller.slot != frame.slot) return StepAction::Continue;
+                uint64_t next = lines.NextRowStart(at);
+                if (!next || next >= curFunc->addr + std::max<uint64_t>(curFunc->size, 1)) return StepAction::Stop;
+                func = curFunc;
+                prologueEnd = next;
+                plan.breakpoints.assign(1, next);
+                plan.stepFrom = plan.stepTo = 0;
+                return StepAction::Replan;
+            }
+            if (deeper) return StepAction::Continue;
+            if (!r || entry) {
+                // Called or jumped into code without line info, or next ended up at a function entry through a tail
+                // call: run to the return address. Returning into code without line info ends the command.
+                if (runToReturn(cur)) return StepAction::Replan;
+                return StepAction::Stop;
+            }
+            if (lines.IsStatementStart(at) && (r->line != line.line || r->file != line.file)) return StepAction::Stop;
+
+            // Somewhere inside a line: run to its end. Rows that aren't statements don't change the line that is
+            // being stepped, so optimized code that interleaves lines stops once per line.
+            frame = cur;
+            func = curFunc;
+            if (r->isStmt) line = *r;
+            replan(at);
+            return StepAction::Replan;
+        });
+        if (ret == 1) PrintSourceLocation(GetPC());
+        return ret < 0 ? ret : 0;
+    }
+
+    // Runs until the current function returns to its caller. Without unwind info or a frame pointer for the current
+    // frame every ret of the function is a breakpoint and the one executed at or above the current rsp is this frame's.
+    int Finish() {
+        const SymbolTable& symbols = Symbols();
+        uint64_t pc = GetPC();
+        FrameRef frame = CurrentFrame(symbols, CallFrames());
+        const Symbol* func = symbols.Find(pc);
+        StepStats& stats = m_stepStats[size_t(StepKind::Finish)];
+        StepPlan plan;
+        uint64_t retAddr = 0;
+        if (frame.exact) {
+            if (!ReadMemory(frame.slot, &retAddr, sizeof(retAddr))) {
+                std::cout << "can't read the return address at 0x" << std::hex << frame.slot << std::dec << std::endl;
+                return 0;
+            }
+            plan.breakpoints.push_back(retAddr);
+        }
+        else if (func && func->size) {
+            for (uint64_t a = func->addr; a < func->addr + func->size;) {
+                const X86DecodeCache::Entry* decoded = DecodeAt(a);
+                if (!decoded) break;
+                if (decoded->insn.kind == X86Insn::RET) plan.breakpoints.push_back(a);
+                a += decoded->insn.length;
+            }
+        }
+        if (plan.breakpoints.empty()) {
+            std::cout << "can't find where the function at 0x" << std::hex << pc << std::dec << " returns" << std::endl;
+            return 0;
+        }
+        stats.commands++;
+        std::cout << "run till exit from ";
+        PrintLocation(pc);
+
+        bool returning = false; // single-stepping this frame's ret
+        int ret = RunStepping(stats, plan, [&](uint64_t at) {
+            uint64_t sp = 0;
+            Regs().Get(Reg::RSP, sp);
+            if (frame.exact) return at == retAddr && sp > frame.slot ? StepAction::Stop : StepAction::Continue;
+            if (returning) return StepAction::Stop;
+            returning = std::binary_search(plan.breakpoints.begin(), plan.breakpoints.end(), at) && sp >= frame.rsp;
+            return StepAction::Continue;
+        });
+        if (ret == 1) {
+            PrintSourceLocation(GetPC());
+            uint64_t rax = 0;
+            Regs().Get(Reg::RAX, rax);
+            std::cout << "value returned: rax = 0x" << std::hex << rax << std::dec << " (" << int64_t(rax) << ")"
+                      << std::endl;
+        }
+        return ret < 0 ? ret : 0;
+    }
+
+    // Runs until addr is reached in the current frame or an outer one, or the current function returns.
+    int RunUntil(uint64_t addr) {
+        const SymbolTable& symbols = Symbols();
+        const CallFrameTable& cfi = CallFrames();
+        FrameRef frame = CurrentFrame(symbols, cfi);
+        StepStats& stats = m_stepStats[size_t(StepKind::Until)];
+        stats.commands++;
+        StepPlan plan;
+        plan.breakpoints.push_back(addr);
+        uint64_t retAddr = 0;
+        if (frame.exact && ReadMemory(frame.slot, &retAddr, sizeof(retAddr))) plan.breakpoints.push_back(retAddr);
+
+        int ret = RunStepping(stats, plan, [&](uint64_t at) {
+            FrameRef cur = CurrentFrame(symbols, cfi);
+            if (at == retAddr && cur.rsp > frame.slot) return StepAction::Stop;
+            if (at != addr) return StepAction::Continue;
+            return IsDeeper(cur, frame) ? StepAction::Continue : StepAction::Stop;
+        });
+        if (ret == 1) PrintSourceLocation(GetPC());
+        return ret < 0 ? ret : 0;
+    }
+
+    // file:line, the address and the source line when the file is readable.
+    void PrintSourceLocation(uint64_t addr) {
+        const LineTable& lines = Lines();
+        const LineRow* row = lines.Find(addr);
+        if (!row) {
+            PrintLocation(addr);
+            return;
+        }
+        const std::string& file = lines.FileName(row->file);
+        std::cout << file << ':' << std::dec << row->line << "  ";
+        PrintLocation(addr);
+        std::ifstream in(file);
+        std::string text;
+        for (uint32_t i = 0; i < row->line && std::getline(in, text); i++) {}
+        if (in) std::cout << std::dec << row->line << '\t' << text << std::endl;
+    }
+
+    void PrintStepStats(StepKind kind) {
+        const StepStats& st = m_stepStats[size_t(kind)];
+        double commands = double(std::max<uint64_t>(st.commands, 1));
+        std::cout << std::dec << st.commands << " commands, " << st.stops << " ptrace stops (" << std::fixed
+                  << std::setprecision(1) << double(st.stops) / commands << " per command), " << st.singleSteps
+                  << " single steps, " << st.breakpoints << " temporary breakpoints inserted" << std::endl;
+    }
+
+private:
+    void OpenCore() {
+        const std::vector<CoreFile::Thread>& threads = m_core->Threads();
+        m_memory.OpenCore(m_core.get());
+        for (const CoreFile::Thread& t : threads) {
+            m_regs[t.tid].Load(t.regs, t.xstate);
+            m_threads[t.tid].state = ThreadState::Stopped;
+        }
+        if (!threads.empty()) m_pid = m_tid = threads.front().tid;
+        if (m_progName.empty()) m_progName = m_core->ProgramName();
+
+        std::cout << std::dec << "core of " << m_progName << " (pid " << m_pid << "), " << threads.size()
+                  << " threads, " << m_core->Mappings().size() << " mappings";
+        if (!threads.empty() && threads.front().signal) {
+            std::cout << ", signal: " << strsignal(threads.front().signal);
+        }
+        std::cout << std::endl;
+    }
+
+    int HandleCmd(std::string_view line) {
+        constexpr std::string_view COMMAND_SEPARATOR = " ";
+        auto args = Split(line, COMMAND_SEPARATOR);
+        if (args.empty()) return 0;
+        std::string_view command = args[0];
+
+        if (m_core && (HasPrefix(command, "cont") || HasPrefix(command, "break") || HasPrefix(command, "gcore") ||
+                       HasPrefix(command, "hbreak") || HasPrefix(command, "watch") || HasPrefix(command, "pwatch") ||
+                       HasPrefix(command, "ftrace") || HasPrefix(command, "step") || HasPrefix(command, "next") ||
+                       HasPrefix(command, "until") || (HasPrefix(command, "finish") && args.size() == 1) ||
+                       HasPrefix(command, "coverage") || (HasPrefix(command, "trace") && args.size() >= 2 &&
+                                                          !HasPrefix(args[1], "convert")))) {
+            std::cout << command << " is not available when debugging a core file" << std::endl;
+        }
+        else if (m_nonStop && !IsStopped(m_tid) &&
+                 (HasPrefix(command, "step") || HasPrefix(command, "next") || HasPrefix(command, "until") ||
+                  HasPrefix(command, "finish") || HasPrefix(command, "register"))) {
+            std::cout << "thread " << m_tid << " is running, interrupt it or pick a stopped one with threads <tid>"
+                      << std::endl;
+        }
+        else if (HasPrefix(command, "cont")) {
+            // cont [all]
+            return ContinueExecution(args.size() == 2 && args[1] == "all");
+        }
+        else if (HasPrefix(command, "break") && args.size() >= 4 && args[2] == "if") {
+            // break <addr> if <condition>
+            uintptr_t addr = std::stoul(std::string(args[1]), 0, 16);
+            if (std::unique_ptr<Condition> cond = CompileCondition(line.substr(size_t(args[3].data() - line.data())))) {
+                SetBreakpointAtAddress(addr);
+                if (Breakpoint* bp = m_breakpoints.Lookup(addr)) AttachCondition(*bp, std::move(cond));
+            }
+        }
+        else if (HasPrefix(command, "condition") && args.size() >= 2) {
+            // condition <addr> [condition], without a condition the breakpoint becomes unconditional
+            std::string_view text = args.size() > 2 ? line.substr(size_t(args[2].data() - line.data())) : "";
+            SetCondition(std::stoul(std::string(args[1]), 0, 16), text);
+        }
+        else if (HasPrefix(command, "break") && args.size() >= 2) {
+            std::vector<uintptr_t> addrs;
+            addrs.reserve(args.size() - 1);
+            for (size_t i = 1; i < args.size(); i++) {
+                addrs.push_back(std::stoul(std::string(args[i]), 0, 16));
+            }
+            SetBreakpointsAtAddresses(addrs.data(), addrs.size());
+        }
+        else if (HasPrefix(command, "register") && args.size() >= 2) {
+            if (HasPrefix(args[1], "dump" ) && args.size() == 2) {
+                DumpRegisters();
+            }
+            else if (HasPrefix(args[1], "bench") && args.size() <= 3) {
+                BenchmarkRegisterLookups(args.size() == 3 ? std::stoul(std::string(args[2])) : 100000);
+            }
+            else if (args.size() >= 3 && GetRegisterFromName(args[2]) == Reg::DEFAULT) {
+                std::cout << "unknown register " << args[2] << std::endl;
+            }
+            else if (HasPrefix(args[1], "read") && args.size() >= 3 && !IsGeneralRegister(GetRegisterFromName(args[2]))) {
+                // register read <xmm|ymm|zmm|k|mxcsr> [lane format]
+                Reg r = GetRegisterFromName(args[2]);
+                uint8_t buf[64];
+                size_t size = 0;
+                if (!Regs().GetExtended(r, buf, size)) {
+                    std::cout << "error getting register " << args[2] << std::endl;
+                    return -1;
+                }
+                std::string fmt = args.size() == 4 ? std::string(args[3]) : "x" + std::to_string(std::min(size, size_t(8)) * 8);
+                if (!PrintRegisterLanes(buf, size, fmt)) {
+                    std::cout << "invalid lane format " << fmt << std::endl;
+                }
             }
             else if (HasPrefix(args[1], "read") && args.size() == 3) {
                 uint64_t regVal;
-                if (!GetRegisterValue(m_pid, GetRegisterFromName(args[2]), regVal)) {
+                if (!Regs().Get(GetRegisterFromName(args[2]), regVal)) {
                     std::cout << "error getting register " << args[2] << std::endl;
                     return -1;
                 }
                 std::cout << std::hex << "0x" << regVal << std::endl;
             }
+            else if (HasPrefix(args[1], "write") && args.size() == 4 && !IsGeneralRegister(GetRegisterFromName(args[2]))) {
+                Reg r = GetRegisterFromName(args[2]);
+                std::vector<uint8_t> bytes;
+                if (!ParseHexBytes(args[3], bytes) || bytes.size() > GetXStateRegisterSize(r)) {
+                    std::cout << "invalid value " << args[3] << std::endl;
+                }
+                else if (!Regs().SetExtended(r, bytes.data(), bytes.size())) {
+                    std::cout << "error setting register " << args[2] << std::endl;
+                }
+            }
             else if (HasPrefix(args[1], "write") && args.size() == 4) {
-                std::string val {args[3].substr(2)};
-                SetRegisterValue(m_pid, GetRegisterFromName(args[2]), std::stol(val, 0, 16));
+                std::vector<uint8_t> bytes;
+                uint64_t value = 0;
+                if (!ParseHexBytes(args[3], bytes) || bytes.size() > sizeof(value)) {
+                    std::cout << "invalid value " << args[3] << std::endl;
+                }
+                else {
+                    std::memcpy(&value, bytes.data(), bytes.size());
+                    if (!Regs().Set(GetRegisterFromName(args[2]), value)) {
+                        std::cout << "error setting register " << args[2] << std::endl;
+                    }
+                }
             }
         }
-        else if (HasPrefix(command, "memory")) {
+        else if (HasPrefix(command, "memory") && args.size() == 2 && HasPrefix(args[1], "cache")) {
+            DumpCacheStats();
+        }
+        else if (HasPrefix(command, "memory") && args.size() >= 3) {
             std::string addr {args[2].substr(2)};
-            if (HasPrefix(args[1], "read")) {
-                std::cout << std::hex << "0x" << ReadMemory(std::stol(addr, 0, 16)) << std::endl;
+            if (HasPrefix(args[1], "read") && args.size() == 4) {
+                uint64_t start = std::stoul(addr, 0, 16);
+                std::vector<uint8_t> buf(std::stoul(std::string(args[3]), 0, 0));
+                size_t n = m_cache.Read(start, buf.data(), buf.size());
+                HexDump(start, buf.data(), n);
+                if (n < buf.size()) {
+                    std::cerr << "error reading memory at 0x" << std::hex << (start + n) << std::endl;
+                }
+            }
+            else if (HasPrefix(args[1], "read")) {
+                uint64_t value = ReadMemory(std::stoul(addr, 0, 16));
+                std::cout << std::hex << "0x" << value << std::endl;
             }
-            else if (HasPrefix(args[1], "write")) {
+            else if (HasPrefix(args[1], "write") && args.size() == 4) {
                 std::string val {args[3].substr(2)};
-                if (WriteMemory(std::stol(addr, 0, 16), std::stol(val, 0, 16)) <= 0) {
+                if (WriteMemory(std::stoul(addr, 0, 16), std::stoul(val, 0, 16)) < 0) {
                     std::cerr << "error writing memory: " << strerror(errno) << std::endl;
                     return -1;
                 }
             }
+            else if (HasPrefix(args[1], "bench") && args.size() >= 4) {
+                size_t len = std::stoul(std::string(args[3]), 0, 0);
+                int iterations = args.size() == 5 ? std::stoi(std::string(args[4])) : 16;
+                BenchmarkMemory(std::stoul(addr, 0, 16), len, iterations);
+            }
+        }
+        else if (HasPrefix(command, "dump") && args.size() == 5 && HasPrefix(args[1], "memory")) {
+            // dump memory <file> <start> <end>
+            DumpMemoryToFile(std::string(args[2]), std::stoull(std::string(args[3]), 0, 16),
+                             std::stoull(std::string(args[4]), 0, 16));
+        }
+        else if (HasPrefix(command, "dump") && (args.size() == 3 || args.size() == 4) && HasPrefix(args[1], "mapping")) {
+            // dump mapping <name> [file]
+            DumpMappingToFile(args[2], args.size() == 4 ? std::string(args[3]) : std::string());
+        }
+        else if (HasPrefix(command, "hbreak") && args.size() >= 2) {
+            for (size_t i = 1; i < args.size(); i++) {
+                SetHardwareBreakpoint(std::stoul(std::string(args[i]), 0, 16));
+            }
+        }
+        else if (HasPrefix(command, "watch") && args.size() >= 2 && args.size() <= 4) {
+            // watch <addr> [len] [rw]
+            uintptr_t addr = std::stoul(std::string(args[1]), 0, 16);
+            uint8_t len = args.size() >= 3 ? uint8_t(std::stoul(std::string(args[2]))) : 8;
+            bool rw = args.size() == 4 && args[3] == "rw";
+            SetWatchpoint(addr, len, rw ? HwBreakType::ReadWrite : HwBreakType::Write);
+        }
+        else if (HasPrefix(command, "pwatch") && args.size() >= 2) {
+            // pwatch <addr> <len> | pwatch delete <addr> | pwatch list
+            if (HasPrefix(args[1], "list") && args.size() == 2) {
+                ListPageWatches();
+            }
+            else if (HasPrefix(args[1], "delete") && args.size() == 3) {
+                RemovePageWatch(std::stoul(std::string(args[2]), 0, 16));
+            }
+            else if (args.size() == 3) {
+                AddPageWatch(std::stoul(std::string(args[1]), 0, 16), std::stoul(std::string(args[2]), 0, 0));
+            }
+        }
+        else if (HasPrefix(command, "ftrace") && args.size() >= 2) {
+            // ftrace <addr> [reg...] [mem <reg>[+-offset] <len>] | ftrace list | ftrace show [n] | ftrace delete <addr>
+            if (HasPrefix(args[1], "list") && args.size() == 2) {
+                ListFastTracepoints(0);
+            }
+            else if (HasPrefix(args[1], "show") && args.size() <= 3) {
+                ListFastTracepoints(args.size() == 3 ? std::stoul(std::string(args[2])) : 10);
+            }
+            else if (HasPrefix(args[1], "delete") && args.size() == 3) {
+                RemoveFastTracepoint(std::stoul(std::string(args[2]), 0, 16));
+            }
+            else {
+                FastTraceSpec spec;
+                bool ok = true;
+                for (size_t i = 2; i < args.size() && ok; i++) {
+                    if (args[i] == "mem" && i + 2 < args.size()) {
+                        std::string_view base = args[i + 1];
+                        size_t sign = base.find_first_of("+-");
+                        spec.memBase = GetRegisterFromName(base.substr(0, sign));
+                        spec.memOffset = sign == std::string_view::npos ? 0 : int32_t(std::stol(std::string(base.substr(sign)), 0, 0));
+                        spec.memLen = uint32_t(std::stoul(std::string(args[i + 2]), 0, 0));
+                        ok = TrampolineBuilder::CanRecord(spec.memBase) && spec.memLen <= TRACE_MAX_MEM;
+                        i += 2;
+                    }
+                    else {
+                        Reg r = GetRegisterFromName(args[i]);
+                        ok = TrampolineBuilder::CanRecord(r) && spec.regs.size() < TRACE_MAX_REGS;
+                        spec.regs.push_back(r);
+                    }
+                }
+                if (!ok) {
+                    std::cout << "usage: ftrace <addr> [up to " << TRACE_MAX_REGS << " registers] [mem <reg>[+-offset] <len <= "
+                              << TRACE_MAX_MEM << ">]" << std::endl;
+                }
+                else {
+                    AddFastTracepoint(std::stoul(std::string(args[1]), 0, 16), spec);
+                }
+            }
+        }
+        else if (HasPrefix(command, "trace") && args.size() >= 2) {
+            // trace <addr|symbol> [reg...] [mem <reg>[+-offset] <len>]... | trace file <path> [records] | trace list |
+            // trace delete <addr> | trace convert <file> text|csv [out]
+            if (HasPrefix(args[1], "list") && args.size() == 2) {
+                ListTracepoints();
+            }
+            else if (HasPrefix(args[1], "file") && args.size() <= 4 && args.size() >= 3) {
+                OpenTraceFile(std::string(args[2]), args.size() == 4 ? uint32_t(std::stoul(std::string(args[3])))
+                                                                      : TRACE_FILE_DEFAULT_RECORDS);
+            }
+            else if (HasPrefix(args[1], "delete") && args.size() == 3) {
+                uint64_t addr = std::stoul(std::string(args[2]), 0, 16);
+                if (!m_tracepoints.count(addr) || !RemoveBreakpoint(addr)) {
+                    std::cout << "no tracepoint at 0x" << std::hex << addr << std::dec << std::endl;
+                }
+            }
+            else if (HasPrefix(args[1], "convert") && args.size() >= 4 && args.size() <= 5) {
+                if (args.size() == 5) {
+                    std::ofstream out{ std::string(args[4]), std::ios::trunc };
+                    ConvertTraceFile(std::string(args[2]), args[3] == "csv", out);
+                }
+                else {
+                    ConvertTraceFile(std::string(args[2]), args[3] == "csv", std::cout);
+                }
+            }
+            else {
+                TraceSpec spec;
+                uint32_t memTotal = 0;
+                bool ok = true;
+                for (size_t i = 2; i < args.size() && ok; i++) {
+                    if (args[i] == "mem" && i + 2 < args.size()) {
+                        std::string_view base = args[i + 1];
+                        size_t sign = base.find_first_of("+-");
+                        TraceSpec::MemRange m;
+                        m.base = GetRegisterFromName(base.substr(0, sign));
+                        std::string offset(sign == std::string_view::npos ? "0" : base.substr(sign));
+                        m.offset = int32_t(std::stol(offset, 0, 0));
+                        m.len = uint32_t(std::stoul(std::string(args[i + 2]), 0, 0));
+                        memTotal += m.len;
+                        ok = IsGeneralRegister(m.base) && memTotal <= TRACE_MAX_MEM &&
+                             spec.mem.size() < TRACE_MAX_MEM_RANGES;
+                        spec.mem.push_back(m);
+                        i += 2;
+                    }
+                    else {
+                        Reg r = GetRegisterFromName(args[i]);
+                        ok = IsGeneralRegister(r) && spec.regs.size() < TRACE_MAX_REGS;
+                        spec.regs.push_back(r);
+                    }
+                }
+                uint64_t addr = 0;
+                if (const Symbol* sym = Symbols().FindByName(args[1])) addr = sym->addr;
+                else addr = std::stoull(std::string(args[1]), nullptr, 16);
+                if (!ok) {
+                    std::cout << "usage: trace <addr|symbol> [up to " << TRACE_MAX_REGS << " registers] "
+                              << "[mem <reg>[+-offset] <len>]... (up to " << TRACE_MAX_MEM_RANGES << " ranges, "
+                              << TRACE_MAX_MEM << " bytes)" << std::endl;
+                }
+                else {
+                    AddTracepoint(addr, spec);
+                }
+            }
+        }
+        else if (HasPrefix(command, "nonstop") && args.size() <= 2) {
+            // nonstop [on|off]
+            if (args.size() == 2) SetNonStop(args[1] == "on");
+            std::cout << "non-stop mode is " << (m_nonStop ? "on" : "off") << std::endl;
+        }
+        else if (HasPrefix(command, "interrupt") && args.size() <= 2) {
+            // interrupt [tid|all], stops running threads in non-stop mode
+            if (args.size() == 2 && args[1] == "all") StopAllThreads();
+            else InterruptThread(args.size() == 2 ? pid_t(std::stol(std::string(args[1]))) : m_tid);
+        }
+        else if (HasPrefix(command, "listen") && args.size() == 2) {
+            // listen <socket path>, accepts control connections on a unix socket
+            ListenControl(std::string(args[1]));
+        }
+        else if (HasPrefix(command, "threads") && args.size() <= 2) {
+            // threads [tid|stats]
+            if (args.size() == 1) {
+                ListThreads();
+            }
+            else if (HasPrefix(args[1], "stats")) {
+                PrintStopAllStats();
+            }
+            else {
+                pid_t tid = pid_t(std::stol(std::string(args[1])));
+                if (m_threads.count(tid)) m_tid = tid;
+                else std::cout << "no thread " << tid << std::endl;
+            }
+        }
+        else if (HasPrefix(command, "breakpoints") && args.size() >= 2) {
+            // breakpoints list|enable <addr>|disable <addr>|delete <addr>|bench [count]
+            if (HasPrefix(args[1], "list") && args.size() == 2) {
+                ListBreakpoints();
+            }
+            else if (HasPrefix(args[1], "stepping") && args.size() == 3) {
+                // breakpoints stepping displaced|inplace
+                m_displacedStepping = HasPrefix(args[2], "displaced");
+            }
+            else if (HasPrefix(args[1], "bench") && args.size() <= 3) {
+                BenchmarkBreakpointTable(args.size() == 3 ? std::stoul(std::string(args[2])) : 1000000);
+            }
+            else if (args.size() == 3 && (HasPrefix(args[1], "enable") || HasPrefix(args[1], "disable") ||
+                                          HasPrefix(args[1], "delete"))) {
+                uintptr_t addr = std::stoul(std::string(args[2]), 0, 16);
+                bool ok = HasPrefix(args[1], "delete") ? RemoveBreakpoint(addr)
+                                                       : SetBreakpointEnabled(addr, HasPrefix(args[1], "enable"));
+                if (!ok) std::cout << "no breakpoint at 0x" << std::hex << addr << std::dec << std::endl;
+            }
+        }
+        else if ((HasPrefix(command, "backtrace") || command == "bt") && args.size() <= 2) {
+            // backtrace [max frames]
+            Backtrace(args.size() == 2 ? std::stoul(std::string(args[1])) : 64);
+        }
+        else if (HasPrefix(command, "gcore") && args.size() <= 2) {
+            // gcore [file], running threads (non-stop) are stopped while it is written
+            std::string path = args.size() == 2 ? std::string(args[1]) : "core." + std::to_string(m_pid);
+            WithAllStopped([&] { return WriteCoreFile(path); });
+        }
+        else if (HasPrefix(command, "snapshot") && args.size() >= 2) {
+            if (HasPrefix(args[1], "save") && args.size() >= 3 && args.size() % 2 == 1) {
+                // snapshot save <name> [mapping <name>] [file <path>]
+                std::string_view mapping;
+                std::string file;
+                for (size_t i = 3; i + 1 < args.size(); i += 2) {
+                    if (args[i] == "mapping") mapping = args[i + 1];
+                    else if (args[i] == "file") file = args[i + 1];
+                }
+                SaveSnapshot(std::string(args[2]), file, mapping);
+            }
+            else if (HasPrefix(args[1], "diff") && (args.size() == 4 || args.size() == 5)) {
+                DiffSnapshots(std::string(args[2]), std::string(args[3]),
+                              args.size() == 5 ? std::stoul(std::string(args[4])) : 100);
+            }
+            else if (HasPrefix(args[1], "list") && args.size() == 2) {
+                for (const auto& [name, snap] : m_snapshots) {
+                    std::cout << std::dec << name << ": " << snap->pages.size() << " pages, "
+                              << snap->arena.Size() / 1024 << " KB" << (snap->arena.IsFileBacked() ? " (file)" : "")
+                              << std::endl;
+                }
+            }
+            else if (HasPrefix(args[1], "drop") && args.size() == 3) {
+                m_snapshots.erase(std::string(args[2]));
+            }
+        }
+        else if ((HasPrefix(command, "step") || HasPrefix(command, "next")) && args.size() <= 2) {
+            // step|next [stats]
+            StepKind kind = HasPrefix(command, "step") ? StepKind::Step : StepKind::Next;
+            if (args.size() == 1) return StepLine(kind);
+            if (HasPrefix(args[1], "stats")) PrintStepStats(kind);
+        }
+        else if (HasPrefix(command, "until") && args.size() <= 2) {
+            // until [addr|symbol|stats]
+            if (args.size() == 1) return StepLine(StepKind::Until);
+            if (args[1] == "stats") PrintStepStats(StepKind::Until);
+            else if (const Symbol* sym = Symbols().FindByName(args[1])) return RunUntil(sym->addr);
+            else return RunUntil(std::stoull(std::string(args[1]), nullptr, 16));
+        }
+        else if (HasPrefix(command, "decoder") && args.size() >= 2) {
+            // decoder bench [elf file]|cache|check
+            if (HasPrefix(args[1], "bench") && args.size() <= 3) {
+                BenchmarkX86Decoder(args.size() == 3 ? std::string(args[2]) : m_progName);
+            }
+            else if (HasPrefix(args[1], "cache") && args.size() == 2) {
+                DumpDecodeCacheStats();
+            }
+            else if (HasPrefix(args[1], "check") && args.size() == 2) {
+                CheckX86Decoder();
+            }
+        }
+        else if (HasPrefix(command, "disas") && args.size() <= 3) {
+            // disas [addr|symbol] [count]
+            uint64_t addr = 0;
+            if (args.size() == 1) addr = GetPC();
+            else if (const Symbol* sym = Symbols().FindByName(args[1])) addr = sym->addr;
+            else addr = std::stoull(std::string(args[1]), nullptr, 16);
+            Disassemble(addr, args.size() == 3 ? std::stoul(std::string(args[2])) : 0);
+        }
+        else if (HasPrefix(command, "find") && args.size() >= 3) {
+            // find <bytes|string|u8|u16|u32|u64> <value> [mask <hex>] [max <count>]
+            SearchPattern pattern;
+            if (!ParseSearchPattern(args, 1, pattern)) {
+                std::cerr << "invalid search pattern\n";
+                return 0;
+            }
+            size_t maxPrinted = 100;
+            if (args.size() >= 2 && args[args.size() - 2] == "max") {
+                maxPrinted = std::stoul(std::string(args.back()));
+            }
+            FindInMemory(pattern, maxPrinted);
+        }
+        else if (HasPrefix(command, "finish") && args.size() <= 2) {
+            // finish [stats]
+            if (args.size() == 1) return Finish();
+            if (HasPrefix(args[1], "stats")) PrintStepStats(StepKind::Finish);
+        }
+        else if (HasPrefix(command, "coverage") && args.size() <= 3) {
+            // coverage [functions|blocks [module]|stop|report [all]|export <file>]
+            if (args.size() == 1) {
+                if (m_coverage.Empty()) std::cout << "coverage is off" << std::endl;
+                else CoverageReport(std::cout, false);
+            }
+            else if (HasPrefix(args[1], "functions")) {
+                StartCoverage(CoverageMap::Mode::Functions, args.size() == 3 ? args[2] : "");
+            }
+            else if (HasPrefix(args[1], "blocks")) {
+                StartCoverage(CoverageMap::Mode::Blocks, args.size() == 3 ? args[2] : "");
+            }
+            else if (m_coverage.Empty()) {
+                std::cout << "coverage is off" << std::endl;
+            }
+            else if (HasPrefix(args[1], "stop") && args.size() == 2) {
+                StopCoverage();
+            }
+            else if (HasPrefix(args[1], "report")) {
+                CoverageReport(std::cout, args.size() == 3 && args[2] == "all");
+            }
+            else if (HasPrefix(args[1], "export") && args.size() == 3) {
+                ExportCoverage(std::string(args[2]));
+            }
         }
         else {
             std::cerr << "Unknown command\n";
@@ -407,27 +9021,454 @@ private:
         return 0;
     }
 
-    int WaitForSignal() {
-        int waitStatus;
-        int options = 0;
-        pid_t pid = waitpid(m_pid, &waitStatus, options);
-        if (pid < 0) {
-            std::cerr << "waitpid failed: " << strerror(errno) << std::endl;
+    // Seizes the child, which stopped itself before its exec, and runs it to the exec. Seized tracees can be stopped
+    // with PTRACE_INTERRUPT, and PTRACE_O_TRACECLONE attaches every thread they create.
+    int Attach() {
+        int status = 0;
+        if (waitpid(m_pid, &status, WSTOPPED) < 0 || !WIFSTOPPED(status)) {
+            std::cerr << "the debugged program did not start" << std::endl;
             return -5;
         }
+        long options = PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL;
+        if (ptrace(PTRACE_SEIZE, m_pid, nullptr, options) < 0) {
+            std::cerr << "Failed to trace process: " << strerror(errno) << std::endl;
+            return -3;
+        }
+        kill(m_pid, SIGCONT);
+        // The group stop, the SIGCONT and its delivery are reported before the exec, none of them is passed on.
+        while ((status >> 16) != PTRACE_EVENT_EXEC) {
+            if (waitpid(m_pid, &status, __WALL) < 0 || !WIFSTOPPED(status)) {
+                std::cerr << "the debugged program did not start" << std::endl;
+                return -5;
+            }
+            if ((status >> 16) != PTRACE_EVENT_EXEC) ptrace(PTRACE_CONT, m_pid, nullptr, nullptr);
+        }
+        m_waitStatus = status;
+        m_threads[m_pid].state = ThreadState::Stopped;
         return 0;
     }
 
+    // Debug registers are per thread, all threads get the same ones. Running threads (non-stop) are paused for it.
+    bool ApplyDebugRegisters() {
+        return WithAllStopped([this] {
+            bool ok = true;
+            for (const auto& [tid, t] : m_threads) {
+                if (!m_debugRegs.Apply(tid)) ok = false;
+            }
+            return ok;
+        });
+    }
+
+    bool IsStopped(pid_t tid) const {
+        auto it = m_threads.find(tid);
+        return it != m_threads.end() && it->second.state == ThreadState::Stopped;
+    }
+
+    bool AnyRunning() const {
+        return std::any_of(m_threads.begin(), m_threads.end(),
+                           [](const auto& entry) { return entry.second.state != ThreadState::Stopped; });
+    }
+
+    // Runs fn with every thread stopped and resumes the ones that were running before. Non-stop mode uses it for the
+    // few things that can't be done while other threads run.
+    template <typename Fn>
+    bool WithAllStopped(Fn&& fn) {
+        std::vector<pid_t> running;
+        for (const auto& [tid, t] : m_threads) {
+            if (t.state == ThreadState::Running) running.push_back(tid);
+        }
+        if (running.empty()) return fn();
+        pid_t current = m_tid;
+        int status = m_waitStatus;
+        bool ok = StopAllThreads();
+        m_tid = current;
+        m_waitStatus = status;
+        ok = fn() && ok;
+        ok = PrepareResume() && ok;
+        for (pid_t tid : running) {
+            if (m_threads.count(tid) && !ResumeThread(tid, PTRACE_CONT)) ok = false;
+        }
+        return ok;
+    }
+
+    bool ResumeThread(pid_t tid, __ptrace_request request) {
+        ThreadState& t = m_threads[tid];
+        int sig = t.pendingSignal;
+        // Callers that don't go through PrepareResume (a rewound breakpoint hit) may still have registers buffered.
+        if (auto regs = m_regs.find(tid); regs != m_regs.end()) {
+            if (!regs->second.Flush()) return false;
+            regs->second.Invalidate();
+        }
+        if (t.pendingStatus && request == PTRACE_CONT) {
+            // It would stop right away for the trap it already has, report that one as its next stop.
+            m_queuedStatus.push_back({ tid, t.pendingStatus });
+            t.pendingStatus = 0;
+        }
+        else if (ptrace(request, tid, nullptr, reinterpret_cast<void*>(intptr_t(sig))) < 0) {
+            std::cerr << "Failed to resume thread " << tid << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        else {
+            t.pendingSignal = 0;
+        }
+        t.request = request;
+        t.state = ThreadState::Running;
+        t.reported = false;
+        return true;
+    }
+
+    // All-stop: every thread runs until one of them reports a stop, see StopAllThreads. In non-stop mode other threads
+    // may still sit on the breakpoint they reported, they are moved past it first. The current thread is the
+    // caller's business.
+    bool ResumeAll() {
+        pid_t current = m_tid;
+        bool stepped = false;
+        for (auto& [tid, t] : m_threads) {
+            if (tid == current || t.state != ThreadState::Stopped || !t.reported) continue;
+            m_tid = tid;
+            StepOverBreakpoint();
+            stepped = true;
+        }
+        m_tid = current;
+        if (stepped && !PrepareResume()) return false;
+
+        m_allRunning = true;
+        bool ok = true;
+        for (auto& [tid, t] : m_threads) {
+            if (t.state == ThreadState::Stopped && !ResumeThread(tid, PTRACE_CONT)) ok = false;
+        }
+        return ok;
+    }
+
+    // Bookkeeping for one wait status of tid. Returns true for a stop the user has to see, m_tid and m_waitStatus then
+    // describe it. New threads, exits of other threads and the stops StopAllThreads asked for are handled here.
+    bool OnThreadStatus(pid_t tid, int status) {
+        m_ptraceStops++;
+        auto [it, unknown] = m_threads.try_emplace(tid);
+        ThreadState& t = it->second;
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            m_regs.erase(tid);
+            if (tid != m_pid) {
+                // Don't leave the current thread dangling, the next resume goes through it.
+                if (tid == m_tid) m_tid = m_pid;
+                m_threads.erase(it);
+                return false;
+            }
+            // The leader's exit comes after all other threads are gone.
+            m_threads.clear();
+            m_tid = m_pid;
+            m_waitStatus = status;
+            return true;
+        }
+        if (!WIFSTOPPED(status)) return false;
+
+        bool wasRunning = t.state == ThreadState::Running && !unknown;
+        t.state = ThreadState::Stopped;
+        t.stops++;
+        t.liftSeq = m_liftSeq;
+        int event = status >> 16;
+        if (unknown || t.fresh) {
+            // First stop of a new thread, it may arrive before the clone event of its parent.
+            t.fresh = false;
+            if (m_debugRegs.Any()) m_debugRegs.Apply(tid);
+            if (m_allRunning || m_nonStop) ResumeThread(tid, PTRACE_CONT);
+            return false;
+        }
+        if (event == PTRACE_EVENT_CLONE) {
+            unsigned long child = 0;
+            ptrace(PTRACE_GETEVENTMSG, tid, nullptr, &child);
+            auto [c, added] = m_threads.try_emplace(pid_t(child));
+            if (added) {
+                c->second.state = ThreadState::Stopping; // its first stop is on the way
+                c->second.fresh = true;
+                c->second.liftSeq = m_liftSeq;
+            }
+            if (wasRunning) ResumeThread(tid, t.request);
+            return false;
+        }
+        if (event == PTRACE_EVENT_STOP) {
+            // Asked for by StopAllThreads, or an interrupt that arrives after the thread stopped for something else.
+            if (wasRunning) ResumeThread(tid, t.request);
+            return false;
+        }
+        if (!wasRunning && event == 0) {
+            // An event that raced with StopAllThreads. A breakpoint hit is undone, the thread runs into it again on the
+            // next resume. Signals are delivered then, other traps (hardware breakpoints and watchpoints) are reported.
+            if (WSTOPSIG(status) != SIGTRAP) t.pendingSignal = WSTOPSIG(status);
+            else if (!RewindBreakpointHit(tid, true)) t.pendingStatus = status;
+            return false;
+        }
+        if (event == 0 && WSTOPSIG(status) == SIGTRAP && t.request == PTRACE_CONT && RewindBreakpointHit(tid, false)) {
+            // The int3 was removed after the thread executed it (non-stop), it runs the original instruction now.
+            ResumeThread(tid, PTRACE_CONT);
+            return false;
+        }
+        m_tid = tid;
+        m_waitStatus = status;
+        t.reported = true;
+        return true;
+    }
+
+    // Moves tid back onto the int3 it stopped after, if there is or was one there. Returns whether it did.
+    bool RewindBreakpointHit(pid_t tid, bool includeEnabled) {
+        RegisterCache& regs = Regs(tid);
+        uint64_t pc = 0;
+        if (!regs.Get(Reg::RIP, pc)) return false;
+        const Breakpoint* bp = m_breakpoints.Lookup(pc - 1);
+        bool enabled = bp && bp->IsEnabled();
+        if (enabled ? !includeEnabled : !m_liftedBreakpoints.count(pc - 1)) return false;
+        // Only an int3 traps with SI_KERNEL, a hardware breakpoint or watchpoint right after a one byte instruction
+        // must not run that instruction again.
+        siginfo_t info;
+        if (ptrace(PTRACE_GETSIGINFO, tid, nullptr, &info) < 0 || info.si_code != SI_KERNEL) return false;
+        return regs.Set(Reg::RIP, pc - 1);
+    }
+
+    // Stops every running thread after one of them reported. The PTRACE_INTERRUPTs go out as one batch and the stops
+    // are collected in whatever order they arrive, so the latency is close to one round trip and not one per thread.
+    bool StopAllThreads() {
+        m_allRunning = false;
+        if (WIFEXITED(m_waitStatus) || WIFSIGNALED(m_waitStatus)) return true;
+        auto begin = std::chrono::steady_clock::now();
+        size_t requested = 0;
+        for (auto& [tid, t] : m_threads) {
+            if (t.state != ThreadState::Running) continue;
+            // Fails for a thread that is exiting, its exit is collected with the other stops.
+            if (ptrace(PTRACE_INTERRUPT, tid, nullptr, nullptr) == 0) t.state = ThreadState::Stopping;
+            requested++;
+        }
+        if (!requested) return true;
+
+        auto busy = [](const auto& entry) { return entry.second.state != ThreadState::Stopped; };
+        while (std::any_of(m_threads.begin(), m_threads.end(), busy)) {
+            int status = 0;
+            pid_t tid = NextStatus(-1, status);
+            if (tid < 0) {
+                std::cerr << "waitpid failed: " << strerror(errno) << std::endl;
+                return false;
+            }
+            if (OnThreadStatus(tid, status)) break; // the process exited
+        }
+        uint64_t us = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                                                                      begin).count());
+        m_stopAllStats.count++;
+        m_stopAllStats.threads += requested;
+        m_stopAllStats.totalUs += us;
+        m_stopAllStats.maxUs = std::max(m_stopAllStats.maxUs, us);
+        m_stopAllStats.lastUs = us;
+        m_stopAllStats.lastThreads = requested;
+        return true;
+    }
+
+    void PrintThreadOfStop() {
+        if (m_threads.size() > 1) std::cout << "thread " << std::dec << m_tid << ' ';
+    }
+
+    void ListThreads() {
+        for (auto& [tid, t] : m_threads) {
+            std::cout << (tid == m_tid ? "* " : "  ") << std::dec << std::setfill(' ') << std::setw(8) << tid << ' '
+                      << std::setw(10) << t.stops << " stops  ";
+            uint64_t pc = 0;
+            if (t.state != ThreadState::Stopped) std::cout << "running" << std::endl;
+            else if (Regs(tid).Get(Reg::RIP, pc)) PrintLocation(pc);
+            else std::cout << std::endl;
+        }
+    }
+
+    // Stops one running thread (non-stop). Events of other threads stay queued until the next wait.
+    bool InterruptThread(pid_t tid) {
+        auto it = m_threads.find(tid);
+        if (it == m_threads.end() || it->second.state != ThreadState::Running) return true;
+        if (ptrace(PTRACE_INTERRUPT, tid, nullptr, nullptr) < 0) return false;
+        it->second.state = ThreadState::Stopping;
+        while (IsRunningOrStopping(tid)) {
+            int status = 0;
+            if (NextStatus(tid, status) < 0) return false;
+            if (OnThreadStatus(tid, status)) break; // stopped for an event of its own first
+        }
+        return true;
+    }
+
+    bool IsRunningOrStopping(pid_t tid) const {
+        auto it = m_threads.find(tid);
+        return it != m_threads.end() && it->second.state != ThreadState::Stopped;
+    }
+
+    bool SetNonStop(bool on) {
+        if (on == m_nonStop) return true;
+        m_nonStop = on;
+        // Back to all-stop: nothing may keep running behind the prompt.
+        return on || StopAllThreads();
+    }
+
+    void PrintStopAllStats() {
+        const StopAllStats& st = m_stopAllStats;
+        std::cout << std::dec << m_threads.size() << " threads, " << st.count << " stop-all";
+        if (st.count) {
+            std::cout << std::fixed << std::setprecision(1) << ", last " << st.lastUs << " us for " << st.lastThreads
+                      << " threads, average " << double(st.totalUs) / double(st.count) << " us for "
+                      << double(st.threads) / double(st.count) << " threads, max " << st.maxUs << " us";
+        }
+        std::cout << std::endl;
+    }
+
+    // Moves every wait status the kernel has ready to m_queuedStatus. Returns false once no tracee is left.
+    bool CollectStatus() {
+        int status = 0;
+        pid_t tid = 0;
+        while ((tid = waitpid(-1, &status, __WALL | WNOHANG)) > 0) m_queuedStatus.push_back({ tid, status });
+        return tid == 0 || !m_queuedStatus.empty();
+    }
+
+    // Next wait status of tid, or of any thread for -1. Everything the kernel has ready is collected at once and for
+    // any thread one of them is picked at random. Otherwise the most recently created thread would win every time and
+    // the others' breakpoint hits would never be reported. Waiting for any thread goes through the event loop.
+    pid_t NextStatus(pid_t tid, int& status) {
+        while (tid < 0 && m_queuedStatus.empty()) {
+            if (m_threads.empty()) {
+                errno = ECHILD;
+                return -1;
+            }
+            if (PollEvents(false) < 0) return -1;
+        }
+        size_t i = 0;
+        if (tid < 0) {
+            i = size_t(m_random()) % m_queuedStatus.size();
+        }
+        else {
+            while (i < m_queuedStatus.size() && m_queuedStatus[i].first != tid) i++;
+            if (i == m_queuedStatus.size()) return waitpid(tid, &status, __WALL);
+        }
+        tid = m_queuedStatus[i].first;
+        status = m_queuedStatus[i].second;
+        m_queuedStatus.erase(m_queuedStatus.begin() + std::ptrdiff_t(i));
+        return tid;
+    }
+
+    // Waits for the next stop of tid only, after one thread was single-stepped. Stops of other threads (non-stop) stay
+    // queued until the next WaitForSignal.
+    int WaitForThread(pid_t tid) {
+        while (true) {
+            int status = 0;
+            if (NextStatus(tid, status) < 0) {
+                std::cerr << "waitpid failed: " << strerror(errno) << std::endl;
+                return -5;
+            }
+            if (OnThreadStatus(tid, status)) return 0;
+        }
+    }
+
+    // Waits for the next stop to report. Without block it returns 1 instead of waiting once nothing is pending.
+    int WaitForSignal(bool block = true) {
+        while (true) {
+            if (!block && m_queuedStatus.empty() && (!CollectStatus() || m_queuedStatus.empty())) return 1;
+            int status = 0;
+            pid_t tid = NextStatus(-1, status);
+            if (tid < 0) {
+                std::cerr << "waitpid failed: " << strerror(errno) << std::endl;
+                return -5;
+            }
+            if (!OnThreadStatus(tid, status)) continue;
+            bool ok = m_nonStop || StopAllThreads();
+            PruneLiftedBreakpoints();
+            return ok ? 0 : -5;
+        }
+    }
+
     std::string m_progName;
     pid_t m_pid;
-    std::unordered_map<uintptr_t, Breakpoint> m_breakpoints;
+    pid_t m_tid; // the thread commands apply to, the one that reported the last stop unless the user picked another
+    int m_waitStatus = 0;
+
+    struct ThreadState {
+        enum State : uint8_t { Running, Stopping, Stopped };
+        State state = Running;
+        bool fresh = false;            // created, its first stop not seen yet
+        bool reported = false;         // its stop was reported to the user and it hasn't run since
+        __ptrace_request request = PTRACE_CONT; // how it was last resumed
+        int pendingSignal = 0;         // delivered with the next resume
+        int pendingStatus = 0;         // a trap that raced with StopAllThreads, reported when it's continued next
+        uint64_t stops = 0;
+        uint64_t liftSeq = 0;          // m_liftSeq when its last stop was handled
+    };
+    std::map<pid_t, ThreadState> m_threads;
+    bool m_allRunning = false;
+    bool m_nonStop = false;
+    std::unordered_map<uint64_t, uint64_t> m_liftedBreakpoints; // a thread may still report a SIGTRAP from these
+    std::map<uint64_t, uint64_t> m_liftOrder;                   // lift sequence -> address
+    uint64_t m_liftSeq = 0;
+    std::vector<std::pair<pid_t, int>> m_queuedStatus;   // collected from waitpid but not handled yet
+    std::minstd_rand m_random;
+    EventLoop m_events;
+    bool m_tty = false;
+    linenoiseState m_lineState = {};
+    char m_lineBuf[4096];
+    LineBuffer m_stdinLines;                   // the terminal input when it is not a tty
+    std::map<int, LineBuffer> m_controlClients; // by socket
+
+    struct StopAllStats {
+        uint64_t count = 0;
+        uint64_t threads = 0;
+        uint64_t totalUs = 0;
+        uint64_t maxUs = 0;
+        uint64_t lastUs = 0;
+        uint64_t lastThreads = 0;
+    };
+    StopAllStats m_stopAllStats;
+    BreakpointTable m_breakpoints;
+    DebugRegisters m_debugRegs;
+    PageWatchSet m_pageWatches;
+    std::vector<std::unique_ptr<Condition>> m_conditions;
+    std::vector<size_t> m_freeConditions; // indices into m_conditions
+
+    struct FastTracepoint {
+        uint64_t addr;
+        FastTraceSpec spec;
+        std::vector<uint8_t> original; // displaced bytes, empty once removed
+        uint64_t trampoline;
+    };
+    struct TrampolineArea {
+        uint64_t start;
+        uint64_t used;
+    };
+    bool m_displacedStepping = true;
+    std::unordered_map<uint64_t, DisplacedCopy> m_displaced;
+    std::vector<FastTracepoint> m_fastTraces;
+    std::vector<TrampolineArea> m_trampolineAreas;
+    uint64_t m_traceRing = 0;
+    std::chrono::steady_clock::time_point m_traceStart;
+    TraceRingReader m_traceReader;
+    uint64_t m_syscallSite = 0;
+    InferiorMemory m_memory;
+    PageCache m_cache;
+    X86DecodeCache m_decodeCache;
+    CodePatcher m_patcher;
+    std::unordered_map<pid_t, RegisterCache> m_regs;
+    std::unique_ptr<ThreadPool> m_pool;
+    std::map<std::string, std::unique_ptr<Snapshot>> m_snapshots;
+    std::unique_ptr<CoreFile> m_core;
+    SymbolTable m_symbols;
+    bool m_symbolsValid = false;
+    LineTable m_lines;
+    bool m_linesValid = false;
+    CallFrameTable m_callFrames;
+    bool m_callFramesValid = false;
+    uint64_t m_ptraceStops = 0;
+    std::vector<TemporaryBreakpoint> m_tempBreakpoints;
+    StepStats m_stepStats[size_t(StepKind::COUNT)] = {};
+    CoverageMap m_coverage;
+
+    struct Tracepoint {
+        uint32_t site;
+        TraceSpec spec;
+    };
+    TraceFile m_traceFile;
+    std::unordered_map<uint64_t, Tracepoint> m_tracepoints;
 };
 
 int ExecDebuggedProgram(std::string_view progName) {
-    if (int err = ptrace(PTRACE_TRACEME, 0, nullptr, nullptr); err < 0) {
-        std::cerr << "Failed to trace process: " << std::strerror(errno) << std::endl;
-        return -3;
-    }
+    // The debugger seizes the process while it is stopped here, see Debugger::Attach.
+    raise(SIGSTOP);
     if (int err = execl(progName.data(), progName.data(), nullptr); err < 0) {
         std::cerr << "Failed to exec program: " << std::strerror(errno) << std::endl;
         return -4;
@@ -441,6 +9482,20 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    if (std::string_view(argv[1]) == "--core") {
+        // dbg --core <core file> [program]
+        if (argc < 3) {
+            std::cerr << "No core file given" << std::endl;
+            return -1;
+        }
+        auto core = std::make_unique<CoreFile>();
+        if (!core->Open(argv[2])) {
+            return -5;
+        }
+        Debugger dbg (argc > 3 ? argv[3] : "", std::move(core));
+        return dbg.Run() < 0 ? -1 : 0;
+    }
+
     char* prog = argv[1];
     pid_t pid = fork();
     if (pid < 0) {